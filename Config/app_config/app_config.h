@@ -13,6 +13,27 @@
 #define appCONFIG_MQTT_PUBSUB_TASK_STACK_SIZE       ( 2048 )
 #define appCONFIG_MQTT_PUBSUB_TASK_PRIORITY         ( tskIDLE_PRIORITY + 1 )
 
+/**
+ * @brief MQTT load generator configuration.
+ * Set appCONFIG_MQTT_LOAD_GENERATOR to 1 to start the load generator instead of the
+ * subscribe publish demo tasks. It runs the workload below once against the configured
+ * broker and logs messages/s, bytes/s, failures and agent queue depth at the end.
+ * The workload can be changed without rebuilding the application through the
+ * provisioning data, see LOAD_GENERATOR_PARAMS in provisioning/CMakeLists.txt.
+ * The publish rate is the total over all producer tasks, 0 publishes as fast as the
+ * agent accepts. Payload sizes are uniformly distributed between the minimum and the
+ * maximum, which must not exceed appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE.
+ */
+#define appCONFIG_MQTT_LOAD_GENERATOR               0
+#define appCONFIG_LOADGEN_NUM_TASKS                 ( 2 )
+#define appCONFIG_LOADGEN_MAX_TASKS                 ( 8 )
+#define appCONFIG_LOADGEN_PUBLISHES_PER_SECOND      ( 20 )
+#define appCONFIG_LOADGEN_PAYLOAD_MIN_SIZE          ( 16 )
+#define appCONFIG_LOADGEN_PAYLOAD_MAX_SIZE          ( 256 )
+#define appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE          ( 1024 )
+#define appCONFIG_LOADGEN_QOS1_PERCENT              ( 50 )
+#define appCONFIG_LOADGEN_DURATION_S                ( 60 )
+
 /**
  * @brief Stack size and priority for MQTT agent task.
  * Stack size is capped to an adequate value based on requirements from MbedTLS stack
@@ -33,6 +54,14 @@
 #define appCONFIG_OTA_MQTT_AGENT_TASK_STACK_SIZE    ( 4096 )
 #define appCONFIG_OTA_MQTT_AGENT_TASK_PRIORITY      ( tskIDLE_PRIORITY + 1 )
 
+/**
+ * @brief Set to 1 to run OTA over its own MQTT agent connection, so that job
+ * documents and file blocks do not share the agent queue and network buffer of
+ * the application. The second connection uses otaexampleMQTT_CLIENT_IDENTIFIER
+ * as client identifier, which must be allowed by the IoT policy of the device.
+ */
+#define appCONFIG_OTA_SEPARATE_MQTT_CONNECTION      0
+
 /** @brief Set logging task as high priority task */
 #define appCONFIG_LOGGING_TASK_PRIORITY             ( configMAX_PRIORITIES - 1 )
 #define appCONFIG_LOGGING_TASK_STACK_SIZE           ( 2048 )
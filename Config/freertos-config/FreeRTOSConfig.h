@@ -73,7 +73,7 @@ extern uint32_t SystemCoreClock;
 #define configMAX_TASK_NAME_LEN                    16
 #define configIDLE_SHOULD_YIELD                    1
 #define configUSE_TASK_NOTIFICATIONS               1
-#define configTASK_NOTIFICATION_ARRAY_ENTRIES      3
+#define configTASK_NOTIFICATION_ARRAY_ENTRIES      4
 #define configUSE_MUTEXES                          1
 #define configUSE_RECURSIVE_MUTEXES                1
 #define configUSE_COUNTING_SEMAPHORES              1
@@ -256,6 +256,11 @@ extern void vLoggingPrintf( const char * pcFormatString,
  * (and associated) API function is available. */
 #define ipconfigSUPPORT_SELECT_FUNCTION                0
 
+/* If ipconfigSOCKET_HAS_USER_SEMAPHORE is set to 1 then a semaphore can be
+ * attached to a socket with FREERTOS_SO_SET_SEMAPHORE, and is given on every
+ * socket event. The MQTT agent blocks on it instead of in FreeRTOS_recv(). */
+#define ipconfigSOCKET_HAS_USER_SEMAPHORE              1
+
 /* If ipconfigFILTER_OUT_NON_ETHERNET_II_FRAMES is set to 1 then Ethernet frames
  * that are not in Ethernet II format will be dropped.  This option is included for
  * potential future IP stack developments. */
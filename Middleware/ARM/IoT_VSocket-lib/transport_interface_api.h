@@ -35,12 +35,37 @@
 #include <stdbool.h>
 #include "transport_interface.h"
 
+/* FreeRTOS includes. */
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+#include "stream_buffer.h"
+
+
+/**
+ * @brief Time spent in each phase of the last Transport_Connect(), in
+ * milliseconds. Phases that were not reached are 0.
+ */
+typedef struct TransportConnectTiming
+{
+    uint32_t dnsMs;          /**< @brief Host name resolution. */
+    uint32_t tcpConnectMs;   /**< @brief TCP connection. */
+    uint32_t tlsInitMs;      /**< @brief TLS_Init(), including credential loading. */
+    uint32_t tlsHandshakeMs; /**< @brief TLS handshake. */
+} TransportConnectTiming_t;
 
 struct NetworkContext
 {
     int32_t socket;
     void * pTLSContext;
     bool useTLS;
+    SemaphoreHandle_t readySemaphore;   /**< @brief Set by Transport_SetReadySemaphore(). */
+    volatile bool receiving;            /**< @brief Set while the receive task reads the socket. */
+    volatile int32_t receiveError;      /**< @brief Error that stopped the receive task, or 0. */
+    TaskHandle_t receiveTask;           /**< @brief Created by the first Transport_SetReadySemaphore(). */
+    StreamBufferHandle_t receiveStream; /**< @brief Data read by the receive task. */
+    SemaphoreHandle_t receiveStopped;   /**< @brief Given when the receive task stops reading. */
+    TransportConnectTiming_t connectTiming;
 };
 
 /**
@@ -178,4 +203,52 @@ int32_t Transport_Send( NetworkContext_t * pNetworkContext,
                         const void * pMessage,
                         size_t bytesToSend );
 
+/**
+ * @brief Sends an array of buffers over an established connection.
+ *
+ * This can be used as the #TransportInterface.writev function. With TLS, the
+ * buffers are gathered into as few TLS records as possible, so that an MQTT
+ * packet made of several vectors does not cost one record per vector. Without
+ * TLS, the buffers are sent one after the other, stopping at the first one
+ * that is not sent completely.
+ *
+ * @param[in] pNetworkContext The network context created using Secure Sockets API.
+ * @param[in] pIoVec Array of buffers to send.
+ * @param[in] ioVecCount Number of entries in pIoVec.
+ *
+ * @return Number of bytes sent if successful; negative value on error.
+ */
+int32_t Transport_Writev( NetworkContext_t * pNetworkContext,
+                          TransportOutVector_t * pIoVec,
+                          size_t ioVecCount );
+
+/**
+ * @brief Stop blocking in Transport_Recv() and signal instead when an
+ * established connection may have data to read.
+ *
+ * Afterwards Transport_Recv() returns 0 straight away when no data is
+ * available, so the caller can block on readySemaphore together with other
+ * events instead of in the socket.
+ *
+ * The IoT Socket API has no readiness notification. A receive task, created
+ * on the first call for a network context, blocks in iotSocketRecv() instead
+ * and buffers what it reads for Transport_Recv(). The network context must
+ * therefore stay valid for as long as the application runs.
+ *
+ * @param[in] pNetworkContext The network context created using Transport_Connect().
+ * @param[in] readySemaphore Semaphore given whenever the receive task has read
+ * data or the connection failed, and after a Transport_Recv() that left data
+ * buffered.
+ * @param[out] pPollPeriodMs Always set to 0, Transport_Recv() does not have
+ * to be polled.
+ *
+ * @return #TRANSPORT_STATUS_SUCCESS on success;
+ *         #TRANSPORT_STATUS_INSUFFICIENT_MEMORY if the receive task could not
+ *         be created;
+ *         #TRANSPORT_STATUS_INVALID_PARAMETER on failure.
+ */
+TransportStatus_t Transport_SetReadySemaphore( NetworkContext_t * pNetworkContext,
+                                               SemaphoreHandle_t readySemaphore,
+                                               uint32_t * pPollPeriodMs );
+
 #endif /* TRANSPORT_INTERFACE_API_H */
@@ -9,6 +9,11 @@
 #include "iot_socket.h"
 #include "tls_helper.h"
 
+/* FreeRTOS includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "stream_buffer.h"
+
 /* Include header that defines log levels. */
 #include "logging_levels.h"
 
@@ -21,6 +26,48 @@
 #endif
 #include "logging_stack.h"
 
+/**
+ * @brief Size of the buffer the receive task reads the socket into, once
+ * Transport_SetReadySemaphore() has been called.
+ */
+#ifndef TRANSPORT_RECEIVE_BUFFER_SIZE
+    #define TRANSPORT_RECEIVE_BUFFER_SIZE    ( 2048U )
+#endif
+
+/**
+ * @brief Largest single read of the receive task.
+ */
+#ifndef TRANSPORT_RECEIVE_CHUNK_SIZE
+    #define TRANSPORT_RECEIVE_CHUNK_SIZE    ( 256U )
+#endif
+
+/**
+ * @brief Stack size and priority of the receive task.
+ */
+#ifndef TRANSPORT_RECEIVE_TASK_STACK_SIZE
+    #define TRANSPORT_RECEIVE_TASK_STACK_SIZE    ( 512 )
+#endif
+#ifndef TRANSPORT_RECEIVE_TASK_PRIORITY
+    #define TRANSPORT_RECEIVE_TASK_PRIORITY    ( tskIDLE_PRIORITY + 2 )
+#endif
+
+/**
+ * @brief Notification indexes of the receive task: one to start reading a
+ * connection, one to wake it up while it waits for buffer space.
+ */
+#define TRANSPORT_RECEIVE_START_INDEX    ( 1U )
+#define TRANSPORT_RECEIVE_WAKE_INDEX     ( 0U )
+
+
+/**
+ * @brief Blocks in iotSocketRecv() on behalf of the caller of
+ * Transport_Recv(), and gives the ready semaphore when data arrived or the
+ * connection failed. Started for each connection by
+ * Transport_SetReadySemaphore(), stopped by Transport_Disconnect().
+ *
+ * @param[in] pvParameters The network context.
+ */
+static void prvReceiveTask( void * pvParameters );
 
 static int Recv_Cb( void * pvCallerContext,
                         unsigned char * pucReceiveBuffer,
@@ -29,6 +76,16 @@ static int Send_Cb( void * pvCallerContext,
                         const unsigned char * pucData,
                         size_t xDataLength );
 
+/**
+ * @brief Milliseconds elapsed since a tick count.
+ */
+static uint32_t getElapsedMs( TickType_t startTicks );
+
+static uint32_t getElapsedMs( TickType_t startTicks )
+{
+    return ( uint32_t ) ( ( xTaskGetTickCount() - startTicks ) * portTICK_PERIOD_MS );
+}
+
 
 TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
                                      const ServerInfo_t * pServerInfo,
@@ -41,6 +98,7 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
     uint8_t ipAddr[ 4 ];
     uint32_t ipAddrLen;
     TLSHelperParams_t tlsHelperParams = { 0 };
+    TickType_t phaseStart = 0;
 
     if( ( pNetworkContext == NULL ) || ( pServerInfo == NULL ) )
     {
@@ -52,6 +110,11 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
     }
     else
     {
+        memset( &( pNetworkContext->connectTiming ), 0x00, sizeof( TransportConnectTiming_t ) );
+        pNetworkContext->readySemaphore = NULL;
+        pNetworkContext->receiving = false;
+        pNetworkContext->receiveError = 0;
+
         /* Create a TCP socket. */
         pNetworkContext->socket = iotSocketCreate( IOT_SOCKET_AF_INET, IOT_SOCKET_SOCK_STREAM, IOT_SOCKET_IPPROTO_TCP );
 
@@ -65,7 +128,9 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
         {
             memset( ipAddr, 0x00, sizeof( ipAddr ) );
             ipAddrLen = sizeof( ipAddr );
+            phaseStart = xTaskGetTickCount();
             socketStatus = iotSocketGetHostByName( pServerInfo->pHostName, IOT_SOCKET_AF_INET, ipAddr, &ipAddrLen );
+            pNetworkContext->connectTiming.dnsMs = getElapsedMs( phaseStart );
 
             if( socketStatus < 0 )
             {
@@ -77,7 +142,9 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
         if( status == TRANSPORT_STATUS_SUCCESS )
         {
             LogDebug( ( "Initiating TCP connection with host: %s:%d\r\n", pServerInfo->pHostName, pServerInfo->port ) );
+            phaseStart = xTaskGetTickCount();
             socketStatus = iotSocketConnect( pNetworkContext->socket, ipAddr, ipAddrLen, pServerInfo->port );
+            pNetworkContext->connectTiming.tcpConnectMs = getElapsedMs( phaseStart );
 
             if( socketStatus < 0 )
             {
@@ -107,16 +174,23 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
                 iotSocketSetOpt( pNetworkContext->socket, IOT_SOCKET_SO_SNDTIMEO, &sendTimeoutMs, sizeof( sendTimeoutMs ) );
                 iotSocketSetOpt( pNetworkContext->socket, IOT_SOCKET_SO_RCVTIMEO, &recvTimeoutMs, sizeof( recvTimeoutMs ) );
 
+                phaseStart = xTaskGetTickCount();
+
                 if( TLS_Init( &tlsHelperParams,
                               ( TLSContext_t * ) ( pNetworkContext->pTLSContext ) ) == pdPASS )
                 {
+                    pNetworkContext->connectTiming.tlsInitMs = getElapsedMs( phaseStart );
                     LogDebug( ( "Initiating TLS handshake with host: %s:%d\r\n", pServerInfo->pHostName, pServerInfo->port ) );
 
                     /* Initiate TLS handshake */
+                    phaseStart = xTaskGetTickCount();
+
                     if( TLS_Connect( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ) ) != 0 )
                     {
                         status = TRANSPORT_STATUS_TLS_FAILURE;
                     }
+
+                    pNetworkContext->connectTiming.tlsHandshakeMs = getElapsedMs( phaseStart );
                 }
                 else
                 {
@@ -154,10 +228,26 @@ int32_t Transport_Recv( NetworkContext_t * pNetworkContext,
         if( pNetworkContext->pTLSContext != NULL )
         {
             rc = TLS_Recv( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ), pBuffer, bytesToRecv );
+
+            /* A TLS record may hold more than was read. The socket has no more
+             * events to signal for it, so signal the rest here. */
+            if( ( pNetworkContext->readySemaphore != NULL ) &&
+                ( mbedtls_ssl_get_bytes_avail( &( ( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ) )->xMbedSslCtx ) ) > 0U ) )
+            {
+                ( void ) xSemaphoreGive( pNetworkContext->readySemaphore );
+            }
         }
         else
         {
-            rc = iotSocketRecv( pNetworkContext->socket, pBuffer, bytesToRecv );
+            rc = Recv_Cb( pNetworkContext, pBuffer, bytesToRecv );
+        }
+
+        /* The receive task signals each read of the socket once, signal what
+         * is left of it. */
+        if( ( pNetworkContext->receiving == true ) &&
+            ( xStreamBufferBytesAvailable( pNetworkContext->receiveStream ) > 0U ) )
+        {
+            ( void ) xSemaphoreGive( pNetworkContext->readySemaphore );
         }
     }
 
@@ -189,6 +279,55 @@ int32_t Transport_Send( NetworkContext_t * pNetworkContext,
     return rc;
 }
 
+int32_t Transport_Writev( NetworkContext_t * pNetworkContext,
+                          TransportOutVector_t * pIoVec,
+                          size_t ioVecCount )
+{
+    int32_t rc = -1;
+    int32_t sent = 0;
+    size_t i;
+
+    if( ( pNetworkContext == NULL ) || ( pIoVec == NULL ) || ( ioVecCount == 0 ) )
+    {
+        rc = -1;
+    }
+    else if( pNetworkContext->pTLSContext != NULL )
+    {
+        rc = TLS_SendVector( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ), pIoVec, ioVecCount );
+    }
+    else
+    {
+        /* Without TLS there is no record framing to save, the socket already
+         * coalesces the segments. Stop at the first short write. */
+        for( i = 0; i < ioVecCount; i++ )
+        {
+            if( pIoVec[ i ].iov_len == 0 )
+            {
+                continue;
+            }
+
+            rc = iotSocketSend( pNetworkContext->socket, pIoVec[ i ].iov_base, pIoVec[ i ].iov_len );
+
+            if( rc > 0 )
+            {
+                sent += rc;
+            }
+
+            if( rc != ( int32_t ) pIoVec[ i ].iov_len )
+            {
+                break;
+            }
+        }
+
+        if( ( sent > 0 ) || ( rc >= 0 ) )
+        {
+            rc = sent;
+        }
+    }
+
+    return rc;
+}
+
 /**
  * @brief Defines callback type for receiving bytes from the network.
  *
@@ -203,12 +342,34 @@ static int Recv_Cb( void * pvCallerContext,
                         size_t xReceiveLength )
 {
     int rc;
+    int32_t receiveError;
     NetworkContext_t * pNetworkContext = ( NetworkContext_t * ) ( pvCallerContext );
 
     if( ( pNetworkContext == NULL ) || ( pucReceiveBuffer == NULL ) )
     {
         rc = IOT_SOCKET_ERROR;
     }
+    else if( pNetworkContext->receiving == true )
+    {
+        /* The receive task has the socket. Read the error first: the data
+         * received before it is already in the buffer. */
+        receiveError = pNetworkContext->receiveError;
+        rc = ( int ) xStreamBufferReceive( pNetworkContext->receiveStream, pucReceiveBuffer, xReceiveLength, 0U );
+
+        if( rc > 0 )
+        {
+            /* The receive task may be waiting for space. */
+            ( void ) xTaskNotifyGiveIndexed( pNetworkContext->receiveTask, TRANSPORT_RECEIVE_WAKE_INDEX );
+        }
+        else if( receiveError != 0 )
+        {
+            rc = ( int ) receiveError;
+        }
+        else
+        {
+            /* No data yet. */
+        }
+    }
     else
     {
         rc = iotSocketRecv( pNetworkContext->socket, pucReceiveBuffer, xReceiveLength );
@@ -254,6 +415,135 @@ static int Send_Cb( void * pvCallerContext,
     return( rc );
 }
 
+TransportStatus_t Transport_SetReadySemaphore( NetworkContext_t * pNetworkContext,
+                                               SemaphoreHandle_t readySemaphore,
+                                               uint32_t * pPollPeriodMs )
+{
+    TransportStatus_t status = TRANSPORT_STATUS_SUCCESS;
+    BaseType_t result;
+
+    if( ( pNetworkContext == NULL ) || ( readySemaphore == NULL ) || ( pPollPeriodMs == NULL ) )
+    {
+        status = TRANSPORT_STATUS_INVALID_PARAMETER;
+    }
+    else if( pNetworkContext->receiveTask == NULL )
+    {
+        /* The receive task and its buffer are kept for the next connections
+         * of the same context. */
+        pNetworkContext->receiveStream = xStreamBufferCreate( TRANSPORT_RECEIVE_BUFFER_SIZE, 1U );
+        pNetworkContext->receiveStopped = xSemaphoreCreateBinary();
+
+        if( ( pNetworkContext->receiveStream == NULL ) || ( pNetworkContext->receiveStopped == NULL ) )
+        {
+            status = TRANSPORT_STATUS_INSUFFICIENT_MEMORY;
+        }
+        else
+        {
+            result = xTaskCreate( prvReceiveTask,
+                                  "Transport Recv",
+                                  TRANSPORT_RECEIVE_TASK_STACK_SIZE,
+                                  pNetworkContext,
+                                  TRANSPORT_RECEIVE_TASK_PRIORITY,
+                                  &( pNetworkContext->receiveTask ) );
+
+            if( result != pdPASS )
+            {
+                pNetworkContext->receiveTask = NULL;
+                status = TRANSPORT_STATUS_INSUFFICIENT_MEMORY;
+            }
+        }
+
+        if( status != TRANSPORT_STATUS_SUCCESS )
+        {
+            LogError( ( "Failed to create the transport receive task." ) );
+
+            if( pNetworkContext->receiveStream != NULL )
+            {
+                vStreamBufferDelete( pNetworkContext->receiveStream );
+                pNetworkContext->receiveStream = NULL;
+            }
+
+            if( pNetworkContext->receiveStopped != NULL )
+            {
+                vSemaphoreDelete( pNetworkContext->receiveStopped );
+                pNetworkContext->receiveStopped = NULL;
+            }
+        }
+    }
+    else
+    {
+        /* Already created. */
+    }
+
+    if( status == TRANSPORT_STATUS_SUCCESS )
+    {
+        ( void ) xStreamBufferReset( pNetworkContext->receiveStream );
+        pNetworkContext->receiveError = 0;
+        pNetworkContext->readySemaphore = readySemaphore;
+        pNetworkContext->receiving = true;
+        ( void ) xTaskNotifyGiveIndexed( pNetworkContext->receiveTask, TRANSPORT_RECEIVE_START_INDEX );
+
+        /* The receive task gives the semaphore, there is nothing to poll. */
+        *pPollPeriodMs = 0U;
+    }
+
+    return status;
+}
+
+static void prvReceiveTask( void * pvParameters )
+{
+    NetworkContext_t * pNetworkContext = ( NetworkContext_t * ) pvParameters;
+    uint8_t chunk[ TRANSPORT_RECEIVE_CHUNK_SIZE ];
+    size_t space;
+    int32_t rc;
+
+    for( ; ; )
+    {
+        /* Wait for a connection to read. */
+        ( void ) ulTaskNotifyTakeIndexed( TRANSPORT_RECEIVE_START_INDEX, pdTRUE, portMAX_DELAY );
+
+        /* Transport_Disconnect() may already have stopped it. Either way each
+         * start is answered with receiveStopped. */
+        while( ( pNetworkContext->receiving == true ) && ( pNetworkContext->receiveError == 0 ) )
+        {
+            space = xStreamBufferSpacesAvailable( pNetworkContext->receiveStream );
+
+            if( space == 0U )
+            {
+                /* Notified once Transport_Recv() has read some of it, or on
+                 * disconnection. */
+                ( void ) ulTaskNotifyTakeIndexed( TRANSPORT_RECEIVE_WAKE_INDEX, pdTRUE, portMAX_DELAY );
+            }
+            else
+            {
+                /* The socket stays blocking, a read ends when data
+                 * arrives, on the receive timeout, or on an error. */
+                rc = iotSocketRecv( pNetworkContext->socket,
+                                    chunk,
+                                    ( space < sizeof( chunk ) ) ? space : sizeof( chunk ) );
+
+                if( rc > 0 )
+                {
+                    ( void ) xStreamBufferSend( pNetworkContext->receiveStream, chunk, ( size_t ) rc, 0U );
+                    ( void ) xSemaphoreGive( pNetworkContext->readySemaphore );
+                }
+                else if( rc == IOT_SOCKET_EAGAIN )
+                {
+                    /* Receive timeout, check whether to stop. */
+                }
+                else
+                {
+                    /* Let Transport_Recv() report the failure. */
+                    pNetworkContext->receiveError = ( rc < 0 ) ? rc : IOT_SOCKET_ERROR;
+                    ( void ) xSemaphoreGive( pNetworkContext->readySemaphore );
+                }
+            }
+        }
+
+        ( void ) xSemaphoreGive( pNetworkContext->receiveStopped );
+    }
+}
+
 TransportStatus_t Transport_Disconnect( NetworkContext_t * pNetworkContext )
 {
     TransportStatus_t status = TRANSPORT_STATUS_SUCCESS;
@@ -265,6 +555,15 @@ TransportStatus_t Transport_Disconnect( NetworkContext_t * pNetworkContext )
     else
     {
         int32_t socketStatus;
+        bool wasReceiving = pNetworkContext->receiving;
+
+        if( wasReceiving == true )
+        {
+            pNetworkContext->receiving = false;
+            ( void ) xTaskNotifyGiveIndexed( pNetworkContext->receiveTask, TRANSPORT_RECEIVE_WAKE_INDEX );
+        }
+
+        /* Closing the socket also ends a read of the receive task. */
         do
         {
             socketStatus = iotSocketClose( pNetworkContext->socket );
@@ -276,6 +575,13 @@ TransportStatus_t Transport_Disconnect( NetworkContext_t * pNetworkContext )
             status = TRANSPORT_STATUS_SOCKET_CLOSE_FAILURE;
         }
 
+        if( wasReceiving == true )
+        {
+            ( void ) xSemaphoreTake( pNetworkContext->receiveStopped, portMAX_DELAY );
+        }
+
+        pNetworkContext->readySemaphore = NULL;
+
         if( pNetworkContext->pTLSContext != NULL )
         {
             TLS_Cleanup( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ) );
@@ -35,6 +35,7 @@
 #include "logging_stack.h"
 
 /* C runtime includes. */
+#include <stdbool.h>
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
@@ -950,6 +951,128 @@ int32_t TLS_Send( TLSContext_t * pxContext,
 
 /*-----------------------------------------------------------*/
 
+/**
+ * @brief Send the bytes gathered by TLS_SendVector().
+ *
+ * @param[in] pxContext The TLS context.
+ * @param[in] pucData The data to send.
+ * @param[in] xDataLength Number of bytes to send.
+ * @param[in,out] pxBytesSent Running total of the bytes sent.
+ *
+ * @return The result of TLS_Send().
+ */
+static int32_t prvSendVectorChunk( TLSContext_t * pxContext,
+                                   const unsigned char * pucData,
+                                   size_t xDataLength,
+                                   size_t * pxBytesSent )
+{
+    int32_t lResult = TLS_Send( pxContext, pucData, xDataLength );
+
+    if( lResult > 0 )
+    {
+        *pxBytesSent += ( size_t ) lResult;
+    }
+
+    return lResult;
+}
+
+/*-----------------------------------------------------------*/
+
+int32_t TLS_SendVector( TLSContext_t * pxContext,
+                        const TransportOutVector_t * pxIoVec,
+                        size_t xIoVecCount )
+{
+    int32_t lResult = 0;
+    int lMaxPayload;
+    size_t xBytesSent = 0U;
+    size_t xBuffered = 0U;
+    size_t xRecordSize = TLS_HELPER_SEND_BUFFER_SIZE;
+    size_t xIndex = 0U;
+    size_t xOffset = 0U;
+    size_t xRemaining;
+    size_t xChunk;
+    const unsigned char * pucData;
+    bool xStop = false;
+
+    if( ( NULL == pxContext ) || ( ( NULL == pxIoVec ) && ( xIoVecCount > 0U ) ) )
+    {
+        lResult = MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    }
+    else
+    {
+        /* Do not gather more than fits a single record, so that the staging buffer
+         * never produces a record split over a fragment boundary. */
+        lMaxPayload = mbedtls_ssl_get_max_out_record_payload( &pxContext->xMbedSslCtx );
+
+        if( ( lMaxPayload > 0 ) && ( ( size_t ) lMaxPayload < xRecordSize ) )
+        {
+            xRecordSize = ( size_t ) lMaxPayload;
+        }
+
+        while( ( xIndex < xIoVecCount ) && ( xStop == false ) )
+        {
+            pucData = ( const unsigned char * ) pxIoVec[ xIndex ].iov_base + xOffset;
+            xRemaining = pxIoVec[ xIndex ].iov_len - xOffset;
+
+            if( xRemaining == 0U )
+            {
+                xIndex++;
+                xOffset = 0U;
+            }
+            else if( ( xBuffered == 0U ) && ( xRemaining >= xRecordSize ) )
+            {
+                /* Nothing to merge with and already a full record: no copy. */
+                lResult = prvSendVectorChunk( pxContext, pucData, xRemaining, &xBytesSent );
+                xStop = ( lResult != ( int32_t ) xRemaining );
+                xIndex++;
+                xOffset = 0U;
+            }
+            else
+            {
+                xChunk = xRecordSize - xBuffered;
+
+                if( xChunk > xRemaining )
+                {
+                    xChunk = xRemaining;
+                }
+
+                memcpy( &( pxContext->ucSendBuffer[ xBuffered ] ), pucData, xChunk );
+                xBuffered += xChunk;
+                xOffset += xChunk;
+
+                if( xOffset == pxIoVec[ xIndex ].iov_len )
+                {
+                    xIndex++;
+                    xOffset = 0U;
+                }
+
+                if( xBuffered == xRecordSize )
+                {
+                    lResult = prvSendVectorChunk( pxContext, pxContext->ucSendBuffer, xBuffered, &xBytesSent );
+                    xStop = ( lResult != ( int32_t ) xBuffered );
+                    xBuffered = 0U;
+                }
+            }
+        }
+
+        if( ( xStop == false ) && ( xBuffered > 0U ) )
+        {
+            lResult = prvSendVectorChunk( pxContext, pxContext->ucSendBuffer, xBuffered, &xBytesSent );
+        }
+
+        /* The caller resends whatever was not sent, so a partial send is only an
+         * error if nothing went out. */
+        if( ( xBytesSent > 0U ) || ( lResult >= 0 ) )
+        {
+            lResult = ( int32_t ) xBytesSent;
+        }
+    }
+
+    return lResult;
+}
+
+/*-----------------------------------------------------------*/
+
 void TLS_Cleanup( TLSContext_t * pxContext )
 {
     prvFreeContext( pxContext );
@@ -34,6 +34,18 @@
 #include "mbedtls/debug.h"
 #include "core_pkcs11.h"
 
+/* Transport interface include, for TransportOutVector_t. */
+#include "transport_interface.h"
+
+/**
+ * @brief Size of the buffer used by TLS_SendVector() to gather the vectors of a
+ * vectored send into a single TLS record. The records are further bounded by
+ * the maximum payload negotiated for the connection.
+ */
+#ifndef TLS_HELPER_SEND_BUFFER_SIZE
+    #define TLS_HELPER_SEND_BUFFER_SIZE    ( 1024U )
+#endif
+
 typedef struct TLSContext
 {
     /* mbedTLS. */
@@ -51,6 +63,9 @@ typedef struct TLSContext
     CK_SESSION_HANDLE xP11Session;
     CK_OBJECT_HANDLE xP11PrivateKey;
     CK_KEY_TYPE xKeyType;
+
+    /* Vectored send. */
+    unsigned char ucSendBuffer[ TLS_HELPER_SEND_BUFFER_SIZE ];
 } TLSContext_t;
 
 /**
@@ -143,5 +158,24 @@ int32_t TLS_Send( TLSContext_t * pxContext,
                      const unsigned char * pucMsg,
                      size_t xMsgLength );
 
+/**
+ * @brief Send an array of buffers over the TLS connection.
+ *
+ * Small vectors are gathered so that they leave in as few TLS records as
+ * possible, instead of one record per vector. Vectors larger than a record are
+ * sent directly without being copied.
+ *
+ * @param pxContext Opaque context handle for TLS library.
+ * @param pxIoVec Array of buffers to send.
+ * @param xIoVecCount Number of entries in pxIoVec.
+ *
+ * @return The number of bytes sent, which may be less than the total length of
+ * the vectors. Error return codes have the high bit set, and are only returned
+ * if nothing was sent.
+ */
+int32_t TLS_SendVector( TLSContext_t * pxContext,
+                        const TransportOutVector_t * pxIoVec,
+                        size_t xIoVecCount );
+
 
 #endif /* ifndef TLS_HELPER_H */
@@ -42,6 +42,7 @@
 
 /* FreeRTOS includes. */
 #include "FreeRTOS.h"
+#include "task.h"
 
 /* Transport header. */
 #include "transport_interface_api.h"
@@ -49,6 +50,14 @@
 /* TLS helper header. */
 #include "tls_helper.h"
 
+/**
+ * @brief Period at which Transport_Recv() has to be polled when the socket
+ * cannot give a semaphore on receive.
+ */
+#ifndef TRANSPORT_READY_POLL_PERIOD_MS
+    #define TRANSPORT_READY_POLL_PERIOD_MS    ( 10U )
+#endif
+
 static int Recv_Cb( void * pvCallerContext,
                     unsigned char * pucReceiveBuffer,
                     size_t xReceiveLength );
@@ -56,6 +65,16 @@ static int Send_Cb( void * pvCallerContext,
                     const unsigned char * pucData,
                     size_t xDataLength );
 
+/**
+ * @brief Milliseconds elapsed since a tick count.
+ */
+static uint32_t getElapsedMs( TickType_t startTicks );
+
+static uint32_t getElapsedMs( TickType_t startTicks )
+{
+    return ( uint32_t ) ( ( xTaskGetTickCount() - startTicks ) * portTICK_PERIOD_MS );
+}
+
 TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
                                      const ServerInfo_t * pServerInfo,
                                      const TLSParams_t * pTLSParams,
@@ -67,6 +86,7 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
     struct freertos_sockaddr serverAddress = { 0 };
     TLSHelperParams_t tlsHelperParams = { 0 };
     TickType_t transportTimeout = 0;
+    TickType_t phaseStart = 0;
 
     if( ( pNetworkContext == NULL ) || ( pServerInfo == NULL ) )
     {
@@ -78,6 +98,9 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
     }
     else
     {
+        memset( &( pNetworkContext->connectTiming ), 0x00, sizeof( TransportConnectTiming_t ) );
+        pNetworkContext->readySemaphore = NULL;
+
         /* Create a TCP socket. */
         pNetworkContext->socket = FreeRTOS_socket( FREERTOS_AF_INET, FREERTOS_SOCK_STREAM, FREERTOS_IPPROTO_TCP );
 
@@ -95,6 +118,7 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
             serverAddress.sin_len = ( uint8_t ) sizeof( serverAddress );
 
             LogInfo( ( "Resolving host name: %s.", pServerInfo->pHostName ) );
+            phaseStart = xTaskGetTickCount();
             #if defined( ipconfigIPv4_BACKWARD_COMPATIBLE ) && ( ipconfigIPv4_BACKWARD_COMPATIBLE == 0 )
                 serverAddress.sin_address.ulIP_IPv4 = ( uint32_t ) FreeRTOS_gethostbyname( pServerInfo->pHostName );
 
@@ -111,13 +135,17 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
                             pServerInfo->pHostName ) );
                 status = TRANSPORT_STATUS_DNS_FAILURE;
             }
+
+            pNetworkContext->connectTiming.dnsMs = getElapsedMs( phaseStart );
         }
 
         /* Create a TCP connection to the host. */
         if( status == TRANSPORT_STATUS_SUCCESS )
         {
             LogInfo( ( "Initiating TCP connection with host: %s:%d\r\n", pServerInfo->pHostName, pServerInfo->port ) );
+            phaseStart = xTaskGetTickCount();
             socketStatus = FreeRTOS_connect( pNetworkContext->socket, &serverAddress, sizeof( serverAddress ) );
+            pNetworkContext->connectTiming.tcpConnectMs = getElapsedMs( phaseStart );
 
             if( socketStatus < 0 )
             {
@@ -167,16 +195,23 @@ TransportStatus_t Transport_Connect( NetworkContext_t * pNetworkContext,
                                               &transportTimeout,
                                               sizeof( TickType_t ) );
 
+                phaseStart = xTaskGetTickCount();
+
                 if( TLS_Init( &tlsHelperParams,
                               ( TLSContext_t * ) ( pNetworkContext->pTLSContext ) ) == pdPASS )
                 {
+                    pNetworkContext->connectTiming.tlsInitMs = getElapsedMs( phaseStart );
                     LogInfo( ( "Initiating TLS handshake with host: %s:%d\r\n", pServerInfo->pHostName, pServerInfo->port ) );
 
                     /* Initiate TLS handshake */
+                    phaseStart = xTaskGetTickCount();
+
                     if( TLS_Connect( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ) ) != 0 )
                     {
                         status = TRANSPORT_STATUS_TLS_FAILURE;
                     }
+
+                    pNetworkContext->connectTiming.tlsHandshakeMs = getElapsedMs( phaseStart );
                 }
                 else
                 {
@@ -250,6 +285,14 @@ int32_t Transport_Recv( NetworkContext_t * pNetworkContext,
         if( pNetworkContext->pTLSContext != NULL )
         {
             rc = TLS_Recv( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ), pBuffer, bytesToRecv );
+
+            /* A TLS record may hold more than was read. The socket has no more
+             * events to signal for it, so signal the rest here. */
+            if( ( pNetworkContext->readySemaphore != NULL ) &&
+                ( mbedtls_ssl_get_bytes_avail( &( ( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ) )->xMbedSslCtx ) ) > 0U ) )
+            {
+                ( void ) xSemaphoreGive( pNetworkContext->readySemaphore );
+            }
         }
         else
         {
@@ -285,6 +328,95 @@ int32_t Transport_Send( NetworkContext_t * pNetworkContext,
     return rc;
 }
 
+TransportStatus_t Transport_SetReadySemaphore( NetworkContext_t * pNetworkContext,
+                                               SemaphoreHandle_t readySemaphore,
+                                               uint32_t * pPollPeriodMs )
+{
+    TransportStatus_t status = TRANSPORT_STATUS_SUCCESS;
+    TickType_t transportTimeout = 0;
+
+    if( ( pNetworkContext == NULL ) || ( readySemaphore == NULL ) || ( pPollPeriodMs == NULL ) )
+    {
+        status = TRANSPORT_STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        #if ( ipconfigSOCKET_HAS_USER_SEMAPHORE == 1 )
+            /* The IP task gives the semaphore on every event of the socket,
+             * including received data and the connection being closed. */
+            ( void ) FreeRTOS_setsockopt( pNetworkContext->socket,
+                                          0,
+                                          FREERTOS_SO_SET_SEMAPHORE,
+                                          &readySemaphore,
+                                          sizeof( SemaphoreHandle_t ) );
+            *pPollPeriodMs = 0U;
+        #else
+            *pPollPeriodMs = TRANSPORT_READY_POLL_PERIOD_MS;
+        #endif
+
+        pNetworkContext->readySemaphore = readySemaphore;
+
+        /* Setting the receive block time cannot fail. */
+        ( void ) FreeRTOS_setsockopt( pNetworkContext->socket,
+                                      0,
+                                      FREERTOS_SO_RCVTIMEO,
+                                      &transportTimeout,
+                                      sizeof( TickType_t ) );
+    }
+
+    return status;
+}
+
+int32_t Transport_Writev( NetworkContext_t * pNetworkContext,
+                          TransportOutVector_t * pIoVec,
+                          size_t ioVecCount )
+{
+    int32_t rc = -1;
+    int32_t sent = 0;
+    size_t i;
+
+    if( ( pNetworkContext == NULL ) || ( pIoVec == NULL ) || ( ioVecCount == 0 ) )
+    {
+        rc = -1;
+    }
+    else if( pNetworkContext->pTLSContext != NULL )
+    {
+        rc = TLS_SendVector( ( TLSContext_t * ) ( pNetworkContext->pTLSContext ), pIoVec, ioVecCount );
+    }
+    else
+    {
+        /* Without TLS there is no record framing to save, the TCP stream
+         * buffer already coalesces the segments. Stop at the first short
+         * write. */
+        for( i = 0; i < ioVecCount; i++ )
+        {
+            if( pIoVec[ i ].iov_len == 0 )
+            {
+                continue;
+            }
+
+            rc = ( int32_t ) FreeRTOS_send( pNetworkContext->socket, pIoVec[ i ].iov_base, pIoVec[ i ].iov_len, 0 );
+
+            if( rc > 0 )
+            {
+                sent += rc;
+            }
+
+            if( rc != ( int32_t ) pIoVec[ i ].iov_len )
+            {
+                break;
+            }
+        }
+
+        if( ( sent > 0 ) || ( rc >= 0 ) )
+        {
+            rc = sent;
+        }
+    }
+
+    return rc;
+}
+
 /**
  * @brief Defines callback type for receiving bytes from the network.
  *
@@ -115,7 +115,7 @@ void SetupMqttTestParam( MqttTestParam_t * pTestParam )
         xTransport.pNetworkContext = &xNetworkContext;
         xTransport.recv = Transport_Recv;
         xTransport.send = Transport_Send;
-        xTransport.writev = NULL;
+        xTransport.writev = Transport_Writev;
 
         pTestParam->pTransport = &xTransport;
         pTestParam->pNetworkConnect = prvTransportNetworkConnectTLS;
@@ -0,0 +1,257 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file latency_probe.c
+ * @brief Implements the latency histogram and the sequence number tracking.
+ */
+
+#include "latency_probe.h"
+
+/* Standard includes. */
+#include <string.h>
+
+/* Kernel includes. */
+#include "task.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "LATENCY"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/*-----------------------------------------------------------*/
+
+#if ( LATENCY_PROBE_WINDOW != 32U )
+    #error "LATENCY_PROBE_WINDOW must match the width of ulSeenMask."
+#endif
+
+/**
+ * @brief Upper bound of each bucket in milliseconds, roughly three buckets
+ * per decade.
+ */
+static const uint32_t ulBucketBoundsMs[ LATENCY_PROBE_NUM_BUCKETS ] =
+{
+    1U,    2U,    3U,    5U,    7U,
+    10U,   15U,   20U,   30U,   50U,
+    70U,   100U,  150U,  200U,  300U,
+    500U,  700U,  1000U, 1500U, 2000U,
+    3000U, 5000U, 7000U, 10000U,
+    UINT32_MAX
+};
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Count the sequence numbers of a window that were not received.
+ *
+ * @param[in] ulSeenMask Received bits of the window.
+ * @param[in] ulBits Number of bits of the window to look at.
+ *
+ * @return The number of clear bits.
+ */
+static uint32_t prvCountUnseen( uint32_t ulSeenMask,
+                                uint32_t ulBits );
+
+/**
+ * @brief Track the sequence number of a received publish.
+ *
+ * @param[in] pxProbe The probe.
+ * @param[in] ulSequence The sequence number.
+ */
+static void prvTrackSequence( LatencyProbe_t * pxProbe,
+                              uint32_t ulSequence );
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvCountUnseen( uint32_t ulSeenMask,
+                                uint32_t ulBits )
+{
+    uint32_t ulUnseen = 0U;
+    uint32_t i;
+
+    for( i = 0U; i < ulBits; i++ )
+    {
+        if( ( ulSeenMask & ( 1UL << i ) ) == 0U )
+        {
+            ulUnseen++;
+        }
+    }
+
+    return ulUnseen;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTrackSequence( LatencyProbe_t * pxProbe,
+                              uint32_t ulSequence )
+{
+    uint32_t ulDistance;
+
+    if( pxProbe->xStarted == false )
+    {
+        /* Sequence numbers sent before the first one received are not
+         * counted as lost. */
+        pxProbe->xStarted = true;
+        pxProbe->ulHighest = ulSequence;
+        pxProbe->ulSeenMask = UINT32_MAX;
+    }
+    else if( ulSequence > pxProbe->ulHighest )
+    {
+        ulDistance = ulSequence - pxProbe->ulHighest;
+
+        /* The oldest ulDistance sequence numbers leave the window, and so do
+         * the ones skipped beyond it. */
+        if( ulDistance >= LATENCY_PROBE_WINDOW )
+        {
+            pxProbe->ulLost += prvCountUnseen( pxProbe->ulSeenMask, LATENCY_PROBE_WINDOW ) +
+                               ( ulDistance - LATENCY_PROBE_WINDOW );
+            pxProbe->ulSeenMask = 1U;
+        }
+        else
+        {
+            pxProbe->ulLost += prvCountUnseen( pxProbe->ulSeenMask >> ( LATENCY_PROBE_WINDOW - ulDistance ), ulDistance );
+            pxProbe->ulSeenMask = ( pxProbe->ulSeenMask << ulDistance ) | 1U;
+        }
+
+        pxProbe->ulHighest = ulSequence;
+    }
+    else
+    {
+        ulDistance = pxProbe->ulHighest - ulSequence;
+
+        if( ulDistance >= LATENCY_PROBE_WINDOW )
+        {
+            /* Already counted as lost when it left the window. */
+            pxProbe->ulReordered++;
+
+            if( pxProbe->ulLost > 0U )
+            {
+                pxProbe->ulLost--;
+            }
+        }
+        else if( ( pxProbe->ulSeenMask & ( 1UL << ulDistance ) ) != 0U )
+        {
+            pxProbe->ulDuplicates++;
+        }
+        else
+        {
+            pxProbe->ulSeenMask |= ( 1UL << ulDistance );
+            pxProbe->ulReordered++;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void LatencyProbe_Init( LatencyProbe_t * pxProbe )
+{
+    configASSERT( pxProbe != NULL );
+
+    memset( pxProbe, 0x00, sizeof( LatencyProbe_t ) );
+}
+
+/*-----------------------------------------------------------*/
+
+void LatencyProbe_Record( LatencyProbe_t * pxProbe,
+                          uint32_t ulSequence,
+                          TickType_t xSentTick )
+{
+    uint32_t ulRoundTripMs;
+    uint32_t ulBucket = 0U;
+
+    configASSERT( pxProbe != NULL );
+
+    /* The tick count wraps, the difference does not. */
+    ulRoundTripMs = ( uint32_t ) ( xTaskGetTickCount() - xSentTick ) * portTICK_PERIOD_MS;
+
+    while( ulRoundTripMs > ulBucketBoundsMs[ ulBucket ] )
+    {
+        ulBucket++;
+    }
+
+    pxProbe->ulBuckets[ ulBucket ]++;
+    pxProbe->ulSamples++;
+
+    if( ulRoundTripMs > pxProbe->ulMaxMs )
+    {
+        pxProbe->ulMaxMs = ulRoundTripMs;
+    }
+
+    prvTrackSequence( pxProbe, ulSequence );
+}
+
+/*-----------------------------------------------------------*/
+
+void LatencyProbe_SetDropped( LatencyProbe_t * pxProbe,
+                              uint32_t ulDropped )
+{
+    configASSERT( pxProbe != NULL );
+
+    pxProbe->ulDropped = ulDropped;
+}
+
+/*-----------------------------------------------------------*/
+
+uint32_t LatencyProbe_GetPercentile( const LatencyProbe_t * pxProbe,
+                                     uint32_t ulPercent )
+{
+    uint32_t ulRank, ulCount = 0U;
+    uint32_t ulBucket = 0U;
+    uint32_t ulPercentileMs = 0U;
+
+    configASSERT( pxProbe != NULL );
+    configASSERT( ( ulPercent > 0U ) && ( ulPercent <= 100U ) );
+
+    if( pxProbe->ulSamples > 0U )
+    {
+        /* Rank of the percentile, rounded up. */
+        ulRank = ( uint32_t ) ( ( ( ( uint64_t ) pxProbe->ulSamples * ulPercent ) + 99U ) / 100U );
+
+        while( ( ulCount + pxProbe->ulBuckets[ ulBucket ] ) < ulRank )
+        {
+            ulCount += pxProbe->ulBuckets[ ulBucket ];
+            ulBucket++;
+        }
+
+        ulPercentileMs = ( ulBucketBoundsMs[ ulBucket ] < pxProbe->ulMaxMs ) ? ulBucketBoundsMs[ ulBucket ] : pxProbe->ulMaxMs;
+    }
+
+    return ulPercentileMs;
+}
+
+/*-----------------------------------------------------------*/
+
+void LatencyProbe_Report( LatencyProbe_t * pxProbe,
+                          const char * pcName )
+{
+    uint32_t ulLost;
+
+    configASSERT( pxProbe != NULL );
+
+    /* A dropped publish is only counted as lost once its sequence number
+     * leaves the window, so the recent drops may not be in ulLost yet. */
+    ulLost = ( pxProbe->ulLost > pxProbe->ulDropped ) ? ( pxProbe->ulLost - pxProbe->ulDropped ) : 0U;
+
+    LogInfo( ( "%s round trip over %u publishes: p50 %u ms, p90 %u ms, p99 %u ms, max %u ms; lost %u, dropped %u, reordered %u, duplicates %u.",
+               pcName,
+               ( unsigned int ) pxProbe->ulSamples,
+               ( unsigned int ) LatencyProbe_GetPercentile( pxProbe, 50U ),
+               ( unsigned int ) LatencyProbe_GetPercentile( pxProbe, 90U ),
+               ( unsigned int ) LatencyProbe_GetPercentile( pxProbe, 99U ),
+               ( unsigned int ) pxProbe->ulMaxMs,
+               ( unsigned int ) ulLost,
+               ( unsigned int ) pxProbe->ulDropped,
+               ( unsigned int ) pxProbe->ulReordered,
+               ( unsigned int ) pxProbe->ulDuplicates ) );
+
+    /* The sequence counts keep going, only the histogram starts again. */
+    memset( pxProbe->ulBuckets, 0x00, sizeof( pxProbe->ulBuckets ) );
+    pxProbe->ulSamples = 0U;
+    pxProbe->ulMaxMs = 0U;
+}
@@ -0,0 +1,116 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file latency_probe.h
+ * @brief Round-trip latency of publishes echoed back by the broker.
+ *
+ * The publisher puts a sequence number and the tick count at which it was
+ * sent in each payload. When the publish comes back on a subscription of the
+ * same device, both are passed to LatencyProbe_Record(), which adds the round
+ * trip to a histogram of fixed buckets and tracks lost, reordered and
+ * duplicated sequence numbers. LatencyProbe_Report() logs the percentiles and
+ * counts, and starts a new histogram.
+ *
+ * Publishes the receiver dropped itself, e.g. because its queue was full, also
+ * leave gaps in the sequence. The receiver passes their count to
+ * LatencyProbe_SetDropped(), so that they are reported apart from the
+ * publishes lost on the way.
+ *
+ * A probe is not thread safe, it is meant to be used by the task that
+ * receives the echoed publishes.
+ */
+#ifndef LATENCY_PROBE_H
+#define LATENCY_PROBE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+
+/**
+ * @brief Number of buckets of the histogram, the last one holds every round
+ * trip above the largest bound.
+ */
+#define LATENCY_PROBE_NUM_BUCKETS    ( 25U )
+
+/**
+ * @brief Sequence numbers followed after the highest one received. An older
+ * sequence number that was not received by then is counted as lost, and
+ * counted as reordered instead should it arrive later.
+ */
+#define LATENCY_PROBE_WINDOW         ( 32U )
+
+/**
+ * @brief Histogram and sequence tracking of one stream of echoed publishes.
+ */
+typedef struct LatencyProbe
+{
+    uint32_t ulBuckets[ LATENCY_PROBE_NUM_BUCKETS ];
+    uint32_t ulSamples;     /**< Round trips in the histogram. */
+    uint32_t ulMaxMs;       /**< Longest round trip in the histogram. */
+    bool xStarted;          /**< Whether a sequence number was received yet. */
+    uint32_t ulHighest;     /**< Highest sequence number received. */
+    uint32_t ulSeenMask;    /**< Bit n set if ulHighest - n was received. */
+    uint32_t ulLost;        /**< Sequence numbers that left the window unseen, since init. */
+    uint32_t ulReordered;   /**< Sequence numbers received after a higher one, since init. */
+    uint32_t ulDuplicates;  /**< Sequence numbers received more than once, since init. */
+    uint32_t ulDropped;     /**< Publishes dropped by the receiver, since init. */
+} LatencyProbe_t;
+
+/**
+ * @brief Initialize a probe.
+ *
+ * @param[in] pxProbe The probe.
+ */
+void LatencyProbe_Init( LatencyProbe_t * pxProbe );
+
+/**
+ * @brief Record a publish received now.
+ *
+ * @param[in] pxProbe The probe.
+ * @param[in] ulSequence Sequence number of the publish.
+ * @param[in] xSentTick Tick count at which the publish was sent.
+ */
+void LatencyProbe_Record( LatencyProbe_t * pxProbe,
+                          uint32_t ulSequence,
+                          TickType_t xSentTick );
+
+/**
+ * @brief Set the number of publishes the receiver dropped before recording
+ * them. These are taken out of the lost count once they leave the window.
+ *
+ * @param[in] pxProbe The probe.
+ * @param[in] ulDropped Publishes dropped since the probe was initialized.
+ */
+void LatencyProbe_SetDropped( LatencyProbe_t * pxProbe,
+                              uint32_t ulDropped );
+
+/**
+ * @brief Get a percentile of the round trips in the histogram.
+ *
+ * @param[in] pxProbe The probe.
+ * @param[in] ulPercent The percentile, from 1 to 100.
+ *
+ * @return Upper bound of the bucket holding the percentile, capped to the
+ * longest round trip, in milliseconds. 0 if the histogram is empty.
+ */
+uint32_t LatencyProbe_GetPercentile( const LatencyProbe_t * pxProbe,
+                                     uint32_t ulPercent );
+
+/**
+ * @brief Log p50, p90, p99 and the longest round trip of the histogram, with
+ * the lost, dropped, reordered and duplicated counts, then empty the
+ * histogram.
+ *
+ * @param[in] pxProbe The probe.
+ * @param[in] pcName Name of the probe in the log.
+ */
+void LatencyProbe_Report( LatencyProbe_t * pxProbe,
+                          const char * pcName );
+
+#endif /* LATENCY_PROBE_H */
@@ -12,6 +12,7 @@
 #include "dev_mode_key_provisioning.h"
 
 #include "mqtt_agent_task.h"
+#include "store_forward.h"
 
 #include "ota_provision.h"
 
@@ -59,6 +60,8 @@ extern int32_t network_startup( void );
 extern BaseType_t xStartPubSubTasks( uint32_t ulNumPubsubTasks,
                                      configSTACK_DEPTH_TYPE uxStackSize,
                                      UBaseType_t uxPriority );
+extern BaseType_t xStartLoadGeneratorTasks( configSTACK_DEPTH_TYPE uxStackSize,
+                                            UBaseType_t uxPriority );
 
 extern uint32_t tfm_ns_interface_init( void );
 
@@ -234,13 +237,22 @@ int main()
             /* Start MQTT agent task */
             vStartMqttAgentTask();
 
+            /* Start the store-and-forward queue of the MQTT agent. */
+            StoreForward_Start( xMQTTAgentGetDefault() );
+
             /* Start OTA task*/
             vStartOtaTask();
 
-            /*Start demo task once agent task is started. */
-            ( void ) xStartPubSubTasks( appCONFIG_MQTT_NUM_PUBSUB_TASKS,
-                                        appCONFIG_MQTT_PUBSUB_TASK_STACK_SIZE,
-                                        appCONFIG_MQTT_PUBSUB_TASK_PRIORITY );
+            #if ( appCONFIG_MQTT_LOAD_GENERATOR == 1 )
+                /* Run the MQTT workload instead of the demo tasks. */
+                ( void ) xStartLoadGeneratorTasks( appCONFIG_MQTT_PUBSUB_TASK_STACK_SIZE,
+                                                   appCONFIG_MQTT_PUBSUB_TASK_PRIORITY );
+            #else
+                /*Start demo task once agent task is started. */
+                ( void ) xStartPubSubTasks( appCONFIG_MQTT_NUM_PUBSUB_TASKS,
+                                            appCONFIG_MQTT_PUBSUB_TASK_STACK_SIZE,
+                                            appCONFIG_MQTT_PUBSUB_TASK_PRIORITY );
+            #endif
         #endif // INTEGRATION_TESTS
 
         vTaskStartScheduler();
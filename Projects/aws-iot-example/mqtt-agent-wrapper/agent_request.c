@@ -0,0 +1,355 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file agent_request.c
+ * @brief Implements the request objects of publishes and subscribes.
+ */
+
+/* Standard includes. */
+#include <stddef.h>
+#include <string.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Header include. */
+#include "agent_request.h"
+
+/* Pool of the shared requests. */
+#include "object_pool.h"
+
+/* MQTT agent includes. */
+#include "freertos_command_pool.h"
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "REQUEST"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief References to a request, as bits of ulReferences. Each holder clears
+ * its own bit with a single atomic operation, and the holder that clears the
+ * last one gives the request back to the pool.
+ */
+#define REQUEST_REFERENCE_CALLER    ( 1U )
+#define REQUEST_REFERENCE_AGENT     ( 2U )
+
+/**
+ * @brief The requests shared by AgentRequest_Obtain().
+ */
+static AgentRequest_t xRequests[ AGENT_REQUEST_POOL_SIZE ];
+static uint8_t ucRequestPoolStorage[ OBJECT_POOL_STORAGE_SIZE( AGENT_REQUEST_POOL_SIZE ) ];
+static ObjectPool_t xRequestPool;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Clear a reference of a request, and give the request back to the
+ * pool if it was the last one.
+ *
+ * @param[in] pxRequest The request.
+ * @param[in] ulReference The reference to clear.
+ */
+static void prvDropReference( AgentRequest_t * pxRequest,
+                              uint32_t ulReference );
+
+/**
+ * @brief Mark a request in flight before its command is queued.
+ *
+ * @param[in] pxRequest The request.
+ */
+static void prvPrepareSend( AgentRequest_t * pxRequest );
+
+/**
+ * @brief Completion callback of every request, run on the agent task.
+ *
+ * @param[in] pxCommandContext The first member of the request.
+ * @param[in] pxReturnInfo Return information of the command.
+ */
+static void prvRequestCompleteCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                        MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/*-----------------------------------------------------------*/
+
+static void prvDropReference( AgentRequest_t * pxRequest,
+                              uint32_t ulReference )
+{
+    bool xFromPool = pxRequest->xFromPool;
+    uint32_t ulReferences;
+
+    /* Once its reference is cleared, the holder must not touch the request
+     * again unless it was the last one. */
+    ulReferences = __atomic_fetch_and( &( pxRequest->ulReferences ), ~ulReference, __ATOMIC_ACQ_REL );
+    configASSERT( ( ulReferences & ulReference ) != 0U );
+
+    if( ( ulReferences == ulReference ) && ( xFromPool == true ) )
+    {
+        ObjectPool_Give( &xRequestPool, pxRequest );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvPrepareSend( AgentRequest_t * pxRequest )
+{
+    configASSERT( __atomic_load_n( &( pxRequest->ulReferences ), __ATOMIC_ACQUIRE ) == REQUEST_REFERENCE_CALLER );
+
+    pxRequest->xCommandContext.xReturnStatus = MQTTSendFailed;
+    pxRequest->xCommandContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
+
+    pxRequest->xCommandInfo.cmdCompleteCallback = prvRequestCompleteCallback;
+    pxRequest->xCommandInfo.pCmdCompleteCallbackContext = &( pxRequest->xCommandContext );
+
+    /* The command may complete before the send returns. */
+    __atomic_store_n( &( pxRequest->ulReferences ),
+                      REQUEST_REFERENCE_CALLER | REQUEST_REFERENCE_AGENT,
+                      __ATOMIC_RELEASE );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRequestCompleteCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                        MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    AgentRequest_t * pxRequest = ( AgentRequest_t * ) pxCommandContext;
+    TaskHandle_t xWaiter = pxRequest->xCommandContext.xTaskToNotify;
+
+    pxRequest->xCommandContext.xReturnStatus = pxReturnInfo->returnCode;
+
+    if( pxRequest->xCallback != NULL )
+    {
+        pxRequest->xCallback( pxRequest, pxReturnInfo );
+    }
+
+    prvDropReference( pxRequest, REQUEST_REFERENCE_AGENT );
+
+    /* The waiter checks the references of the request when woken, so a task
+     * that stopped waiting only gets a spurious wakeup. */
+    ( void ) xTaskNotifyGiveIndexed( xWaiter, AGENT_REQUEST_NOTIFICATION_INDEX );
+}
+
+/*-----------------------------------------------------------*/
+
+void AgentRequest_InitPool( void )
+{
+    ObjectPool_Init( &xRequestPool, xRequests, sizeof( AgentRequest_t ), AGENT_REQUEST_POOL_SIZE, ucRequestPoolStorage );
+}
+
+/*-----------------------------------------------------------*/
+
+AgentRequest_t * AgentRequest_Obtain( uint32_t ulBlockTimeMs )
+{
+    AgentRequest_t * pxRequest;
+
+    pxRequest = ( AgentRequest_t * ) ObjectPool_Take( &xRequestPool, pdMS_TO_TICKS( ulBlockTimeMs ) );
+
+    if( pxRequest != NULL )
+    {
+        AgentRequest_Init( pxRequest );
+        pxRequest->xFromPool = true;
+    }
+    else
+    {
+        LogDebug( ( "No request available." ) );
+    }
+
+    return pxRequest;
+}
+
+/*-----------------------------------------------------------*/
+
+void AgentRequest_Init( AgentRequest_t * pxRequest )
+{
+    configASSERT( pxRequest != NULL );
+
+    memset( pxRequest, 0x00, sizeof( AgentRequest_t ) );
+    pxRequest->ulReferences = REQUEST_REFERENCE_CALLER;
+}
+
+/*-----------------------------------------------------------*/
+
+void AgentRequest_SetPublish( AgentRequest_t * pxRequest,
+                              MQTTQoS_t xQoS,
+                              const char * pcTopic,
+                              uint16_t usTopicLength,
+                              const void * pvPayload,
+                              size_t xPayloadLength )
+{
+    configASSERT( pxRequest != NULL );
+
+    pxRequest->xPublishInfo.qos = xQoS;
+    pxRequest->xPublishInfo.pTopicName = pcTopic;
+    pxRequest->xPublishInfo.topicNameLength = usTopicLength;
+    pxRequest->xPublishInfo.pPayload = pvPayload;
+    pxRequest->xPublishInfo.payloadLength = xPayloadLength;
+    pxRequest->xCommandContext.pArgs = &( pxRequest->xPublishInfo );
+}
+
+/*-----------------------------------------------------------*/
+
+void AgentRequest_SetSubscribe( AgentRequest_t * pxRequest,
+                                MQTTQoS_t xQoS,
+                                const char * pcTopicFilter,
+                                uint16_t usTopicFilterLength )
+{
+    configASSERT( pxRequest != NULL );
+
+    pxRequest->xSubscribeInfo.qos = xQoS;
+    pxRequest->xSubscribeInfo.pTopicFilter = pcTopicFilter;
+    pxRequest->xSubscribeInfo.topicFilterLength = usTopicFilterLength;
+    pxRequest->xSubscribeArgs.pSubscribeInfo = &( pxRequest->xSubscribeInfo );
+    pxRequest->xSubscribeArgs.numSubscriptions = 1U;
+    pxRequest->xCommandContext.pArgs = &( pxRequest->xSubscribeArgs );
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t AgentRequest_Publish( MQTTAgentHandle_t xHandle,
+                                   AgentRequest_t * pxRequest,
+                                   uint32_t ulBlockTimeMs )
+{
+    MQTTStatus_t xStatus;
+
+    configASSERT( xHandle != NULL );
+    configASSERT( pxRequest != NULL );
+
+    prvPrepareSend( pxRequest );
+    pxRequest->xCommandInfo.blockTimeMs = ulBlockTimeMs;
+
+    Agent_SetNextCommandDeadline( pxRequest->ulDeadlineMs );
+    xStatus = xMQTTAgentPublish( xHandle,
+                                 &( pxRequest->xPublishInfo ),
+                                 &( pxRequest->xCommandInfo ),
+                                 ulBlockTimeMs );
+    Agent_SetNextCommandDeadline( 0U );
+
+    if( xStatus != MQTTSuccess )
+    {
+        /* The command was never queued, so no completion will arrive. */
+        prvDropReference( pxRequest, REQUEST_REFERENCE_AGENT );
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t AgentRequest_Subscribe( MQTTAgentHandle_t xHandle,
+                                     AgentRequest_t * pxRequest,
+                                     uint32_t ulBlockTimeMs )
+{
+    MQTTStatus_t xStatus;
+
+    configASSERT( xHandle != NULL );
+    configASSERT( pxRequest != NULL );
+
+    prvPrepareSend( pxRequest );
+    pxRequest->xCommandInfo.blockTimeMs = ulBlockTimeMs;
+
+    Agent_SetNextCommandDeadline( pxRequest->ulDeadlineMs );
+    xStatus = MQTTAgent_Subscribe( pxMQTTAgentGetContext( xHandle ),
+                                   &( pxRequest->xSubscribeArgs ),
+                                   &( pxRequest->xCommandInfo ) );
+    Agent_SetNextCommandDeadline( 0U );
+
+    if( xStatus != MQTTSuccess )
+    {
+        /* The command was never queued, so no completion will arrive. */
+        prvDropReference( pxRequest, REQUEST_REFERENCE_AGENT );
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t AgentRequest_Unsubscribe( MQTTAgentHandle_t xHandle,
+                                       AgentRequest_t * pxRequest,
+                                       uint32_t ulBlockTimeMs )
+{
+    MQTTStatus_t xStatus;
+
+    configASSERT( xHandle != NULL );
+    configASSERT( pxRequest != NULL );
+
+    prvPrepareSend( pxRequest );
+    pxRequest->xCommandInfo.blockTimeMs = ulBlockTimeMs;
+
+    Agent_SetNextCommandDeadline( pxRequest->ulDeadlineMs );
+    xStatus = MQTTAgent_Unsubscribe( pxMQTTAgentGetContext( xHandle ),
+                                     &( pxRequest->xSubscribeArgs ),
+                                     &( pxRequest->xCommandInfo ) );
+    Agent_SetNextCommandDeadline( 0U );
+
+    if( xStatus != MQTTSuccess )
+    {
+        /* The command was never queued, so no completion will arrive. */
+        prvDropReference( pxRequest, REQUEST_REFERENCE_AGENT );
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t AgentRequest_Wait( AgentRequest_t * pxRequest,
+                                uint32_t ulTimeoutMs )
+{
+    MQTTStatus_t xStatus = MQTTSendFailed;
+    TickType_t xTicksToWait = pdMS_TO_TICKS( ulTimeoutMs );
+    TimeOut_t xTimeOut;
+    bool xInFlight = AgentRequest_IsInFlight( pxRequest );
+
+    vTaskSetTimeOutState( &xTimeOut );
+
+    /* A notification may be left over from a request the task stopped waiting
+     * for, so the request itself says whether it completed. */
+    while( ( xInFlight == true ) && ( xTicksToWait > 0U ) )
+    {
+        ( void ) ulTaskNotifyTakeIndexed( AGENT_REQUEST_NOTIFICATION_INDEX, pdTRUE, xTicksToWait );
+        xInFlight = AgentRequest_IsInFlight( pxRequest );
+
+        if( xTaskCheckForTimeOut( &xTimeOut, &xTicksToWait ) != pdFALSE )
+        {
+            xTicksToWait = 0U;
+        }
+    }
+
+    if( xInFlight == false )
+    {
+        xStatus = pxRequest->xCommandContext.xReturnStatus;
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+bool AgentRequest_IsInFlight( const AgentRequest_t * pxRequest )
+{
+    configASSERT( pxRequest != NULL );
+
+    return ( ( __atomic_load_n( &( pxRequest->ulReferences ), __ATOMIC_ACQUIRE ) & REQUEST_REFERENCE_AGENT ) != 0U );
+}
+
+/*-----------------------------------------------------------*/
+
+void AgentRequest_Release( AgentRequest_t * pxRequest )
+{
+    configASSERT( pxRequest != NULL );
+
+    prvDropReference( pxRequest, REQUEST_REFERENCE_CALLER );
+}
@@ -0,0 +1,218 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file agent_request.h
+ * @brief Re-entrant request objects for publishes and subscribes sent through
+ * the MQTT agent.
+ *
+ * A request holds everything the agent reads while a command is in flight: the
+ * publish or subscribe information, the command information and the command
+ * context. Any number of tasks can therefore send commands at the same time,
+ * each with its own request.
+ *
+ * A request is referenced by its caller and, while the command is in flight,
+ * by the agent. It is only reused once both are done with it, so a caller that
+ * stops waiting before the command completes does not corrupt it. A request is
+ * either obtained from a shared pool with AgentRequest_Obtain(), in which case
+ * it goes back to the pool by itself, or owned by the caller and prepared with
+ * AgentRequest_Init().
+ */
+#ifndef AGENT_REQUEST_H
+#define AGENT_REQUEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* MQTT library includes. */
+#include "core_mqtt_config.h"
+#include "core_mqtt_agent.h"
+
+/* MQTT agent task header include. */
+#include "mqtt_agent_task.h"
+
+/**
+ * @brief Number of requests in the pool shared by AgentRequest_Obtain().
+ */
+#ifndef AGENT_REQUEST_POOL_SIZE
+    #define AGENT_REQUEST_POOL_SIZE    ( 8U )
+#endif
+
+/**
+ * @brief Task notification index used to signal completions to the waiting
+ * task, so that it does not interfere with the other APIs.
+ */
+#ifndef AGENT_REQUEST_NOTIFICATION_INDEX
+    #define AGENT_REQUEST_NOTIFICATION_INDEX    ( 3U )
+#endif
+
+typedef struct AgentRequest AgentRequest_t;
+
+/**
+ * @brief Callback executed in the MQTT agent task when the command of a
+ * request completes, before the caller is woken.
+ *
+ * @param[in] pxRequest The request, with its return status set.
+ * @param[in] pxReturnInfo Return information of the command.
+ */
+typedef void ( * AgentRequestCallback_t )( AgentRequest_t * pxRequest,
+                                           MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief A publish or subscribe request. xCommandContext must stay the first
+ * member, as the completion callback receives its address.
+ */
+struct AgentRequest
+{
+    MQTTAgentCommandContext_t xCommandContext;
+    MQTTAgentCommandInfo_t xCommandInfo;
+    MQTTPublishInfo_t xPublishInfo;
+    MQTTSubscribeInfo_t xSubscribeInfo;
+    MQTTAgentSubscribeArgs_t xSubscribeArgs;
+    AgentRequestCallback_t xCallback; /**< Optional, set after the request is prepared. */
+    void * pvUserContext;             /**< Free for the use of xCallback. */
+    uint32_t ulDeadlineMs;            /**< Optional, see Agent_SetNextCommandDeadline(). 0 for none. */
+    uint32_t ulReferences;            /**< Held by the caller, and by the agent while the command is in flight. */
+    bool xFromPool;
+};
+
+/**
+ * @brief Create the pool of requests. Called when an MQTT agent is started,
+ * before any task can obtain a request.
+ */
+void AgentRequest_InitPool( void );
+
+/**
+ * @brief Obtain a request from the pool. The request goes back to the pool
+ * once released by the caller and completed by the agent.
+ * AgentRequest_InitPool() must have been called.
+ *
+ * @param[in] ulBlockTimeMs Time to wait for a request to be free.
+ *
+ * @return The request, or NULL if none was free in time.
+ */
+AgentRequest_t * AgentRequest_Obtain( uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Prepare a request owned by the caller. Must not be called while
+ * AgentRequest_IsInFlight() returns `true` for it.
+ *
+ * @param[in] pxRequest The request.
+ */
+void AgentRequest_Init( AgentRequest_t * pxRequest );
+
+/**
+ * @brief Set the publish a request sends.
+ *
+ * @param[in] pxRequest The request.
+ * @param[in] xQoS QoS of the publish.
+ * @param[in] pcTopic Topic name, which must stay valid until the command
+ * completes.
+ * @param[in] usTopicLength Length of the topic name.
+ * @param[in] pvPayload Payload, which must stay valid until the command
+ * completes.
+ * @param[in] xPayloadLength Length of the payload.
+ */
+void AgentRequest_SetPublish( AgentRequest_t * pxRequest,
+                              MQTTQoS_t xQoS,
+                              const char * pcTopic,
+                              uint16_t usTopicLength,
+                              const void * pvPayload,
+                              size_t xPayloadLength );
+
+/**
+ * @brief Set the single topic filter a request subscribes to or unsubscribes
+ * from.
+ *
+ * @param[in] pxRequest The request.
+ * @param[in] xQoS QoS of the subscription.
+ * @param[in] pcTopicFilter Topic filter, which must stay valid until the
+ * command completes.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ */
+void AgentRequest_SetSubscribe( AgentRequest_t * pxRequest,
+                                MQTTQoS_t xQoS,
+                                const char * pcTopicFilter,
+                                uint16_t usTopicFilterLength );
+
+/**
+ * @brief Send the publish of a request.
+ *
+ * @param[in] xHandle The agent instance.
+ * @param[in] pxRequest The request, prepared with AgentRequest_SetPublish().
+ * @param[in] ulBlockTimeMs Time to wait for the command to be queued.
+ *
+ * @return #MQTTSuccess if the command was queued, in which case
+ * AgentRequest_Wait() returns its result.
+ */
+MQTTStatus_t AgentRequest_Publish( MQTTAgentHandle_t xHandle,
+                                   AgentRequest_t * pxRequest,
+                                   uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Send the subscribe of a request.
+ *
+ * @param[in] xHandle The agent instance.
+ * @param[in] pxRequest The request, prepared with AgentRequest_SetSubscribe().
+ * @param[in] ulBlockTimeMs Time to wait for the command to be queued.
+ *
+ * @return #MQTTSuccess if the command was queued, in which case
+ * AgentRequest_Wait() returns its result.
+ */
+MQTTStatus_t AgentRequest_Subscribe( MQTTAgentHandle_t xHandle,
+                                     AgentRequest_t * pxRequest,
+                                     uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Send the unsubscribe of a request.
+ *
+ * @param[in] xHandle The agent instance.
+ * @param[in] pxRequest The request, prepared with AgentRequest_SetSubscribe().
+ * @param[in] ulBlockTimeMs Time to wait for the command to be queued.
+ *
+ * @return #MQTTSuccess if the command was queued, in which case
+ * AgentRequest_Wait() returns its result.
+ */
+MQTTStatus_t AgentRequest_Unsubscribe( MQTTAgentHandle_t xHandle,
+                                       AgentRequest_t * pxRequest,
+                                       uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Wait for the command of a request to complete. Only called by the
+ * task that sent it.
+ *
+ * @param[in] pxRequest The request.
+ * @param[in] ulTimeoutMs Time to wait.
+ *
+ * @return The result of the command, or #MQTTSendFailed if it did not
+ * complete in time.
+ */
+MQTTStatus_t AgentRequest_Wait( AgentRequest_t * pxRequest,
+                                uint32_t ulTimeoutMs );
+
+/**
+ * @brief Check whether the agent still references a request, e.g. after
+ * AgentRequest_Wait() timed out.
+ *
+ * @param[in] pxRequest The request.
+ *
+ * @return `true` if the command has been sent and has not completed.
+ */
+bool AgentRequest_IsInFlight( const AgentRequest_t * pxRequest );
+
+/**
+ * @brief Give up the reference of the caller. A request of the pool goes back
+ * to the pool when its command completes, or straight away if it already has.
+ *
+ * @param[in] pxRequest The request.
+ */
+void AgentRequest_Release( AgentRequest_t * pxRequest );
+
+#endif /* AGENT_REQUEST_H */
@@ -0,0 +1,221 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file async_publish.c
+ * @brief Implements the non-blocking publish API.
+ */
+
+/* Standard includes. */
+#include <string.h>
+
+/* Header include. */
+#include "async_publish.h"
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "ASYNC PUB"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Passed into xMQTTAgentPublish() as the callback to execute when the
+ * publish completes. Runs in the MQTT agent task.
+ *
+ * @param[in] pxCommandContext The slot of the completed publish.
+ * @param[in] pxReturnInfo The result of the command.
+ */
+static void prvAsyncPublishCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                            MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/*-----------------------------------------------------------*/
+
+static void prvAsyncPublishCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                            MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    AsyncPublishSlot_t * pxSlot = ( AsyncPublishSlot_t * ) pxCommandContext;
+    AsyncPublisher_t * pxPublisher = pxSlot->pxPublisher;
+
+    pxSlot->xStatus = pxReturnInfo->returnCode;
+
+    taskENTER_CRITICAL();
+    {
+        pxPublisher->ulInFlight--;
+    }
+    taskEXIT_CRITICAL();
+
+    if( pxPublisher->pxCallback != NULL )
+    {
+        pxPublisher->pxCallback( pxSlot->pvUserContext, pxSlot->xStatus );
+        pxSlot->xInUse = false;
+    }
+    else
+    {
+        /* The slot is released once the owner takes the completion, so the
+         * ring can never hold more entries than there are slots. */
+        pxPublisher->ucCompletionRing[ pxPublisher->ulRingHead % ASYNC_PUBLISH_MAX_IN_FLIGHT ] =
+            ( uint8_t ) ( pxSlot - pxPublisher->xSlots );
+        pxPublisher->ulRingHead++;
+
+        ( void ) xTaskNotifyGiveIndexed( pxPublisher->xOwner, ASYNC_PUBLISH_NOTIFICATION_INDEX );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void AsyncPublish_Init( AsyncPublisher_t * pxPublisher,
+                        MQTTAgentHandle_t xAgent,
+                        AsyncPublishCallback_t pxCallback )
+{
+    configASSERT( pxPublisher != NULL );
+    configASSERT( xAgent != NULL );
+
+    memset( pxPublisher, 0x00, sizeof( AsyncPublisher_t ) );
+    pxPublisher->xAgent = xAgent;
+    pxPublisher->pxCallback = pxCallback;
+    pxPublisher->xOwner = xTaskGetCurrentTaskHandle();
+
+    ( void ) xTaskNotifyStateClearIndexed( NULL, ASYNC_PUBLISH_NOTIFICATION_INDEX );
+    ( void ) ulTaskNotifyValueClearIndexed( NULL, ASYNC_PUBLISH_NOTIFICATION_INDEX, UINT32_MAX );
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t AsyncPublish_Submit( AsyncPublisher_t * pxPublisher,
+                                  const MQTTPublishInfo_t * pxPublishInfo,
+                                  bool xCopyPayload,
+                                  void * pvUserContext,
+                                  uint32_t ulBlockTimeMs )
+{
+    MQTTStatus_t xStatus = MQTTNoMemory;
+    AsyncPublishSlot_t * pxSlot = NULL;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+    uint32_t ulIndex;
+
+    if( ( pxPublisher == NULL ) || ( pxPublishInfo == NULL ) )
+    {
+        LogError( ( "Invalid parameter. pxPublisher=%p, pxPublishInfo=%p.",
+                    pxPublisher,
+                    pxPublishInfo ) );
+        xStatus = MQTTBadParameter;
+    }
+    else if( ( xCopyPayload == true ) && ( pxPublishInfo->payloadLength > ASYNC_PUBLISH_SLOT_BUFFER_SIZE ) )
+    {
+        LogError( ( "Payload of %u bytes does not fit the slot buffer.",
+                    ( unsigned int ) pxPublishInfo->payloadLength ) );
+    }
+    else
+    {
+        /* Only the owner marks slots in use, so no locking is required. */
+        for( ulIndex = 0U; ulIndex < ASYNC_PUBLISH_MAX_IN_FLIGHT; ulIndex++ )
+        {
+            if( pxPublisher->xSlots[ ulIndex ].xInUse == false )
+            {
+                pxSlot = &( pxPublisher->xSlots[ ulIndex ] );
+                break;
+            }
+        }
+
+        if( pxSlot == NULL )
+        {
+            LogDebug( ( "All %u publish slots are in flight.", ( unsigned int ) ASYNC_PUBLISH_MAX_IN_FLIGHT ) );
+        }
+        else
+        {
+            pxSlot->xPublishInfo = *pxPublishInfo;
+            pxSlot->pvUserContext = pvUserContext;
+            pxSlot->pxPublisher = pxPublisher;
+            pxSlot->xStatus = MQTTSendFailed;
+            pxSlot->xInUse = true;
+
+            if( ( xCopyPayload == true ) && ( pxPublishInfo->payloadLength > 0U ) )
+            {
+                memcpy( pxSlot->ucBuffer, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
+                pxSlot->xPublishInfo.pPayload = pxSlot->ucBuffer;
+            }
+
+            taskENTER_CRITICAL();
+            {
+                pxPublisher->ulInFlight++;
+            }
+            taskEXIT_CRITICAL();
+
+            xCommandParams.blockTimeMs = ulBlockTimeMs;
+            xCommandParams.cmdCompleteCallback = prvAsyncPublishCommandCallback;
+            xCommandParams.pCmdCompleteCallbackContext = ( MQTTAgentCommandContext_t * ) pxSlot;
+
+            xStatus = xMQTTAgentPublish( pxPublisher->xAgent,
+                                         &( pxSlot->xPublishInfo ),
+                                         &xCommandParams,
+                                         ulBlockTimeMs );
+
+            if( xStatus != MQTTSuccess )
+            {
+                /* The command was never enqueued, so no completion will arrive. */
+                taskENTER_CRITICAL();
+                {
+                    pxPublisher->ulInFlight--;
+                }
+                taskEXIT_CRITICAL();
+
+                pxSlot->xInUse = false;
+            }
+        }
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+bool AsyncPublish_GetCompletion( AsyncPublisher_t * pxPublisher,
+                                 AsyncPublishCompletion_t * pxCompletion,
+                                 uint32_t ulBlockTimeMs )
+{
+    bool xCompleted = false;
+    AsyncPublishSlot_t * pxSlot;
+
+    configASSERT( pxPublisher != NULL );
+    configASSERT( pxCompletion != NULL );
+    configASSERT( pxPublisher->pxCallback == NULL );
+
+    /* Every completion also notifies the owner, so a notification may still
+     * be pending for a completion that was already taken. Loop until there is
+     * a completion or the wait times out. */
+    while( ( pxPublisher->ulRingTail == pxPublisher->ulRingHead ) &&
+           ( ulTaskNotifyTakeIndexed( ASYNC_PUBLISH_NOTIFICATION_INDEX, pdTRUE, pdMS_TO_TICKS( ulBlockTimeMs ) ) != 0U ) )
+    {
+    }
+
+    if( pxPublisher->ulRingTail != pxPublisher->ulRingHead )
+    {
+        pxSlot = &( pxPublisher->xSlots[ pxPublisher->ucCompletionRing[ pxPublisher->ulRingTail % ASYNC_PUBLISH_MAX_IN_FLIGHT ] ] );
+        pxCompletion->pvUserContext = pxSlot->pvUserContext;
+        pxCompletion->xStatus = pxSlot->xStatus;
+
+        pxPublisher->ulRingTail++;
+        pxSlot->xInUse = false;
+        xCompleted = true;
+    }
+
+    return xCompleted;
+}
+
+/*-----------------------------------------------------------*/
+
+uint32_t AsyncPublish_GetInFlightCount( const AsyncPublisher_t * pxPublisher )
+{
+    configASSERT( pxPublisher != NULL );
+
+    return pxPublisher->ulInFlight;
+}
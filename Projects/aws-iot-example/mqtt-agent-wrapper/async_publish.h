@@ -0,0 +1,165 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file async_publish.h
+ * @brief Non-blocking publish API on top of MQTTAgent_Publish().
+ *
+ * A task owns an #AsyncPublisher_t and can keep up to
+ * ASYNC_PUBLISH_MAX_IN_FLIGHT publishes outstanding at the same time. The
+ * result of each publish is either delivered through a callback executed by
+ * the MQTT agent task, or pushed to a completion ring that the owning task
+ * drains with AsyncPublish_GetCompletion().
+ */
+#ifndef ASYNC_PUBLISH_H
+#define ASYNC_PUBLISH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* MQTT library includes. */
+#include "core_mqtt_config.h"
+#include "core_mqtt_agent.h"
+
+/* MQTT agent task header include. */
+#include "mqtt_agent_task.h"
+
+/**
+ * @brief Maximum number of publishes a single publisher can have in flight.
+ */
+#ifndef ASYNC_PUBLISH_MAX_IN_FLIGHT
+    #define ASYNC_PUBLISH_MAX_IN_FLIGHT    MQTT_STATE_ARRAY_MAX_COUNT
+#endif
+
+/**
+ * @brief Size of the per-slot buffer used when the payload is copied by
+ * AsyncPublish_Submit().
+ */
+#ifndef ASYNC_PUBLISH_SLOT_BUFFER_SIZE
+    #define ASYNC_PUBLISH_SLOT_BUFFER_SIZE    ( 256U )
+#endif
+
+/**
+ * @brief Task notification index used to signal completions to the owning
+ * task, so that it does not interfere with the synchronous APIs using index 0.
+ */
+#ifndef ASYNC_PUBLISH_NOTIFICATION_INDEX
+    #define ASYNC_PUBLISH_NOTIFICATION_INDEX    ( 1U )
+#endif
+
+/**
+ * @brief Callback executed in the MQTT agent task when a publish completes.
+ *
+ * @param[in] pvUserContext Context passed to AsyncPublish_Submit().
+ * @param[in] xStatus Result of the publish.
+ */
+typedef void (* AsyncPublishCallback_t )( void * pvUserContext,
+                                          MQTTStatus_t xStatus );
+
+/**
+ * @brief Result of a completed publish.
+ */
+typedef struct AsyncPublishCompletion
+{
+    void * pvUserContext;
+    MQTTStatus_t xStatus;
+} AsyncPublishCompletion_t;
+
+struct AsyncPublisher;
+
+/**
+ * @brief Storage for a publish that is in flight.
+ */
+typedef struct AsyncPublishSlot
+{
+    MQTTPublishInfo_t xPublishInfo;
+    void * pvUserContext;
+    struct AsyncPublisher * pxPublisher;
+    MQTTStatus_t xStatus;
+    volatile bool xInUse;
+    uint8_t ucBuffer[ ASYNC_PUBLISH_SLOT_BUFFER_SIZE ];
+} AsyncPublishSlot_t;
+
+/**
+ * @brief A publisher owned by a single task.
+ *
+ * @note The structure must stay in scope for as long as publishes are in
+ * flight.
+ */
+typedef struct AsyncPublisher
+{
+    AsyncPublishSlot_t xSlots[ ASYNC_PUBLISH_MAX_IN_FLIGHT ];
+    volatile uint8_t ucCompletionRing[ ASYNC_PUBLISH_MAX_IN_FLIGHT ];
+    volatile uint32_t ulRingHead;
+    volatile uint32_t ulRingTail;
+    MQTTAgentHandle_t xAgent;
+    AsyncPublishCallback_t pxCallback;
+    TaskHandle_t xOwner;
+    volatile uint32_t ulInFlight;
+} AsyncPublisher_t;
+
+/**
+ * @brief Initialize a publisher owned by the calling task.
+ *
+ * @param[in] pxPublisher The publisher to initialize.
+ * @param[in] xAgent The MQTT agent instance to publish with.
+ * @param[in] pxCallback Callback executed when a publish completes. If NULL,
+ * completions are queued to the completion ring instead.
+ */
+void AsyncPublish_Init( AsyncPublisher_t * pxPublisher,
+                        MQTTAgentHandle_t xAgent,
+                        AsyncPublishCallback_t pxCallback );
+
+/**
+ * @brief Submit a publish to the MQTT agent without waiting for it to complete.
+ *
+ * @note The topic and, unless xCopyPayload is set, the payload must stay in
+ * scope until the publish completes. Only the owning task may submit.
+ *
+ * @param[in] pxPublisher The publisher.
+ * @param[in] pxPublishInfo The publish to send.
+ * @param[in] xCopyPayload Copy the payload to the slot buffer so that the
+ * caller can reuse its buffer immediately.
+ * @param[in] pvUserContext Context returned with the completion.
+ * @param[in] ulBlockTimeMs Time to wait should the in-flight window of the
+ * agent, or its command queue, be full.
+ *
+ * @return `MQTTSuccess` if the publish was enqueued, `MQTTNoMemory` if all the
+ * slots are in flight, the payload does not fit the slot buffer or the agent
+ * window stayed full, otherwise the error returned by MQTTAgent_Publish().
+ */
+MQTTStatus_t AsyncPublish_Submit( AsyncPublisher_t * pxPublisher,
+                                  const MQTTPublishInfo_t * pxPublishInfo,
+                                  bool xCopyPayload,
+                                  void * pvUserContext,
+                                  uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Take the next completion from the completion ring.
+ *
+ * @param[in] pxPublisher The publisher.
+ * @param[out] pxCompletion The completed publish.
+ * @param[in] ulBlockTimeMs Time to wait for a publish to complete.
+ *
+ * @return `true` if a completion was returned, `false` on timeout.
+ */
+bool AsyncPublish_GetCompletion( AsyncPublisher_t * pxPublisher,
+                                 AsyncPublishCompletion_t * pxCompletion,
+                                 uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Number of publishes submitted and not yet completed.
+ *
+ * @param[in] pxPublisher The publisher.
+ *
+ * @return The number of publishes in flight.
+ */
+uint32_t AsyncPublish_GetInFlightCount( const AsyncPublisher_t * pxPublisher );
+
+#endif /* ASYNC_PUBLISH_H */
@@ -0,0 +1,212 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file deferred_dispatch.c
+ * @brief Implements the deferred delivery of incoming publishes.
+ */
+
+/* Standard includes. */
+#include <stddef.h>
+#include <string.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+
+/* Header include. */
+#include "deferred_dispatch.h"
+
+/* Pool of the buffers. */
+#include "object_pool.h"
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "DEFERRED"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief The buffers shared by all the subscribers.
+ */
+static DeferredPublish_t xPublishes[ DEFERRED_DISPATCH_POOL_SIZE ];
+static uint8_t ucPublishPoolStorage[ OBJECT_POOL_STORAGE_SIZE( DEFERRED_DISPATCH_POOL_SIZE ) ];
+static ObjectPool_t xPublishPool;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Publish callback of a deferred subscription, run on the agent task.
+ * Copies the publish to a buffer of the pool and queues it to the subscriber.
+ *
+ * @param[in] pvIncomingPublishCallbackContext The subscriber.
+ * @param[in] pxPublishInfo The incoming publish.
+ */
+static void prvDeferPublish( void * pvIncomingPublishCallbackContext,
+                             MQTTPublishInfo_t * pxPublishInfo );
+
+/*-----------------------------------------------------------*/
+
+static void prvDeferPublish( void * pvIncomingPublishCallbackContext,
+                             MQTTPublishInfo_t * pxPublishInfo )
+{
+    DeferredSubscriber_t * pxSubscriber = ( DeferredSubscriber_t * ) pvIncomingPublishCallbackContext;
+    DeferredPublish_t * pxPublish = NULL;
+    TickType_t xTicksToWait = 0U;
+    TimeOut_t xTimeOut;
+    bool xQueued = false;
+
+    if( pxSubscriber->xPolicy == DeferredDispatchBlock )
+    {
+        xTicksToWait = pxSubscriber->xBlockTicks;
+    }
+
+    if( ( ( size_t ) pxPublishInfo->topicNameLength + pxPublishInfo->payloadLength ) > DEFERRED_DISPATCH_BUFFER_SIZE )
+    {
+        LogWarn( ( "Dropping publish on %.*s: %u bytes do not fit a deferred buffer.",
+                   pxPublishInfo->topicNameLength,
+                   pxPublishInfo->pTopicName,
+                   ( unsigned int ) pxPublishInfo->payloadLength ) );
+    }
+    else
+    {
+        vTaskSetTimeOutState( &xTimeOut );
+
+        pxPublish = ( DeferredPublish_t * ) ObjectPool_Take( &xPublishPool, xTicksToWait );
+
+        if( pxPublish != NULL )
+        {
+            pxPublish->xPublishInfo = *pxPublishInfo;
+
+            ( void ) memcpy( pxPublish->ucData, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength );
+            pxPublish->xPublishInfo.pTopicName = ( const char * ) pxPublish->ucData;
+
+            if( pxPublishInfo->payloadLength > 0U )
+            {
+                ( void ) memcpy( &pxPublish->ucData[ pxPublishInfo->topicNameLength ],
+                                 pxPublishInfo->pPayload,
+                                 pxPublishInfo->payloadLength );
+            }
+
+            pxPublish->xPublishInfo.pPayload = &pxPublish->ucData[ pxPublishInfo->topicNameLength ];
+
+            /* The wait for the buffer counts towards the block time. */
+            ( void ) xTaskCheckForTimeOut( &xTimeOut, &xTicksToWait );
+
+            xQueued = ( xQueueSend( pxSubscriber->xQueue, &pxPublish, xTicksToWait ) == pdTRUE );
+
+            if( !xQueued )
+            {
+                DeferredDispatch_Release( pxPublish );
+            }
+        }
+
+        if( !xQueued )
+        {
+            LogDebug( ( "Dropping publish on %.*s: subscriber is not keeping up.",
+                        pxPublishInfo->topicNameLength,
+                        pxPublishInfo->pTopicName ) );
+        }
+    }
+
+    if( xQueued )
+    {
+        pxSubscriber->ulDelivered++;
+    }
+    else
+    {
+        pxSubscriber->ulDropped++;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void DeferredDispatch_Init( DeferredSubscriber_t * pxSubscriber,
+                            UBaseType_t uxDepth,
+                            DeferredDispatchPolicy_t xPolicy,
+                            uint32_t ulBlockTimeMs )
+{
+    configASSERT( pxSubscriber != NULL );
+    configASSERT( ( uxDepth > 0U ) && ( uxDepth <= DEFERRED_DISPATCH_MAX_DEPTH ) );
+
+    ObjectPool_Init( &xPublishPool, xPublishes, sizeof( DeferredPublish_t ), DEFERRED_DISPATCH_POOL_SIZE, ucPublishPoolStorage );
+
+    pxSubscriber->xPolicy = xPolicy;
+    pxSubscriber->xBlockTicks = pdMS_TO_TICKS( ulBlockTimeMs );
+    pxSubscriber->ulDelivered = 0U;
+    pxSubscriber->ulDropped = 0U;
+    pxSubscriber->xQueue = xQueueCreateStatic( uxDepth,
+                                               sizeof( DeferredPublish_t * ),
+                                               pxSubscriber->ucQueueStorage,
+                                               &pxSubscriber->xQueueBuffer );
+    configASSERT( pxSubscriber->xQueue != NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t DeferredDispatch_Subscribe( MQTTAgentHandle_t xHandle,
+                                         const char * pcTopicFilterString,
+                                         uint16_t usTopicFilterLength,
+                                         MQTTQoS_t xQoS,
+                                         DeferredSubscriber_t * pxSubscriber,
+                                         uint32_t ulBlockTimeMs )
+{
+    configASSERT( ( pxSubscriber != NULL ) && ( pxSubscriber->xQueue != NULL ) );
+
+    return xMQTTAgentSubscribe( xHandle,
+                                pcTopicFilterString,
+                                usTopicFilterLength,
+                                xQoS,
+                                prvDeferPublish,
+                                ( void * ) pxSubscriber,
+                                ulBlockTimeMs );
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t DeferredDispatch_Unsubscribe( MQTTAgentHandle_t xHandle,
+                                           const char * pcTopicFilterString,
+                                           uint16_t usTopicFilterLength,
+                                           DeferredSubscriber_t * pxSubscriber,
+                                           uint32_t ulBlockTimeMs )
+{
+    return xMQTTAgentUnsubscribe( xHandle,
+                                  pcTopicFilterString,
+                                  usTopicFilterLength,
+                                  prvDeferPublish,
+                                  ( void * ) pxSubscriber,
+                                  ulBlockTimeMs );
+}
+
+/*-----------------------------------------------------------*/
+
+DeferredPublish_t * DeferredDispatch_Receive( DeferredSubscriber_t * pxSubscriber,
+                                              TickType_t xTicksToWait )
+{
+    DeferredPublish_t * pxPublish = NULL;
+
+    if( xQueueReceive( pxSubscriber->xQueue, &pxPublish, xTicksToWait ) != pdTRUE )
+    {
+        pxPublish = NULL;
+    }
+
+    return pxPublish;
+}
+
+/*-----------------------------------------------------------*/
+
+void DeferredDispatch_Release( DeferredPublish_t * pxPublish )
+{
+    ObjectPool_Give( &xPublishPool, pxPublish );
+}
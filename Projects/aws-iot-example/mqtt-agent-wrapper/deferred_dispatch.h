@@ -0,0 +1,186 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file deferred_dispatch.h
+ * @brief Deferred delivery of incoming publishes to the task of the
+ * subscriber.
+ *
+ * A subscription made with DeferredDispatch_Subscribe() does not run
+ * application code on the MQTT agent task. The agent copies the topic and
+ * payload once, into a buffer of a shared pool, and sends the buffer to the
+ * bounded queue of the subscriber. The subscriber task takes ownership of the
+ * buffer with DeferredDispatch_Receive() and gives it back with
+ * DeferredDispatch_Release(). The payload cannot be handed over without the
+ * copy, as coreMQTT reuses its network buffer as soon as the publish callback
+ * returns.
+ *
+ * When the queue of a subscriber is full or the pool is empty, the policy of
+ * the subscriber decides whether the publish is dropped straight away or the
+ * agent task waits for the subscriber for a bounded time before dropping it.
+ * Waiting stops the agent from reading the socket, which pushes back on the
+ * broker but also delays every other subscriber and command.
+ *
+ * @note coreMQTT acknowledges a QoS1 publish once the publish callback
+ * returns, so a dropped QoS1 publish is not redelivered.
+ */
+#ifndef DEFERRED_DISPATCH_H
+#define DEFERRED_DISPATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "queue.h"
+
+/* MQTT library includes. */
+#include "core_mqtt.h"
+
+/* Subscription manager header include. */
+#include "subscription_manager.h"
+
+/* MQTT agent task header include. */
+#include "mqtt_agent_task.h"
+
+/**
+ * @brief Number of buffers shared by all the deferred subscribers.
+ */
+#ifndef DEFERRED_DISPATCH_POOL_SIZE
+    #define DEFERRED_DISPATCH_POOL_SIZE    ( 8U )
+#endif
+
+/**
+ * @brief Size of a buffer, which holds the topic name and the payload of one
+ * publish. Larger publishes are dropped.
+ */
+#ifndef DEFERRED_DISPATCH_BUFFER_SIZE
+    #define DEFERRED_DISPATCH_BUFFER_SIZE    ( 512U )
+#endif
+
+/**
+ * @brief Largest queue depth of a subscriber.
+ */
+#ifndef DEFERRED_DISPATCH_MAX_DEPTH
+    #define DEFERRED_DISPATCH_MAX_DEPTH    ( 4U )
+#endif
+
+/**
+ * @brief What the agent task does with a publish when the subscriber cannot
+ * take it.
+ */
+typedef enum DeferredDispatchPolicy
+{
+    DeferredDispatchDrop = 0, /**< Drop the publish without waiting. */
+    DeferredDispatchBlock     /**< Wait up to the block time of the subscriber, then drop. */
+} DeferredDispatchPolicy_t;
+
+/**
+ * @brief A publish owned by the subscriber task between
+ * DeferredDispatch_Receive() and DeferredDispatch_Release(). The topic name and
+ * payload of xPublishInfo point into ucData.
+ */
+typedef struct DeferredPublish
+{
+    MQTTPublishInfo_t xPublishInfo;
+    uint8_t ucData[ DEFERRED_DISPATCH_BUFFER_SIZE ];
+} DeferredPublish_t;
+
+/**
+ * @brief A deferred subscriber: the queue serviced by its task and its
+ * counters.
+ */
+typedef struct DeferredSubscriber
+{
+    QueueHandle_t xQueue;
+    StaticQueue_t xQueueBuffer;
+    uint8_t ucQueueStorage[ DEFERRED_DISPATCH_MAX_DEPTH * sizeof( DeferredPublish_t * ) ];
+    DeferredDispatchPolicy_t xPolicy;
+    TickType_t xBlockTicks;
+    volatile uint32_t ulDelivered; /**< Publishes queued to the subscriber. */
+    volatile uint32_t ulDropped;   /**< Publishes dropped, whatever the reason. */
+} DeferredSubscriber_t;
+
+/**
+ * @brief Create the queue of a subscriber. Must be called by the subscriber
+ * before adding a subscription for it.
+ *
+ * @param[in] pxSubscriber The subscriber to initialize.
+ * @param[in] uxDepth Number of publishes the queue holds, from 1 to
+ * DEFERRED_DISPATCH_MAX_DEPTH.
+ * @param[in] xPolicy What to do with a publish when the queue is full or the
+ * pool is empty.
+ * @param[in] ulBlockTimeMs Time the agent task waits with
+ * `DeferredDispatchBlock`. Ignored with `DeferredDispatchDrop`.
+ */
+void DeferredDispatch_Init( DeferredSubscriber_t * pxSubscriber,
+                            UBaseType_t uxDepth,
+                            DeferredDispatchPolicy_t xPolicy,
+                            uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Subscribe a subscriber to a topic filter with xMQTTAgentSubscribe(),
+ * so that its publishes are queued to the subscriber instead of being
+ * delivered on the agent task.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[in] pcTopicFilterString Topic filter of the subscription.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] xQoS QoS of the subscription.
+ * @param[in] pxSubscriber The subscriber, initialized with
+ * DeferredDispatch_Init().
+ * @param[in] ulBlockTimeMs Time to wait for each step of the subscribe, see
+ * xMQTTAgentSubscribe().
+ *
+ * @return The result of xMQTTAgentSubscribe().
+ */
+MQTTStatus_t DeferredDispatch_Subscribe( MQTTAgentHandle_t xHandle,
+                                         const char * pcTopicFilterString,
+                                         uint16_t usTopicFilterLength,
+                                         MQTTQoS_t xQoS,
+                                         DeferredSubscriber_t * pxSubscriber,
+                                         uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Unsubscribe a subscriber from a topic filter with
+ * xMQTTAgentUnsubscribe().
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[in] pcTopicFilterString Topic filter of the subscription.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] pxSubscriber The subscriber.
+ * @param[in] ulBlockTimeMs Time to wait for each step of the unsubscribe, see
+ * xMQTTAgentUnsubscribe().
+ *
+ * @return The result of xMQTTAgentUnsubscribe().
+ */
+MQTTStatus_t DeferredDispatch_Unsubscribe( MQTTAgentHandle_t xHandle,
+                                           const char * pcTopicFilterString,
+                                           uint16_t usTopicFilterLength,
+                                           DeferredSubscriber_t * pxSubscriber,
+                                           uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Wait for the next publish of a subscriber. Only called by the
+ * subscriber task.
+ *
+ * @param[in] pxSubscriber The subscriber.
+ * @param[in] xTicksToWait Time to wait for a publish.
+ *
+ * @return The publish, to be given back with DeferredDispatch_Release(), or
+ * NULL if none arrived in time.
+ */
+DeferredPublish_t * DeferredDispatch_Receive( DeferredSubscriber_t * pxSubscriber,
+                                              TickType_t xTicksToWait );
+
+/**
+ * @brief Give a publish back to the pool.
+ *
+ * @param[in] pxPublish The publish returned by DeferredDispatch_Receive().
+ */
+void DeferredDispatch_Release( DeferredPublish_t * pxPublish );
+
+#endif /* DEFERRED_DISPATCH_H */
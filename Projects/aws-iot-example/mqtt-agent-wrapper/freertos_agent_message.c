@@ -35,26 +35,619 @@
 
 /* Kernel includes. */
 #include "FreeRTOS.h"
+#include "task.h"
 #include "semphr.h"
 
 /* Header include. */
 #include "freertos_agent_message.h"
+#include "freertos_command_pool.h"
 #include "core_mqtt_agent_message_interface.h"
 
 /*-----------------------------------------------------------*/
 
+#if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+
+/**
+ * @brief Values of receiverWaiting: what a sender gives to wake the receiver.
+ */
+    #define RING_RECEIVER_RUNNING              ( 0U )
+    #define RING_RECEIVER_ON_NOTIFICATION      ( 1U )
+    #define RING_RECEIVER_ON_SEMAPHORE         ( 2U )
+
+/**
+ * @brief Initialize a ring over its slots.
+ *
+ * @param[in] pRing The ring.
+ * @param[in] pSlots The slots of the ring.
+ * @param[in] length Number of slots, a power of two.
+ */
+    static void prvRingInit( MQTTAgentMessageRing_t * pRing,
+                             MQTTAgentMessageSlot_t * pSlots,
+                             uint32_t length );
+
+/**
+ * @brief Add a command to a ring without waiting. May be called by any task.
+ *
+ * @param[in] pRing The ring.
+ * @param[in] pCommand The command.
+ *
+ * @return `true` if the command was added, `false` if the ring is full.
+ */
+    static bool prvRingPush( MQTTAgentMessageRing_t * pRing,
+                             MQTTAgentCommand_t * pCommand );
+
+/**
+ * @brief Take the oldest command of a ring without waiting. Only called by the
+ * receiver.
+ *
+ * @param[in] pRing The ring.
+ * @param[out] pCommand The command.
+ *
+ * @return `true` if a command was taken, `false` if the ring is empty.
+ */
+    static bool prvRingPop( MQTTAgentMessageRing_t * pRing,
+                            MQTTAgentCommand_t ** pCommand );
+
+/**
+ * @brief Wake the receiver of a context if it is blocked.
+ *
+ * @param[in] pMsgCtx A context initialized with Agent_MessageInitLanes().
+ */
+    static void prvWakeReceiver( MQTTAgentMessageContext_t * pMsgCtx );
+
+#endif /* if ( MQTT_AGENT_MESSAGE_USE_RING == 1 ) */
+
+/**
+ * @brief Check whether a lane has a command to receive.
+ *
+ * @param[in] lane The lane.
+ *
+ * @return `true` if the lane is empty.
+ */
+static bool prvLaneIsEmpty( MQTTAgentMessageLane_t lane );
+
+/**
+ * @brief Count the commands waiting in a lane.
+ *
+ * @param[in] lane The lane.
+ *
+ * @return The number of commands sent and not received yet.
+ */
+static uint32_t prvLaneDepth( MQTTAgentMessageLane_t lane );
+
+/**
+ * @brief Add a command to a lane, waiting for space up to a block time.
+ *
+ * @param[in] pMsgCtx A context initialized with Agent_MessageInitLanes().
+ * @param[in] lane The lane.
+ * @param[in] pCommandToSend Pointer to the command.
+ * @param[in] blockTimeMs Block time to wait for space.
+ *
+ * @return `true` if the command was added.
+ */
+static bool prvLanePut( MQTTAgentMessageContext_t * pMsgCtx,
+                        MQTTAgentMessageLane_t lane,
+                        MQTTAgentCommand_t * const * pCommandToSend,
+                        uint32_t blockTimeMs );
+
+/**
+ * @brief Take the oldest command of a lane without waiting.
+ *
+ * @param[in] pMsgCtx A context initialized with Agent_MessageInitLanes().
+ * @param[in] lane The lane.
+ * @param[in] pReceivedCommand Pointer to write address of received command.
+ *
+ * @return `true` if a command was taken.
+ */
+static bool prvLaneTake( MQTTAgentMessageContext_t * pMsgCtx,
+                         MQTTAgentMessageLane_t lane,
+                         MQTTAgentCommand_t ** pReceivedCommand );
+
+/**
+ * @brief Block the receiver until a command is sent, the transport signals
+ * or the block time expires.
+ *
+ * @param[in] pMsgCtx A context initialized with Agent_MessageInitLanes().
+ * @param[in] blockTimeMs Block time.
+ *
+ * @return `true` if the receiver was woken before the block time expired.
+ */
+static bool prvWaitForWakeup( MQTTAgentMessageContext_t * pMsgCtx,
+                              uint32_t blockTimeMs );
+
+/**
+ * @brief Select the lane a command is sent to.
+ *
+ * @param[in] pMsgCtx A context initialized with Agent_MessageInitLanes().
+ * @param[in] pCommand The command to send.
+ *
+ * @return The control or the bulk lane of the context.
+ */
+static MQTTAgentMessageLane_t prvSelectLane( const MQTTAgentMessageContext_t * pMsgCtx,
+                                             const MQTTAgentCommand_t * pCommand );
+
+/**
+ * @brief Take the next command from the lanes of a context without blocking.
+ *
+ * @param[in] pMsgCtx A context initialized with Agent_MessageInitLanes().
+ * @param[in] pReceivedCommand Pointer to write address of received command.
+ *
+ * @return `true` if a command was taken, `false` if both lanes are empty.
+ */
+static bool prvTakeFromLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                              MQTTAgentCommand_t ** pReceivedCommand );
+
+/**
+ * @brief Receive from a context that has a control and a bulk lane.
+ *
+ * @param[in] pMsgCtx A context initialized with Agent_MessageInitLanes().
+ * @param[in] pReceivedCommand Pointer to write address of received command.
+ * @param[in] blockTimeMs Block time to wait for a receive.
+ *
+ * @return `true` if receive was successful, else `false`.
+ */
+static bool prvReceiveFromLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                                 MQTTAgentCommand_t ** pReceivedCommand,
+                                 uint32_t blockTimeMs );
+
+/*-----------------------------------------------------------*/
+
+#if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+
+    static void prvRingInit( MQTTAgentMessageRing_t * pRing,
+                             MQTTAgentMessageSlot_t * pSlots,
+                             uint32_t length )
+    {
+        uint32_t i;
+
+        for( i = 0; i < length; i++ )
+        {
+            pSlots[ i ].sequence = i;
+            pSlots[ i ].command = NULL;
+        }
+
+        pRing->slots = pSlots;
+        pRing->mask = length - 1U;
+        pRing->tail = 0U;
+        pRing->head = 0U;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvRingPush( MQTTAgentMessageRing_t * pRing,
+                             MQTTAgentCommand_t * pCommand )
+    {
+        MQTTAgentMessageSlot_t * pSlot = NULL;
+        uint32_t tail = __atomic_load_n( &( pRing->tail ), __ATOMIC_RELAXED );
+        int32_t difference;
+        bool reserved = false;
+        bool full = false;
+
+        while( ( reserved == false ) && ( full == false ) )
+        {
+            pSlot = &( pRing->slots[ tail & pRing->mask ] );
+            difference = ( int32_t ) ( __atomic_load_n( &( pSlot->sequence ), __ATOMIC_ACQUIRE ) - tail );
+
+            if( difference == 0 )
+            {
+                /* The slot is free, reserve its position. */
+                reserved = __atomic_compare_exchange_n( &( pRing->tail ), &tail, tail + 1U, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+            }
+            else if( difference < 0 )
+            {
+                /* The receiver has not taken the command of the previous lap. */
+                full = true;
+            }
+            else
+            {
+                /* Another sender reserved the position meanwhile. */
+                tail = __atomic_load_n( &( pRing->tail ), __ATOMIC_RELAXED );
+            }
+        }
+
+        if( reserved == true )
+        {
+            pSlot->command = pCommand;
+            __atomic_store_n( &( pSlot->sequence ), tail + 1U, __ATOMIC_RELEASE );
+        }
+
+        return reserved;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvRingPop( MQTTAgentMessageRing_t * pRing,
+                            MQTTAgentCommand_t ** pCommand )
+    {
+        uint32_t head = pRing->head;
+        MQTTAgentMessageSlot_t * pSlot = &( pRing->slots[ head & pRing->mask ] );
+        bool popped = ( __atomic_load_n( &( pSlot->sequence ), __ATOMIC_ACQUIRE ) == ( head + 1U ) );
+
+        /* A sender that reserved the head position but has not written it yet
+         * makes the ring look empty. It wakes the receiver once written. */
+        if( popped == true )
+        {
+            *pCommand = pSlot->command;
+            /* Atomic only for Agent_MessageGetDepth(), senders never read it. */
+            __atomic_store_n( &( pRing->head ), head + 1U, __ATOMIC_RELAXED );
+
+            /* Free the slot for the next lap. */
+            __atomic_store_n( &( pSlot->sequence ), head + pRing->mask + 1U, __ATOMIC_RELEASE );
+        }
+
+        return popped;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvWakeReceiver( MQTTAgentMessageContext_t * pMsgCtx )
+    {
+        uint32_t waiting = __atomic_exchange_n( &( pMsgCtx->receiverWaiting ), RING_RECEIVER_RUNNING, __ATOMIC_SEQ_CST );
+
+        if( waiting == RING_RECEIVER_ON_NOTIFICATION )
+        {
+            ( void ) xTaskNotifyGiveIndexed( pMsgCtx->receiver, MQTT_AGENT_MESSAGE_NOTIFICATION_INDEX );
+        }
+        else if( waiting == RING_RECEIVER_ON_SEMAPHORE )
+        {
+            ( void ) xSemaphoreGive( pMsgCtx->wakeup );
+        }
+        else
+        {
+            /* The receiver checks the lanes before it blocks. */
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvLaneIsEmpty( MQTTAgentMessageLane_t lane )
+    {
+        const MQTTAgentMessageSlot_t * pSlot = &( lane->slots[ lane->head & lane->mask ] );
+
+        return ( __atomic_load_n( &( pSlot->sequence ), __ATOMIC_ACQUIRE ) != ( lane->head + 1U ) ) ? true : false;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint32_t prvLaneDepth( MQTTAgentMessageLane_t lane )
+    {
+        /* Read head first, tail can only have moved further since. Positions
+         * reserved by a sender that has not written its slot yet count too. */
+        uint32_t head = __atomic_load_n( &( lane->head ), __ATOMIC_RELAXED );
+        uint32_t depth = __atomic_load_n( &( lane->tail ), __ATOMIC_RELAXED ) - head;
+
+        return ( depth > ( lane->mask + 1U ) ) ? ( lane->mask + 1U ) : depth;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvLanePut( MQTTAgentMessageContext_t * pMsgCtx,
+                            MQTTAgentMessageLane_t lane,
+                            MQTTAgentCommand_t * const * pCommandToSend,
+                            uint32_t blockTimeMs )
+    {
+        TimeOut_t timeOut;
+        TickType_t ticksToWait = pdMS_TO_TICKS( blockTimeMs );
+        bool pushed = prvRingPush( lane, *pCommandToSend );
+
+        if( pushed == false )
+        {
+            vTaskSetTimeOutState( &timeOut );
+
+            /* Register as a waiter before checking the ring again, so that a
+             * slot freed in between is either found here or signalled. */
+            while( ( pushed == false ) && ( ticksToWait > 0U ) )
+            {
+                ( void ) __atomic_add_fetch( &( pMsgCtx->sendersWaiting ), 1U, __ATOMIC_SEQ_CST );
+
+                pushed = prvRingPush( lane, *pCommandToSend );
+
+                if( pushed == false )
+                {
+                    ( void ) xSemaphoreTake( pMsgCtx->spaceFreed, ticksToWait );
+                    pushed = prvRingPush( lane, *pCommandToSend );
+                }
+
+                ( void ) __atomic_sub_fetch( &( pMsgCtx->sendersWaiting ), 1U, __ATOMIC_SEQ_CST );
+
+                if( xTaskCheckForTimeOut( &timeOut, &ticksToWait ) != pdFALSE )
+                {
+                    ticksToWait = 0U;
+                }
+            }
+        }
+
+        if( pushed == true )
+        {
+            prvWakeReceiver( pMsgCtx );
+        }
+
+        return pushed;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvLaneTake( MQTTAgentMessageContext_t * pMsgCtx,
+                             MQTTAgentMessageLane_t lane,
+                             MQTTAgentCommand_t ** pReceivedCommand )
+    {
+        bool popped = prvRingPop( lane, pReceivedCommand );
+
+        if( ( popped == true ) &&
+            ( __atomic_load_n( &( pMsgCtx->sendersWaiting ), __ATOMIC_SEQ_CST ) != 0U ) )
+        {
+            ( void ) xSemaphoreGive( pMsgCtx->spaceFreed );
+        }
+
+        return popped;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvWaitForWakeup( MQTTAgentMessageContext_t * pMsgCtx,
+                                  uint32_t blockTimeMs )
+    {
+        bool woken = true;
+        uint32_t waiting;
+
+        /* The transport gives the wakeup semaphore unless it is polled, in
+         * which case nothing but the senders has to wake the receiver. */
+        waiting = ( pMsgCtx->pollPeriodMs == 0U ) ? RING_RECEIVER_ON_SEMAPHORE : RING_RECEIVER_ON_NOTIFICATION;
+        pMsgCtx->receiver = xTaskGetCurrentTaskHandle();
+
+        /* Publish how to be woken before checking the lanes again, so that a
+         * command sent in between is either found here or signalled. */
+        __atomic_store_n( &( pMsgCtx->receiverWaiting ), waiting, __ATOMIC_SEQ_CST );
+
+        if( ( prvLaneIsEmpty( pMsgCtx->controlQueue ) == true ) &&
+            ( prvLaneIsEmpty( pMsgCtx->queue ) == true ) )
+        {
+            if( waiting == RING_RECEIVER_ON_NOTIFICATION )
+            {
+                woken = ( ulTaskNotifyTakeIndexed( MQTT_AGENT_MESSAGE_NOTIFICATION_INDEX,
+                                                   pdTRUE,
+                                                   pdMS_TO_TICKS( blockTimeMs ) ) != 0U );
+            }
+            else
+            {
+                woken = ( xSemaphoreTake( pMsgCtx->wakeup, pdMS_TO_TICKS( blockTimeMs ) ) == pdPASS );
+            }
+        }
+
+        __atomic_store_n( &( pMsgCtx->receiverWaiting ), RING_RECEIVER_RUNNING, __ATOMIC_SEQ_CST );
+
+        return woken;
+    }
+
+#else /* if ( MQTT_AGENT_MESSAGE_USE_RING == 1 ) */
+
+    static bool prvLaneIsEmpty( MQTTAgentMessageLane_t lane )
+    {
+        return ( uxQueueMessagesWaiting( lane ) == 0U ) ? true : false;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint32_t prvLaneDepth( MQTTAgentMessageLane_t lane )
+    {
+        return ( uint32_t ) uxQueueMessagesWaiting( lane );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvLanePut( MQTTAgentMessageContext_t * pMsgCtx,
+                            MQTTAgentMessageLane_t lane,
+                            MQTTAgentCommand_t * const * pCommandToSend,
+                            uint32_t blockTimeMs )
+    {
+        BaseType_t queueStatus = xQueueSendToBack( lane, pCommandToSend, pdMS_TO_TICKS( blockTimeMs ) );
+
+        if( queueStatus == pdPASS )
+        {
+            ( void ) xSemaphoreGive( pMsgCtx->wakeup );
+        }
+
+        return ( queueStatus == pdPASS ) ? true : false;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvLaneTake( MQTTAgentMessageContext_t * pMsgCtx,
+                             MQTTAgentMessageLane_t lane,
+                             MQTTAgentCommand_t ** pReceivedCommand )
+    {
+        ( void ) pMsgCtx;
+
+        return ( xQueueReceive( lane, pReceivedCommand, 0U ) == pdPASS ) ? true : false;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvWaitForWakeup( MQTTAgentMessageContext_t * pMsgCtx,
+                                  uint32_t blockTimeMs )
+    {
+        /* The wakeup semaphore is binary, so a command queued since the lanes
+         * were checked is not missed. */
+        return ( xSemaphoreTake( pMsgCtx->wakeup, pdMS_TO_TICKS( blockTimeMs ) ) == pdPASS ) ? true : false;
+    }
+
+#endif /* if ( MQTT_AGENT_MESSAGE_USE_RING == 1 ) */
+
+/*-----------------------------------------------------------*/
+
+static MQTTAgentMessageLane_t prvSelectLane( const MQTTAgentMessageContext_t * pMsgCtx,
+                                             const MQTTAgentCommand_t * pCommand )
+{
+    MQTTAgentMessageLane_t lane = pMsgCtx->controlQueue;
+    const MQTTPublishInfo_t * pPublishInfo;
+    bool isMatch = false;
+
+    if( pCommand->commandType == PUBLISH )
+    {
+        lane = pMsgCtx->queue;
+        pPublishInfo = ( const MQTTPublishInfo_t * ) pCommand->pArgs;
+
+        if( ( pMsgCtx->pControlTopicFilter != NULL ) && ( pPublishInfo != NULL ) )
+        {
+            if( ( MQTT_MatchTopic( pPublishInfo->pTopicName,
+                                   pPublishInfo->topicNameLength,
+                                   pMsgCtx->pControlTopicFilter,
+                                   pMsgCtx->controlTopicFilterLength,
+                                   &isMatch ) == MQTTSuccess ) &&
+                ( isMatch == true ) )
+            {
+                lane = pMsgCtx->controlQueue;
+            }
+        }
+    }
+
+    return lane;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvTakeFromLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                              MQTTAgentCommand_t ** pReceivedCommand )
+{
+    bool taken = false;
+    bool bulkWaiting = ( prvLaneIsEmpty( pMsgCtx->queue ) == false );
+
+    if( ( bulkWaiting == true ) && ( pMsgCtx->controlBurst >= MQTT_AGENT_CONTROL_BURST_MAX ) )
+    {
+        /* Let one bulk command through. */
+        taken = prvLaneTake( pMsgCtx, pMsgCtx->queue, pReceivedCommand );
+        pMsgCtx->controlBurst = 0U;
+    }
+    else
+    {
+        taken = prvLaneTake( pMsgCtx, pMsgCtx->controlQueue, pReceivedCommand );
+
+        if( taken == true )
+        {
+            pMsgCtx->controlBurst = ( bulkWaiting == true ) ? ( pMsgCtx->controlBurst + 1U ) : 0U;
+        }
+        else
+        {
+            taken = prvLaneTake( pMsgCtx, pMsgCtx->queue, pReceivedCommand );
+            pMsgCtx->controlBurst = 0U;
+        }
+    }
+
+    return taken;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvReceiveFromLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                                 MQTTAgentCommand_t ** pReceivedCommand,
+                                 uint32_t blockTimeMs )
+{
+    bool received = prvTakeFromLanes( pMsgCtx, pReceivedCommand );
+
+    if( ( pMsgCtx->pollPeriodMs != 0U ) && ( blockTimeMs > pMsgCtx->pollPeriodMs ) )
+    {
+        blockTimeMs = pMsgCtx->pollPeriodMs;
+    }
+
+    /* A wakeup without a command comes from the transport, or from a command
+     * that was already taken, and returns `false` so that the agent runs its
+     * process loop. The agent task is the only receiver. */
+    if( ( received == false ) && ( prvWaitForWakeup( pMsgCtx, blockTimeMs ) == true ) )
+    {
+        received = prvTakeFromLanes( pMsgCtx, pReceivedCommand );
+    }
+
+    /* Commands whose deadline passed while they were queued are completed
+     * here rather than sent late. */
+    while( ( received == true ) && ( Agent_IsCommandExpired( *pReceivedCommand ) == true ) )
+    {
+        Agent_ExpireCommand( *pReceivedCommand );
+        received = prvTakeFromLanes( pMsgCtx, pReceivedCommand );
+    }
+
+    return received;
+}
+
+/*-----------------------------------------------------------*/
+
+void Agent_MessageInitLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                             MQTTAgentMessageLanes_t * pLanes,
+                             const char * pControlTopicFilter )
+{
+    configASSERT( pMsgCtx != NULL );
+    configASSERT( pLanes != NULL );
+
+    memset( pMsgCtx, 0x00, sizeof( MQTTAgentMessageContext_t ) );
+
+    #if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+        prvRingInit( &( pLanes->controlRing ), pLanes->controlSlots, MQTT_AGENT_CONTROL_QUEUE_LENGTH );
+        pMsgCtx->controlQueue = &( pLanes->controlRing );
+
+        prvRingInit( &( pLanes->bulkRing ), pLanes->bulkSlots, MQTT_AGENT_COMMAND_QUEUE_LENGTH );
+        pMsgCtx->queue = &( pLanes->bulkRing );
+
+        pMsgCtx->spaceFreed = xSemaphoreCreateCountingStatic( MQTT_AGENT_CONTROL_QUEUE_LENGTH + MQTT_AGENT_COMMAND_QUEUE_LENGTH,
+                                                              0U,
+                                                              &( pLanes->spaceFreedStructure ) );
+        configASSERT( pMsgCtx->spaceFreed );
+    #else
+        pMsgCtx->controlQueue = xQueueCreateStatic( MQTT_AGENT_CONTROL_QUEUE_LENGTH,
+                                                    sizeof( MQTTAgentCommand_t * ),
+                                                    pLanes->controlQueueStorage,
+                                                    &( pLanes->controlQueueStructure ) );
+        configASSERT( pMsgCtx->controlQueue );
+
+        pMsgCtx->queue = xQueueCreateStatic( MQTT_AGENT_COMMAND_QUEUE_LENGTH,
+                                             sizeof( MQTTAgentCommand_t * ),
+                                             pLanes->bulkQueueStorage,
+                                             &( pLanes->bulkQueueStructure ) );
+        configASSERT( pMsgCtx->queue );
+    #endif /* if ( MQTT_AGENT_MESSAGE_USE_RING == 1 ) */
+
+    pMsgCtx->wakeup = xSemaphoreCreateBinaryStatic( &( pLanes->wakeupStructure ) );
+    configASSERT( pMsgCtx->wakeup );
+
+    if( pControlTopicFilter != NULL )
+    {
+        pMsgCtx->pControlTopicFilter = pControlTopicFilter;
+        pMsgCtx->controlTopicFilterLength = ( uint16_t ) strlen( pControlTopicFilter );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
 bool Agent_MessageSend( MQTTAgentMessageContext_t * pMsgCtx,
                         MQTTAgentCommand_t * const * pCommandToSend,
                         uint32_t blockTimeMs )
 {
-    BaseType_t queueStatus = pdFAIL;
+    bool sent = false;
 
     if( ( pMsgCtx != NULL ) && ( pCommandToSend != NULL ) )
     {
-        queueStatus = xQueueSendToBack( pMsgCtx->queue, pCommandToSend, pdMS_TO_TICKS( blockTimeMs ) );
+        #if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+            /* Rings are only created with both lanes. */
+            configASSERT( pMsgCtx->controlQueue != NULL );
+
+            sent = prvLanePut( pMsgCtx,
+                               prvSelectLane( pMsgCtx, *pCommandToSend ),
+                               pCommandToSend,
+                               blockTimeMs );
+        #else
+            if( pMsgCtx->controlQueue == NULL )
+            {
+                sent = ( xQueueSendToBack( pMsgCtx->queue, pCommandToSend, pdMS_TO_TICKS( blockTimeMs ) ) == pdPASS ) ? true : false;
+            }
+            else
+            {
+                sent = prvLanePut( pMsgCtx,
+                                   prvSelectLane( pMsgCtx, *pCommandToSend ),
+                                   pCommandToSend,
+                                   blockTimeMs );
+            }
+        #endif /* if ( MQTT_AGENT_MESSAGE_USE_RING == 1 ) */
     }
 
-    return ( queueStatus == pdPASS ) ? true : false;
+    return sent;
 }
 
 /*-----------------------------------------------------------*/
@@ -63,12 +656,44 @@ bool Agent_MessageReceive( MQTTAgentMessageContext_t * pMsgCtx,
                            MQTTAgentCommand_t ** pReceivedCommand,
                            uint32_t blockTimeMs )
 {
-    BaseType_t queueStatus = pdFAIL;
+    bool received = false;
 
     if( ( pMsgCtx != NULL ) && ( pReceivedCommand != NULL ) )
     {
-        queueStatus = xQueueReceive( pMsgCtx->queue, pReceivedCommand, pdMS_TO_TICKS( blockTimeMs ) );
+        #if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+            configASSERT( pMsgCtx->controlQueue != NULL );
+
+            received = prvReceiveFromLanes( pMsgCtx, pReceivedCommand, blockTimeMs );
+        #else
+            if( pMsgCtx->controlQueue == NULL )
+            {
+                received = ( xQueueReceive( pMsgCtx->queue, pReceivedCommand, pdMS_TO_TICKS( blockTimeMs ) ) == pdPASS ) ? true : false;
+            }
+            else
+            {
+                received = prvReceiveFromLanes( pMsgCtx, pReceivedCommand, blockTimeMs );
+            }
+        #endif /* if ( MQTT_AGENT_MESSAGE_USE_RING == 1 ) */
+    }
+
+    return received;
+}
+
+/*-----------------------------------------------------------*/
+
+uint32_t Agent_MessageGetDepth( const MQTTAgentMessageContext_t * pMsgCtx )
+{
+    uint32_t depth = 0U;
+
+    if( ( pMsgCtx != NULL ) && ( pMsgCtx->queue != NULL ) )
+    {
+        depth = prvLaneDepth( pMsgCtx->queue );
+
+        if( pMsgCtx->controlQueue != NULL )
+        {
+            depth += prvLaneDepth( pMsgCtx->controlQueue );
+        }
     }
 
-    return ( queueStatus == pdPASS ) ? true : false;
+    return depth;
 }
@@ -37,22 +37,168 @@
 
 /* FreeRTOS includes. */
 #include "FreeRTOS.h"
+#include "task.h"
 #include "queue.h"
+#include "semphr.h"
+
+/* MQTT library includes. */
+#include "core_mqtt_config.h"
 
 /* Include MQTT agent messaging interface. */
 #include "core_mqtt_agent_message_interface.h"
 
+/**
+ * @brief Length of the control lane of a context initialized with
+ * Agent_MessageInitLanes(). The bulk lane is MQTT_AGENT_COMMAND_QUEUE_LENGTH
+ * long.
+ */
+#ifndef MQTT_AGENT_CONTROL_QUEUE_LENGTH
+    #define MQTT_AGENT_CONTROL_QUEUE_LENGTH    ( 8U )
+#endif
+
+/**
+ * @brief Maximum number of control commands received in a row while bulk
+ * commands are waiting. The next receive then takes a bulk command, so that
+ * the bulk lane is not starved.
+ */
+#ifndef MQTT_AGENT_CONTROL_BURST_MAX
+    #define MQTT_AGENT_CONTROL_BURST_MAX    ( 4U )
+#endif
+
+/**
+ * @brief Set to 1 to build the lanes as lock-free rings of command pointers
+ * instead of FreeRTOS queues.
+ *
+ * Any task may send to a ring, but only the agent task receives from it. A
+ * send reserves a slot with a compare-and-swap and wakes the agent task only
+ * if it is blocked, with a task notification, so that most commands are queued
+ * without entering the kernel. The length of both lanes must then be a power
+ * of two.
+ */
+#ifndef MQTT_AGENT_MESSAGE_USE_RING
+    #define MQTT_AGENT_MESSAGE_USE_RING    ( 0 )
+#endif
+
+/**
+ * @brief Task notification index the agent task waits on when the lanes are
+ * rings, so that it does not interfere with the indexes used by the other
+ * APIs.
+ */
+#ifndef MQTT_AGENT_MESSAGE_NOTIFICATION_INDEX
+    #define MQTT_AGENT_MESSAGE_NOTIFICATION_INDEX    ( 2U )
+#endif
+
+#if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+    #if ( ( MQTT_AGENT_CONTROL_QUEUE_LENGTH & ( MQTT_AGENT_CONTROL_QUEUE_LENGTH - 1 ) ) != 0 )
+        #error "MQTT_AGENT_CONTROL_QUEUE_LENGTH must be a power of two with MQTT_AGENT_MESSAGE_USE_RING."
+    #endif
+    #if ( ( MQTT_AGENT_COMMAND_QUEUE_LENGTH & ( MQTT_AGENT_COMMAND_QUEUE_LENGTH - 1 ) ) != 0 )
+        #error "MQTT_AGENT_COMMAND_QUEUE_LENGTH must be a power of two with MQTT_AGENT_MESSAGE_USE_RING."
+    #endif
+#endif
+
+#if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+
+/**
+ * @brief A slot of a ring. sequence equals the position of the slot when it
+ * is free to be written, and the position plus one once the command written
+ * to it can be received.
+ */
+    typedef struct MQTTAgentMessageSlot
+    {
+        uint32_t sequence;
+        MQTTAgentCommand_t * command;
+    } MQTTAgentMessageSlot_t;
+
+/**
+ * @brief A bounded ring of command pointers with many senders and a single
+ * receiver. Positions count up forever, the slot of a position is the
+ * position modulo the length of the ring.
+ */
+    typedef struct MQTTAgentMessageRing
+    {
+        MQTTAgentMessageSlot_t * slots;
+        uint32_t mask;           /**< Length of the ring minus one. */
+        uint32_t tail;           /**< Next position to reserve, updated by senders. */
+        uint32_t head;           /**< Next position to receive, updated by the receiver only. */
+    } MQTTAgentMessageRing_t;
+
+    typedef MQTTAgentMessageRing_t * MQTTAgentMessageLane_t;
+#else
+    typedef QueueHandle_t MQTTAgentMessageLane_t;
+#endif /* if ( MQTT_AGENT_MESSAGE_USE_RING == 1 ) */
+
 /**
  * @ingroup mqtt_agent_struct_types
  * @brief Context with which tasks may deliver messages to the agent.
+ *
+ * A context either has a single FIFO, or a control and a bulk lane when
+ * initialized with Agent_MessageInitLanes(). Every command other than a
+ * PUBLISH, and publishes to the control topic filter, go to the control lane
+ * and are received ahead of the publishes queued in the bulk lane.
+ *
+ * The receiver of a context with lanes blocks on the wakeup semaphore only.
+ * It is given whenever a command is queued, and may also be given by the
+ * transport when the connection becomes readable, in which case the receive
+ * returns without a command so that the agent processes the incoming data.
+ *
+ * With MQTT_AGENT_MESSAGE_USE_RING, the receiver blocks on its task
+ * notification instead while the transport is polled (pollPeriodMs is not 0),
+ * and on the wakeup semaphore while the transport gives it. Senders wake the
+ * receiver only when receiverWaiting says it is blocked.
  */
 struct MQTTAgentMessageContext
 {
-    QueueHandle_t queue;
+    MQTTAgentMessageLane_t queue;        /**< The only lane, or the bulk lane. */
+    MQTTAgentMessageLane_t controlQueue; /**< The control lane, NULL for a single FIFO. */
+    SemaphoreHandle_t wakeup;            /**< Wakes the receiver, given by senders and by the transport. */
+    #if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+        TaskHandle_t receiver;           /**< The task receiving from the rings. */
+        uint32_t receiverWaiting;        /**< How the receiver is blocked, 0 while it is not. */
+        uint32_t sendersWaiting;         /**< Senders waiting for a ring to have space. */
+        SemaphoreHandle_t spaceFreed;    /**< Given by the receiver while sendersWaiting is not 0. */
+    #endif
+    const char * pControlTopicFilter;
+    uint16_t controlTopicFilterLength;
+    uint32_t controlBurst;           /**< Control commands received in a row while bulk ones were waiting. */
+    uint32_t pollPeriodMs;           /**< Longest time the receiver blocks, 0 to use the requested block time. */
 };
 
+/**
+ * @brief Static storage of the lanes of a context.
+ */
+typedef struct MQTTAgentMessageLanes
+{
+    #if ( MQTT_AGENT_MESSAGE_USE_RING == 1 )
+        MQTTAgentMessageRing_t controlRing;
+        MQTTAgentMessageSlot_t controlSlots[ MQTT_AGENT_CONTROL_QUEUE_LENGTH ];
+        MQTTAgentMessageRing_t bulkRing;
+        MQTTAgentMessageSlot_t bulkSlots[ MQTT_AGENT_COMMAND_QUEUE_LENGTH ];
+        StaticSemaphore_t spaceFreedStructure;
+    #else
+        StaticQueue_t controlQueueStructure;
+        uint8_t controlQueueStorage[ MQTT_AGENT_CONTROL_QUEUE_LENGTH * sizeof( MQTTAgentCommand_t * ) ];
+        StaticQueue_t bulkQueueStructure;
+        uint8_t bulkQueueStorage[ MQTT_AGENT_COMMAND_QUEUE_LENGTH * sizeof( MQTTAgentCommand_t * ) ];
+    #endif
+    StaticSemaphore_t wakeupStructure;
+} MQTTAgentMessageLanes_t;
+
 /*-----------------------------------------------------------*/
 
+/**
+ * @brief Create the control and bulk lanes of a context.
+ *
+ * @param[in] pMsgCtx The #MQTTAgentMessageContext_t to initialize.
+ * @param[in] pLanes Storage of the lanes. Must stay in scope for as long as
+ * the context is used.
+ * @param[in] pControlTopicFilter Publishes to topics matching this filter go to
+ * the control lane, e.g. alarms. NULL to send all publishes to the bulk lane.
+ */
+void Agent_MessageInitLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                             MQTTAgentMessageLanes_t * pLanes,
+                             const char * pControlTopicFilter );
+
 /**
  * @brief Send a message to the specified context.
  * Must be thread safe.
@@ -81,4 +227,14 @@ bool Agent_MessageReceive( MQTTAgentMessageContext_t * pMsgCtx,
                            MQTTAgentCommand_t ** pReceivedCommand,
                            uint32_t blockTimeMs );
 
+/**
+ * @brief Get the number of commands waiting to be received by a context, in
+ * all its lanes. Only a snapshot, as senders and the receiver keep going.
+ *
+ * @param[in] pMsgCtx An #MQTTAgentMessageContext_t.
+ *
+ * @return The number of commands sent and not received yet.
+ */
+uint32_t Agent_MessageGetDepth( const MQTTAgentMessageContext_t * pMsgCtx );
+
 #endif /* FREERTOS_AGENT_MESSAGE_H */
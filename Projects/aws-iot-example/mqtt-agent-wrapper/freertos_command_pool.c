@@ -32,6 +32,7 @@
  */
 
 /* Standard includes. */
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -41,7 +42,6 @@
 
 /* Header include. */
 #include "freertos_command_pool.h"
-#include "freertos_agent_message.h"
 
 /* Include header that defines log levels. */
 #include "logging_levels.h"
@@ -61,6 +61,20 @@
 #define QUEUE_NOT_INITIALIZED    ( 0U )
 #define QUEUE_INITIALIZED        ( 1U )
 
+/**
+ * @brief Links of the free list are the index of a command plus one, 0 ends
+ * the list. The head of the list also holds a tag in its upper half, changed
+ * by every update, so that a compare-and-swap fails if the head was popped
+ * and pushed back in between (ABA).
+ */
+#define FREE_LIST_END            ( 0U )
+#define FREE_LIST_LINK_MASK      ( 0xFFFFU )
+#define FREE_LIST_TAG_INCREMENT  ( 0x10000U )
+
+#if ( MQTT_COMMAND_CONTEXTS_POOL_SIZE >= 0xFFFF )
+    #error "MQTT_COMMAND_CONTEXTS_POOL_SIZE must be below 65535."
+#endif
+
 /**
  * @brief The pool of command structures used to hold information on commands (such
  * as PUBLISH or SUBSCRIBE) between the command being created by an API call and
@@ -69,47 +83,150 @@
 static MQTTAgentCommand_t commandStructurePool[ MQTT_COMMAND_CONTEXTS_POOL_SIZE ];
 
 /**
- * @brief The message context used to guard the pool of MQTTAgentCommand_t structures.
- * For FreeRTOS, this is implemented with a queue. Structures may be
- * obtained by receiving a pointer from the queue, and returned by
- * sending the pointer back into it.
+ * @brief Free list of the pool. Structures are pushed and popped with a
+ * compare-and-swap of freeListHead, so that obtaining and releasing a command
+ * takes no lock. freeListNext holds the link of each free structure.
+ */
+static volatile uint32_t freeListHead = FREE_LIST_END;
+static uint16_t freeListNext[ MQTT_COMMAND_CONTEXTS_POOL_SIZE ];
+
+/**
+ * @brief Set while a structure is handed out, to catch double releases.
  */
-static MQTTAgentMessageContext_t commandStructMessageCtx;
+static bool commandInUse[ MQTT_COMMAND_CONTEXTS_POOL_SIZE ];
 
 /**
- * @brief Initialization status of the queue.
+ * @brief Tasks waiting for a structure to be released. Only used when the
+ * pool is empty: waiters sleep on the semaphore, which Agent_ReleaseCommand()
+ * gives while waiterCount is not 0.
+ */
+static volatile uint32_t waiterCount = 0U;
+static SemaphoreHandle_t commandReleased = NULL;
+
+/**
+ * @brief Initialization status of the pool.
  */
 static volatile uint8_t initStatus = QUEUE_NOT_INITIALIZED;
 
+/**
+ * @brief Usage counters of the pool.
+ */
+static volatile uint32_t commandsInUse = 0U;
+static volatile uint32_t highWaterMark = 0U;
+static volatile uint32_t exhaustedCount = 0U;
+static volatile uint32_t failedCount = 0U;
+
+/**
+ * @brief Deadline of each command of the pool, in ticks, valid when
+ * commandHasDeadline is set. Written by the task that obtained the command
+ * before the command is queued, read by the agent task once received.
+ */
+static TickType_t commandDeadlines[ MQTT_COMMAND_CONTEXTS_POOL_SIZE ];
+static bool commandHasDeadline[ MQTT_COMMAND_CONTEXTS_POOL_SIZE ];
+
+/**
+ * @brief Number of commands dropped because their deadline passed.
+ */
+static volatile uint32_t expiredCommandCount = 0U;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Pop a structure from the free list without waiting.
+ *
+ * @return The structure, or NULL if the pool is empty.
+ */
+static MQTTAgentCommand_t * prvPopFree( void );
+
+/**
+ * @brief Push a structure to the free list.
+ *
+ * @param[in] index Index of the structure in the pool.
+ */
+static void prvPushFree( size_t index );
+
+/*-----------------------------------------------------------*/
+
+static MQTTAgentCommand_t * prvPopFree( void )
+{
+    MQTTAgentCommand_t * pCommand = NULL;
+    uint32_t head = __atomic_load_n( &freeListHead, __ATOMIC_ACQUIRE );
+    uint32_t newHead;
+    uint32_t link;
+    uint32_t inUse;
+    uint32_t highest;
+    bool popped = false;
+
+    while( ( popped == false ) && ( ( head & FREE_LIST_LINK_MASK ) != FREE_LIST_END ) )
+    {
+        link = head & FREE_LIST_LINK_MASK;
+
+        /* If another task popped the head meanwhile, the tag changed and the
+         * exchange fails, whatever freeListNext was read. The link is read
+         * atomically as it may be written concurrently in that case. */
+        newHead = ( ( head + FREE_LIST_TAG_INCREMENT ) & ~FREE_LIST_LINK_MASK ) |
+                  __atomic_load_n( &freeListNext[ link - 1U ], __ATOMIC_RELAXED );
+        popped = __atomic_compare_exchange_n( &freeListHead, &head, newHead, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+
+        if( popped == true )
+        {
+            pCommand = &commandStructurePool[ link - 1U ];
+        }
+    }
+
+    if( pCommand != NULL )
+    {
+        inUse = __atomic_add_fetch( &commandsInUse, 1U, __ATOMIC_RELAXED );
+        highest = __atomic_load_n( &highWaterMark, __ATOMIC_RELAXED );
+
+        while( ( inUse > highest ) &&
+               ( __atomic_compare_exchange_n( &highWaterMark, &highest, inUse, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) == false ) )
+        {
+            /* highest was reloaded by the failed exchange. */
+        }
+    }
+
+    return pCommand;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvPushFree( size_t index )
+{
+    uint32_t head = __atomic_load_n( &freeListHead, __ATOMIC_RELAXED );
+    uint32_t newHead;
+
+    ( void ) __atomic_sub_fetch( &commandsInUse, 1U, __ATOMIC_RELAXED );
+
+    do
+    {
+        __atomic_store_n( &freeListNext[ index ], ( uint16_t ) ( head & FREE_LIST_LINK_MASK ), __ATOMIC_RELAXED );
+        newHead = ( ( head + FREE_LIST_TAG_INCREMENT ) & ~FREE_LIST_LINK_MASK ) | ( uint32_t ) ( index + 1U );
+    } while( __atomic_compare_exchange_n( &freeListHead, &head, newHead, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) == false );
+}
+
 /*-----------------------------------------------------------*/
 
 void Agent_InitializePool( void )
 {
-    MQTTAgentCommand_t * pCommand;
-    static StaticQueue_t staticQueueStructure;
+    static StaticSemaphore_t commandReleasedBuffer;
+    size_t i;
 
     if( initStatus == QUEUE_NOT_INITIALIZED )
     {
-        static uint8_t staticQueueStorageArea[ MQTT_COMMAND_CONTEXTS_POOL_SIZE * sizeof( MQTTAgentCommand_t * ) ];
         memset( ( void * ) commandStructurePool, 0x00, sizeof( commandStructurePool ) );
-        commandStructMessageCtx.queue = xQueueCreateStatic( MQTT_COMMAND_CONTEXTS_POOL_SIZE,
-                                                            sizeof( MQTTAgentCommand_t * ),
-                                                            staticQueueStorageArea,
-                                                            &staticQueueStructure );
-        configASSERT( commandStructMessageCtx.queue );
 
-        size_t i;
-
-        /* Populate the queue. */
+        /* Chain every structure, in order. */
         for( i = 0; i < MQTT_COMMAND_CONTEXTS_POOL_SIZE; i++ )
         {
-            /* Store the address as a variable. */
-            pCommand = &commandStructurePool[ i ];
-            /* Send the pointer to the queue. */
-            bool commandAdded = Agent_MessageSend( &commandStructMessageCtx, &pCommand, 0U );
-            configASSERT( commandAdded );
+            freeListNext[ i ] = ( uint16_t ) ( ( ( i + 1U ) < MQTT_COMMAND_CONTEXTS_POOL_SIZE ) ? ( i + 2U ) : FREE_LIST_END );
         }
 
+        freeListHead = 1U;
+
+        commandReleased = xSemaphoreCreateCountingStatic( MQTT_COMMAND_CONTEXTS_POOL_SIZE, 0U, &commandReleasedBuffer );
+        configASSERT( commandReleased );
+
         initStatus = QUEUE_INITIALIZED;
     }
 }
@@ -119,18 +236,64 @@ void Agent_InitializePool( void )
 MQTTAgentCommand_t * Agent_GetCommand( uint32_t blockTimeMs )
 {
     MQTTAgentCommand_t * structToUse = NULL;
-    bool structRetrieved = false;
+    uint32_t timeoutMs;
+    size_t index;
+    TimeOut_t timeOut;
+    TickType_t ticksToWait = pdMS_TO_TICKS( blockTimeMs );
 
-    /* Check queue has been created. */
+    /* Check the pool has been initialized. */
     configASSERT( initStatus == QUEUE_INITIALIZED );
 
-    /* Retrieve a struct from the queue. */
-    structRetrieved = Agent_MessageReceive( &commandStructMessageCtx, &( structToUse ), blockTimeMs );
+    structToUse = prvPopFree();
 
-    if( !structRetrieved )
+    if( structToUse == NULL )
     {
+        ( void ) __atomic_add_fetch( &exhaustedCount, 1U, __ATOMIC_RELAXED );
+        vTaskSetTimeOutState( &timeOut );
+
+        /* Register as a waiter before checking the pool again, so that a
+         * structure released in between is either found here or signalled. */
+        while( ( structToUse == NULL ) && ( ticksToWait > 0U ) )
+        {
+            ( void ) __atomic_add_fetch( &waiterCount, 1U, __ATOMIC_SEQ_CST );
+
+            structToUse = prvPopFree();
+
+            if( structToUse == NULL )
+            {
+                ( void ) xSemaphoreTake( commandReleased, ticksToWait );
+                structToUse = prvPopFree();
+            }
+
+            ( void ) __atomic_sub_fetch( &waiterCount, 1U, __ATOMIC_SEQ_CST );
+
+            if( xTaskCheckForTimeOut( &timeOut, &ticksToWait ) != pdFALSE )
+            {
+                ticksToWait = 0U;
+            }
+        }
+    }
+
+    /* The deadline set by the calling task only applies to this command. */
+    timeoutMs = ( uint32_t ) ( uintptr_t ) pvTaskGetThreadLocalStoragePointer( NULL, MQTT_AGENT_DEADLINE_TLS_INDEX );
+
+    if( timeoutMs != 0U )
+    {
+        vTaskSetThreadLocalStoragePointer( NULL, MQTT_AGENT_DEADLINE_TLS_INDEX, NULL );
+    }
+
+    if( structToUse == NULL )
+    {
+        ( void ) __atomic_add_fetch( &failedCount, 1U, __ATOMIC_RELAXED );
         LogDebug( ( "No command structure available.\n" ) );
     }
+    else
+    {
+        index = ( size_t ) ( structToUse - commandStructurePool );
+        commandInUse[ index ] = true;
+        commandHasDeadline[ index ] = ( timeoutMs != 0U );
+        commandDeadlines[ index ] = xTaskGetTickCount() + pdMS_TO_TICKS( timeoutMs );
+    }
 
     return structToUse;
 }
@@ -140,6 +303,7 @@ MQTTAgentCommand_t * Agent_GetCommand( uint32_t blockTimeMs )
 bool Agent_ReleaseCommand( MQTTAgentCommand_t * pCommandToRelease )
 {
     bool structReturned = false;
+    size_t index;
 
     configASSERT( initStatus == QUEUE_INITIALIZED );
 
@@ -147,14 +311,92 @@ bool Agent_ReleaseCommand( MQTTAgentCommand_t * pCommandToRelease )
     if( ( pCommandToRelease >= commandStructurePool ) &&
         ( pCommandToRelease < ( commandStructurePool + MQTT_COMMAND_CONTEXTS_POOL_SIZE ) ) )
     {
-        structReturned = Agent_MessageSend( &commandStructMessageCtx, &pCommandToRelease, 0U );
+        index = ( size_t ) ( pCommandToRelease - commandStructurePool );
+
+        /* A structure released twice would be linked twice into the free list. */
+        configASSERT( commandInUse[ index ] == true );
+        commandInUse[ index ] = false;
+        commandHasDeadline[ index ] = false;
+
+        prvPushFree( index );
+        structReturned = true;
+
+        if( __atomic_load_n( &waiterCount, __ATOMIC_SEQ_CST ) != 0U )
+        {
+            ( void ) xSemaphoreGive( commandReleased );
+        }
 
-        /* The send should not fail as the queue was created to hold every command
-         * in the pool. */
-        configASSERT( structReturned );
         LogDebug( ( "Returned Command Context %d to pool\n",
-                    ( int ) ( pCommandToRelease - commandStructurePool ) ) );
+                    ( int ) index ) );
     }
 
     return structReturned;
 }
+
+/*-----------------------------------------------------------*/
+
+void Agent_GetPoolStats( CommandPoolStats_t * pStats )
+{
+    pStats->inUse = __atomic_load_n( &commandsInUse, __ATOMIC_RELAXED );
+    pStats->highWaterMark = __atomic_load_n( &highWaterMark, __ATOMIC_RELAXED );
+    pStats->exhaustedCount = __atomic_load_n( &exhaustedCount, __ATOMIC_RELAXED );
+    pStats->failedCount = __atomic_load_n( &failedCount, __ATOMIC_RELAXED );
+}
+
+/*-----------------------------------------------------------*/
+
+void Agent_SetNextCommandDeadline( uint32_t timeoutMs )
+{
+    vTaskSetThreadLocalStoragePointer( NULL, MQTT_AGENT_DEADLINE_TLS_INDEX, ( void * ) ( uintptr_t ) timeoutMs );
+}
+
+/*-----------------------------------------------------------*/
+
+bool Agent_IsCommandExpired( const MQTTAgentCommand_t * pCommand )
+{
+    bool expired = false;
+    size_t index;
+
+    if( ( pCommand >= commandStructurePool ) &&
+        ( pCommand < ( commandStructurePool + MQTT_COMMAND_CONTEXTS_POOL_SIZE ) ) )
+    {
+        index = ( size_t ) ( pCommand - commandStructurePool );
+
+        /* The difference is only below half the tick range once the deadline
+         * has passed, which handles the tick count wrapping around. */
+        if( ( commandHasDeadline[ index ] == true ) &&
+            ( ( TickType_t ) ( xTaskGetTickCount() - commandDeadlines[ index ] ) < ( portMAX_DELAY / 2U ) ) )
+        {
+            expired = true;
+        }
+    }
+
+    return expired;
+}
+
+/*-----------------------------------------------------------*/
+
+void Agent_ExpireCommand( MQTTAgentCommand_t * pCommand )
+{
+    MQTTAgentReturnInfo_t returnInfo = { 0 };
+
+    returnInfo.returnCode = MQTTSendFailed;
+    ( void ) __atomic_add_fetch( &expiredCommandCount, 1U, __ATOMIC_RELAXED );
+
+    LogWarn( ( "Command %d was not sent, its deadline passed while it was queued.",
+               ( int ) pCommand->commandType ) );
+
+    if( pCommand->pCommandCompleteCallback != NULL )
+    {
+        pCommand->pCommandCompleteCallback( pCommand->pCmdContext, &returnInfo );
+    }
+
+    ( void ) Agent_ReleaseCommand( pCommand );
+}
+
+/*-----------------------------------------------------------*/
+
+uint32_t Agent_GetExpiredCommandCount( void )
+{
+    return __atomic_load_n( &expiredCommandCount, __ATOMIC_RELAXED );
+}
@@ -31,11 +31,42 @@
 #ifndef FREERTOS_COMMAND_POOL_H
 #define FREERTOS_COMMAND_POOL_H
 
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
 /* MQTT agent includes. */
 #include "core_mqtt_agent.h"
 
+/**
+ * @brief Thread local storage pointer of a task that holds the deadline of the
+ * next command it creates, see Agent_SetNextCommandDeadline().
+ */
+#ifndef MQTT_AGENT_DEADLINE_TLS_INDEX
+    #define MQTT_AGENT_DEADLINE_TLS_INDEX    ( configNUM_THREAD_LOCAL_STORAGE_POINTERS - 1 )
+#endif
+
+#if ( MQTT_AGENT_DEADLINE_TLS_INDEX < 0 )
+    #error "Command deadlines need configNUM_THREAD_LOCAL_STORAGE_POINTERS to be at least 1."
+#endif
+
+/**
+ * @brief Usage counters of the command pool.
+ */
+typedef struct CommandPoolStats
+{
+    uint32_t inUse;          /**< Structures currently handed out. */
+    uint32_t highWaterMark;  /**< Most structures handed out at once since boot. */
+    uint32_t exhaustedCount; /**< Calls to Agent_GetCommand() that found the pool empty. */
+    uint32_t failedCount;    /**< Calls to Agent_GetCommand() that returned NULL. */
+} CommandPoolStats_t;
+
 /**
  * @brief Initialize the common task pool. Not thread safe.
+ *
+ * @note Obtaining and releasing a structure does not take a lock: the free
+ * list is updated with atomic compare-and-swap (LDREX/STREX). The kernel is
+ * only involved when a caller has to wait for a structure.
  */
 void Agent_InitializePool( void );
 
@@ -80,4 +111,58 @@ MQTTAgentCommand_t * Agent_GetCommand( uint32_t blockTimeMs );
  */
 bool Agent_ReleaseCommand( MQTTAgentCommand_t * pCommandToRelease );
 
+/**
+ * @brief Give the next command created by the calling task a deadline.
+ *
+ * If the agent has not started processing the command timeoutMs after it was
+ * created, for example because the connection was down, the command is not
+ * sent. Its completion callback is called with #MQTTSendFailed instead, and
+ * the expiry is logged. Call right before the MQTTAgent_ function that
+ * creates the command, and clear the deadline once it returns, as the
+ * function may fail before it obtains a command, e.g.
+ *
+ * @code{c}
+ * Agent_SetNextCommandDeadline( 2000U );
+ * xStatus = MQTTAgent_Publish( pxAgentContext, &xPublishInfo, &xCommandParams );
+ * Agent_SetNextCommandDeadline( 0U );
+ * @endcode
+ *
+ * AgentRequest_Publish() and AgentRequest_Subscribe() do this for the
+ * deadline of a request.
+ *
+ * @param[in] timeoutMs Time the command stays valid for. 0 for no deadline.
+ */
+void Agent_SetNextCommandDeadline( uint32_t timeoutMs );
+
+/**
+ * @brief Check whether the deadline of a command has passed.
+ *
+ * @param[in] pCommand A command obtained with Agent_GetCommand().
+ *
+ * @return `true` if the command has a deadline and it has passed.
+ */
+bool Agent_IsCommandExpired( const MQTTAgentCommand_t * pCommand );
+
+/**
+ * @brief Complete a command whose deadline has passed with #MQTTSendFailed
+ * and give it back to the pool, without sending it.
+ *
+ * @param[in] pCommand The expired command.
+ */
+void Agent_ExpireCommand( MQTTAgentCommand_t * pCommand );
+
+/**
+ * @brief Get the number of commands dropped because their deadline passed.
+ *
+ * @return The number of expired commands since boot.
+ */
+uint32_t Agent_GetExpiredCommandCount( void );
+
+/**
+ * @brief Read the usage counters of the pool.
+ *
+ * @param[out] pStats The counters.
+ */
+void Agent_GetPoolStats( CommandPoolStats_t * pStats );
+
 #endif /* FREERTOS_COMMAND_POOL_H */
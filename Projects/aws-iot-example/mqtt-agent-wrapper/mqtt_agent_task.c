@@ -27,6 +27,7 @@
  */
 
 /* Standard includes. */
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -59,9 +60,24 @@
 /* Subscription manager header include. */
 #include "subscription_manager.h"
 
-/* Exponential backoff retry include. */
+/* Streaming of oversized incoming publishes. */
+#include "publish_stream.h"
+
+/* Requests holding the arguments of subscribes and unsubscribes. */
+#include "agent_request.h"
+
+/* Exponential backoff retry include, used for resubscribe retries. */
 #include "backoff_algorithm.h"
 
+/* Reconnect backoff with decorrelated jitter. */
+#include "reconnect_backoff.h"
+
+/* Software timer used to schedule resubscribe retries. */
+#include "timers.h"
+
+/* Counting semaphore used as the in-flight window. */
+#include "semphr.h"
+
 /* System events header. */
 #include "event_helper.h"
 
@@ -85,6 +101,42 @@
     #define MQTT_AGENT_NETWORK_BUFFER_SIZE    ( 10240 )
 #endif
 
+/**
+ * @brief Publishes of the default instance that go to the control lane of the
+ * command queue, e.g. alarms. NULL to queue all publishes in the bulk lane.
+ */
+#ifndef MQTT_AGENT_CONTROL_TOPIC_FILTER
+    #define MQTT_AGENT_CONTROL_TOPIC_FILTER    NULL
+#endif
+
+/**
+ * @brief Maximum number of MQTT agent instances. Each instance statically
+ * allocates its own network buffer and command queue.
+ */
+#ifndef MQTT_AGENT_MAX_INSTANCES
+    #define MQTT_AGENT_MAX_INSTANCES    ( 1U + appCONFIG_OTA_SEPARATE_MQTT_CONNECTION )
+#endif
+
+/**
+ * @brief Default in-flight window of an instance, see
+ * MQTTAgentConfig_t::uxInFlightWindow. coreMQTT tracks at most
+ * MQTT_STATE_ARRAY_MAX_COUNT outstanding acknowledgements per connection, the
+ * slots outside the window are left to subscribes and to publishes not sent
+ * with xMQTTAgentPublish().
+ */
+#ifndef MQTT_AGENT_IN_FLIGHT_WINDOW
+    #define MQTT_AGENT_IN_FLIGHT_WINDOW    ( MQTT_STATE_ARRAY_MAX_COUNT - 4U )
+#endif
+
+/**
+ * @brief Requests of an instance for the SUBSCRIBE and UNSUBSCRIBE commands of
+ * xMQTTAgentSubscribe() and xMQTTAgentUnsubscribe(). One is used at a time,
+ * the others hold commands whose caller stopped waiting for the broker.
+ */
+#ifndef MQTT_AGENT_SUBSCRIPTION_REQUESTS
+    #define MQTT_AGENT_SUBSCRIPTION_REQUESTS    ( 4U )
+#endif
+
 /**
  * @brief The maximum amount of time in milliseconds to wait for the commands
  * to be posted to the MQTT agent should the MQTT agent's command queue be full.
@@ -111,9 +163,29 @@
 
 /**
  * @brief The base back-off delay (in milliseconds) to use for network operation retry
- * attempts.
+ * attempts. Reconnect delays are drawn from this up, so it also sets how much
+ * devices that lost their connection together spread out on the first retry.
+ */
+#define RETRY_BACKOFF_BASE_MS                        ( 500U )
+
+/**
+ * @brief Time (in milliseconds) a connection has to stay up before the
+ * reconnect backoff is reset.
  */
-#define RETRY_BACKOFF_BASE_MS                        ( 10U )
+#define RETRY_BACKOFF_STABLE_CONNECTION_MS           ( 60000U )
+
+/**
+ * @brief The base and maximum back-off delays (in milliseconds) used to retry
+ * topic filters that the broker rejected while resubscribing.
+ */
+#define RESUBSCRIBE_BACKOFF_BASE_MS                  ( 500U )
+#define RESUBSCRIBE_MAX_BACKOFF_DELAY_MS             ( 30000U )
+
+/**
+ * @brief Number of times a rejected topic filter is resubscribed before the
+ * subscription is dropped.
+ */
+#define RESUBSCRIBE_MAX_ATTEMPTS                     ( 5U )
 
 /**
  * @brief The maximum time interval in seconds which is allowed to elapse
@@ -123,11 +195,40 @@
  *  Control Packets being sent does not exceed the this Keep Alive value. In the
  *  absence of sending any other Control Packets, the Client MUST send a
  *  PINGREQ Packet.
+ *
+ *  This is given to the broker in CONNECT. coreMQTT only pings once nothing
+ *  was sent for this long, the adaptive keep-alive pings much earlier.
+ */
+#define MQTT_AGENT_KEEP_ALIVE_MAX_SECONDS            ( 1200U )
+
+/**
+ * @brief Adaptive keep-alive. A PINGREQ is only sent once nothing was received
+ * for the keep-alive interval, as any incoming packet already proves the link
+ * is alive. The interval starts at MQTT_AGENT_KEEP_ALIVE_INTERVAL_SECONDS and
+ * grows by MQTT_AGENT_KEEP_ALIVE_STEP_SECONDS every
+ * MQTT_AGENT_KEEP_ALIVE_PROBES_TO_GROW answered pings, up to
+ * MQTT_AGENT_KEEP_ALIVE_MAX_SECONDS. Once the connection was lost
+ * MQTT_AGENT_KEEP_ALIVE_NAT_OBSERVATIONS times after being idle, without an
+ * answered ping at that idle time in between, the shortest of those idle times
+ * is taken as the NAT timeout. The interval is then capped to
+ * MQTT_AGENT_KEEP_ALIVE_NAT_MARGIN_PERCENT of it, but not below
+ * MQTT_AGENT_KEEP_ALIVE_MIN_SECONDS. While pings keep being answered at the
+ * cap, the NAT timeout is raised by MQTT_AGENT_KEEP_ALIVE_STEP_SECONDS every
+ * MQTT_AGENT_KEEP_ALIVE_PROBES_TO_GROW answered pings, so that a mapping
+ * that lasts longer again is found.
  */
 #define MQTT_AGENT_KEEP_ALIVE_INTERVAL_SECONDS       ( 60U )
+#define MQTT_AGENT_KEEP_ALIVE_MIN_SECONDS            ( 30U )
+#define MQTT_AGENT_KEEP_ALIVE_STEP_SECONDS           ( 30U )
+#define MQTT_AGENT_KEEP_ALIVE_PROBES_TO_GROW         ( 3U )
+#define MQTT_AGENT_KEEP_ALIVE_NAT_MARGIN_PERCENT     ( 75U )
+#define MQTT_AGENT_KEEP_ALIVE_NAT_OBSERVATIONS       ( 2U )
 
 /**
  * @brief Socket send and receive timeouts to use.  Specified in milliseconds.
+ * The receive timeout only applies until the MQTT connection is established.
+ * The agent then waits for incoming data on its command queue, which the
+ * transport wakes up.
  */
 #define MQTT_AGENT_TRANSPORT_SEND_RECV_TIMEOUT_MS    ( 750 )
 
@@ -137,57 +238,209 @@
  */
 #define MQTT_AGENT_CONNACK_RECV_TIMEOUT_MS           ( 1000U )
 
-/*-----------------------------------------------------------*/
-
-/**
- * @brief Global entry time into the application to use as a reference timestamp
- * in the #prvGetTimeMs function. #prvGetTimeMs will always return the difference
- * between the current time and the global entry time. This will reduce the chances
- * of overflow for the 32 bit unsigned integer used for holding the timestamp.
- */
-static uint32_t ulGlobalEntryTimeMs;
 
-/**
- * @brief The buffer is used to hold the serialized packets for transmission to and from
- * the transport interface.
- */
-static uint8_t xNetworkBuffer[ MQTT_AGENT_NETWORK_BUFFER_SIZE ];
+/*-----------------------------------------------------------*/
 
 /**
- * @brief FreeRTOS blocking queue to be used as MQTT Agent context.
+ * @brief Subscribe arguments of a resubscribe command, with the instance
+ * that issued it so that the completion callback can find it.
  */
-static MQTTAgentMessageContext_t xCommandQueue;
+typedef struct ResubscribeArgs
+{
+    MQTTAgentSubscribeArgs_t xSubscribeArgs; /* Must be first, the callback context is cast back from it. */
+    struct MQTTAgentInstance * pxInstance;
+} ResubscribeArgs_t;
 
 /**
- * @brief The network context used by the MQTT library transport interface.
- * See https://www.freertos.org/network-interface.html
+ * @brief Completion callback of a publish admitted to the in-flight window,
+ * called once the slot has been given back.
  */
-static NetworkContext_t xNetworkContextMqtt;
+typedef struct InFlightSlot
+{
+    MQTTAgentCommandCallback_t xCallback;
+    MQTTAgentCommandContext_t * pxCallbackContext;
+    struct MQTTAgentInstance * pxInstance;
+    bool xInUse;
+} InFlightSlot_t;
 
 /**
- * @brief MQTT CONNECT packet parameters.
+ * @brief State of an MQTT agent instance.
  */
-static MQTTConnectInfo_t xConnectInfo = { 0 };
+typedef struct MQTTAgentInstance
+{
+    /**
+     * @brief The agent context. Must be first, so that the instance can be
+     * found from the agent context passed to the incoming publish callback.
+     */
+    MQTTAgentContext_t xAgentContext;
+
+    /**
+     * @brief The network context used by the MQTT library transport interface.
+     * See https://www.freertos.org/network-interface.html
+     */
+    NetworkContext_t xNetworkContext;
+
+    /**
+     * @brief FreeRTOS blocking queues to be used as MQTT Agent context, one
+     * for control commands and one for bulk publishes.
+     */
+    MQTTAgentMessageContext_t xCommandQueue;
+    MQTTAgentMessageLanes_t xCommandLanes;
+
+    /**
+     * @brief The buffer is used to hold the serialized packets for transmission to and from
+     * the transport interface.
+     */
+    uint8_t ucNetworkBuffer[ MQTT_AGENT_NETWORK_BUFFER_SIZE ];
+
+    /**
+     * @brief Parameters the instance was started with.
+     */
+    MQTTAgentConfig_t xConfig;
+
+    /**
+     * @brief MQTT CONNECT packet parameters.
+     */
+    MQTTConnectInfo_t xConnectInfo;
+
+    /**
+     * @brief Number of times the agent has (re)connected to the broker.
+     */
+    uint32_t ulConnectCount;
+
+    /**
+     * @brief Delays between reconnect attempts. Updated from the agent task
+     * only.
+     */
+    ReconnectBackoff_t xReconnectBackoff;
+
+    /**
+     * @brief Timing of the (re)connect in progress, and of the last completed
+     * one. The connect in progress started at ulReconnectStartMs, its
+     * resubscribe at ulResubscribeStartMs and usResubscribeOutstanding of the
+     * SUBSCRIBE commands have not completed yet.
+     */
+    MQTTAgentReconnectTiming_t xReconnectTiming;
+    MQTTAgentReconnectTiming_t xLastReconnectTiming;
+    uint32_t ulReconnectStartMs;
+    uint32_t ulResubscribeStartMs;
+    uint16_t usResubscribeOutstanding;
+
+    /**
+     * @brief Adaptive keep-alive. Updated from the agent task only. A PINGREQ
+     * is queued once nothing was received since ulLastRxMs for
+     * ulKeepAliveIntervalMs, and sent at ulPingSentMs after the connection had
+     * been idle for ulPingIdleMs. ulNatCandidateMs is the shortest idle time
+     * of the usNatObservations losses not yet confirmed as ulNatTimeoutMs.
+     * Nothing is updated before xKeepAliveStarted, i.e. during the CONNACK
+     * wait.
+     */
+    uint32_t ulKeepAliveIntervalMs;
+    uint32_t ulNatTimeoutMs;
+    uint32_t ulNatCandidateMs;
+    uint16_t usNatObservations;
+    bool xKeepAliveStarted;
+    uint32_t ulLastRxMs;
+    uint32_t ulLastKeepAliveMs;
+    uint32_t ulPingSentMs;
+    uint32_t ulPingIdleMs;
+    uint32_t ulLastPingRttMs;
+    uint32_t ulPingsSent;
+    uint32_t ulPingsSuppressed;
+    uint16_t usPingsAnswered;
+    bool xPingQueued;
+    bool xPingSent;
+    MQTTAgentCommandInfo_t xPingParams;
+
+    /**
+     * @brief In-flight window. The semaphore counts the free slots of the
+     * window, xInFlightSlots holds the callbacks of the admitted publishes.
+     * Slots are claimed and freed within a critical section.
+     */
+    UBaseType_t uxInFlightWindow;
+    SemaphoreHandle_t xInFlightWindow;
+    StaticSemaphore_t xInFlightWindowBuffer;
+    InFlightSlot_t xInFlightSlots[ MQTT_STATE_ARRAY_MAX_COUNT ];
+
+    /**
+     * @brief Held by xMQTTAgentSubscribe() and xMQTTAgentUnsubscribe() from
+     * the reference count update until the SUBSCRIBE or UNSUBSCRIBE completed
+     * or was given up on, and any rollback is done, so that the broker sees
+     * the commands in the order of the updates. Also protects
+     * xSubscriptionRequests.
+     */
+    SemaphoreHandle_t xSubscriptionMutex;
+    StaticSemaphore_t xSubscriptionMutexBuffer;
+    AgentRequest_t xSubscriptionRequests[ MQTT_AGENT_SUBSCRIPTION_REQUESTS ];
+
+    /**
+     * @brief EVENT_MASK_MQTT_INIT and EVENT_MASK_MQTT_CONNECTED of this instance.
+     */
+    EventGroupHandle_t xEvents;
+    StaticEventGroup_t xEventsBuffer;
+
+    /**
+     * @brief The subscriptions of this connection. Initialized to 0 as the
+     * instances are statically allocated.
+     */
+    SubscriptionList_t xSubscriptionList;
+
+    /**
+     * @brief Streaming of incoming publishes larger than the network buffer.
+     */
+    PublishStream_t xPublishStream;
+
+    /**
+     * @brief Resubscribe commands issued on reconnect. They need to stay in
+     * scope until the commands complete. Each batch refers to a contiguous
+     * slice of xSubInfo.
+     */
+    ResubscribeArgs_t xSubArgs[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+    MQTTSubscribeInfo_t xSubInfo[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+
+    /**
+     * @brief Topic filters rejected by the broker that are waiting to be
+     * resubscribed, and the ones currently being retried.
+     *
+     * @note The pending list is appended to from the agent task and drained from
+     * the timer task, so it is only accessed within a critical section.
+     */
+    MQTTSubscribeInfo_t xResubscribePending[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+    uint16_t usResubscribePendingCount;
+    MQTTSubscribeInfo_t xResubscribeRetry[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+    ResubscribeArgs_t xResubscribeRetryArgs;
+    volatile bool xResubscribeRetryInFlight;
+
+    /**
+     * @brief Backoff parameters and timer used to space out resubscribe retries.
+     */
+    BackoffAlgorithmContext_t xResubscribeBackoff;
+    TimerHandle_t xResubscribeTimer;
+    StaticTimer_t xResubscribeTimerBuffer;
+
+    /**
+     * @brief Context of the disconnect command.
+     */
+    MQTTAgentCommandContext_t xDisconnectContext;
+    MQTTAgentCommandInfo_t xDisconnectParams;
+} MQTTAgentInstance_t;
 
 /*-----------------------------------------------------------*/
 
 /**
- * @brief Static handle used for MQTT agent context.
+ * @brief Global entry time into the application to use as a reference timestamp
+ * in the #prvGetTimeMs function. #prvGetTimeMs will always return the difference
+ * between the current time and the global entry time. This will reduce the chances
+ * of overflow for the 32 bit unsigned integer used for holding the timestamp.
  */
-MQTTAgentContext_t xGlobalMqttAgentContext;
-
-/*-----------------------------------------------------------*/
+static uint32_t ulGlobalEntryTimeMs;
 
 /**
- * @brief The global array of subscription elements.
- *
- * @note No thread safety is required to this array, since the updates the array
- * elements are done only from one task at a time. The subscription manager
- * implementation expects that the array of the subscription elements used for
- * storing subscriptions to be initialized to 0. As this is a global array, it
- * will be intialized to 0 by default.
+ * @brief The MQTT agent instances. The first one is the default instance
+ * started by vStartMqttAgentTask().
  */
-extern SubscriptionElement_t xGlobalSubscriptionList[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+static MQTTAgentInstance_t xAgentInstances[ MQTT_AGENT_MAX_INSTANCES ];
+static UBaseType_t uxNumAgentInstances = 0U;
 
 /*-----------------------------------------------------------*/
 
@@ -197,7 +450,7 @@ extern SubscriptionElement_t xGlobalSubscriptionList[ SUBSCRIPTION_MANAGER_MAX_S
  * MQTT, terminates agent, or the mqtt connection is broken. If the mqtt connection is broken, the task
  * tries to reconnect to the broker.
  *
- * @param[in] pParam Can be used to pass down functionality to the agent task
+ * @param[in] pParam The MQTT agent instance run by the task.
  */
 static void prvMQTTAgentTask( void * pParam );
 
@@ -207,36 +460,178 @@ static void prvMQTTAgentTask( void * pParam );
  * If the connection fails, keep retrying with exponentially increasing
  * timeout value, until max retries, max timeout or successful connect.
  *
- * @param[in] pNetworkContext Network context to connect on.
+ * @param[in] pxInstance The MQTT agent instance to connect.
  * @return int pdFALSE if connection failed after retries.
  */
-static BaseType_t prvSocketConnect( NetworkContext_t * pNetworkContext );
+static BaseType_t prvSocketConnect( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Have the transport wake the agent up through its command queue when
+ * data arrives, instead of the agent blocking in the transport receive.
+ *
+ * @param[in] pxInstance The MQTT agent instance, connected to the broker.
+ */
+static void prvEnableReadySignal( MQTTAgentInstance_t * pxInstance );
 
 /**
  * @brief Disconnects from the MQTT broker.
  * Initiates an MQTT disconnect and then teardown underlying TCP connection.
  *
+ * @param[in] pxInstance The MQTT agent instance to disconnect.
  */
-static void prvDisconnectFromMQTTBroker( void );
+static void prvDisconnectFromMQTTBroker( MQTTAgentInstance_t * pxInstance );
 
 /**
  * @brief Initializes an MQTT context, including transport interface and
  * network buffer.
  *
+ * @param[in] pxInstance The MQTT agent instance to initialize.
+ *
  * @return `MQTTSuccess` if the initialization succeeds, else `MQTTBadParameter`.
  */
-static MQTTStatus_t prvMqttInit( void );
+static MQTTStatus_t prvMQTTInit( MQTTAgentInstance_t * pxInstance );
 
 /**
  * @brief Sends an MQTT Connect packet over the already connected TCP socket.
  *
- * @param[in] pxMQTTContext MQTT context pointer.
- * @param[in] xCleanSession If a clean session should be established.
+ * @param[in] pxInstance The MQTT agent instance to connect.
  *
  * @return `MQTTSuccess` if connection succeeds, else appropriate error code
  * from MQTT_Connect.
  */
-static MQTTStatus_t prvMQTTConnect( void );
+static MQTTStatus_t prvMQTTConnect( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Complete the SUBSCRIBE and UNSUBSCRIBE commands of the previous
+ * connection that are still waiting for their acknowledgement.
+ * MQTTAgent_ResumeSession() only resends the unacknowledged publishes, so
+ * these would otherwise never complete.
+ *
+ * @param[in] pxInstance The MQTT agent instance, before its command loop runs.
+ */
+static void prvFailPendingSubscriptionAcks( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Subscribes to the topic filters in the resubscribe list, splitting
+ * them into as many SUBSCRIBE packets as needed to fit the network buffer.
+ *
+ * @param[in] pxInstance The MQTT agent instance to resubscribe.
+ *
+ * @return `MQTTSuccess` if all the SUBSCRIBE commands were enqueued.
+ */
+static MQTTStatus_t prvHandleResubscribe( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Schedules a retry for the topic filters in the pending resubscribe
+ * list, dropping the subscriptions once the retries are exhausted.
+ *
+ * @param[in] pxInstance The MQTT agent instance.
+ */
+static void prvScheduleResubscribeRetry( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Start recording the timing of a new (re)connect.
+ *
+ * @param[in] pxInstance The MQTT agent instance.
+ */
+static void prvStartReconnectTiming( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Complete the timing record of the (re)connect, make it available to
+ * xMQTTAgentGetReconnectTiming() and log it as a single line.
+ *
+ * @param[in] pxInstance The MQTT agent instance.
+ */
+static void prvCompleteReconnectTiming( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Restart the adaptive keep-alive on a new connection.
+ *
+ * @param[in] pxInstance The MQTT agent instance.
+ */
+static void prvKeepAliveStart( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Run the adaptive keep-alive. Called from the agent task on every
+ * receive, which happens at least every MQTT_AGENT_MAX_EVENT_QUEUE_WAIT_TIME.
+ *
+ * @param[in] pxInstance The MQTT agent instance.
+ * @param[in] lBytesReceived Result of the receive.
+ */
+static void prvKeepAliveUpdate( MQTTAgentInstance_t * pxInstance,
+                                int32_t lBytesReceived );
+
+/**
+ * @brief Learn from a lost connection. A connection lost after being idle for
+ * at least the minimum interval is counted as an observation of an expired NAT
+ * mapping.
+ *
+ * @param[in] pxInstance The MQTT agent instance.
+ */
+static void prvKeepAliveConnectionLost( MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Longest keep-alive interval allowed by the configuration and by the
+ * observed NAT timeout.
+ *
+ * @param[in] pxInstance The MQTT agent instance.
+ *
+ * @return The interval in milliseconds.
+ */
+static uint32_t prvKeepAliveLimitMs( const MQTTAgentInstance_t * pxInstance );
+
+/**
+ * @brief Completion callback of the keep-alive PINGREQ command.
+ *
+ * @param[in] pxCommandContext The MQTT agent instance.
+ * @param[in] pxReturnInfo The result of the command.
+ */
+static void prvPingCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                    MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Completion callback of the publishes admitted to the in-flight
+ * window. Gives the slot back, then calls the callback of the publisher.
+ *
+ * @param[in] pxCommandContext The slot of the publish.
+ * @param[in] pxReturnInfo The result of the command.
+ */
+static void prvInFlightCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                        MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Enqueue a SUBSCRIBE or UNSUBSCRIBE for one topic filter and wait for
+ * the command to complete. The arguments are kept in a request of the
+ * instance, so the command stays valid if the wait times out.
+ *
+ * @param[in] pxInstance The MQTT agent instance, with its subscription mutex
+ * held.
+ * @param[in] pcTopicFilter The topic filter.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] xQoS QoS to subscribe with.
+ * @param[in] xSubscribe `true` for a SUBSCRIBE, `false` for an UNSUBSCRIBE.
+ * @param[in] ulBlockTimeMs Time to wait for room in the command queue, and
+ * then for the command to complete.
+ * @param[out] pxInFlight Set to `true` if the command was sent but did not
+ * complete in time.
+ *
+ * @return The result of the command.
+ */
+static MQTTStatus_t prvSendSubscriptionCommand( MQTTAgentInstance_t * pxInstance,
+                                                const char * pcTopicFilter,
+                                                uint16_t usTopicFilterLength,
+                                                MQTTQoS_t xQoS,
+                                                bool xSubscribe,
+                                                uint32_t ulBlockTimeMs,
+                                                bool * pxInFlight );
+
+/**
+ * @brief Transport receive function of all the instances. Receives through
+ * the publish stream of the instance owning the network context.
+ */
+static int32_t prvTransportRecv( NetworkContext_t * pNetworkContext,
+                                 void * pBuffer,
+                                 size_t bytesToRecv );
 
 /*-----------------------------------------------------------*/
 
@@ -269,16 +664,283 @@ static UBaseType_t prvGetRandomNumber( void )
     {
         LogError( ( "psa_generate_random failed with %d.", xPsaStatus ) );
         LogError( ( "Using xTaskGetTickCount() as random number generator" ) );
+        uxRandomValue = xTaskGetTickCount();
+    }
+
+    return uxRandomValue;
+}
+
+static void prvSetEvents( MQTTAgentInstance_t * pxInstance,
+                          EventBits_t uxBits )
+{
+    ( void ) xEventGroupSetBits( pxInstance->xEvents, uxBits );
+
+    /* The default instance also reports through the system events. */
+    if( pxInstance == &( xAgentInstances[ 0 ] ) )
+    {
+        ( void ) xEventGroupSetBits( xSystemEvents, uxBits );
+    }
+}
+
+static void prvClearEvents( MQTTAgentInstance_t * pxInstance,
+                            EventBits_t uxBits )
+{
+    ( void ) xEventGroupClearBits( pxInstance->xEvents, uxBits );
+
+    if( pxInstance == &( xAgentInstances[ 0 ] ) )
+    {
+        ( void ) xEventGroupClearBits( xSystemEvents, uxBits );
+    }
+}
+
+static void prvStartReconnectTiming( MQTTAgentInstance_t * pxInstance )
+{
+    memset( &( pxInstance->xReconnectTiming ), 0x00, sizeof( MQTTAgentReconnectTiming_t ) );
+    pxInstance->ulReconnectStartMs = prvGetTimeMs();
+    pxInstance->usResubscribeOutstanding = 0U;
+}
+
+static void prvCompleteReconnectTiming( MQTTAgentInstance_t * pxInstance )
+{
+    MQTTAgentReconnectTiming_t * pxTiming = &( pxInstance->xReconnectTiming );
+
+    pxTiming->ulConnectCount = pxInstance->ulConnectCount;
+    pxTiming->ulTotalMs = prvGetTimeMs() - pxInstance->ulReconnectStartMs;
+
+    taskENTER_CRITICAL();
+    {
+        pxInstance->xLastReconnectTiming = *pxTiming;
+    }
+    taskEXIT_CRITICAL();
+
+    /* One key=value line per connect, so that it can be extracted from the
+     * logs by tooling. */
+    LogInfo( ( "reconnect_timing client=%s connect=%u attempts=%u backoff_ms=%u dns_ms=%u tcp_ms=%u "
+               "tls_init_ms=%u tls_handshake_ms=%u connack_ms=%u resubscribe_ms=%u total_ms=%u session_present=%d",
+               pxInstance->xConfig.pcClientIdentifier,
+               ( unsigned int ) pxTiming->ulConnectCount,
+               ( unsigned int ) pxTiming->ulAttempts,
+               ( unsigned int ) pxTiming->ulBackoffMs,
+               ( unsigned int ) pxTiming->ulDnsMs,
+               ( unsigned int ) pxTiming->ulTcpConnectMs,
+               ( unsigned int ) pxTiming->ulTlsInitMs,
+               ( unsigned int ) pxTiming->ulTlsHandshakeMs,
+               ( unsigned int ) pxTiming->ulConnackMs,
+               ( unsigned int ) pxTiming->ulResubscribeMs,
+               ( unsigned int ) pxTiming->ulTotalMs,
+               ( int ) pxTiming->xSessionPresent ) );
+}
+
+static uint32_t prvKeepAliveLimitMs( const MQTTAgentInstance_t * pxInstance )
+{
+    uint32_t ulLimitMs = MQTT_AGENT_KEEP_ALIVE_MAX_SECONDS * 1000U;
+    uint32_t ulNatLimitMs;
+
+    if( pxInstance->ulNatTimeoutMs != 0U )
+    {
+        ulNatLimitMs = ( pxInstance->ulNatTimeoutMs / 100U ) * MQTT_AGENT_KEEP_ALIVE_NAT_MARGIN_PERCENT;
+
+        if( ulNatLimitMs < ulLimitMs )
+        {
+            ulLimitMs = ulNatLimitMs;
+        }
+    }
+
+    if( ulLimitMs < ( MQTT_AGENT_KEEP_ALIVE_MIN_SECONDS * 1000U ) )
+    {
+        ulLimitMs = MQTT_AGENT_KEEP_ALIVE_MIN_SECONDS * 1000U;
+    }
+
+    return ulLimitMs;
+}
+
+static void prvKeepAliveStart( MQTTAgentInstance_t * pxInstance )
+{
+    uint32_t ulNowMs = prvGetTimeMs();
+
+    pxInstance->ulLastRxMs = ulNowMs;
+    pxInstance->ulLastKeepAliveMs = ulNowMs;
+    pxInstance->usPingsAnswered = 0U;
+    pxInstance->xPingQueued = false;
+    pxInstance->xPingSent = false;
+    pxInstance->xKeepAliveStarted = true;
+}
+
+static void prvPingCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                    MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    MQTTAgentInstance_t * pxInstance = ( MQTTAgentInstance_t * ) pxCommandContext;
+
+    /* Runs in the agent task right after the PINGREQ was written. */
+    pxInstance->xPingQueued = false;
+
+    if( pxReturnInfo->returnCode == MQTTSuccess )
+    {
+        pxInstance->xPingSent = true;
+        pxInstance->ulPingSentMs = prvGetTimeMs();
+        pxInstance->ulPingsSent++;
+    }
+}
+
+static void prvKeepAliveUpdate( MQTTAgentInstance_t * pxInstance,
+                                int32_t lBytesReceived )
+{
+    uint32_t ulNowMs = prvGetTimeMs();
+    uint32_t ulIdleMs;
+    uint32_t ulLimitMs;
+
+    if( lBytesReceived > 0 )
+    {
+        pxInstance->ulLastRxMs = ulNowMs;
+    }
+
+    ulIdleMs = ulNowMs - pxInstance->ulLastRxMs;
+
+    if( pxInstance->xPingSent == true )
+    {
+        /* coreMQTT clears the flag when the PINGRESP is processed, and fails
+         * the process loop if it does not arrive in time. */
+        if( pxInstance->xAgentContext.mqttContext.waitingForPingResp == false )
+        {
+            pxInstance->xPingSent = false;
+            pxInstance->ulLastPingRttMs = ulNowMs - pxInstance->ulPingSentMs;
+            pxInstance->usPingsAnswered++;
+
+            /* The link survived this idle time, so earlier losses after as
+             * long were not caused by the NAT. */
+            if( ( pxInstance->usNatObservations > 0U ) && ( pxInstance->ulPingIdleMs >= pxInstance->ulNatCandidateMs ) )
+            {
+                pxInstance->usNatObservations = 0U;
+            }
+
+            if( pxInstance->usPingsAnswered >= MQTT_AGENT_KEEP_ALIVE_PROBES_TO_GROW )
+            {
+                pxInstance->usPingsAnswered = 0U;
+                ulLimitMs = prvKeepAliveLimitMs( pxInstance );
+
+                /* Stable at the cap of the NAT timeout: probe whether the
+                 * mapping lasts longer now. */
+                if( ( pxInstance->ulNatTimeoutMs != 0U ) &&
+                    ( pxInstance->ulKeepAliveIntervalMs >= ulLimitMs ) &&
+                    ( ulLimitMs < ( MQTT_AGENT_KEEP_ALIVE_MAX_SECONDS * 1000U ) ) )
+                {
+                    pxInstance->ulNatTimeoutMs += MQTT_AGENT_KEEP_ALIVE_STEP_SECONDS * 1000U;
+                    ulLimitMs = prvKeepAliveLimitMs( pxInstance );
+                }
+
+                if( pxInstance->ulKeepAliveIntervalMs < ulLimitMs )
+                {
+                    pxInstance->ulKeepAliveIntervalMs += MQTT_AGENT_KEEP_ALIVE_STEP_SECONDS * 1000U;
+
+                    if( pxInstance->ulKeepAliveIntervalMs > ulLimitMs )
+                    {
+                        pxInstance->ulKeepAliveIntervalMs = ulLimitMs;
+                    }
+
+                    LogInfo( ( "%s: Keep-alive interval raised to %u s, PINGRESP after %u ms.",
+                               pxInstance->xConfig.pcTaskName,
+                               ( unsigned int ) ( pxInstance->ulKeepAliveIntervalMs / 1000U ),
+                               ( unsigned int ) pxInstance->ulLastPingRttMs ) );
+                }
+            }
+        }
+    }
+    else if( pxInstance->xPingQueued == true )
+    {
+        /* Waiting for the agent to send the PINGREQ. */
+    }
+    else if( ulIdleMs >= pxInstance->ulKeepAliveIntervalMs )
+    {
+        pxInstance->ulPingIdleMs = ulIdleMs;
+        pxInstance->ulLastKeepAliveMs = ulNowMs;
+        pxInstance->xPingParams.cmdCompleteCallback = prvPingCommandCallback;
+        pxInstance->xPingParams.pCmdCompleteCallbackContext = ( MQTTAgentCommandContext_t * ) pxInstance;
+        pxInstance->xPingParams.blockTimeMs = 0U;
+
+        if( MQTTAgent_Ping( &( pxInstance->xAgentContext ), &( pxInstance->xPingParams ) ) == MQTTSuccess )
+        {
+            pxInstance->xPingQueued = true;
+        }
+    }
+    else if( ( ulNowMs - pxInstance->ulLastKeepAliveMs ) >= pxInstance->ulKeepAliveIntervalMs )
+    {
+        /* A fixed schedule would ping now, incoming traffic made it unnecessary. */
+        pxInstance->ulLastKeepAliveMs = ulNowMs;
+        pxInstance->ulPingsSuppressed++;
     }
     else
     {
-        uxRandomValue = xTaskGetTickCount();
+        /* Not due yet. */
     }
+}
 
-    return uxRandomValue;
+static void prvKeepAliveConnectionLost( MQTTAgentInstance_t * pxInstance )
+{
+    uint32_t ulIdleMs = prvGetTimeMs() - pxInstance->ulLastRxMs;
+
+    /* The link was already dead when an unanswered PINGREQ was sent. */
+    if( ( pxInstance->xPingQueued == true ) || ( pxInstance->xPingSent == true ) )
+    {
+        ulIdleMs = pxInstance->ulPingIdleMs;
+    }
+
+    if( ulIdleMs >= ( MQTT_AGENT_KEEP_ALIVE_MIN_SECONDS * 1000U ) )
+    {
+        if( ( pxInstance->usNatObservations == 0U ) || ( ulIdleMs < pxInstance->ulNatCandidateMs ) )
+        {
+            pxInstance->ulNatCandidateMs = ulIdleMs;
+        }
+
+        pxInstance->usNatObservations++;
+
+        /* A single loss may have any cause, only act on repeated ones. */
+        if( pxInstance->usNatObservations >= MQTT_AGENT_KEEP_ALIVE_NAT_OBSERVATIONS )
+        {
+            pxInstance->usNatObservations = 0U;
+            pxInstance->ulNatTimeoutMs = pxInstance->ulNatCandidateMs;
+            pxInstance->ulKeepAliveIntervalMs = prvKeepAliveLimitMs( pxInstance );
+
+            LogWarn( ( "%s: Connection lost after %u s idle, keep-alive interval lowered to %u s.",
+                       pxInstance->xConfig.pcTaskName,
+                       ( unsigned int ) ( ulIdleMs / 1000U ),
+                       ( unsigned int ) ( pxInstance->ulKeepAliveIntervalMs / 1000U ) ) );
+        }
+        else
+        {
+            LogInfo( ( "%s: Connection lost after %u s idle, %u of %u losses to lower the keep-alive interval.",
+                       pxInstance->xConfig.pcTaskName,
+                       ( unsigned int ) ( ulIdleMs / 1000U ),
+                       ( unsigned int ) pxInstance->usNatObservations,
+                       ( unsigned int ) MQTT_AGENT_KEEP_ALIVE_NAT_OBSERVATIONS ) );
+        }
+    }
+
+    pxInstance->xPingQueued = false;
+    pxInstance->xPingSent = false;
+    pxInstance->xKeepAliveStarted = false;
+}
+
+static int32_t prvTransportRecv( NetworkContext_t * pNetworkContext,
+                                 void * pBuffer,
+                                 size_t bytesToRecv )
+{
+    MQTTAgentInstance_t * pxInstance = ( MQTTAgentInstance_t * ) ( ( uint8_t * ) pNetworkContext -
+                                                                   offsetof( MQTTAgentInstance_t, xNetworkContext ) );
+    int32_t lResult;
+
+    lResult = PublishStream_Recv( &( pxInstance->xPublishStream ), pNetworkContext, pBuffer, bytesToRecv );
+
+    /* The receives of the CONNACK wait run before the keep-alive is started,
+     * with the state of the previous connection. */
+    if( pxInstance->xKeepAliveStarted == true )
+    {
+        prvKeepAliveUpdate( pxInstance, lResult );
+    }
+
+    return lResult;
 }
 
-static BaseType_t prvSocketConnect( NetworkContext_t * pxNetworkContext )
+static BaseType_t prvSocketConnect( MQTTAgentInstance_t * pxInstance )
 {
     BaseType_t xConnected = pdFAIL;
 
@@ -318,21 +980,33 @@ static BaseType_t prvSocketConnect( NetworkContext_t * pxNetworkContext )
     /* Establish a TCP connection with the MQTT broker. This example connects to
      * the MQTT broker as specified in democonfigMQTT_BROKER_ENDPOINT and
      * democonfigMQTT_BROKER_PORT */
-    LogInfo( ( "Creating a TLS connection to %s:%d.",
+    LogInfo( ( "%s: Creating a TLS connection to %s:%d.",
+               pxInstance->xConfig.pcTaskName,
                democonfigMQTT_BROKER_ENDPOINT,
                democonfigMQTT_BROKER_PORT ) );
 
-    xNetworkStatus = Transport_Connect( pxNetworkContext,
+    /* Discard any packet left partially parsed by the previous connection. */
+    PublishStream_Reset( &( pxInstance->xPublishStream ) );
+
+    pxInstance->xReconnectTiming.ulAttempts++;
+
+    xNetworkStatus = Transport_Connect( &( pxInstance->xNetworkContext ),
                                         &xServerInfo,
                                         &xTLSParams,
                                         MQTT_AGENT_TRANSPORT_SEND_RECV_TIMEOUT_MS,
                                         MQTT_AGENT_TRANSPORT_SEND_RECV_TIMEOUT_MS );
 
+    pxInstance->xReconnectTiming.ulDnsMs = pxInstance->xNetworkContext.connectTiming.dnsMs;
+    pxInstance->xReconnectTiming.ulTcpConnectMs = pxInstance->xNetworkContext.connectTiming.tcpConnectMs;
+    pxInstance->xReconnectTiming.ulTlsInitMs = pxInstance->xNetworkContext.connectTiming.tlsInitMs;
+    pxInstance->xReconnectTiming.ulTlsHandshakeMs = pxInstance->xNetworkContext.connectTiming.tlsHandshakeMs;
+
     xConnected = ( xNetworkStatus == TRANSPORT_STATUS_SUCCESS ) ? pdPASS : pdFAIL;
 
     if( xConnected )
     {
-        LogInfo( ( "Successfully created a TLS connection to %s:%d.",
+        LogInfo( ( "%s: Successfully created a TLS connection to %s:%d.",
+                   pxInstance->xConfig.pcTaskName,
                    democonfigMQTT_BROKER_ENDPOINT,
                    democonfigMQTT_BROKER_PORT ) );
     }
@@ -340,30 +1014,71 @@ static BaseType_t prvSocketConnect( NetworkContext_t * pxNetworkContext )
     return xConnected;
 }
 
-static BaseType_t prvSocketDisconnect( NetworkContext_t * pxNetworkContext )
+static BaseType_t prvSocketDisconnect( MQTTAgentInstance_t * pxInstance )
 {
     BaseType_t xDisconnected = pdFAIL;
 
     LogInfo( ( "Disconnecting TLS connection.\n" ) );
-    Transport_Disconnect( pxNetworkContext );
+    Transport_Disconnect( &( pxInstance->xNetworkContext ) );
     xDisconnected = pdPASS;
 
-    ( void ) xEventGroupClearBits( xSystemEvents, EVENT_MASK_MQTT_CONNECTED );
+    prvClearEvents( pxInstance, EVENT_MASK_MQTT_CONNECTED );
 
     return xDisconnected;
 }
 
+static void prvEnableReadySignal( MQTTAgentInstance_t * pxInstance )
+{
+    TransportStatus_t xNetworkStatus;
+    uint32_t ulPollPeriodMs = 0U;
+
+    xNetworkStatus = Transport_SetReadySemaphore( &( pxInstance->xNetworkContext ),
+                                                  pxInstance->xCommandQueue.wakeup,
+                                                  &ulPollPeriodMs );
+
+    if( xNetworkStatus == TRANSPORT_STATUS_SUCCESS )
+    {
+        /* Without readiness signals, wake up to poll the transport. */
+        pxInstance->xCommandQueue.pollPeriodMs = ulPollPeriodMs;
+
+        /* A publish being streamed waits for the rest of its data the same
+         * way. */
+        PublishStream_SetReadySemaphore( &( pxInstance->xPublishStream ),
+                                         pxInstance->xCommandQueue.wakeup );
+
+        LogDebug( ( "%s: Waiting for incoming data %s.",
+                    pxInstance->xConfig.pcTaskName,
+                    ( ulPollPeriodMs == 0U ) ? "on socket events" : "by polling" ) );
+    }
+    else
+    {
+        LogWarn( ( "%s: Transport cannot signal incoming data, receiving with a %u ms timeout.",
+                   pxInstance->xConfig.pcTaskName,
+                   ( unsigned int ) MQTT_AGENT_TRANSPORT_SEND_RECV_TIMEOUT_MS ) );
+    }
+}
+
 static void prvIncomingPublishCallback( MQTTAgentContext_t * pMqttAgentContext,
                                         uint16_t packetId,
                                         MQTTPublishInfo_t * pxPublishInfo )
 {
+    MQTTAgentInstance_t * pxInstance = ( MQTTAgentInstance_t * ) pMqttAgentContext;
     bool xPublishHandled = false;
 
     ( void ) packetId;
 
-    /* Fan out the incoming publishes to the callbacks registered using
-     * subscription manager. */
-    xPublishHandled = handleIncomingPublishes( pxPublishInfo );
+    /* The payload of a publish larger than the network buffer has already
+     * been streamed to the subscribers, only the acknowledgement remains. */
+    if( PublishStream_WasStreamed( &( pxInstance->xPublishStream ), pxPublishInfo ) == true )
+    {
+        xPublishHandled = true;
+    }
+    else
+    {
+        /* Fan out the incoming publishes to the callbacks registered using
+         * subscription manager. */
+        xPublishHandled = handleIncomingPublishes( &( pxInstance->xSubscriptionList ), pxPublishInfo );
+    }
 
     /* If there are no callbacks to handle the incoming publishes,
      * handle it as an unsolicited publish. */
@@ -382,7 +1097,10 @@ static void prvIncomingPublishCallback( MQTTAgentContext_t * pMqttAgentContext,
 static void prvReSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
                                               MQTTAgentReturnInfo_t * pxReturnInfo )
 {
-    MQTTAgentSubscribeArgs_t * pxSubscribeArgs = ( MQTTAgentSubscribeArgs_t * ) pxCommandContext;
+    ResubscribeArgs_t * pxResubscribeArgs = ( ResubscribeArgs_t * ) pxCommandContext;
+    MQTTAgentSubscribeArgs_t * pxSubscribeArgs = &( pxResubscribeArgs->xSubscribeArgs );
+    MQTTAgentInstance_t * pxInstance = pxResubscribeArgs->pxInstance;
+    bool xRetryRequired = false;
 
     /* If the return code is success, no further action is required as all the topic filters
      * are already part of the subscription list. */
@@ -390,67 +1108,240 @@ static void prvReSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxComm
     {
         size_t xIndex;
 
-        /* Check through each of the suback codes and determine if there are any failures. */
-        for( xIndex = 0; xIndex < pxSubscribeArgs->numSubscriptions; xIndex++ )
+        if( pxReturnInfo->pSubackCodes == NULL )
+        {
+            /* The command did not complete with a SUBACK, e.g. the connection
+             * dropped. A resumed session does not resubscribe, so retry all
+             * the topic filters; a new session supersedes the retry. */
+            LogWarn( ( "Resubscribe did not complete. xResult=%s.",
+                       MQTT_Status_strerror( pxReturnInfo->returnCode ) ) );
+        }
+
+        /* Queue the topic filters rejected by the broker for a retry. */
+        taskENTER_CRITICAL();
         {
-            /* This demo doesn't attempt to resubscribe in the event that a SUBACK failed. */
-            if( pxReturnInfo->pSubackCodes[ xIndex ] == MQTTSubAckFailure )
+            for( xIndex = 0; xIndex < pxSubscribeArgs->numSubscriptions; xIndex++ )
             {
-                LogError( ( "Failed to resubscribe to topic %.*s.",
-                            pxSubscribeArgs->pSubscribeInfo[ xIndex ].topicFilterLength,
-                            pxSubscribeArgs->pSubscribeInfo[ xIndex ].pTopicFilter ) );
-                /* Remove subscription callback for unsubscribe. */
-                removeSubscription( pxSubscribeArgs->pSubscribeInfo[ xIndex ].pTopicFilter,
-                                    pxSubscribeArgs->pSubscribeInfo[ xIndex ].topicFilterLength );
+                if( ( ( pxReturnInfo->pSubackCodes == NULL ) ||
+                      ( pxReturnInfo->pSubackCodes[ xIndex ] == MQTTSubAckFailure ) ) &&
+                    ( pxInstance->usResubscribePendingCount < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) )
+                {
+                    pxInstance->xResubscribePending[ pxInstance->usResubscribePendingCount ] = pxSubscribeArgs->pSubscribeInfo[ xIndex ];
+                    pxInstance->usResubscribePendingCount++;
+                    xRetryRequired = true;
+                }
             }
         }
-
-        /* Hit an assert as some of the tasks won't be able to proceed correctly without
-         * the subscriptions. This logic will be updated with exponential backoff and retry.  */
-        configASSERT( pdTRUE );
+        taskEXIT_CRITICAL();
     }
-}
 
-static MQTTStatus_t prvMQTTInit( void )
-{
-    TransportInterface_t xTransport = { 0 };
-    MQTTStatus_t xReturn;
-    MQTTFixedBuffer_t xFixedBuffer = { .pBuffer = xNetworkBuffer, .size = MQTT_AGENT_NETWORK_BUFFER_SIZE };
-    static uint8_t staticQueueStorageArea[ MQTT_AGENT_COMMAND_QUEUE_LENGTH * sizeof( MQTTAgentCommand_t * ) ];
-    static StaticQueue_t staticQueueStructure;
-    MQTTAgentMessageInterface_t messageInterface =
+    if( pxResubscribeArgs != &( pxInstance->xResubscribeRetryArgs ) )
     {
-        .pMsgCtx        = NULL,
-        .send           = Agent_MessageSend,
-        .recv           = Agent_MessageReceive,
-        .getCommand     = Agent_GetCommand,
-        .releaseCommand = Agent_ReleaseCommand
-    };
+        /* The reconnect is complete once every resubscribe batch completed. */
+        if( pxInstance->usResubscribeOutstanding > 0U )
+        {
+            pxInstance->usResubscribeOutstanding--;
 
-    LogDebug( ( "Creating command queue." ) );
-    xCommandQueue.queue = xQueueCreateStatic( MQTT_AGENT_COMMAND_QUEUE_LENGTH,
-                                              sizeof( MQTTAgentCommand_t * ),
-                                              staticQueueStorageArea,
-                                              &staticQueueStructure );
-    configASSERT( xCommandQueue.queue );
-    messageInterface.pMsgCtx = &xCommandQueue;
-
-    /* Initialize the task pool. */
-    Agent_InitializePool();
-
-    /* Fill in Transport Interface send and receive function pointers. */
-    xTransport.pNetworkContext = &xNetworkContextMqtt;
-    xTransport.send = Transport_Send;
-    xTransport.recv = Transport_Recv;
+            if( pxInstance->usResubscribeOutstanding == 0U )
+            {
+                pxInstance->xReconnectTiming.ulResubscribeMs = prvGetTimeMs() - pxInstance->ulResubscribeStartMs;
+                prvCompleteReconnectTiming( pxInstance );
+            }
+        }
+    }
+    else
+    {
+        pxInstance->xResubscribeRetryInFlight = false;
+
+        /* Start a fresh backoff sequence if the retried filters were accepted. */
+        if( xRetryRequired == false )
+        {
+            BackoffAlgorithm_InitializeParams( &( pxInstance->xResubscribeBackoff ),
+                                               RESUBSCRIBE_BACKOFF_BASE_MS,
+                                               RESUBSCRIBE_MAX_BACKOFF_DELAY_MS,
+                                               RESUBSCRIBE_MAX_ATTEMPTS );
+        }
+    }
+
+    if( pxInstance->usResubscribePendingCount > 0U )
+    {
+        prvScheduleResubscribeRetry( pxInstance );
+    }
+}
+
+static void prvResubscribeTimerCallback( TimerHandle_t xTimer )
+{
+    MQTTAgentInstance_t * pxInstance = ( MQTTAgentInstance_t * ) pvTimerGetTimerID( xTimer );
+    MQTTAgentSubscribeArgs_t * pxRetryArgs = &( pxInstance->xResubscribeRetryArgs.xSubscribeArgs );
+    MQTTStatus_t xResult;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+
+    /* Only one retry is in flight at a time. Filters rejected in the meantime
+     * are picked up once it completes. */
+    if( pxInstance->xResubscribeRetryInFlight == false )
+    {
+        taskENTER_CRITICAL();
+        {
+            memcpy( pxInstance->xResubscribeRetry,
+                    pxInstance->xResubscribePending,
+                    pxInstance->usResubscribePendingCount * sizeof( MQTTSubscribeInfo_t ) );
+            pxRetryArgs->pSubscribeInfo = pxInstance->xResubscribeRetry;
+            pxRetryArgs->numSubscriptions = pxInstance->usResubscribePendingCount;
+            pxInstance->usResubscribePendingCount = 0U;
+        }
+        taskEXIT_CRITICAL();
+
+        if( pxRetryArgs->numSubscriptions > 0U )
+        {
+            LogInfo( ( "Retrying subscription of %u rejected topic filters.",
+                       ( unsigned int ) pxRetryArgs->numSubscriptions ) );
+
+            /* The timer task must not block, the command waits in the queue
+             * until the agent picks it up. */
+            xCommandParams.blockTimeMs = 0U;
+            xCommandParams.cmdCompleteCallback = prvReSubscriptionCommandCallback;
+            xCommandParams.pCmdCompleteCallbackContext = ( void * ) &( pxInstance->xResubscribeRetryArgs );
+
+            pxInstance->xResubscribeRetryInFlight = true;
+            xResult = MQTTAgent_Subscribe( &( pxInstance->xAgentContext ), pxRetryArgs, &xCommandParams );
+
+            if( xResult != MQTTSuccess )
+            {
+                LogWarn( ( "Failed to enqueue the resubscribe retry. xResult=%s.",
+                           MQTT_Status_strerror( xResult ) ) );
+
+                /* Put the filters back so that the next retry picks them up. */
+                pxInstance->xResubscribeRetryInFlight = false;
+                taskENTER_CRITICAL();
+                {
+                    uint16_t usIndex;
+
+                    for( usIndex = 0U;
+                         ( usIndex < pxRetryArgs->numSubscriptions ) &&
+                         ( pxInstance->usResubscribePendingCount < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS );
+                         usIndex++ )
+                    {
+                        pxInstance->xResubscribePending[ pxInstance->usResubscribePendingCount ] = pxInstance->xResubscribeRetry[ usIndex ];
+                        pxInstance->usResubscribePendingCount++;
+                    }
+                }
+                taskEXIT_CRITICAL();
+
+                prvScheduleResubscribeRetry( pxInstance );
+            }
+        }
+    }
+}
+
+static void prvScheduleResubscribeRetry( MQTTAgentInstance_t * pxInstance )
+{
+    MQTTAgentSubscribeArgs_t * pxRetryArgs = &( pxInstance->xResubscribeRetryArgs.xSubscribeArgs );
+    BackoffAlgorithmStatus_t xBackoffAlgStatus;
+    uint16_t usNextRetryBackOff = 0U;
+    uint16_t usIndex;
+
+    if( ( pxInstance->xResubscribeRetryInFlight == true ) || ( xTimerIsTimerActive( pxInstance->xResubscribeTimer ) != pdFALSE ) )
+    {
+        /* A retry is already scheduled or in flight. */
+    }
+    else
+    {
+        xBackoffAlgStatus = BackoffAlgorithm_GetNextBackoff( &( pxInstance->xResubscribeBackoff ), prvGetRandomNumber(), &usNextRetryBackOff );
+
+        if( xBackoffAlgStatus == BackoffAlgorithmSuccess )
+        {
+            LogWarn( ( "Retrying rejected subscriptions in %hu ms.", usNextRetryBackOff ) );
+
+            ( void ) xTimerChangePeriod( pxInstance->xResubscribeTimer,
+                                         pdMS_TO_TICKS( usNextRetryBackOff ) + 1U,
+                                         0U );
+        }
+        else
+        {
+            /* Give up on the rejected topic filters. */
+            taskENTER_CRITICAL();
+            {
+                memcpy( pxInstance->xResubscribeRetry,
+                        pxInstance->xResubscribePending,
+                        pxInstance->usResubscribePendingCount * sizeof( MQTTSubscribeInfo_t ) );
+                pxRetryArgs->numSubscriptions = pxInstance->usResubscribePendingCount;
+                pxInstance->usResubscribePendingCount = 0U;
+            }
+            taskEXIT_CRITICAL();
 
-    /* Initialize MQTT library. */
-    xReturn = MQTTAgent_Init( &xGlobalMqttAgentContext,
+            for( usIndex = 0U; usIndex < pxRetryArgs->numSubscriptions; usIndex++ )
+            {
+                LogError( ( "Failed to resubscribe to topic %.*s after %u attempts.",
+                            pxInstance->xResubscribeRetry[ usIndex ].topicFilterLength,
+                            pxInstance->xResubscribeRetry[ usIndex ].pTopicFilter,
+                            ( unsigned int ) RESUBSCRIBE_MAX_ATTEMPTS ) );
+
+                /* Remove subscription callback for unsubscribe. */
+                removeSubscription( &( pxInstance->xSubscriptionList ),
+                                    pxInstance->xResubscribeRetry[ usIndex ].pTopicFilter,
+                                    pxInstance->xResubscribeRetry[ usIndex ].topicFilterLength );
+            }
+
+            pxRetryArgs->numSubscriptions = 0U;
+        }
+    }
+}
+
+static MQTTStatus_t prvMQTTInit( MQTTAgentInstance_t * pxInstance )
+{
+    TransportInterface_t xTransport = { 0 };
+    MQTTStatus_t xReturn;
+    MQTTFixedBuffer_t xFixedBuffer = { .pBuffer = pxInstance->ucNetworkBuffer, .size = MQTT_AGENT_NETWORK_BUFFER_SIZE };
+    MQTTAgentMessageInterface_t messageInterface =
+    {
+        .pMsgCtx        = NULL,
+        .send           = Agent_MessageSend,
+        .recv           = Agent_MessageReceive,
+        .getCommand     = Agent_GetCommand,
+        .releaseCommand = Agent_ReleaseCommand
+    };
+
+    LogDebug( ( "Creating command queue." ) );
+    Agent_MessageInitLanes( &( pxInstance->xCommandQueue ),
+                            &( pxInstance->xCommandLanes ),
+                            pxInstance->xConfig.pcControlTopicFilter );
+    messageInterface.pMsgCtx = &( pxInstance->xCommandQueue );
+
+    pxInstance->ulKeepAliveIntervalMs = MQTT_AGENT_KEEP_ALIVE_INTERVAL_SECONDS * 1000U;
+    pxInstance->xKeepAliveStarted = false;
+
+    /* Create the timer used to retry rejected subscriptions. */
+    pxInstance->xResubscribeTimer = xTimerCreateStatic( "Resubscribe",
+                                                        1U,
+                                                        pdFALSE,
+                                                        ( void * ) pxInstance,
+                                                        prvResubscribeTimerCallback,
+                                                        &( pxInstance->xResubscribeTimerBuffer ) );
+    configASSERT( pxInstance->xResubscribeTimer );
+
+    /* Fill in Transport Interface send, vectored send and receive function
+     * pointers. */
+    xTransport.pNetworkContext = &( pxInstance->xNetworkContext );
+    xTransport.send = Transport_Send;
+    xTransport.writev = Transport_Writev;
+    xTransport.recv = prvTransportRecv;
+
+    /* Publishes that do not fit the network buffer are streamed in chunks
+     * instead of being dropped by coreMQTT. */
+    PublishStream_Init( &( pxInstance->xPublishStream ),
+                        Transport_Recv,
+                        MQTT_AGENT_NETWORK_BUFFER_SIZE,
+                        &( pxInstance->xSubscriptionList ) );
+
+    /* Initialize MQTT library. The subscription list is given as the incoming
+     * publish callback context. */
+    xReturn = MQTTAgent_Init( &( pxInstance->xAgentContext ),
                               &messageInterface,
                               &xFixedBuffer,
                               &xTransport,
                               prvGetTimeMs,
                               prvIncomingPublishCallback,
-                              NULL );
+                              ( void * ) &( pxInstance->xSubscriptionList ) );
 
     if( xReturn != MQTTSuccess )
     {
@@ -458,63 +1349,150 @@ static MQTTStatus_t prvMQTTInit( void )
     }
     else
     {
-        ( void ) xEventGroupSetBits( xSystemEvents, EVENT_MASK_MQTT_INIT );
+        prvSetEvents( pxInstance, EVENT_MASK_MQTT_INIT );
     }
 
     return xReturn;
 }
 
-static MQTTStatus_t prvHandleResubscribe( void )
+static MQTTStatus_t prvHandleResubscribe( MQTTAgentInstance_t * pxInstance )
 {
-    MQTTStatus_t xResult = MQTTBadParameter;
+    MQTTStatus_t xResult = MQTTSuccess;
     uint32_t ulIndex = 0U;
     uint16_t usNumSubscriptions = 0U;
-
-    /* These variables need to stay in scope until command completes. */
-    static MQTTAgentSubscribeArgs_t xSubArgs = { 0 };
-    static MQTTSubscribeInfo_t xSubInfo[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ] = { 0 };
-    static MQTTAgentCommandInfo_t xCommandParams = { 0 };
-
-    /* Loop through each subscription in the subscription list and add a subscribe
-     * command to the command queue. */
-    for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++ )
+    uint16_t usBatchStart = 0U;
+    uint16_t usNumBatches = 0U;
+    uint16_t usSubIndex;
+    size_t xRemainingLength = 0U;
+    size_t xPacketSize = 0U;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+    SubscriptionElement_t xSubscription;
+    MQTTSubscribeInfo_t * pxSubInfo = pxInstance->xSubInfo;
+    MQTTAgentSubscribeArgs_t * pxSubArgs;
+
+    /* Retries left over from the previous connection are superseded by this
+     * resubscribe. */
+    ( void ) xTimerStop( pxInstance->xResubscribeTimer, 0U );
+    taskENTER_CRITICAL();
+    {
+        pxInstance->usResubscribePendingCount = 0U;
+    }
+    taskEXIT_CRITICAL();
+    pxInstance->xResubscribeRetryInFlight = false;
+    BackoffAlgorithm_InitializeParams( &( pxInstance->xResubscribeBackoff ),
+                                       RESUBSCRIBE_BACKOFF_BASE_MS,
+                                       RESUBSCRIBE_MAX_BACKOFF_DELAY_MS,
+                                       RESUBSCRIBE_MAX_ATTEMPTS );
+
+    /* Loop through each subscription in the subscription list and collect the
+     * distinct topic filters, using the highest QoS requested for a filter.
+     * A subscription added while the pool is walked is subscribed by its own
+     * command, so the walk stops once the list is full. */
+    for( ulIndex = 0U;
+         ( ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE ) && ( usNumSubscriptions < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS );
+         ulIndex++ )
     {
-        /* Check if there is a subscription in the subscription list. This demo
-         * doesn't check for duplicate subscriptions. */
-        if( xGlobalSubscriptionList[ ulIndex ].usFilterStringLength != 0 )
+        /* Other tasks may be modifying the list, take a consistent copy. */
+        if( readSubscription( &( pxInstance->xSubscriptionList ), ulIndex, &xSubscription ) == true )
         {
-            xSubInfo[ usNumSubscriptions ].pTopicFilter = xGlobalSubscriptionList[ ulIndex ].pcSubscriptionFilterString;
-            xSubInfo[ usNumSubscriptions ].topicFilterLength = xGlobalSubscriptionList[ ulIndex ].usFilterStringLength;
+            for( usSubIndex = 0U; usSubIndex < usNumSubscriptions; usSubIndex++ )
+            {
+                if( ( pxSubInfo[ usSubIndex ].topicFilterLength == xSubscription.usFilterStringLength ) &&
+                    ( strncmp( pxSubInfo[ usSubIndex ].pTopicFilter,
+                               xSubscription.pcSubscriptionFilterString,
+                               pxSubInfo[ usSubIndex ].topicFilterLength ) == 0 ) )
+                {
+                    break;
+                }
+            }
 
-            /* QoS1 is used for all the subscriptions in this demo. */
-            xSubInfo[ usNumSubscriptions ].qos = MQTTQoS1;
+            if( usSubIndex < usNumSubscriptions )
+            {
+                if( xSubscription.xQoS > pxSubInfo[ usSubIndex ].qos )
+                {
+                    pxSubInfo[ usSubIndex ].qos = xSubscription.xQoS;
+                }
+            }
+            else
+            {
+                pxSubInfo[ usNumSubscriptions ].pTopicFilter = xSubscription.pcSubscriptionFilterString;
+                pxSubInfo[ usNumSubscriptions ].topicFilterLength = xSubscription.usFilterStringLength;
+                pxSubInfo[ usNumSubscriptions ].qos = xSubscription.xQoS;
 
-            LogInfo( ( "Resubscribe to the topic %.*s will be attempted.",
-                       xSubInfo[ usNumSubscriptions ].topicFilterLength,
-                       xSubInfo[ usNumSubscriptions ].pTopicFilter ) );
+                LogInfo( ( "Resubscribe to the topic %.*s will be attempted.",
+                           pxSubInfo[ usNumSubscriptions ].topicFilterLength,
+                           pxSubInfo[ usNumSubscriptions ].pTopicFilter ) );
 
-            usNumSubscriptions++;
+                usNumSubscriptions++;
+            }
         }
     }
 
-    if( usNumSubscriptions > 0U )
+    /* The block time can be 0 as the command loop is not running at this point. */
+    xCommandParams.blockTimeMs = 0U;
+    xCommandParams.cmdCompleteCallback = prvReSubscriptionCommandCallback;
+
+    /* Grow each batch for as long as the SUBSCRIBE packet fits in the network
+     * buffer, then enqueue it and start the next one. */
+    for( usSubIndex = 0U; ( usSubIndex < usNumSubscriptions ) && ( xResult == MQTTSuccess ); usSubIndex++ )
     {
-        xSubArgs.pSubscribeInfo = xSubInfo;
-        xSubArgs.numSubscriptions = usNumSubscriptions;
+        bool xLastEntry = ( ( usSubIndex + 1U ) == usNumSubscriptions );
+        bool xBatchFull = false;
 
-        /* The block time can be 0 as the command loop is not running at this point. */
-        xCommandParams.blockTimeMs = 0U;
-        xCommandParams.cmdCompleteCallback = prvReSubscriptionCommandCallback;
-        xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xSubArgs;
+        if( xLastEntry == false )
+        {
+            xResult = MQTT_GetSubscribePacketSize( &( pxSubInfo[ usBatchStart ] ),
+                                                   ( size_t ) ( usSubIndex - usBatchStart ) + 2U,
+                                                   &xRemainingLength,
+                                                   &xPacketSize );
+            xBatchFull = ( ( xResult != MQTTSuccess ) || ( xPacketSize > MQTT_AGENT_NETWORK_BUFFER_SIZE ) );
+            xResult = MQTTSuccess;
+        }
 
-        /* Enqueue subscribe to the command queue. These commands will be processed only
-         * when command loop starts. */
-        xResult = MQTTAgent_Subscribe( &xGlobalMqttAgentContext, &xSubArgs, &xCommandParams );
-    }
-    else
-    {
-        /* Mark the resubscribe as success if there is nothing to be subscribed. */
-        xResult = MQTTSuccess;
+        if( ( xLastEntry == true ) || ( xBatchFull == true ) )
+        {
+            pxSubArgs = &( pxInstance->xSubArgs[ usNumBatches ].xSubscribeArgs );
+            pxInstance->xSubArgs[ usNumBatches ].pxInstance = pxInstance;
+            pxSubArgs->pSubscribeInfo = &( pxSubInfo[ usBatchStart ] );
+            pxSubArgs->numSubscriptions = ( size_t ) ( usSubIndex - usBatchStart ) + 1U;
+
+            xResult = MQTT_GetSubscribePacketSize( pxSubArgs->pSubscribeInfo,
+                                                   pxSubArgs->numSubscriptions,
+                                                   &xRemainingLength,
+                                                   &xPacketSize );
+
+            if( ( xResult == MQTTSuccess ) && ( xPacketSize > MQTT_AGENT_NETWORK_BUFFER_SIZE ) )
+            {
+                /* Only a single topic filter can end up in an oversized batch. */
+                LogError( ( "Topic filter %.*s does not fit in the network buffer and will not be resubscribed.",
+                            pxSubInfo[ usBatchStart ].topicFilterLength,
+                            pxSubInfo[ usBatchStart ].pTopicFilter ) );
+            }
+            else if( xResult == MQTTSuccess )
+            {
+                LogDebug( ( "Resubscribing to %u topic filters in a %u byte SUBSCRIBE packet.",
+                            ( unsigned int ) pxSubArgs->numSubscriptions,
+                            ( unsigned int ) xPacketSize ) );
+
+                xCommandParams.pCmdCompleteCallbackContext = ( void * ) &( pxInstance->xSubArgs[ usNumBatches ] );
+
+                /* Enqueue subscribe to the command queue. These commands will be processed only
+                 * when command loop starts. */
+                xResult = MQTTAgent_Subscribe( &( pxInstance->xAgentContext ), pxSubArgs, &xCommandParams );
+                usNumBatches++;
+
+                if( xResult == MQTTSuccess )
+                {
+                    pxInstance->usResubscribeOutstanding++;
+                }
+            }
+            else
+            {
+                /* Invalid topic filter. */
+            }
+
+            usBatchStart = usSubIndex + 1U;
+        }
     }
 
     if( xResult != MQTTSuccess )
@@ -522,62 +1500,175 @@ static MQTTStatus_t prvHandleResubscribe( void )
         LogError( ( "Failed to enqueue the MQTT subscribe command. xResult=%s.",
                     MQTT_Status_strerror( xResult ) ) );
     }
+    else if( usNumBatches > 0U )
+    {
+        LogInfo( ( "Resubscribing to %u topic filters using %u SUBSCRIBE packets.",
+                   ( unsigned int ) usNumSubscriptions,
+                   ( unsigned int ) usNumBatches ) );
+    }
+    else
+    {
+        /* Nothing to be subscribed. */
+    }
 
     return xResult;
 }
 
-static MQTTStatus_t prvMQTTConnect( void )
+static void prvFailPendingSubscriptionAcks( MQTTAgentInstance_t * pxInstance )
+{
+    MQTTAgentContext_t * pxAgentContext = &( pxInstance->xAgentContext );
+    MQTTAgentAckInfo_t * pxAck;
+    MQTTAgentCommand_t * pxCommand;
+    MQTTAgentReturnInfo_t xReturnInfo = { 0 };
+    size_t xIndex;
+    uint32_t ulFailed = 0U;
+
+    /* The acknowledgement was lost with the connection. The callers see the
+     * same error as for a command cancelled by a disconnect, and may retry. */
+    xReturnInfo.returnCode = MQTTRecvFailed;
+    xReturnInfo.pSubackCodes = NULL;
+
+    for( xIndex = 0U;
+         xIndex < ( sizeof( pxAgentContext->pPendingAcks ) / sizeof( pxAgentContext->pPendingAcks[ 0 ] ) );
+         xIndex++ )
+    {
+        pxAck = &( pxAgentContext->pPendingAcks[ xIndex ] );
+        pxCommand = pxAck->pOriginalCommand;
+
+        if( ( pxAck->packetId != MQTT_PACKET_ID_INVALID ) &&
+            ( pxCommand != NULL ) &&
+            ( pxCommand->commandType != PUBLISH ) )
+        {
+            /* Free the slot before the callback, which may queue a new command. */
+            pxAck->packetId = MQTT_PACKET_ID_INVALID;
+            pxAck->pOriginalCommand = NULL;
+
+            if( pxCommand->pCommandCompleteCallback != NULL )
+            {
+                pxCommand->pCommandCompleteCallback( pxCommand->pCmdContext, &xReturnInfo );
+            }
+
+            ( void ) pxAgentContext->agentInterface.releaseCommand( pxCommand );
+            ulFailed++;
+        }
+    }
+
+    if( ulFailed > 0U )
+    {
+        LogWarn( ( "%s: Failed %u SUBSCRIBE and UNSUBSCRIBE commands not acknowledged before the reconnect.",
+                   pxInstance->xConfig.pcTaskName,
+                   ( unsigned int ) ulFailed ) );
+    }
+}
+
+static MQTTStatus_t prvMQTTConnect( MQTTAgentInstance_t * pxInstance )
 {
     MQTTStatus_t xResult;
     bool xSessionPresent = false;
+    uint32_t ulConnectStartMs = 0U;
+    MQTTConnectInfo_t * pxConnectInfo = &( pxInstance->xConnectInfo );
 
     /* The client identifier is used to uniquely identify this MQTT client to
      * the MQTT broker. In a production device the identifier can be something
      * unique, such as a device serial number. */
-    xConnectInfo.pClientIdentifier = democonfigCLIENT_IDENTIFIER;
-    xConnectInfo.clientIdentifierLength = ( uint16_t ) strlen( democonfigCLIENT_IDENTIFIER );
+    pxConnectInfo->pClientIdentifier = pxInstance->xConfig.pcClientIdentifier;
+    pxConnectInfo->clientIdentifierLength = ( uint16_t ) strlen( pxInstance->xConfig.pcClientIdentifier );
 
     /* Set MQTT keep-alive period. It is the responsibility of the application
      * to ensure that the interval between Control Packets being sent does not
      * exceed the Keep Alive value. In the absence of sending any other Control
-     * Packets, the Client MUST send a PINGREQ Packet.  This responsibility will
-     * be moved inside the agent. */
-    xConnectInfo.keepAliveSeconds = MQTT_AGENT_KEEP_ALIVE_INTERVAL_SECONDS;
-
-    LogInfo( ( "Creating an MQTT connection to the broker. \n" ) );
+     * Packets, the Client MUST send a PINGREQ Packet. The adaptive keep-alive
+     * pings well within this period. */
+    pxConnectInfo->keepAliveSeconds = MQTT_AGENT_KEEP_ALIVE_MAX_SECONDS;
+
+    LogInfo( ( "%s: Creating an MQTT connection to the broker. \n", pxInstance->xConfig.pcTaskName ) );
+
+    /* Commands and pending acknowledgements left over from a previous
+     * connection are only discarded when starting a clean session. For a
+     * persistent session they are kept so that MQTTAgent_ResumeSession() can
+     * resend the unacknowledged publishes. The pending SUBSCRIBE and
+     * UNSUBSCRIBE acknowledgements are failed once the session is resumed. */
+    if( pxConnectInfo->cleanSession == true )
+    {
+        ( void ) MQTTAgent_CancelAll( &( pxInstance->xAgentContext ) );
+    }
 
-    ( void ) MQTTAgent_CancelAll( &( xGlobalMqttAgentContext ) );
+    ulConnectStartMs = prvGetTimeMs();
 
     /* Send MQTT CONNECT packet to broker. MQTT's Last Will and Testament feature
      * is not used in this demo, so it is passed as NULL. */
-    xResult = MQTT_Connect( &( xGlobalMqttAgentContext.mqttContext ),
-                            &xConnectInfo,
+    xResult = MQTT_Connect( &( pxInstance->xAgentContext.mqttContext ),
+                            pxConnectInfo,
                             NULL,
                             MQTT_AGENT_CONNACK_RECV_TIMEOUT_MS,
                             &xSessionPresent );
 
+    pxInstance->xReconnectTiming.ulConnackMs = prvGetTimeMs() - ulConnectStartMs;
+    pxInstance->xReconnectTiming.xSessionPresent = xSessionPresent;
+
     /* Resume a session if desired. */
     if( ( xResult == MQTTSuccess ) &&
-        ( xConnectInfo.cleanSession == false ) )
+        ( pxConnectInfo->cleanSession == false ) )
     {
-        LogInfo( ( "Resuming persistent MQTT Session." ) );
-        xResult = MQTTAgent_ResumeSession( &xGlobalMqttAgentContext, xSessionPresent );
+        LogInfo( ( "Resuming persistent MQTT Session. Session present: %d", xSessionPresent ) );
+        xResult = MQTTAgent_ResumeSession( &( pxInstance->xAgentContext ), xSessionPresent );
+
+        /* Without a session, MQTTAgent_ResumeSession() already failed every
+         * pending acknowledgement. */
+        if( ( xResult == MQTTSuccess ) && ( xSessionPresent == true ) )
+        {
+            prvFailPendingSubscriptionAcks( pxInstance );
+        }
 
-        /* Resubscribe to all the subscribed topics. */
+        /* The broker only keeps the subscriptions if it still has the session,
+         * otherwise resubscribe to all the subscribed topics. */
         if( ( xResult == MQTTSuccess ) && ( xSessionPresent == false ) )
         {
-            xResult = prvHandleResubscribe();
+            pxInstance->ulResubscribeStartMs = prvGetTimeMs();
+            pxInstance->usResubscribeOutstanding = 0U;
+            xResult = prvHandleResubscribe( pxInstance );
+        }
+
+        if( xResult == MQTTSuccess )
+        {
+            pxInstance->ulConnectCount++;
+
+            LogInfo( ( "%s: Reconnect %u completed in %u ms (session present: %d, resubscribe %s).",
+                       pxInstance->xConfig.pcTaskName,
+                       ( unsigned int ) pxInstance->ulConnectCount,
+                       ( unsigned int ) ( prvGetTimeMs() - ulConnectStartMs ),
+                       xSessionPresent,
+                       ( xSessionPresent == true ) ? "skipped" : "queued" ) );
+
+            /* Otherwise completed once the resubscribes are acknowledged. */
+            if( pxInstance->usResubscribeOutstanding == 0U )
+            {
+                prvCompleteReconnectTiming( pxInstance );
+            }
+
+            prvSetEvents( pxInstance, EVENT_MASK_MQTT_CONNECTED );
+        }
+        else
+        {
+            LogError( ( "Failed to resume the MQTT session. xResult=%s.",
+                        MQTT_Status_strerror( xResult ) ) );
         }
     }
     else if( xResult == MQTTSuccess )
     {
-        LogInfo( ( "Successfully connected to the MQTT broker." ) );
+        pxInstance->ulConnectCount++;
+
+        LogInfo( ( "%s: Successfully connected to the MQTT broker in %u ms.",
+                   pxInstance->xConfig.pcTaskName,
+                   ( unsigned int ) ( prvGetTimeMs() - ulConnectStartMs ) ) );
         LogInfo( ( "Session present: %d\n", xSessionPresent ) );
         LogInfo( ( "Starting a clean MQTT Session." ) );
         /* Further reconnects will include a session resume operation */
-        xConnectInfo.cleanSession = false;
+        pxConnectInfo->cleanSession = false;
+
+        prvCompleteReconnectTiming( pxInstance );
 
-        ( void ) xEventGroupSetBits( xSystemEvents, EVENT_MASK_MQTT_CONNECTED );
+        prvSetEvents( pxInstance, EVENT_MASK_MQTT_CONNECTED );
     }
     else
     {
@@ -598,24 +1689,24 @@ static void prvDisconnectCommandCallback( MQTTAgentCommandContext_t * pxCommandC
     }
 }
 
-static void prvDisconnectFromMQTTBroker( void )
+static void prvDisconnectFromMQTTBroker( MQTTAgentInstance_t * pxInstance )
 {
-    static MQTTAgentCommandContext_t xCommandContext = { 0 };
-    static MQTTAgentCommandInfo_t xCommandParams = { 0 };
+    MQTTAgentCommandContext_t * pxCommandContext = &( pxInstance->xDisconnectContext );
+    MQTTAgentCommandInfo_t * pxCommandParams = &( pxInstance->xDisconnectParams );
     MQTTStatus_t xCommandStatus;
 
     /* Disconnect from broker. */
     LogInfo( ( "Disconnecting the MQTT connection with %s.", democonfigMQTT_BROKER_ENDPOINT ) );
 
-    xCommandParams.blockTimeMs = MQTT_AGENT_SEND_BLOCK_TIME_MS;
-    xCommandParams.cmdCompleteCallback = prvDisconnectCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = &xCommandContext;
-    xCommandContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
-    xCommandContext.pArgs = NULL;
-    xCommandContext.xReturnStatus = MQTTSendFailed;
+    pxCommandParams->blockTimeMs = MQTT_AGENT_SEND_BLOCK_TIME_MS;
+    pxCommandParams->cmdCompleteCallback = prvDisconnectCommandCallback;
+    pxCommandParams->pCmdCompleteCallbackContext = pxCommandContext;
+    pxCommandContext->xTaskToNotify = xTaskGetCurrentTaskHandle();
+    pxCommandContext->pArgs = NULL;
+    pxCommandContext->xReturnStatus = MQTTSendFailed;
 
     /* Disconnect MQTT session. */
-    xCommandStatus = MQTTAgent_Disconnect( &xGlobalMqttAgentContext, &xCommandParams );
+    xCommandStatus = MQTTAgent_Disconnect( &( pxInstance->xAgentContext ), pxCommandParams );
     configASSERT( xCommandStatus == MQTTSuccess );
 
     xTaskNotifyWait( 0,
@@ -624,23 +1715,20 @@ static void prvDisconnectFromMQTTBroker( void )
                      pdMS_TO_TICKS( MQTT_AGENT_MS_TO_WAIT_FOR_NOTIFICATION ) );
 
     /* End TLS session, then close TCP connection. */
-    prvSocketDisconnect( &xNetworkContextMqtt );
+    prvSocketDisconnect( pxInstance );
 }
 
 static void prvMQTTAgentTask( void * pParam )
 {
+    MQTTAgentInstance_t * pxInstance = ( MQTTAgentInstance_t * ) pParam;
     BaseType_t xResult;
     MQTTStatus_t xMQTTStatus = MQTTSuccess;
-    BackoffAlgorithmStatus_t xBackoffAlgStatus;
-    BackoffAlgorithmContext_t xReconnectParams = { 0 };
-    uint16_t usNextRetryBackOff = 0U;
-
-    ( void ) pParam;
+    uint32_t ulNextRetryBackOff = 0U;
 
     vWaitUntilNetworkIsUp();
 
     /* Initialize the MQTT context with the buffer and transport interface. */
-    xMQTTStatus = prvMQTTInit();
+    xMQTTStatus = prvMQTTInit( pxInstance );
 
     if( xMQTTStatus != MQTTSuccess )
     {
@@ -648,106 +1736,108 @@ static void prvMQTTAgentTask( void * pParam )
         configASSERT( 0 );
     }
 
-    /* We will use a retry mechanism with an exponential backoff mechanism and
-     * jitter.  That is done to prevent a fleet of IoT devices all trying to
-     * reconnect at exactly the same time should they become disconnected at
-     * the same time. We initialize reconnect attempts and interval here. */
-    BackoffAlgorithm_InitializeParams( &xReconnectParams,
-                                       RETRY_BACKOFF_BASE_MS,
-                                       RETRY_MAX_BACKOFF_DELAY_MS,
-                                       BACKOFF_ALGORITHM_RETRY_FOREVER );
+    /* We will use a retry mechanism with a backoff mechanism and jitter.
+     * That is done to prevent a fleet of IoT devices all trying to reconnect
+     * at exactly the same time should they become disconnected at the same
+     * time. We initialize reconnect attempts and interval here. */
+    ReconnectBackoff_Init( &( pxInstance->xReconnectBackoff ),
+                           RETRY_BACKOFF_BASE_MS,
+                           RETRY_MAX_BACKOFF_DELAY_MS,
+                           RETRY_BACKOFF_STABLE_CONNECTION_MS );
+
+    /* Start with a clean session i.e. direct the MQTT broker to discard any
+     * previous session data. Once connected, prvMQTTConnect() switches to a
+     * persistent session so that reconnects resume the broker-side session
+     * state instead of discarding it. */
+    pxInstance->xConnectInfo.cleanSession = true;
+
+    prvStartReconnectTiming( pxInstance );
 
     while( true )
     {
         /* Connect a TCP socket to the broker. */
-        xResult = prvSocketConnect( &xNetworkContextMqtt );
+        xResult = prvSocketConnect( pxInstance );
 
         if( xResult != pdPASS )
         {
-            xBackoffAlgStatus = BackoffAlgorithm_GetNextBackoff( &xReconnectParams, prvGetRandomNumber(), &usNextRetryBackOff );
+            ulNextRetryBackOff = ReconnectBackoff_NextDelay( &( pxInstance->xReconnectBackoff ), ( uint32_t ) prvGetRandomNumber() );
 
-            if( xBackoffAlgStatus == BackoffAlgorithmSuccess )
-            {
-                #if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
-                    usNextRetryBackOff += 8000U;
-                #endif
-
-                LogWarn( ( "TLS connection to the broker failed. "
-                           "Retrying connection in %hu ms.",
-                           usNextRetryBackOff ) );
-                vTaskDelay( pdMS_TO_TICKS( usNextRetryBackOff ) );
-            }
-            else
-            {
-                LogError( ( "BackoffAlgorithm_GetNextBackoff failed with %d. ",
-                            usNextRetryBackOff ) );
-            }
+            #if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
+                ulNextRetryBackOff += 8000U;
+            #endif
+
+            LogWarn( ( "TLS connection to the broker failed. "
+                       "Retrying connection in %u ms.",
+                       ( unsigned int ) ulNextRetryBackOff ) );
+            pxInstance->xReconnectTiming.ulBackoffMs += ulNextRetryBackOff;
+            vTaskDelay( pdMS_TO_TICKS( ulNextRetryBackOff ) );
 
             continue;
         }
 
-        /* Start with a clean session i.e. direct the MQTT broker to discard any
-         * previous session data. Also, establishing a connection with clean session
-         * will ensure that the broker does not store any data when this client
-         * gets disconnected. */
-        xConnectInfo.cleanSession = true;
-
-        /* Form an MQTT connection without a persistent session. */
-        xMQTTStatus = prvMQTTConnect();
+        /* Form an MQTT connection, resuming the session after the first connect. */
+        xMQTTStatus = prvMQTTConnect( pxInstance );
 
         if( xMQTTStatus != MQTTSuccess )
         {
             /* End TLS session, then close TCP connection. */
-            prvSocketDisconnect( &xNetworkContextMqtt );
+            prvSocketDisconnect( pxInstance );
 
-            xBackoffAlgStatus = BackoffAlgorithm_GetNextBackoff( &xReconnectParams, prvGetRandomNumber(), &usNextRetryBackOff );
+            ulNextRetryBackOff = ReconnectBackoff_NextDelay( &( pxInstance->xReconnectBackoff ), ( uint32_t ) prvGetRandomNumber() );
 
-            if( xBackoffAlgStatus == BackoffAlgorithmSuccess )
-            {
-                #if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
-                    usNextRetryBackOff += 8000U;
-                #endif
-
-                LogWarn( ( "Connection to the MQTT broker failed. "
-                           "Retrying connection in %hu ms.",
-                           usNextRetryBackOff ) );
-                vTaskDelay( pdMS_TO_TICKS( usNextRetryBackOff ) );
-            }
-            else
-            {
-                LogError( ( "BackoffAlgorithm_GetNextBackoff failed with %d. ",
-                            usNextRetryBackOff ) );
-            }
+            #if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
+                ulNextRetryBackOff += 8000U;
+            #endif
+
+            LogWarn( ( "Connection to the MQTT broker failed. "
+                       "Retrying connection in %u ms.",
+                       ( unsigned int ) ulNextRetryBackOff ) );
+            pxInstance->xReconnectTiming.ulBackoffMs += ulNextRetryBackOff;
+            vTaskDelay( pdMS_TO_TICKS( ulNextRetryBackOff ) );
 
             continue;
         }
 
+        ReconnectBackoff_Connected( &( pxInstance->xReconnectBackoff ), prvGetTimeMs() );
+
+        prvEnableReadySignal( pxInstance );
+        prvKeepAliveStart( pxInstance );
+
         /* MQTTAgent_CommandLoop() is effectively the agent implementation.  It
          * will manage the MQTT protocol until such time that an error occurs,
          * which could be a disconnect.  If an error occurs the MQTT context on
          * which the error happened is returned so there can be an attempt to
          * clean up and reconnect however the application writer prefers. */
-        xMQTTStatus = MQTTAgent_CommandLoop( &xGlobalMqttAgentContext );
+        xMQTTStatus = MQTTAgent_CommandLoop( &( pxInstance->xAgentContext ) );
 
-        ( void ) xEventGroupClearBits( xSystemEvents, EVENT_MASK_MQTT_CONNECTED );
+        prvClearEvents( pxInstance, EVENT_MASK_MQTT_CONNECTED );
 
+        ReconnectBackoff_Disconnected( &( pxInstance->xReconnectBackoff ), prvGetTimeMs() );
 
         LogError( ( "MQTTAgent_CommandLoop returned with status: %s.",
                     MQTT_Status_strerror( xMQTTStatus ) ) );
 
-        ( void ) MQTTAgent_CancelAll( &( xGlobalMqttAgentContext ) );
-
         /* Success is returned for application initiated disconnect or termination. The socket will also be disconnected by the caller. */
         if( xMQTTStatus == MQTTSuccess )
         {
+            pxInstance->xKeepAliveStarted = false;
+            ( void ) MQTTAgent_CancelAll( &( pxInstance->xAgentContext ) );
+            ( void ) xTimerStop( pxInstance->xResubscribeTimer, 0U );
             break;
         }
 
+        /* Pending commands and acknowledgements are kept across a broken
+         * connection so that they can be resumed once reconnected. */
+
+        prvKeepAliveConnectionLost( pxInstance );
+
+        prvStartReconnectTiming( pxInstance );
+
         /* End TLS session, then close TCP connection. */
-        prvSocketDisconnect( &xNetworkContextMqtt );
+        prvSocketDisconnect( pxInstance );
     }
 
-    ( void ) xEventGroupClearBits( xSystemEvents, EVENT_MASK_MQTT_INIT | EVENT_MASK_MQTT_CONNECTED );
+    prvClearEvents( pxInstance, EVENT_MASK_MQTT_INIT | EVENT_MASK_MQTT_CONNECTED );
 
     LogError( ( "Terminating MqttAgentTask." ) );
 
@@ -756,17 +1846,526 @@ static void prvMQTTAgentTask( void * pParam )
 
 /*-----------------------------------------------------------*/
 
+MQTTAgentHandle_t xMQTTAgentStart( const MQTTAgentConfig_t * pxConfig )
+{
+    MQTTAgentInstance_t * pxInstance = NULL;
+    BaseType_t xResult;
+
+    configASSERT( pxConfig != NULL );
+    configASSERT( pxConfig->pcClientIdentifier != NULL );
+
+    taskENTER_CRITICAL();
+    {
+        if( uxNumAgentInstances < MQTT_AGENT_MAX_INSTANCES )
+        {
+            pxInstance = &( xAgentInstances[ uxNumAgentInstances ] );
+            uxNumAgentInstances++;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if( pxInstance == NULL )
+    {
+        LogError( ( "Cannot start %s: all %u MQTT agent instances are in use.",
+                    pxConfig->pcTaskName,
+                    ( unsigned int ) MQTT_AGENT_MAX_INSTANCES ) );
+    }
+    else
+    {
+        /* The command structures and the requests are shared by all the
+         * instances. */
+        Agent_InitializePool();
+        AgentRequest_InitPool();
+
+        pxInstance->xConfig = *pxConfig;
+        pxInstance->xEvents = xEventGroupCreateStatic( &( pxInstance->xEventsBuffer ) );
+        configASSERT( pxInstance->xEvents );
+
+        pxInstance->uxInFlightWindow = ( pxConfig->uxInFlightWindow != 0U ) ?
+                                       pxConfig->uxInFlightWindow : MQTT_AGENT_IN_FLIGHT_WINDOW;
+
+        if( pxInstance->uxInFlightWindow > MQTT_STATE_ARRAY_MAX_COUNT )
+        {
+            LogWarn( ( "In-flight window of %u is larger than MQTT_STATE_ARRAY_MAX_COUNT, using %u.",
+                       ( unsigned int ) pxInstance->uxInFlightWindow,
+                       ( unsigned int ) MQTT_STATE_ARRAY_MAX_COUNT ) );
+            pxInstance->uxInFlightWindow = MQTT_STATE_ARRAY_MAX_COUNT;
+        }
+
+        pxInstance->xInFlightWindow = xSemaphoreCreateCountingStatic( pxInstance->uxInFlightWindow,
+                                                                      pxInstance->uxInFlightWindow,
+                                                                      &( pxInstance->xInFlightWindowBuffer ) );
+        configASSERT( pxInstance->xInFlightWindow );
+
+        pxInstance->xSubscriptionMutex = xSemaphoreCreateMutexStatic( &( pxInstance->xSubscriptionMutexBuffer ) );
+        configASSERT( pxInstance->xSubscriptionMutex );
+
+        xResult = xTaskCreate( prvMQTTAgentTask,
+                               pxConfig->pcTaskName,
+                               pxConfig->usStackSize,
+                               ( void * ) pxInstance,
+                               pxConfig->uxPriority,
+                               NULL );
+        configASSERT( xResult == pdPASS );
+    }
+
+    return pxInstance;
+}
+
+/*-----------------------------------------------------------*/
+
 /*
  * @brief Create MQTT agent task.
  */
 void vStartMqttAgentTask( void )
 {
-    xTaskCreate( prvMQTTAgentTask,
-                 "MQTT Agent Task ",
-                 appCONFIG_MQTT_AGENT_TASK_STACK_SIZE,
-                 NULL,
-                 appCONFIG_MQTT_AGENT_TASK_PRIORITY,
-                 NULL );
+    static const MQTTAgentConfig_t xDefaultConfig =
+    {
+        .pcTaskName           = "MQTT Agent Task ",
+        .pcClientIdentifier   = democonfigCLIENT_IDENTIFIER,
+        .usStackSize          = appCONFIG_MQTT_AGENT_TASK_STACK_SIZE,
+        .uxPriority           = appCONFIG_MQTT_AGENT_TASK_PRIORITY,
+        .pcControlTopicFilter = MQTT_AGENT_CONTROL_TOPIC_FILTER
+    };
+
+    configASSERT( uxNumAgentInstances == 0U );
+
+    ( void ) xMQTTAgentStart( &xDefaultConfig );
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTAgentHandle_t xMQTTAgentGetDefault( void )
+{
+    return ( uxNumAgentInstances > 0U ) ? &( xAgentInstances[ 0 ] ) : NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTAgentContext_t * pxMQTTAgentGetContext( MQTTAgentHandle_t xHandle )
+{
+    configASSERT( xHandle != NULL );
+
+    return &( xHandle->xAgentContext );
+}
+
+/*-----------------------------------------------------------*/
+
+SubscriptionList_t * pxMQTTAgentGetSubscriptionList( MQTTAgentHandle_t xHandle )
+{
+    configASSERT( xHandle != NULL );
+
+    return &( xHandle->xSubscriptionList );
+}
+
+/*-----------------------------------------------------------*/
+
+void vMQTTAgentWaitUntilConnected( MQTTAgentHandle_t xHandle )
+{
+    configASSERT( xHandle != NULL );
+
+    /* There is no need to check the return value of this API, since the task
+     * is waiting for a particular bit to be set and is waiting forever. */
+    ( void ) xEventGroupWaitBits( xHandle->xEvents,
+                                  EVENT_MASK_MQTT_INIT | EVENT_MASK_MQTT_CONNECTED,
+                                  pdFALSE,
+                                  pdTRUE,
+                                  portMAX_DELAY );
+}
+
+/*-----------------------------------------------------------*/
+
+bool xMQTTAgentIsConnected( MQTTAgentHandle_t xHandle )
+{
+    configASSERT( xHandle != NULL );
+
+    return( ( xEventGroupGetBits( xHandle->xEvents ) & EVENT_MASK_MQTT_CONNECTED ) != 0U );
+}
+
+/*-----------------------------------------------------------*/
+
+bool xMQTTAgentGetReconnectTiming( MQTTAgentHandle_t xHandle,
+                                   MQTTAgentReconnectTiming_t * pxTiming )
+{
+    configASSERT( xHandle != NULL );
+    configASSERT( pxTiming != NULL );
+
+    taskENTER_CRITICAL();
+    {
+        *pxTiming = xHandle->xLastReconnectTiming;
+    }
+    taskEXIT_CRITICAL();
+
+    return( pxTiming->ulConnectCount > 0U );
+}
+
+/*-----------------------------------------------------------*/
+
+void vMQTTAgentGetKeepAliveStats( MQTTAgentHandle_t xHandle,
+                                  MQTTAgentKeepAliveStats_t * pxStats )
+{
+    configASSERT( xHandle != NULL );
+    configASSERT( pxStats != NULL );
+
+    taskENTER_CRITICAL();
+    {
+        pxStats->ulIntervalSeconds = xHandle->ulKeepAliveIntervalMs / 1000U;
+        pxStats->ulNatTimeoutSeconds = xHandle->ulNatTimeoutMs / 1000U;
+        pxStats->ulLastRttMs = xHandle->ulLastPingRttMs;
+        pxStats->ulPingsSent = xHandle->ulPingsSent;
+        pxStats->ulPingsSuppressed = xHandle->ulPingsSuppressed;
+    }
+    taskEXIT_CRITICAL();
+}
+
+/*-----------------------------------------------------------*/
+
+void vMQTTAgentGetBackoffStats( MQTTAgentHandle_t xHandle,
+                                ReconnectBackoffStats_t * pxStats )
+{
+    configASSERT( xHandle != NULL );
+    configASSERT( pxStats != NULL );
+
+    taskENTER_CRITICAL();
+    {
+        *pxStats = xHandle->xReconnectBackoff.xStats;
+    }
+    taskEXIT_CRITICAL();
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvInFlightCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                        MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    InFlightSlot_t * pxSlot = ( InFlightSlot_t * ) pxCommandContext;
+    MQTTAgentInstance_t * pxInstance = pxSlot->pxInstance;
+    MQTTAgentCommandCallback_t xCallback = pxSlot->xCallback;
+    MQTTAgentCommandContext_t * pxCallbackContext = pxSlot->pxCallbackContext;
+
+    taskENTER_CRITICAL();
+    {
+        pxSlot->xInUse = false;
+    }
+    taskEXIT_CRITICAL();
+
+    ( void ) xSemaphoreGive( pxInstance->xInFlightWindow );
+
+    if( xCallback != NULL )
+    {
+        xCallback( pxCallbackContext, pxReturnInfo );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t xMQTTAgentPublish( MQTTAgentHandle_t xHandle,
+                                MQTTPublishInfo_t * pxPublishInfo,
+                                const MQTTAgentCommandInfo_t * pxCommandInfo,
+                                uint32_t ulAdmissionTimeMs )
+{
+    MQTTStatus_t xStatus = MQTTNoMemory;
+    MQTTAgentCommandInfo_t xWindowCommandInfo;
+    InFlightSlot_t * pxSlot = NULL;
+    UBaseType_t uxIndex;
+
+    configASSERT( xHandle != NULL );
+    configASSERT( pxPublishInfo != NULL );
+    configASSERT( pxCommandInfo != NULL );
+
+    if( pxPublishInfo->qos == MQTTQoS0 )
+    {
+        xStatus = MQTTAgent_Publish( &( xHandle->xAgentContext ), pxPublishInfo, pxCommandInfo );
+    }
+    else if( xSemaphoreTake( xHandle->xInFlightWindow, pdMS_TO_TICKS( ulAdmissionTimeMs ) ) != pdTRUE )
+    {
+        LogDebug( ( "In-flight window of %u publishes is full.",
+                    ( unsigned int ) xHandle->uxInFlightWindow ) );
+    }
+    else
+    {
+        /* Taking the semaphore guarantees that a slot is free. */
+        taskENTER_CRITICAL();
+        {
+            for( uxIndex = 0U; uxIndex < xHandle->uxInFlightWindow; uxIndex++ )
+            {
+                if( xHandle->xInFlightSlots[ uxIndex ].xInUse == false )
+                {
+                    pxSlot = &( xHandle->xInFlightSlots[ uxIndex ] );
+                    pxSlot->xInUse = true;
+                    break;
+                }
+            }
+        }
+        taskEXIT_CRITICAL();
+
+        configASSERT( pxSlot != NULL );
+
+        pxSlot->xCallback = pxCommandInfo->cmdCompleteCallback;
+        pxSlot->pxCallbackContext = pxCommandInfo->pCmdCompleteCallbackContext;
+        pxSlot->pxInstance = xHandle;
+
+        xWindowCommandInfo = *pxCommandInfo;
+        xWindowCommandInfo.cmdCompleteCallback = prvInFlightCommandCallback;
+        xWindowCommandInfo.pCmdCompleteCallbackContext = ( MQTTAgentCommandContext_t * ) pxSlot;
+
+        xStatus = MQTTAgent_Publish( &( xHandle->xAgentContext ), pxPublishInfo, &xWindowCommandInfo );
+
+        if( xStatus != MQTTSuccess )
+        {
+            /* The command was never enqueued, so no completion will arrive. */
+            taskENTER_CRITICAL();
+            {
+                pxSlot->xInUse = false;
+            }
+            taskEXIT_CRITICAL();
+
+            ( void ) xSemaphoreGive( xHandle->xInFlightWindow );
+        }
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+UBaseType_t uxMQTTAgentGetInFlightCount( MQTTAgentHandle_t xHandle )
+{
+    configASSERT( xHandle != NULL );
+
+    return xHandle->uxInFlightWindow - uxSemaphoreGetCount( xHandle->xInFlightWindow );
+}
+
+/*-----------------------------------------------------------*/
+
+UBaseType_t uxMQTTAgentGetQueueDepth( MQTTAgentHandle_t xHandle )
+{
+    configASSERT( xHandle != NULL );
+
+    return ( UBaseType_t ) Agent_MessageGetDepth( &( xHandle->xCommandQueue ) );
+}
+
+/*-----------------------------------------------------------*/
+
+bool xMQTTAgentIsWindowFull( MQTTAgentHandle_t xHandle )
+{
+    configASSERT( xHandle != NULL );
+
+    return( uxSemaphoreGetCount( xHandle->xInFlightWindow ) == 0U );
+}
+
+/*-----------------------------------------------------------*/
+
+static MQTTStatus_t prvSendSubscriptionCommand( MQTTAgentInstance_t * pxInstance,
+                                                const char * pcTopicFilter,
+                                                uint16_t usTopicFilterLength,
+                                                MQTTQoS_t xQoS,
+                                                bool xSubscribe,
+                                                uint32_t ulBlockTimeMs,
+                                                bool * pxInFlight )
+{
+    MQTTStatus_t xStatus = MQTTNoMemory;
+    AgentRequest_t * pxRequest = NULL;
+    UBaseType_t uxIndex;
+
+    *pxInFlight = false;
+
+    for( uxIndex = 0U; uxIndex < MQTT_AGENT_SUBSCRIPTION_REQUESTS; uxIndex++ )
+    {
+        if( AgentRequest_IsInFlight( &( pxInstance->xSubscriptionRequests[ uxIndex ] ) ) == false )
+        {
+            pxRequest = &( pxInstance->xSubscriptionRequests[ uxIndex ] );
+            break;
+        }
+    }
+
+    if( pxRequest == NULL )
+    {
+        LogError( ( "All %u subscription requests are still waiting for the broker.",
+                    ( unsigned int ) MQTT_AGENT_SUBSCRIPTION_REQUESTS ) );
+    }
+    else
+    {
+        AgentRequest_Init( pxRequest );
+        AgentRequest_SetSubscribe( pxRequest, xQoS, pcTopicFilter, usTopicFilterLength );
+
+        if( xSubscribe == true )
+        {
+            xStatus = AgentRequest_Subscribe( pxInstance, pxRequest, ulBlockTimeMs );
+        }
+        else
+        {
+            xStatus = AgentRequest_Unsubscribe( pxInstance, pxRequest, ulBlockTimeMs );
+        }
+
+        /* The command completes with the acknowledgement, or fails once the
+         * connection is lost and the session cannot be resumed. */
+        if( xStatus == MQTTSuccess )
+        {
+            xStatus = AgentRequest_Wait( pxRequest, ulBlockTimeMs );
+            *pxInFlight = AgentRequest_IsInFlight( pxRequest );
+        }
+
+        AgentRequest_Release( pxRequest );
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t xMQTTAgentSubscribe( MQTTAgentHandle_t xHandle,
+                                  const char * pcTopicFilter,
+                                  uint16_t usTopicFilterLength,
+                                  MQTTQoS_t xQoS,
+                                  IncomingPubCallback_t pxCallback,
+                                  void * pvCallbackContext,
+                                  uint32_t ulBlockTimeMs )
+{
+    MQTTStatus_t xStatus = MQTTNoMemory;
+    SubscriptionReferences_t xReferences;
+    bool xInFlight = false;
+
+    configASSERT( xHandle != NULL );
+
+    if( xSemaphoreTake( xHandle->xSubscriptionMutex, pdMS_TO_TICKS( ulBlockTimeMs ) ) != pdTRUE )
+    {
+        LogError( ( "Timed out waiting for another subscription update to subscribe to topic filter %.*s.",
+                    ( int ) usTopicFilterLength,
+                    pcTopicFilter ) );
+        xStatus = MQTTSendFailed;
+    }
+    else
+    {
+        if( addSubscriptionReference( &( xHandle->xSubscriptionList ),
+                                      pcTopicFilter,
+                                      usTopicFilterLength,
+                                      xQoS,
+                                      pxCallback,
+                                      pvCallbackContext,
+                                      &xReferences ) == false )
+        {
+            /* The subscription list is full. */
+        }
+        else if( ( xReferences.usCount == 0U ) || ( xQoS > xReferences.xMaxQoS ) )
+        {
+            /* First subscription to the topic filter, or one that needs a
+             * higher QoS than the broker was subscribed with. */
+            xStatus = prvSendSubscriptionCommand( xHandle,
+                                                  pcTopicFilter,
+                                                  usTopicFilterLength,
+                                                  xQoS,
+                                                  true,
+                                                  ulBlockTimeMs,
+                                                  &xInFlight );
+
+            if( xStatus != MQTTSuccess )
+            {
+                LogError( ( "Failed to subscribe to topic filter %.*s. xStatus=%s.",
+                            ( int ) usTopicFilterLength,
+                            pcTopicFilter,
+                            MQTT_Status_strerror( xStatus ) ) );
+
+                ( void ) removeSubscriptionReference( &( xHandle->xSubscriptionList ),
+                                                      pcTopicFilter,
+                                                      usTopicFilterLength,
+                                                      pxCallback,
+                                                      pvCallbackContext,
+                                                      &xReferences );
+
+                /* The SUBSCRIBE may still be accepted once it is sent. Queue
+                 * an UNSUBSCRIBE behind it so that the broker does not keep a
+                 * subscription no callback uses. */
+                if( ( xInFlight == true ) && ( xReferences.usCount == 0U ) )
+                {
+                    ( void ) prvSendSubscriptionCommand( xHandle,
+                                                         pcTopicFilter,
+                                                         usTopicFilterLength,
+                                                         MQTTQoS0,
+                                                         false,
+                                                         0U,
+                                                         &xInFlight );
+                }
+            }
+        }
+        else
+        {
+            LogDebug( ( "Topic filter %.*s is already subscribed to, %u local subscriptions.",
+                        ( int ) usTopicFilterLength,
+                        pcTopicFilter,
+                        ( unsigned int ) xReferences.usCount + 1U ) );
+            xStatus = MQTTSuccess;
+        }
+
+        ( void ) xSemaphoreGive( xHandle->xSubscriptionMutex );
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t xMQTTAgentUnsubscribe( MQTTAgentHandle_t xHandle,
+                                    const char * pcTopicFilter,
+                                    uint16_t usTopicFilterLength,
+                                    IncomingPubCallback_t pxCallback,
+                                    void * pvCallbackContext,
+                                    uint32_t ulBlockTimeMs )
+{
+    MQTTStatus_t xStatus = MQTTBadParameter;
+    SubscriptionReferences_t xReferences;
+    bool xInFlight = false;
+
+    configASSERT( xHandle != NULL );
+
+    if( xSemaphoreTake( xHandle->xSubscriptionMutex, pdMS_TO_TICKS( ulBlockTimeMs ) ) != pdTRUE )
+    {
+        LogError( ( "Timed out waiting for another subscription update to unsubscribe from topic filter %.*s.",
+                    ( int ) usTopicFilterLength,
+                    pcTopicFilter ) );
+        xStatus = MQTTSendFailed;
+    }
+    else
+    {
+        if( removeSubscriptionReference( &( xHandle->xSubscriptionList ),
+                                         pcTopicFilter,
+                                         usTopicFilterLength,
+                                         pxCallback,
+                                         pvCallbackContext,
+                                         &xReferences ) == false )
+        {
+            LogWarn( ( "No subscription to topic filter %.*s to remove.",
+                       ( int ) usTopicFilterLength,
+                       pcTopicFilter ) );
+        }
+        else if( xReferences.usCount == 0U )
+        {
+            /* The last local subscription is gone. */
+            xStatus = prvSendSubscriptionCommand( xHandle,
+                                                  pcTopicFilter,
+                                                  usTopicFilterLength,
+                                                  MQTTQoS0,
+                                                  false,
+                                                  ulBlockTimeMs,
+                                                  &xInFlight );
+
+            if( xStatus != MQTTSuccess )
+            {
+                LogWarn( ( "Failed to unsubscribe from topic filter %.*s. xStatus=%s.",
+                           ( int ) usTopicFilterLength,
+                           pcTopicFilter,
+                           MQTT_Status_strerror( xStatus ) ) );
+            }
+        }
+        else
+        {
+            xStatus = MQTTSuccess;
+        }
+
+        ( void ) xSemaphoreGive( xHandle->xSubscriptionMutex );
+    }
+
+    return xStatus;
 }
 
 /*-----------------------------------------------------------*/
@@ -37,6 +37,12 @@
 #include "core_mqtt_config.h"
 #include "core_mqtt_agent.h"
 
+/* Subscription manager header include. */
+#include "subscription_manager.h"
+
+/* Reconnect backoff header include. */
+#include "reconnect_backoff.h"
+
 /**
  * @brief Defines the structure to use as the command callback context in this
  * demo.
@@ -48,9 +54,276 @@ struct MQTTAgentCommandContext
     void * pArgs;
 };
 
+/**
+ * @brief Handle to an MQTT agent instance. Each instance owns its connection,
+ * network buffer, command queue, subscription list and task.
+ */
+typedef struct MQTTAgentInstance * MQTTAgentHandle_t;
+
+/**
+ * @brief Parameters of an MQTT agent instance.
+ *
+ * @note Every instance connects with its own client identifier, as the broker
+ * drops an existing connection when a client with the same identifier connects.
+ */
+typedef struct MQTTAgentConfig
+{
+    const char * pcTaskName;
+    const char * pcClientIdentifier;
+    configSTACK_DEPTH_TYPE usStackSize;
+    UBaseType_t uxPriority;
+
+    /* Publishes to topics matching this filter overtake the publishes already
+     * queued to the agent, like its other commands do. May be NULL. */
+    const char * pcControlTopicFilter;
+
+    /* Maximum number of QoS1 and QoS2 publishes sent with xMQTTAgentPublish()
+     * that may wait for their acknowledgement at the same time. 0 for
+     * MQTT_AGENT_IN_FLIGHT_WINDOW. */
+    UBaseType_t uxInFlightWindow;
+} MQTTAgentConfig_t;
+
+/**
+ * @brief Time spent in each phase of a (re)connect, in milliseconds. The
+ * transport phases are the ones of the attempt that succeeded.
+ */
+typedef struct MQTTAgentReconnectTiming
+{
+    uint32_t ulConnectCount;   /**< Number of this connect since the agent started. */
+    uint32_t ulAttempts;       /**< TLS connection attempts made for this connect. */
+    uint32_t ulBackoffMs;      /**< Time spent waiting between attempts. */
+    uint32_t ulDnsMs;          /**< Host name resolution. */
+    uint32_t ulTcpConnectMs;   /**< TCP connection. */
+    uint32_t ulTlsInitMs;      /**< TLS_Init(), including credential loading. */
+    uint32_t ulTlsHandshakeMs; /**< TLS handshake. */
+    uint32_t ulConnackMs;      /**< CONNECT sent until CONNACK received. */
+    uint32_t ulResubscribeMs;  /**< Resubscribe queued until all SUBACKs received, 0 if not needed. */
+    uint32_t ulTotalMs;        /**< Connection lost, or agent started, until fully reconnected. */
+    bool xSessionPresent;
+} MQTTAgentReconnectTiming_t;
+
+/**
+ * @brief State of the adaptive keep-alive of an instance.
+ */
+typedef struct MQTTAgentKeepAliveStats
+{
+    uint32_t ulIntervalSeconds;   /**< Receive idle time after which a PINGREQ is sent. */
+    uint32_t ulNatTimeoutSeconds; /**< Idle time after which the connection is repeatedly lost, 0 if not learned. */
+    uint32_t ulLastRttMs;         /**< Round trip time of the last PINGREQ. */
+    uint32_t ulPingsSent;         /**< PINGREQs sent by the adaptive keep-alive. */
+    uint32_t ulPingsSuppressed;   /**< PINGREQs a fixed schedule would have sent, made unnecessary by incoming traffic. */
+} MQTTAgentKeepAliveStats_t;
+
 void vWaitUntilMQTTAgentReady( void );
 void vWaitUntilMQTTAgentConnected( void );
 bool xIsMqttAgentConnected( void );
+
+/**
+ * @brief Create the default MQTT agent instance, which reports its state
+ * through the system events.
+ */
 void vStartMqttAgentTask( void );
 
+/**
+ * @brief Create an MQTT agent instance and its task.
+ *
+ * @param[in] pxConfig Parameters of the instance. The strings must stay in
+ * scope for the lifetime of the instance.
+ *
+ * @return Handle to the instance, or NULL if MQTT_AGENT_MAX_INSTANCES
+ * instances already exist.
+ */
+MQTTAgentHandle_t xMQTTAgentStart( const MQTTAgentConfig_t * pxConfig );
+
+/**
+ * @brief Get the default MQTT agent instance.
+ *
+ * @return Handle to the default instance, or NULL if it was not started.
+ */
+MQTTAgentHandle_t xMQTTAgentGetDefault( void );
+
+/**
+ * @brief Get the agent context to pass to the MQTTAgent_* APIs.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ *
+ * @return The agent context of the instance.
+ */
+MQTTAgentContext_t * pxMQTTAgentGetContext( MQTTAgentHandle_t xHandle );
+
+/**
+ * @brief Get the subscription list incoming publishes of an instance are
+ * dispatched from.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ *
+ * @return The subscription list of the instance.
+ */
+SubscriptionList_t * pxMQTTAgentGetSubscriptionList( MQTTAgentHandle_t xHandle );
+
+/**
+ * @brief Wait until an MQTT agent instance is connected to the broker.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ */
+void vMQTTAgentWaitUntilConnected( MQTTAgentHandle_t xHandle );
+
+/**
+ * @brief Check whether an MQTT agent instance is connected to the broker.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ *
+ * @return `true` if the instance is connected.
+ */
+bool xMQTTAgentIsConnected( MQTTAgentHandle_t xHandle );
+
+/**
+ * @brief Get the timing of the last completed (re)connect of an instance.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[out] pxTiming The timing record.
+ *
+ * @return `false` if the instance has not connected yet.
+ */
+bool xMQTTAgentGetReconnectTiming( MQTTAgentHandle_t xHandle,
+                                   MQTTAgentReconnectTiming_t * pxTiming );
+
+/**
+ * @brief Get the state of the adaptive keep-alive of an instance.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[out] pxStats The keep-alive state.
+ */
+void vMQTTAgentGetKeepAliveStats( MQTTAgentHandle_t xHandle,
+                                  MQTTAgentKeepAliveStats_t * pxStats );
+
+/**
+ * @brief Get the counters of the reconnect backoff of an instance.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[out] pxStats The counters.
+ */
+void vMQTTAgentGetBackoffStats( MQTTAgentHandle_t xHandle,
+                                ReconnectBackoffStats_t * pxStats );
+
+/**
+ * @brief Publish through an MQTT agent instance, waiting for room in its
+ * in-flight window first.
+ *
+ * QoS1 and QoS2 publishes take a slot of the window of the instance, which is
+ * given back when the publish completes. When the window is full the caller
+ * blocks for up to ulAdmissionTimeMs, so that a burst of publishes queues up
+ * in the producers instead of failing inside the agent once coreMQTT runs out
+ * of room to track outstanding acknowledgements. QoS0 publishes are passed
+ * straight to MQTTAgent_Publish().
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[in] pxPublishInfo The publish. Must stay in scope until the publish
+ * completes, as for MQTTAgent_Publish().
+ * @param[in] pxCommandInfo The command parameters, as for MQTTAgent_Publish().
+ * @param[in] ulAdmissionTimeMs Time to wait for room in the window.
+ *
+ * @return `MQTTNoMemory` if the window stayed full for ulAdmissionTimeMs,
+ * otherwise the result of MQTTAgent_Publish().
+ */
+MQTTStatus_t xMQTTAgentPublish( MQTTAgentHandle_t xHandle,
+                                MQTTPublishInfo_t * pxPublishInfo,
+                                const MQTTAgentCommandInfo_t * pxCommandInfo,
+                                uint32_t ulAdmissionTimeMs );
+
+/**
+ * @brief Get the number of publishes sent with xMQTTAgentPublish() that have
+ * not completed yet.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ *
+ * @return The number of publishes in the in-flight window.
+ */
+UBaseType_t uxMQTTAgentGetInFlightCount( MQTTAgentHandle_t xHandle );
+
+/**
+ * @brief Get the number of commands queued to an instance and not yet
+ * received by its agent task, over both lanes.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ *
+ * @return The number of queued commands.
+ */
+UBaseType_t uxMQTTAgentGetQueueDepth( MQTTAgentHandle_t xHandle );
+
+/**
+ * @brief Check whether the in-flight window of an instance is full, i.e.
+ * whether xMQTTAgentPublish() would block.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ *
+ * @return `true` if no QoS1 or QoS2 publish can be admitted right now.
+ */
+bool xMQTTAgentIsWindowFull( MQTTAgentHandle_t xHandle );
+
+/**
+ * @brief Subscribe a callback to a topic filter, subscribing with the broker
+ * only when needed.
+ *
+ * The callback is added to the subscription list of the instance. A SUBSCRIBE
+ * is sent, and waited for, only if no other local subscription uses the same
+ * topic filter, or if they all use a lower QoS. Otherwise the call returns
+ * straight away.
+ *
+ * @note If the SUBACK does not arrive in time, e.g. because the connection is
+ * down, the callback is not subscribed and an UNSUBSCRIBE is queued behind the
+ * SUBSCRIBE, as the broker may still accept it later. pcTopicFilter must stay
+ * valid until both commands complete.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[in] pcTopicFilter The topic filter.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] xQoS QoS of the subscription.
+ * @param[in] pxCallback Callback called with the incoming publishes.
+ * @param[in] pvCallbackContext Context of the callback.
+ * @param[in] ulBlockTimeMs Time to wait for another subscribe or unsubscribe
+ * of the instance to finish, for room in the command queue, and for the
+ * SUBACK, each.
+ *
+ * @return `MQTTSuccess` if the callback is subscribed, `MQTTNoMemory` if the
+ * subscription list is full, `MQTTSendFailed` if a wait timed out, otherwise
+ * the result of the SUBSCRIBE. The callback is not subscribed if the SUBSCRIBE
+ * failed.
+ */
+MQTTStatus_t xMQTTAgentSubscribe( MQTTAgentHandle_t xHandle,
+                                  const char * pcTopicFilter,
+                                  uint16_t usTopicFilterLength,
+                                  MQTTQoS_t xQoS,
+                                  IncomingPubCallback_t pxCallback,
+                                  void * pvCallbackContext,
+                                  uint32_t ulBlockTimeMs );
+
+/**
+ * @brief Remove a callback subscribed with xMQTTAgentSubscribe(), and
+ * unsubscribe from the broker if it was the last local subscription to the
+ * topic filter.
+ *
+ * @param[in] xHandle The MQTT agent instance.
+ * @param[in] pcTopicFilter The topic filter.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] pxCallback Callback the topic filter was subscribed with.
+ * @param[in] pvCallbackContext Context the topic filter was subscribed with.
+ * @param[in] ulBlockTimeMs Time to wait for another subscribe or unsubscribe
+ * of the instance to finish, for room in the command queue, and for the
+ * UNSUBACK, each.
+ *
+ * @return `MQTTBadParameter` if the callback was not subscribed to the topic
+ * filter, `MQTTSendFailed` if another subscribe or unsubscribe did not finish
+ * in time, otherwise `MQTTSuccess` or the result of the UNSUBSCRIBE. The
+ * callback is removed unless another subscribe or unsubscribe did not finish
+ * in time. pcTopicFilter must stay valid until the UNSUBSCRIBE completes, even
+ * if it did not complete in time.
+ */
+MQTTStatus_t xMQTTAgentUnsubscribe( MQTTAgentHandle_t xHandle,
+                                    const char * pcTopicFilter,
+                                    uint16_t usTopicFilterLength,
+                                    IncomingPubCallback_t pxCallback,
+                                    void * pvCallbackContext,
+                                    uint32_t ulBlockTimeMs );
+
 #endif /* MQTT_AGENT_H */
@@ -0,0 +1,89 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file object_pool.c
+ * @brief Implements the pool of statically allocated objects.
+ */
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+
+/* Header include. */
+#include "object_pool.h"
+
+/*-----------------------------------------------------------*/
+
+void ObjectPool_Init( ObjectPool_t * pxPool,
+                      void * pvObjects,
+                      size_t xObjectSize,
+                      UBaseType_t uxCount,
+                      uint8_t * pucStorage )
+{
+    void * pvObject;
+    UBaseType_t uxIndex;
+
+    configASSERT( pxPool != NULL );
+    configASSERT( pvObjects != NULL );
+    configASSERT( pucStorage != NULL );
+
+    /* The first users of the pool may start at the same time. */
+    vTaskSuspendAll();
+
+    if( pxPool->xFree == NULL )
+    {
+        pxPool->pucObjects = ( uint8_t * ) pvObjects;
+        pxPool->xObjectSize = xObjectSize;
+        pxPool->uxCount = uxCount;
+        pxPool->xFree = xQueueCreateStatic( uxCount,
+                                            sizeof( void * ),
+                                            pucStorage,
+                                            &( pxPool->xFreeBuffer ) );
+        configASSERT( pxPool->xFree != NULL );
+
+        for( uxIndex = 0U; uxIndex < uxCount; uxIndex++ )
+        {
+            pvObject = &( pxPool->pucObjects[ uxIndex * xObjectSize ] );
+            ( void ) xQueueSend( pxPool->xFree, &pvObject, 0U );
+        }
+    }
+
+    ( void ) xTaskResumeAll();
+}
+
+/*-----------------------------------------------------------*/
+
+void * ObjectPool_Take( ObjectPool_t * pxPool,
+                        TickType_t xTicksToWait )
+{
+    void * pvObject = NULL;
+
+    configASSERT( pxPool->xFree != NULL );
+
+    if( xQueueReceive( pxPool->xFree, &pvObject, xTicksToWait ) != pdTRUE )
+    {
+        pvObject = NULL;
+    }
+
+    return pvObject;
+}
+
+/*-----------------------------------------------------------*/
+
+void ObjectPool_Give( ObjectPool_t * pxPool,
+                      void * pvObject )
+{
+    BaseType_t xReturned;
+
+    configASSERT( ( ( uint8_t * ) pvObject >= pxPool->pucObjects ) &&
+                  ( ( uint8_t * ) pvObject < &( pxPool->pucObjects[ pxPool->uxCount * pxPool->xObjectSize ] ) ) );
+
+    /* Cannot fail, the queue holds every object of the pool. */
+    xReturned = xQueueSend( pxPool->xFree, &pvObject, 0U );
+    configASSERT( xReturned == pdTRUE );
+    ( void ) xReturned;
+}
@@ -0,0 +1,79 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file object_pool.h
+ * @brief Fixed pool of statically allocated objects shared by several tasks.
+ *
+ * The free objects are kept as pointers in a queue, so that a task can wait
+ * for one to be given back. The pool is created by ObjectPool_Init(), either
+ * at startup or on first use by any task.
+ */
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "queue.h"
+
+/**
+ * @brief Size of the queue storage of a pool of uxCount objects.
+ */
+#define OBJECT_POOL_STORAGE_SIZE( uxCount )    ( ( uxCount ) * sizeof( void * ) )
+
+/**
+ * @brief A pool. Must be zero initialized, e.g. static, before
+ * ObjectPool_Init() is first called.
+ */
+typedef struct ObjectPool
+{
+    QueueHandle_t xFree;
+    StaticQueue_t xFreeBuffer;
+    uint8_t * pucObjects;
+    size_t xObjectSize;
+    UBaseType_t uxCount;
+} ObjectPool_t;
+
+/**
+ * @brief Create the pool and fill it with every object, unless it already
+ * exists. Safe to call from several tasks at once.
+ *
+ * @param[in] pxPool The pool.
+ * @param[in] pvObjects Array of uxCount objects of xObjectSize bytes.
+ * @param[in] xObjectSize Size of an object.
+ * @param[in] uxCount Number of objects.
+ * @param[in] pucStorage Queue storage of OBJECT_POOL_STORAGE_SIZE( uxCount )
+ * bytes.
+ */
+void ObjectPool_Init( ObjectPool_t * pxPool,
+                      void * pvObjects,
+                      size_t xObjectSize,
+                      UBaseType_t uxCount,
+                      uint8_t * pucStorage );
+
+/**
+ * @brief Take a free object.
+ *
+ * @param[in] pxPool The pool.
+ * @param[in] xTicksToWait Time to wait for an object to be given back.
+ *
+ * @return The object, or NULL if none was free in time.
+ */
+void * ObjectPool_Take( ObjectPool_t * pxPool,
+                        TickType_t xTicksToWait );
+
+/**
+ * @brief Give an object back to the pool.
+ *
+ * @param[in] pxPool The pool.
+ * @param[in] pvObject An object taken with ObjectPool_Take().
+ */
+void ObjectPool_Give( ObjectPool_t * pxPool,
+                      void * pvObject );
+
+#endif /* OBJECT_POOL_H */
@@ -35,6 +35,7 @@
 #include "app_config.h"
 
 #include "mqtt_agent_task.h"
+#include "agent_request.h"
 
 /* includes for TFM */
 #include "psa/update.h"
@@ -97,6 +98,33 @@
  */
 #define otaexampleMQTT_TIMEOUT_MS                        ( 5000U )
 
+/**
+ * @brief Number of OTA publishes that can wait for their acknowledgment at
+ * once, including those the OTA library already stopped waiting for.
+ */
+#define otaexampleMAX_PUBLISHES                          ( 4U )
+
+/**
+ * @brief The maximum size of the topic of an OTA publish.
+ */
+#define otaexampleMAX_PUBLISH_TOPIC_SIZE                 ( 256U )
+
+/**
+ * @brief The maximum size of the payload of an OTA publish. It must hold the
+ * largest job status update and stream data request of the OTA library.
+ */
+#define otaexampleMAX_PUBLISH_PAYLOAD_SIZE               ( 512U )
+
+/**
+ * @brief Client identifier of the dedicated OTA MQTT connection, used when
+ * appCONFIG_OTA_SEPARATE_MQTT_CONNECTION is set. It must differ from the one of
+ * the default connection, as the broker only allows one connection per client
+ * identifier.
+ */
+#ifndef otaexampleMQTT_CLIENT_IDENTIFIER
+    #define otaexampleMQTT_CLIENT_IDENTIFIER    democonfigCLIENT_IDENTIFIER "-ota"
+#endif
+
 /**
  * @brief The common prefix for all OTA topics.
  *
@@ -162,11 +190,6 @@
  */
 #define OTA_DEFAULT_TOPIC_FILTER_LENGTH          ( ( uint16_t ) ( sizeof( OTA_DEFAULT_TOPIC_FILTER ) - 1 ) )
 
-/**
- * @brief Used to clear bits in a task's notification value.
- */
-#define otaexampleMAX_UINT32                     ( 0xffffffff )
-
 /**
  * @brief Stack size required for OTA agent task.
  */
@@ -199,6 +222,18 @@ typedef struct OtaTopicFilterCallback
     IncomingPubCallback_t callback;
 } OtaTopicFilterCallback_t;
 
+/**
+ * @brief A publish of the OTA library, with its own copy of the topic and
+ * payload. The copies stay valid until the broker acknowledges the publish or
+ * the agent cancels it, also when the publish is resent on a resumed session.
+ */
+typedef struct OtaPublish
+{
+    AgentRequest_t xRequest;
+    char cTopic[ otaexampleMAX_PUBLISH_TOPIC_SIZE ];
+    char cPayload[ otaexampleMAX_PUBLISH_PAYLOAD_SIZE ];
+} OtaPublish_t;
+
 /*---------------------------------------------------------*/
 
 /**
@@ -245,13 +280,19 @@ static OtaEventData_t eventBuffer[ otaconfigMAX_NUM_OTA_DATA_BUFFERS ] = { 0 };
  */
 static SemaphoreHandle_t xBufferSemaphore;
 
+/**
+ * @brief The publishes of the OTA library. Only the OTA agent task publishes,
+ * so a publish is reused once its request is no longer in flight.
+ */
+static OtaPublish_t xOtaPublishes[ otaexampleMAX_PUBLISHES ];
+
 /*---------------------------------------------------------*/
 
 /**
- * @brief The MQTT agent manages the MQTT contexts.  This set the handle to the
- * context used by this demo.
+ * @brief The MQTT agent instance used by OTA. Either the default instance, or
+ * a dedicated one when appCONFIG_OTA_SEPARATE_MQTT_CONNECTION is set.
  */
-extern MQTTAgentContext_t xGlobalMqttAgentContext;
+static MQTTAgentHandle_t xOtaMqttAgent = NULL;
 
 /*---------------------------------------------------------*/
 
@@ -351,10 +392,12 @@ static void prvMqttDefaultCallback( void * pvIncomingPublishCallbackContext,
  *
  * @param[in] pTopicFilter The topic filter for which a  callback needs to be registered for.
  * @param[in] topicFilterLength length of the topic filter.
+ * @param[in] xQoS QoS the topic filter was subscribed with.
  *
  */
 static void prvRegisterOTACallback( const char * pTopicFilter,
-                                    uint16_t topicFilterLength );
+                                    uint16_t topicFilterLength,
+                                    MQTTQoS_t xQoS );
 
 /**
  * @brief Suspend OTA demo.
@@ -647,7 +690,8 @@ static void prvMqttDataCallback( void * pvIncomingPublishCallbackContext,
 /*-----------------------------------------------------------*/
 
 static void prvRegisterOTACallback( const char * pTopicFilter,
-                                    uint16_t topicFilterLength )
+                                    uint16_t topicFilterLength,
+                                    MQTTQoS_t xQoS )
 {
     bool isMatch = false;
     MQTTStatus_t mqttStatus = MQTTSuccess;
@@ -673,8 +717,10 @@ static void prvRegisterOTACallback( const char * pTopicFilter,
         if( isMatch )
         {
             /* Add subscription so that incoming publishes are routed to the application callback. */
-            subscriptionAdded = addSubscription( pTopicFilter,
+            subscriptionAdded = addSubscription( pxMQTTAgentGetSubscriptionList( xOtaMqttAgent ),
+                                                 pTopicFilter,
                                                  topicFilterLength,
+                                                 xQoS,
                                                  otaTopicFilterCallbacks[ index ].callback,
                                                  NULL );
 
@@ -688,93 +734,43 @@ static void prvRegisterOTACallback( const char * pTopicFilter,
     }
 }
 
-static void prvMQTTSubscribeCompleteCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                              MQTTAgentReturnInfo_t * pxReturnInfo )
-{
-    if( pxReturnInfo->returnCode == MQTTSuccess )
-    {
-        MQTTAgentSubscribeArgs_t * pSubscribeArgs = ( MQTTAgentSubscribeArgs_t * ) ( pxCommandContext->pArgs );
-        prvRegisterOTACallback( pSubscribeArgs->pSubscribeInfo->pTopicFilter, pSubscribeArgs->pSubscribeInfo->topicFilterLength );
-    }
-
-    /* Store the result in the application defined context so the task that
-     * initiated the publish can check the operation's status. */
-    pxCommandContext->xReturnStatus = pxReturnInfo->returnCode;
-
-    if( pxCommandContext->xTaskToNotify != NULL )
-    {
-        /* Send the context's ulNotificationValue as the notification value so
-         * the receiving task can check the value it set in the context matches
-         * the value it receives in the notification. */
-        xTaskNotify( pxCommandContext->xTaskToNotify, ( uint32_t ) ( pxReturnInfo->returnCode ), eSetValueWithOverwrite );
-    }
-}
-
-static void prvMQTTUnsubscribeCompleteCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                                MQTTAgentReturnInfo_t * pxReturnInfo )
-{
-    /* Store the result in the application defined context so the task that
-     * initiated the publish can check the operation's status. */
-    pxCommandContext->xReturnStatus = pxReturnInfo->returnCode;
-
-    if( pxCommandContext->xTaskToNotify != NULL )
-    {
-        /* Send the context's ulNotificationValue as the notification value so
-         * the receiving task can check the value it set in the context matches
-         * the value it receives in the notification. */
-        xTaskNotify( pxCommandContext->xTaskToNotify, ( uint32_t ) ( pxReturnInfo->returnCode ), eSetValueWithOverwrite );
-    }
-}
-
 static OtaMqttStatus_t prvMQTTSubscribe( const char * pTopicFilter,
                                          uint16_t topicFilterLength,
                                          uint8_t ucQoS )
 {
-    MQTTStatus_t mqttStatus;
-    uint32_t ulNotifiedValue;
-    static MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
-    static MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
-    BaseType_t result;
-    static MQTTAgentCommandInfo_t xCommandParams = { 0 };
-    static MQTTAgentCommandContext_t xApplicationDefinedContext = { 0 };
+    MQTTStatus_t mqttStatus = MQTTBadParameter;
+    bool isMatch = false;
+    uint16_t index = 0U;
+    uint16_t numTopicFilters = sizeof( otaTopicFilterCallbacks ) / sizeof( OtaTopicFilterCallback_t );
     OtaMqttStatus_t otaRet = OtaMqttSuccess;
 
     configASSERT( pTopicFilter != NULL );
     configASSERT( topicFilterLength > 0 );
 
-    xSubscribeInfo.pTopicFilter = pTopicFilter;
-    xSubscribeInfo.topicFilterLength = topicFilterLength;
-    xSubscribeInfo.qos = ucQoS;
-    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
-    xSubscribeArgs.numSubscriptions = 1;
-
-    xApplicationDefinedContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
-    xApplicationDefinedContext.pArgs = &xSubscribeArgs;
-    xApplicationDefinedContext.xReturnStatus = MQTTSendFailed;
-
-    xCommandParams.blockTimeMs = otaexampleMQTT_TIMEOUT_MS;
-    xCommandParams.cmdCompleteCallback = prvMQTTSubscribeCompleteCallback;
-    xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xApplicationDefinedContext;
-
-    xTaskNotifyStateClear( NULL );
-
-    mqttStatus = MQTTAgent_Subscribe( &xGlobalMqttAgentContext,
-                                      &xSubscribeArgs,
-                                      &xCommandParams );
-
-    /* Wait for command to complete so MQTTSubscribeInfo_t remains in scope for the
-     * duration of the command. */
-    if( mqttStatus == MQTTSuccess )
+    /* Subscribe the OTA callbacks whose pattern matches the topic filter. The
+     * agent only sends a SUBSCRIBE for the first of them. */
+    for( ; index < numTopicFilters; index++ )
     {
-        result = xTaskNotifyWait( 0, otaexampleMAX_UINT32, &ulNotifiedValue, pdMS_TO_TICKS( otaexampleMQTT_TIMEOUT_MS ) );
+        ( void ) MQTT_MatchTopic( pTopicFilter,
+                                  topicFilterLength,
+                                  otaTopicFilterCallbacks[ index ].pTopicFilter,
+                                  otaTopicFilterCallbacks[ index ].topicFilterLength,
+                                  &isMatch );
 
-        if( result == pdTRUE )
-        {
-            mqttStatus = xApplicationDefinedContext.xReturnStatus;
-        }
-        else
+        if( isMatch )
         {
-            mqttStatus = MQTTRecvFailed;
+            mqttStatus = xMQTTAgentSubscribe( xOtaMqttAgent,
+                                              pTopicFilter,
+                                              topicFilterLength,
+                                              ( MQTTQoS_t ) ucQoS,
+                                              otaTopicFilterCallbacks[ index ].callback,
+                                              NULL,
+                                              otaexampleMQTT_TIMEOUT_MS );
+
+            if( mqttStatus != MQTTSuccess )
+            {
+                break;
+            }
         }
     }
 
@@ -795,61 +791,62 @@ static OtaMqttStatus_t prvMQTTSubscribe( const char * pTopicFilter,
     return otaRet;
 }
 
-static void prvOTAPublishCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                          MQTTAgentReturnInfo_t * pxReturnInfo )
-{
-    pxCommandContext->xReturnStatus = pxReturnInfo->returnCode;
-
-    if( pxCommandContext->xTaskToNotify != NULL )
-    {
-        xTaskNotify( pxCommandContext->xTaskToNotify, ( uint32_t ) ( pxReturnInfo->returnCode ), eSetValueWithOverwrite );
-    }
-}
-
 static OtaMqttStatus_t prvMQTTPublish( const char * const pacTopic,
                                        uint16_t topicLen,
                                        const char * pMsg,
                                        uint32_t msgSize,
                                        uint8_t qos )
 {
-    BaseType_t result;
-    MQTTStatus_t mqttStatus = MQTTBadParameter;
-    static MQTTPublishInfo_t publishInfo = { 0 };
-    static MQTTAgentCommandInfo_t xCommandParams = { 0 };
-    static MQTTAgentCommandContext_t xCommandContext = { 0 };
+    MQTTStatus_t mqttStatus = MQTTNoMemory;
+    OtaPublish_t * pxPublish = NULL;
+    AgentRequest_t * pxRequest;
     OtaMqttStatus_t otaRet = OtaMqttSuccess;
+    uint32_t ulIndex;
 
-    publishInfo.pTopicName = pacTopic;
-    publishInfo.topicNameLength = topicLen;
-    publishInfo.qos = qos;
-    publishInfo.pPayload = pMsg;
-    publishInfo.payloadLength = msgSize;
+    for( ulIndex = 0U; ulIndex < otaexampleMAX_PUBLISHES; ulIndex++ )
+    {
+        if( AgentRequest_IsInFlight( &( xOtaPublishes[ ulIndex ].xRequest ) ) == false )
+        {
+            pxPublish = &( xOtaPublishes[ ulIndex ] );
+            break;
+        }
+    }
 
-    xCommandContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
-    xTaskNotifyStateClear( NULL );
+    if( ( topicLen > otaexampleMAX_PUBLISH_TOPIC_SIZE ) || ( msgSize > otaexampleMAX_PUBLISH_PAYLOAD_SIZE ) )
+    {
+        LogError( ( "OTA publish of %u bytes to a topic of %u bytes is too large.",
+                    ( unsigned int ) msgSize,
+                    ( unsigned int ) topicLen ) );
+        mqttStatus = MQTTBadParameter;
+    }
+    else if( pxPublish == NULL )
+    {
+        LogError( ( "Every OTA publish is still waiting for its acknowledgment." ) );
+    }
+    else
+    {
+        /* The agent resends an unacknowledged publish from the request when the
+         * session is resumed, long after the OTA library reused its buffers. */
+        ( void ) memcpy( pxPublish->cTopic, pacTopic, topicLen );
+        ( void ) memcpy( pxPublish->cPayload, pMsg, msgSize );
 
-    xCommandParams.blockTimeMs = otaexampleMQTT_TIMEOUT_MS;
-    xCommandParams.cmdCompleteCallback = prvOTAPublishCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xCommandContext;
+        pxRequest = &( pxPublish->xRequest );
+        AgentRequest_Init( pxRequest );
+        AgentRequest_SetPublish( pxRequest, ( MQTTQoS_t ) qos, pxPublish->cTopic, topicLen, pxPublish->cPayload, msgSize );
 
-    mqttStatus = MQTTAgent_Publish( &xGlobalMqttAgentContext,
-                                    &publishInfo,
-                                    &xCommandParams );
+        /* The OTA library reports a publish that did not complete in time as
+         * failed and may send it again, so one still queued by then is
+         * dropped. */
+        pxRequest->ulDeadlineMs = otaexampleMQTT_TIMEOUT_MS;
 
-    /* Wait for command to complete so MQTTSubscribeInfo_t remains in scope for the
-     * duration of the command. */
-    if( mqttStatus == MQTTSuccess )
-    {
-        result = xTaskNotifyWait( 0, otaexampleMAX_UINT32, NULL, pdMS_TO_TICKS( otaexampleMQTT_TIMEOUT_MS ) );
+        mqttStatus = AgentRequest_Publish( xOtaMqttAgent, pxRequest, otaexampleMQTT_TIMEOUT_MS );
 
-        if( result != pdTRUE )
-        {
-            mqttStatus = MQTTSendFailed;
-        }
-        else
+        if( mqttStatus == MQTTSuccess )
         {
-            mqttStatus = xCommandContext.xReturnStatus;
+            mqttStatus = AgentRequest_Wait( pxRequest, otaexampleMQTT_TIMEOUT_MS );
         }
+
+        AgentRequest_Release( pxRequest );
     }
 
     if( mqttStatus != MQTTSuccess )
@@ -872,52 +869,43 @@ static OtaMqttStatus_t prvMQTTUnsubscribe( const char * pTopicFilter,
                                            uint16_t topicFilterLength,
                                            uint8_t ucQoS )
 {
-    MQTTStatus_t mqttStatus;
-    uint32_t ulNotifiedValue;
-    static MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
-    static MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
-    BaseType_t result;
-    static MQTTAgentCommandInfo_t xCommandParams = { 0 };
-    static MQTTAgentCommandContext_t xApplicationDefinedContext = { 0 };
+    MQTTStatus_t mqttStatus = MQTTBadParameter;
+    MQTTStatus_t xCallbackStatus;
+    bool isMatch = false;
+    uint16_t index = 0U;
+    uint16_t numTopicFilters = sizeof( otaTopicFilterCallbacks ) / sizeof( OtaTopicFilterCallback_t );
     OtaMqttStatus_t otaRet = OtaMqttSuccess;
 
+    ( void ) ucQoS;
+
     configASSERT( pTopicFilter != NULL );
     configASSERT( topicFilterLength > 0 );
 
-    xSubscribeInfo.pTopicFilter = pTopicFilter;
-    xSubscribeInfo.topicFilterLength = topicFilterLength;
-    xSubscribeInfo.qos = ucQoS;
-    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
-    xSubscribeArgs.numSubscriptions = 1;
-
-
-    xApplicationDefinedContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
-
-    xCommandParams.blockTimeMs = otaexampleMQTT_TIMEOUT_MS;
-    xCommandParams.cmdCompleteCallback = prvMQTTUnsubscribeCompleteCallback;
-    xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xApplicationDefinedContext;
-
     LogInfo( ( " Unsubscribing to topic filter: %s", pTopicFilter ) );
-    xTaskNotifyStateClear( NULL );
-
-
-    mqttStatus = MQTTAgent_Unsubscribe( &xGlobalMqttAgentContext,
-                                        &xSubscribeArgs,
-                                        &xCommandParams );
 
-    /* Wait for command to complete so MQTTSubscribeInfo_t remains in scope for the
-     * duration of the command. */
-    if( mqttStatus == MQTTSuccess )
+    /* Remove every OTA callback subscribed to the topic filter. The agent
+     * sends the UNSUBSCRIBE with the last one. */
+    for( ; index < numTopicFilters; index++ )
     {
-        result = xTaskNotifyWait( 0, otaexampleMAX_UINT32, &ulNotifiedValue, pdMS_TO_TICKS( otaexampleMQTT_TIMEOUT_MS ) );
+        ( void ) MQTT_MatchTopic( pTopicFilter,
+                                  topicFilterLength,
+                                  otaTopicFilterCallbacks[ index ].pTopicFilter,
+                                  otaTopicFilterCallbacks[ index ].topicFilterLength,
+                                  &isMatch );
 
-        if( result == pdTRUE )
-        {
-            mqttStatus = xApplicationDefinedContext.xReturnStatus;
-        }
-        else
+        if( isMatch )
         {
-            mqttStatus = MQTTRecvFailed;
+            xCallbackStatus = xMQTTAgentUnsubscribe( xOtaMqttAgent,
+                                                     pTopicFilter,
+                                                     topicFilterLength,
+                                                     otaTopicFilterCallbacks[ index ].callback,
+                                                     NULL,
+                                                     otaexampleMQTT_TIMEOUT_MS );
+
+            if( ( mqttStatus == MQTTBadParameter ) || ( xCallbackStatus != MQTTSuccess ) )
+            {
+                mqttStatus = xCallbackStatus;
+            }
         }
     }
 
@@ -1070,8 +1058,7 @@ static BaseType_t prvRunOTADemo( void )
     /* Set OTA Library interfaces.*/
     setOtaInterfaces( &otaInterfaces );
 
-    vWaitUntilMQTTAgentReady();
-    vWaitUntilMQTTAgentConnected();
+    vMQTTAgentWaitUntilConnected( xOtaMqttAgent );
 
     /****************************** Init OTA Library. ******************************/
 
@@ -1113,7 +1100,7 @@ static BaseType_t prvRunOTADemo( void )
      * Register a callback for receiving messages intended for OTA agent from broker,
      * for which the topic has not been subscribed for.
      */
-    prvRegisterOTACallback( OTA_DEFAULT_TOPIC_FILTER, OTA_DEFAULT_TOPIC_FILTER_LENGTH );
+    prvRegisterOTACallback( OTA_DEFAULT_TOPIC_FILTER, OTA_DEFAULT_TOPIC_FILTER_LENGTH, MQTTQoS1 );
 
     /****************************** Start OTA ******************************/
 
@@ -1138,7 +1125,7 @@ static BaseType_t prvRunOTADemo( void )
                            otaStatistics.otaPacketsDropped ) );
             }
 
-            if( !xIsMqttAgentConnected() )
+            if( !xMQTTAgentIsConnected( xOtaMqttAgent ) )
             {
                 xStatus = prvSuspendOTA();
                 configASSERT( xStatus == pdPASS );
@@ -1164,7 +1151,8 @@ static BaseType_t prvRunOTADemo( void )
      * Remove callback for receiving messages intended for OTA agent from broker,
      * for which the topic has not been subscribed for.
      */
-    removeSubscription( OTA_DEFAULT_TOPIC_FILTER,
+    removeSubscription( pxMQTTAgentGetSubscriptionList( xOtaMqttAgent ),
+                        OTA_DEFAULT_TOPIC_FILTER,
                         OTA_DEFAULT_TOPIC_FILTER_LENGTH );
 
     return xStatus;
@@ -1227,6 +1215,23 @@ static void vOtaDemoTask( void * pvParam )
  */
 void vStartOtaTask( void )
 {
+    #if ( appCONFIG_OTA_SEPARATE_MQTT_CONNECTION == 1 )
+        static const MQTTAgentConfig_t xOtaAgentConfig =
+        {
+            .pcTaskName           = "OTA MQTT Agent Task ",
+            .pcClientIdentifier   = otaexampleMQTT_CLIENT_IDENTIFIER,
+            .usStackSize          = appCONFIG_MQTT_AGENT_TASK_STACK_SIZE,
+            .uxPriority           = appCONFIG_OTA_MQTT_AGENT_TASK_PRIORITY,
+            .pcControlTopicFilter = NULL
+        };
+
+        /* Move OTA traffic to its own connection. */
+        xOtaMqttAgent = xMQTTAgentStart( &xOtaAgentConfig );
+    #else
+        xOtaMqttAgent = xMQTTAgentGetDefault();
+    #endif
+    configASSERT( xOtaMqttAgent != NULL );
+
     xTaskCreate( vOtaDemoTask,                             /* Function that implements the task. */
                  "OTA Task ",                              /* Text name for the task - only used for debugging. */
                  appCONFIG_OTA_MQTT_AGENT_TASK_STACK_SIZE, /* Size of stack (in words, not bytes) to allocate for the task. */
@@ -0,0 +1,619 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file publish_stream.c
+ * @brief Implements the streaming receive of oversized incoming publishes.
+ */
+
+/* Standard includes. */
+#include <string.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+/* Header include. */
+#include "publish_stream.h"
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "PUB STREAM"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/**
+ * @brief Receive up to xLength bytes, from the bytes received ahead first and
+ * then from the transport.
+ *
+ * @param[in] pxStream The stream.
+ * @param[in] pNetworkContext The network context.
+ * @param[out] pucBuffer Buffer to receive into.
+ * @param[in] xLength Size of pucBuffer.
+ *
+ * @return Number of bytes received, 0 if no data is available, or a negative
+ * value on error.
+ */
+static int32_t prvRecv( PublishStream_t * pxStream,
+                        NetworkContext_t * pNetworkContext,
+                        uint8_t * pucBuffer,
+                        size_t xLength );
+
+/**
+ * @brief Receive exactly xLength bytes, waiting up to
+ * PUBLISH_STREAM_RECV_TIMEOUT_MS for them.
+ *
+ * @param[in] pxStream The stream.
+ * @param[in] pNetworkContext The network context.
+ * @param[out] pucBuffer Buffer to receive into.
+ * @param[in] xLength Number of bytes to receive.
+ *
+ * @return `true` if all the bytes were received.
+ */
+static bool prvRecvExact( PublishStream_t * pxStream,
+                          NetworkContext_t * pNetworkContext,
+                          uint8_t * pucBuffer,
+                          size_t xLength );
+
+/**
+ * @brief Decode a fixed header.
+ *
+ * @param[in] pucBytes Bytes starting with the fixed header.
+ * @param[in] xLength Number of bytes available.
+ * @param[out] pxHeaderLength Length of the fixed header.
+ * @param[out] pxRemainingLength The decoded remaining length.
+ *
+ * @return 1 once the header is complete, 0 if more bytes are needed, or a
+ * negative value if it is malformed.
+ */
+static int32_t prvParseFixedHeader( const uint8_t * pucBytes,
+                                    size_t xLength,
+                                    size_t * pxHeaderLength,
+                                    size_t * pxRemainingLength );
+
+/**
+ * @brief Receive and decode the fixed header of the next packet. Up to
+ * PUBLISH_STREAM_FIXED_HEADER_MAX bytes are received ahead with a single
+ * transport receive. The header is left in the received bytes.
+ *
+ * @param[in] pxStream The stream.
+ * @param[in] pNetworkContext The network context.
+ * @param[out] pxHeaderLength Length of the fixed header.
+ * @param[out] pxRemainingLength The decoded remaining length.
+ *
+ * @return 1 once the header is complete, 0 if more bytes are needed, or a
+ * negative value on error.
+ */
+static int32_t prvRecvFixedHeader( PublishStream_t * pxStream,
+                                   NetworkContext_t * pNetworkContext,
+                                   size_t * pxHeaderLength,
+                                   size_t * pxRemainingLength );
+
+/**
+ * @brief Stream the payload of a PUBLISH whose fixed header has been read, and
+ * prepare the placeholder for coreMQTT.
+ *
+ * @param[in] pxStream The stream.
+ * @param[in] pNetworkContext The network context.
+ * @param[in] ucPacketType First byte of the fixed header: packet type and
+ * flags.
+ * @param[in] xRemainingLength Remaining length of the PUBLISH.
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+static int32_t prvStreamPublish( PublishStream_t * pxStream,
+                                 NetworkContext_t * pNetworkContext,
+                                 uint8_t ucPacketType,
+                                 size_t xRemainingLength );
+
+/**
+ * @brief Drain bytes from the transport without processing them.
+ *
+ * @param[in] pxStream The stream.
+ * @param[in] pNetworkContext The network context.
+ * @param[in] xLength Number of bytes to drain.
+ *
+ * @return `true` if all the bytes were drained.
+ */
+static bool prvDrain( PublishStream_t * pxStream,
+                      NetworkContext_t * pNetworkContext,
+                      size_t xLength );
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvRecv( PublishStream_t * pxStream,
+                        NetworkContext_t * pNetworkContext,
+                        uint8_t * pucBuffer,
+                        size_t xLength )
+{
+    int32_t lResult;
+    size_t xAvailable = pxStream->xRecvAheadLength - pxStream->xRecvAheadIndex;
+
+    if( xAvailable > 0U )
+    {
+        if( xAvailable > xLength )
+        {
+            xAvailable = xLength;
+        }
+
+        memcpy( pucBuffer, &( pxStream->ucRecvAhead[ pxStream->xRecvAheadIndex ] ), xAvailable );
+        pxStream->xRecvAheadIndex += xAvailable;
+        lResult = ( int32_t ) xAvailable;
+    }
+    else
+    {
+        lResult = pxStream->xTransportRecv( pNetworkContext, pucBuffer, xLength );
+    }
+
+    return lResult;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRecvExact( PublishStream_t * pxStream,
+                          NetworkContext_t * pNetworkContext,
+                          uint8_t * pucBuffer,
+                          size_t xLength )
+{
+    size_t xReceived = 0U;
+    int32_t lResult = 0;
+    TimeOut_t xTimeOut;
+    TickType_t xTicksToWait = pdMS_TO_TICKS( PUBLISH_STREAM_RECV_TIMEOUT_MS );
+    bool xTimedOut = false;
+    bool xWaited = false;
+
+    vTaskSetTimeOutState( &xTimeOut );
+
+    while( ( xReceived < xLength ) && ( lResult >= 0 ) && ( xTimedOut == false ) )
+    {
+        lResult = prvRecv( pxStream, pNetworkContext, &( pucBuffer[ xReceived ] ), xLength - xReceived );
+
+        if( lResult > 0 )
+        {
+            xReceived += ( size_t ) lResult;
+        }
+        else if( lResult == 0 )
+        {
+            if( xTaskCheckForTimeOut( &xTimeOut, &xTicksToWait ) == pdTRUE )
+            {
+                xTimedOut = true;
+            }
+            else if( pxStream->xReadySemaphore != NULL )
+            {
+                /* The transport does not block, wait until it signals more
+                 * data. Without the semaphore, the transport receive has
+                 * already waited for its own timeout. */
+                ( void ) xSemaphoreTake( pxStream->xReadySemaphore, xTicksToWait );
+                xWaited = true;
+            }
+            else
+            {
+                /* Receive again. */
+            }
+        }
+        else
+        {
+            /* Receive error. */
+        }
+    }
+
+    if( xWaited == true )
+    {
+        /* The semaphore is shared with the other wakeup events of the agent.
+         * Give it back, so that an event taken while streaming is not lost. */
+        ( void ) xSemaphoreGive( pxStream->xReadySemaphore );
+    }
+
+    return( xReceived == xLength );
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvDrain( PublishStream_t * pxStream,
+                      NetworkContext_t * pNetworkContext,
+                      size_t xLength )
+{
+    size_t xChunkLength;
+    bool xDrained = true;
+
+    while( ( xLength > 0U ) && ( xDrained == true ) )
+    {
+        xChunkLength = ( xLength < sizeof( pxStream->ucChunk ) ) ? xLength : sizeof( pxStream->ucChunk );
+        xDrained = prvRecvExact( pxStream, pNetworkContext, pxStream->ucChunk, xChunkLength );
+        xLength -= xChunkLength;
+    }
+
+    return xDrained;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvParseFixedHeader( const uint8_t * pucBytes,
+                                    size_t xLength,
+                                    size_t * pxHeaderLength,
+                                    size_t * pxRemainingLength )
+{
+    int32_t lResult = 0;
+    size_t xRemainingLength = 0U;
+    size_t xMultiplier = 1U;
+    size_t xIndex = 1U;
+
+    /* The length is complete once a byte without the continuation bit follows
+     * the packet type. */
+    while( ( lResult == 0 ) && ( xIndex < xLength ) )
+    {
+        xRemainingLength += ( size_t ) ( pucBytes[ xIndex ] & 0x7FU ) * xMultiplier;
+        xMultiplier *= 128U;
+
+        if( ( pucBytes[ xIndex ] & 0x80U ) == 0U )
+        {
+            *pxHeaderLength = xIndex + 1U;
+            *pxRemainingLength = xRemainingLength;
+            lResult = 1;
+        }
+        else if( ( xIndex + 1U ) == PUBLISH_STREAM_FIXED_HEADER_MAX )
+        {
+            LogError( ( "Malformed remaining length in incoming packet." ) );
+            lResult = -1;
+        }
+        else
+        {
+            xIndex++;
+        }
+    }
+
+    return lResult;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvRecvFixedHeader( PublishStream_t * pxStream,
+                                   NetworkContext_t * pNetworkContext,
+                                   size_t * pxHeaderLength,
+                                   size_t * pxRemainingLength )
+{
+    int32_t lResult;
+    size_t xAvailable = pxStream->xRecvAheadLength - pxStream->xRecvAheadIndex;
+
+    lResult = prvParseFixedHeader( &( pxStream->ucRecvAhead[ pxStream->xRecvAheadIndex ] ),
+                                   xAvailable,
+                                   pxHeaderLength,
+                                   pxRemainingLength );
+
+    if( lResult == 0 )
+    {
+        /* Move the start of the header to the front, and receive as much of
+         * the rest as fits. Bytes beyond the header are kept for the body. */
+        memmove( pxStream->ucRecvAhead, &( pxStream->ucRecvAhead[ pxStream->xRecvAheadIndex ] ), xAvailable );
+        pxStream->xRecvAheadIndex = 0U;
+        pxStream->xRecvAheadLength = xAvailable;
+
+        lResult = pxStream->xTransportRecv( pNetworkContext,
+                                            &( pxStream->ucRecvAhead[ xAvailable ] ),
+                                            PUBLISH_STREAM_FIXED_HEADER_MAX - xAvailable );
+
+        if( lResult > 0 )
+        {
+            pxStream->xRecvAheadLength += ( size_t ) lResult;
+            lResult = prvParseFixedHeader( pxStream->ucRecvAhead,
+                                           pxStream->xRecvAheadLength,
+                                           pxHeaderLength,
+                                           pxRemainingLength );
+        }
+    }
+
+    return lResult;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvStreamPublish( PublishStream_t * pxStream,
+                                 NetworkContext_t * pNetworkContext,
+                                 uint8_t ucPacketType,
+                                 size_t xRemainingLength )
+{
+    int32_t lResult = 0;
+    uint8_t ucTopicLength[ 2 ];
+    uint16_t usTopicLength = 0U;
+    uint16_t usKeptTopicLength = 0U;
+    size_t xPacketIdLength;
+    size_t xVariableHeaderLength = 0U;
+    size_t xPayloadLength;
+    size_t xOffset = 0U;
+    size_t xChunkLength;
+    size_t xIndex;
+    size_t xLength;
+    MQTTPublishInfo_t xPublishInfo = { 0 };
+    bool xDropped = false;
+    bool xUnhandled = false;
+
+    xPublishInfo.qos = ( MQTTQoS_t ) ( ( ucPacketType >> 1 ) & 0x03U );
+    xPublishInfo.retain = ( ( ucPacketType & 0x01U ) != 0U );
+    xPublishInfo.dup = ( ( ucPacketType & 0x08U ) != 0U );
+    xPacketIdLength = ( xPublishInfo.qos != MQTTQoS0 ) ? 2U : 0U;
+
+    if( ( xRemainingLength < 2U ) || ( prvRecvExact( pxStream, pNetworkContext, ucTopicLength, 2U ) == false ) )
+    {
+        lResult = -1;
+    }
+    else
+    {
+        usTopicLength = ( uint16_t ) ( ( ( uint16_t ) ucTopicLength[ 0 ] << 8 ) | ucTopicLength[ 1 ] );
+        xVariableHeaderLength = 2U + usTopicLength + xPacketIdLength;
+        usKeptTopicLength = usTopicLength;
+
+        if( usTopicLength > PUBLISH_STREAM_MAX_TOPIC_LENGTH )
+        {
+            /* The topic does not fit the placeholder. The payload is dropped,
+             * but coreMQTT is still given the publish with a truncated topic
+             * so that a QoS 1 or 2 publish is acknowledged. */
+            usKeptTopicLength = PUBLISH_STREAM_MAX_TOPIC_LENGTH;
+            xDropped = true;
+        }
+
+        if( xVariableHeaderLength > xRemainingLength )
+        {
+            LogError( ( "Malformed incoming PUBLISH." ) );
+            lResult = -1;
+        }
+        else
+        {
+            /* Lay out the placeholder: same packet type and flags, with a
+             * remaining length that excludes the payload. */
+            pxStream->ucPending[ 0 ] = ucPacketType;
+            xIndex = 1U;
+            xLength = 2U + usKeptTopicLength + xPacketIdLength;
+
+            do
+            {
+                pxStream->ucPending[ xIndex ] = ( uint8_t ) ( xLength % 128U );
+                xLength /= 128U;
+
+                if( xLength > 0U )
+                {
+                    pxStream->ucPending[ xIndex ] |= 0x80U;
+                }
+
+                xIndex++;
+            } while( xLength > 0U );
+
+            pxStream->ucPending[ xIndex++ ] = ( uint8_t ) ( usKeptTopicLength >> 8 );
+            pxStream->ucPending[ xIndex++ ] = ( uint8_t ) ( usKeptTopicLength & 0xFFU );
+            xPublishInfo.pTopicName = ( const char * ) &( pxStream->ucPending[ xIndex ] );
+            xPublishInfo.topicNameLength = usKeptTopicLength;
+
+            if( ( prvRecvExact( pxStream, pNetworkContext, &( pxStream->ucPending[ xIndex ] ), usKeptTopicLength ) == false ) ||
+                ( prvDrain( pxStream, pNetworkContext, ( size_t ) usTopicLength - usKeptTopicLength ) == false ) ||
+                ( prvRecvExact( pxStream, pNetworkContext, &( pxStream->ucPending[ xIndex + usKeptTopicLength ] ), xPacketIdLength ) == false ) )
+            {
+                lResult = -1;
+            }
+            else
+            {
+                pxStream->xPendingLength = xIndex + usKeptTopicLength + xPacketIdLength;
+                pxStream->xPendingIndex = 0U;
+            }
+        }
+    }
+
+    if( lResult == 0 )
+    {
+        xPayloadLength = xRemainingLength - xVariableHeaderLength;
+
+        if( xDropped == true )
+        {
+            LogError( ( "Dropped a PUBLISH of %u bytes: topic of %u bytes is too long to stream.",
+                        ( unsigned int ) xRemainingLength,
+                        ( unsigned int ) usTopicLength ) );
+
+            if( prvDrain( pxStream, pNetworkContext, xPayloadLength ) == false )
+            {
+                lResult = -1;
+            }
+        }
+        else
+        {
+            LogInfo( ( "Streaming a PUBLISH with a payload of %u bytes.", ( unsigned int ) xPayloadLength ) );
+        }
+
+        while( ( xDropped == false ) && ( xUnhandled == false ) && ( xOffset < xPayloadLength ) && ( lResult == 0 ) )
+        {
+            xChunkLength = xPayloadLength - xOffset;
+
+            if( xChunkLength > sizeof( pxStream->ucChunk ) )
+            {
+                xChunkLength = sizeof( pxStream->ucChunk );
+            }
+
+            if( prvRecvExact( pxStream, pNetworkContext, pxStream->ucChunk, xChunkLength ) == false )
+            {
+                LogError( ( "Timed out streaming a PUBLISH at offset %u.", ( unsigned int ) xOffset ) );
+                lResult = -1;
+            }
+            else
+            {
+                xPublishInfo.pPayload = pxStream->ucChunk;
+                xPublishInfo.payloadLength = xChunkLength;
+
+                if( ( handleIncomingPublishChunk( pxStream->pxSubscriptionList, &xPublishInfo, xOffset, xPayloadLength ) == false ) &&
+                    ( xOffset == 0U ) )
+                {
+                    xUnhandled = true;
+                }
+
+                xOffset += xChunkLength;
+            }
+        }
+
+        if( xUnhandled == true )
+        {
+            /* Nothing has consumed the data, so the publish is not
+             * acknowledged: coreMQTT is not given a placeholder, and the
+             * broker redelivers a QoS 1 or 2 publish on a resumed session. */
+            LogWarn( ( "No subscription accepts chunks for a streamed PUBLISH of %u bytes, not acknowledging it.",
+                       ( unsigned int ) xPayloadLength ) );
+
+            if( prvDrain( pxStream, pNetworkContext, xPayloadLength - xOffset ) == false )
+            {
+                lResult = -1;
+            }
+
+            pxStream->xPendingLength = 0U;
+        }
+        else if( lResult == 0 )
+        {
+            /* A dropped publish is acknowledged like a streamed one: its
+             * placeholder must not be delivered either. */
+            pxStream->xPlaceholderPending = true;
+            pxStream->usPlaceholderTopicLength = usKeptTopicLength;
+        }
+        else
+        {
+            pxStream->xPendingLength = 0U;
+        }
+    }
+
+    return lResult;
+}
+
+/*-----------------------------------------------------------*/
+
+void PublishStream_Init( PublishStream_t * pxStream,
+                         TransportRecv_t xRecv,
+                         size_t xBufferSize,
+                         SubscriptionList_t * pxSubscriptionList )
+{
+    configASSERT( pxStream != NULL );
+    configASSERT( xRecv != NULL );
+
+    pxStream->xTransportRecv = xRecv;
+    pxStream->xReadySemaphore = NULL;
+    pxStream->xStreamThreshold = xBufferSize;
+    pxStream->pxSubscriptionList = pxSubscriptionList;
+    PublishStream_Reset( pxStream );
+}
+
+/*-----------------------------------------------------------*/
+
+void PublishStream_SetReadySemaphore( PublishStream_t * pxStream,
+                                      SemaphoreHandle_t xReadySemaphore )
+{
+    pxStream->xReadySemaphore = xReadySemaphore;
+}
+
+/*-----------------------------------------------------------*/
+
+void PublishStream_Reset( PublishStream_t * pxStream )
+{
+    pxStream->xReadySemaphore = NULL;
+    pxStream->xRecvAheadIndex = 0U;
+    pxStream->xRecvAheadLength = 0U;
+    pxStream->xBodyRemaining = 0U;
+    pxStream->xPendingLength = 0U;
+    pxStream->xPendingIndex = 0U;
+    pxStream->xPlaceholderPending = false;
+}
+
+/*-----------------------------------------------------------*/
+
+int32_t PublishStream_Recv( PublishStream_t * pxStream,
+                            NetworkContext_t * pNetworkContext,
+                            void * pBuffer,
+                            size_t bytesToRecv )
+{
+    int32_t lResult = 0;
+    size_t xHeaderLength = 0U;
+    size_t xRemainingLength = 0U;
+    uint8_t ucPacketType;
+    size_t xLength;
+
+    if( ( pxStream->xPendingIndex == pxStream->xPendingLength ) && ( pxStream->xBodyRemaining == 0U ) )
+    {
+        pxStream->xPendingIndex = 0U;
+        pxStream->xPendingLength = 0U;
+
+        lResult = prvRecvFixedHeader( pxStream, pNetworkContext, &xHeaderLength, &xRemainingLength );
+
+        if( lResult > 0 )
+        {
+            /* coreMQTT has processed every byte handed to it, including the
+             * placeholder of a previously streamed publish. */
+            pxStream->xPlaceholderPending = false;
+            lResult = 0;
+            ucPacketType = pxStream->ucRecvAhead[ pxStream->xRecvAheadIndex ];
+
+            if( ( ( ucPacketType & 0xF0U ) == MQTT_PACKET_TYPE_PUBLISH ) &&
+                ( ( xHeaderLength + xRemainingLength ) > pxStream->xStreamThreshold ) )
+            {
+                pxStream->xRecvAheadIndex += xHeaderLength;
+                lResult = prvStreamPublish( pxStream, pNetworkContext, ucPacketType, xRemainingLength );
+            }
+            else
+            {
+                /* Passed through from the received bytes, header included. */
+                pxStream->xBodyRemaining = xHeaderLength + xRemainingLength;
+            }
+        }
+    }
+
+    if( lResult < 0 )
+    {
+        PublishStream_Reset( pxStream );
+    }
+    else if( pxStream->xPendingIndex < pxStream->xPendingLength )
+    {
+        xLength = pxStream->xPendingLength - pxStream->xPendingIndex;
+
+        if( xLength > bytesToRecv )
+        {
+            xLength = bytesToRecv;
+        }
+
+        memcpy( pBuffer, &( pxStream->ucPending[ pxStream->xPendingIndex ] ), xLength );
+        pxStream->xPendingIndex += xLength;
+        lResult = ( int32_t ) xLength;
+    }
+    else if( pxStream->xBodyRemaining > 0U )
+    {
+        xLength = ( pxStream->xBodyRemaining < bytesToRecv ) ? pxStream->xBodyRemaining : bytesToRecv;
+        lResult = prvRecv( pxStream, pNetworkContext, ( uint8_t * ) pBuffer, xLength );
+
+        if( lResult > 0 )
+        {
+            pxStream->xBodyRemaining -= ( size_t ) lResult;
+        }
+    }
+    else
+    {
+        /* Waiting for the rest of the fixed header. */
+    }
+
+    return lResult;
+}
+
+/*-----------------------------------------------------------*/
+
+bool PublishStream_WasStreamed( PublishStream_t * pxStream,
+                                const MQTTPublishInfo_t * pxPublishInfo )
+{
+    bool xStreamed = false;
+
+    if( ( pxStream->xPlaceholderPending == true ) &&
+        ( pxPublishInfo->payloadLength == 0U ) &&
+        ( pxPublishInfo->topicNameLength == pxStream->usPlaceholderTopicLength ) )
+    {
+        pxStream->xPlaceholderPending = false;
+        xStreamed = true;
+    }
+
+    return xStreamed;
+}
@@ -0,0 +1,168 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file publish_stream.h
+ * @brief Streaming receive of incoming publishes larger than the agent network
+ * buffer.
+ *
+ * PublishStream_Recv() sits between coreMQTT and the transport receive
+ * function of a connection. The fixed header of each packet is received
+ * ahead with a single bounded receive. Packets that fit the network buffer are
+ * passed through untouched. For a PUBLISH that does not fit, the topic is read
+ * into a small header buffer, and the payload is read in chunks of
+ * PUBLISH_STREAM_CHUNK_SIZE bytes and handed to the subscription manager with
+ * handleIncomingPublishChunk(). coreMQTT is then given the same PUBLISH with an
+ * empty payload, so that acknowledgements are handled as usual. A PUBLISH whose
+ * topic is longer than PUBLISH_STREAM_MAX_TOPIC_LENGTH is dropped, and coreMQTT
+ * is given a placeholder with the topic truncated so it is still acknowledged.
+ * A PUBLISH that no subscription takes chunks of is drained and not given to
+ * coreMQTT, so it is not acknowledged.
+ */
+#ifndef PUBLISH_STREAM_H
+#define PUBLISH_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+/* MQTT library includes. */
+#include "core_mqtt.h"
+#include "transport_interface.h"
+
+/* Subscription manager header include. */
+#include "subscription_manager.h"
+
+/**
+ * @brief Size of the buffer the payload of a streamed publish is read into.
+ */
+#ifndef PUBLISH_STREAM_CHUNK_SIZE
+    #define PUBLISH_STREAM_CHUNK_SIZE    ( 1024U )
+#endif
+
+/**
+ * @brief Longest topic name of a streamed publish. AWS IoT Core limits topic
+ * names to 256 bytes.
+ */
+#ifndef PUBLISH_STREAM_MAX_TOPIC_LENGTH
+    #define PUBLISH_STREAM_MAX_TOPIC_LENGTH    ( 256U )
+#endif
+
+/**
+ * @brief Time to wait for the rest of a packet once it is being streamed.
+ */
+#ifndef PUBLISH_STREAM_RECV_TIMEOUT_MS
+    #define PUBLISH_STREAM_RECV_TIMEOUT_MS    ( 5000U )
+#endif
+
+/**
+ * @brief Largest MQTT fixed header: one byte of packet type and flags followed
+ * by up to four bytes of remaining length.
+ */
+#define PUBLISH_STREAM_FIXED_HEADER_MAX    ( 5U )
+
+/**
+ * @brief Streaming state of one connection.
+ */
+typedef struct PublishStream
+{
+    TransportRecv_t xTransportRecv;
+    SemaphoreHandle_t xReadySemaphore;
+    size_t xStreamThreshold;
+    SubscriptionList_t * pxSubscriptionList;
+
+    /* Bytes received ahead to parse the fixed header of the next packet. Any
+     * bytes beyond the header are received from here first. */
+    uint8_t ucRecvAhead[ PUBLISH_STREAM_FIXED_HEADER_MAX ];
+    size_t xRecvAheadIndex;
+    size_t xRecvAheadLength;
+
+    /* Bytes of the current packet, fixed header included, still to be passed
+     * through. */
+    size_t xBodyRemaining;
+
+    /* Placeholder of a streamed publish waiting to be handed to coreMQTT. */
+    uint8_t ucPending[ PUBLISH_STREAM_FIXED_HEADER_MAX + 2U + PUBLISH_STREAM_MAX_TOPIC_LENGTH + 2U ];
+    size_t xPendingLength;
+    size_t xPendingIndex;
+
+    /* Payload chunk delivered to the subscribers. */
+    uint8_t ucChunk[ PUBLISH_STREAM_CHUNK_SIZE ];
+
+    /* Set while the placeholder of a streamed or dropped publish has not been
+     * processed by coreMQTT. */
+    bool xPlaceholderPending;
+    uint16_t usPlaceholderTopicLength;
+} PublishStream_t;
+
+/**
+ * @brief Set the transport receive function and the size above which incoming
+ * publishes are streamed.
+ *
+ * @param[in] pxStream The stream to initialize.
+ * @param[in] xRecv The transport receive function.
+ * @param[in] xBufferSize Size of the buffer given to coreMQTT. Packets larger
+ * than this are streamed.
+ * @param[in] pxSubscriptionList Subscriptions the chunks are dispatched to.
+ */
+void PublishStream_Init( PublishStream_t * pxStream,
+                         TransportRecv_t xRecv,
+                         size_t xBufferSize,
+                         SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Set the semaphore given when the transport has data to read, once
+ * the transport receive no longer blocks. The rest of a streamed publish is
+ * then waited for on it.
+ *
+ * @param[in] pxStream The stream.
+ * @param[in] xReadySemaphore The semaphore given to Transport_SetReadySemaphore().
+ */
+void PublishStream_SetReadySemaphore( PublishStream_t * pxStream,
+                                      SemaphoreHandle_t xReadySemaphore );
+
+/**
+ * @brief Discard any partially parsed packet, and the ready semaphore. Must be
+ * called whenever a new connection is established.
+ *
+ * @param[in] pxStream The stream.
+ */
+void PublishStream_Reset( PublishStream_t * pxStream );
+
+/**
+ * @brief Receive through the stream. Called from the transport receive
+ * function given to coreMQTT.
+ *
+ * @param[in] pxStream The stream of the connection.
+ * @param[in] pNetworkContext The network context.
+ * @param[out] pBuffer Buffer to receive into.
+ * @param[in] bytesToRecv Size of pBuffer.
+ *
+ * @return Number of bytes received, 0 if no data is available, or a negative
+ * value on error.
+ */
+int32_t PublishStream_Recv( PublishStream_t * pxStream,
+                            NetworkContext_t * pNetworkContext,
+                            void * pBuffer,
+                            size_t bytesToRecv );
+
+/**
+ * @brief Check whether an incoming publish is the empty placeholder of a
+ * publish that was already streamed to the subscribers or dropped, so that it
+ * is not delivered.
+ *
+ * @param[in] pxStream The stream of the connection.
+ * @param[in] pxPublishInfo Publish received from coreMQTT.
+ *
+ * @return `true` if the payload of the publish was streamed or dropped.
+ */
+bool PublishStream_WasStreamed( PublishStream_t * pxStream,
+                                const MQTTPublishInfo_t * pxPublishInfo );
+
+#endif /* PUBLISH_STREAM_H */
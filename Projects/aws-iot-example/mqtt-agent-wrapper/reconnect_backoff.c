@@ -0,0 +1,104 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file reconnect_backoff.c
+ * @brief Implements the backoff between reconnect attempts to the broker.
+ */
+
+/* Header include. */
+#include "reconnect_backoff.h"
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "BACKOFF"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/*-----------------------------------------------------------*/
+
+void ReconnectBackoff_Init( ReconnectBackoff_t * pxBackoff,
+                            uint32_t ulBaseMs,
+                            uint32_t ulMaxMs,
+                            uint32_t ulStableMs )
+{
+    pxBackoff->ulBaseMs = ( ulBaseMs > 0U ) ? ulBaseMs : 1U;
+    pxBackoff->ulMaxMs = ( ulMaxMs > pxBackoff->ulBaseMs ) ? ulMaxMs : pxBackoff->ulBaseMs;
+    pxBackoff->ulStableMs = ulStableMs;
+    pxBackoff->ulPreviousMs = pxBackoff->ulBaseMs;
+    pxBackoff->ulConnectedAtMs = 0U;
+    pxBackoff->xConnected = false;
+    pxBackoff->xStats.ulAttempts = 0U;
+    pxBackoff->xStats.ulTotalAttempts = 0U;
+    pxBackoff->xStats.ulTotalBackoffMs = 0U;
+    pxBackoff->xStats.ulResets = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+uint32_t ReconnectBackoff_NextDelay( ReconnectBackoff_t * pxBackoff,
+                                     uint32_t ulRandom )
+{
+    uint32_t ulUpperMs;
+    uint32_t ulDelayMs;
+
+    /* Upper bound of the draw is three times the previous delay, computed so
+     * that it cannot overflow. */
+    if( pxBackoff->ulPreviousMs > ( pxBackoff->ulMaxMs / 3U ) )
+    {
+        ulUpperMs = pxBackoff->ulMaxMs;
+    }
+    else
+    {
+        ulUpperMs = pxBackoff->ulPreviousMs * 3U;
+    }
+
+    ulDelayMs = pxBackoff->ulBaseMs + ( ulRandom % ( ( ulUpperMs - pxBackoff->ulBaseMs ) + 1U ) );
+
+    pxBackoff->ulPreviousMs = ulDelayMs;
+    pxBackoff->xStats.ulAttempts++;
+    pxBackoff->xStats.ulTotalAttempts++;
+    pxBackoff->xStats.ulTotalBackoffMs += ulDelayMs;
+
+    return ulDelayMs;
+}
+
+/*-----------------------------------------------------------*/
+
+void ReconnectBackoff_Connected( ReconnectBackoff_t * pxBackoff,
+                                 uint32_t ulNowMs )
+{
+    pxBackoff->ulConnectedAtMs = ulNowMs;
+    pxBackoff->xConnected = true;
+}
+
+/*-----------------------------------------------------------*/
+
+void ReconnectBackoff_Disconnected( ReconnectBackoff_t * pxBackoff,
+                                    uint32_t ulNowMs )
+{
+    uint32_t ulUptimeMs = ulNowMs - pxBackoff->ulConnectedAtMs;
+
+    if( ( pxBackoff->xConnected == true ) && ( ulUptimeMs >= pxBackoff->ulStableMs ) )
+    {
+        LogDebug( ( "Connection was up for %u ms, resetting the backoff after %u attempts.",
+                    ( unsigned int ) ulUptimeMs,
+                    ( unsigned int ) pxBackoff->xStats.ulAttempts ) );
+
+        pxBackoff->ulPreviousMs = pxBackoff->ulBaseMs;
+        pxBackoff->xStats.ulAttempts = 0U;
+        pxBackoff->xStats.ulResets++;
+    }
+
+    pxBackoff->xConnected = false;
+}
+
+/*-----------------------------------------------------------*/
@@ -0,0 +1,92 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file reconnect_backoff.h
+ * @brief Backoff between reconnect attempts to the broker.
+ *
+ * Delays use decorrelated jitter: each delay is drawn uniformly between the
+ * base delay and three times the previous delay, capped to the maximum delay.
+ * Devices that lost their connection at the same time therefore spread out
+ * from the first retry on, rather than only once the exponential backoff
+ * has grown. The backoff is only reset once a connection stayed up for the
+ * stable window, so a connection that keeps dropping right after being
+ * established keeps backing off.
+ */
+#ifndef RECONNECT_BACKOFF_H
+#define RECONNECT_BACKOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Counters of a reconnect backoff.
+ */
+typedef struct ReconnectBackoffStats
+{
+    uint32_t ulAttempts;       /**< Failed attempts since the backoff was last reset. */
+    uint32_t ulTotalAttempts;  /**< Failed attempts since the backoff was initialized. */
+    uint32_t ulTotalBackoffMs; /**< Time spent backing off since the backoff was initialized. */
+    uint32_t ulResets;         /**< Times a stable connection reset the backoff. */
+} ReconnectBackoffStats_t;
+
+/**
+ * @brief State of a reconnect backoff.
+ */
+typedef struct ReconnectBackoff
+{
+    uint32_t ulBaseMs;
+    uint32_t ulMaxMs;
+    uint32_t ulStableMs;
+    uint32_t ulPreviousMs; /* Last delay, the base delay after a reset. */
+    uint32_t ulConnectedAtMs;
+    bool xConnected;
+    ReconnectBackoffStats_t xStats;
+} ReconnectBackoff_t;
+
+/**
+ * @brief Initialize a reconnect backoff.
+ *
+ * @param[in] pxBackoff The backoff to initialize.
+ * @param[in] ulBaseMs Shortest delay.
+ * @param[in] ulMaxMs Longest delay.
+ * @param[in] ulStableMs Time a connection has to stay up to reset the backoff.
+ */
+void ReconnectBackoff_Init( ReconnectBackoff_t * pxBackoff,
+                            uint32_t ulBaseMs,
+                            uint32_t ulMaxMs,
+                            uint32_t ulStableMs );
+
+/**
+ * @brief Get the delay before the next attempt, after an attempt failed.
+ *
+ * @param[in] pxBackoff The backoff.
+ * @param[in] ulRandom A random number, e.g. from psa_generate_random().
+ *
+ * @return The delay in milliseconds.
+ */
+uint32_t ReconnectBackoff_NextDelay( ReconnectBackoff_t * pxBackoff,
+                                     uint32_t ulRandom );
+
+/**
+ * @brief Record that a connection was established.
+ *
+ * @param[in] pxBackoff The backoff.
+ * @param[in] ulNowMs The current time.
+ */
+void ReconnectBackoff_Connected( ReconnectBackoff_t * pxBackoff,
+                                 uint32_t ulNowMs );
+
+/**
+ * @brief Record that the connection was lost. Resets the backoff if the
+ * connection stayed up for the stable window.
+ *
+ * @param[in] pxBackoff The backoff.
+ * @param[in] ulNowMs The current time.
+ */
+void ReconnectBackoff_Disconnected( ReconnectBackoff_t * pxBackoff,
+                                    uint32_t ulNowMs );
+
+#endif /* RECONNECT_BACKOFF_H */
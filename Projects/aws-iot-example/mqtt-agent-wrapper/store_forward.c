@@ -0,0 +1,532 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file store_forward.c
+ * @brief Implements the store-and-forward queue for outgoing QoS1 publishes.
+ */
+
+/* Standard includes. */
+#include <stddef.h>
+#include <string.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+/* Header include. */
+#include "store_forward.h"
+
+#if ( STORE_FORWARD_USE_PSA_PS == 1 )
+    #include "psa/protected_storage.h"
+#endif
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "STORE FWD"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief States of a RAM slot.
+ */
+#define STORE_FORWARD_SLOT_FREE         ( 0U )
+#define STORE_FORWARD_SLOT_WRITING      ( 1U )
+#define STORE_FORWARD_SLOT_QUEUED       ( 2U )
+#define STORE_FORWARD_SLOT_IN_FLIGHT    ( 3U )
+#define STORE_FORWARD_SLOT_DONE         ( 4U )
+
+/**
+ * @brief A stored publish. This is also the layout written to Protected
+ * Storage, truncated after the payload.
+ */
+typedef struct StoreForwardEntry
+{
+    uint16_t usTopicLength;
+    uint16_t usPayloadLength;
+    char cTopic[ STORE_FORWARD_MAX_TOPIC_LENGTH ];
+    uint8_t ucPayload[ STORE_FORWARD_MAX_PAYLOAD_LENGTH ];
+} StoreForwardEntry_t;
+
+/**
+ * @brief A slot of the RAM ring.
+ */
+typedef struct StoreForwardSlot
+{
+    StoreForwardEntry_t xEntry;
+    MQTTPublishInfo_t xPublishInfo;
+    volatile uint8_t ucState;
+} StoreForwardSlot_t;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief The RAM ring. ulHead and ulTail are free running, slots between
+ * them are in use.
+ *
+ * @note The indexes and slot states are updated from the producers, the drain
+ * task and the agent task, so only within a critical section.
+ */
+static StoreForwardSlot_t xSlots[ STORE_FORWARD_RAM_SLOTS ];
+static uint32_t ulHead = 0U;
+static uint32_t ulTail = 0U;
+static uint32_t ulInFlight = 0U;
+
+/**
+ * @brief Spilled publishes are stored under consecutive UIDs from
+ * ulSpillHead to ulSpillTail, modulo STORE_FORWARD_PS_MAX_ENTRIES.
+ */
+static uint32_t ulSpillHead = 0U;
+static uint32_t ulSpillTail = 0U;
+
+/**
+ * @brief Counters reported by StoreForward_GetStats().
+ */
+static uint32_t ulSentCount = 0U;
+static uint32_t ulDroppedCount = 0U;
+
+/**
+ * @brief Serializes the producers with each other and with the drain task
+ * refilling the ring, so that the publishes keep their order across the
+ * spill.
+ */
+static SemaphoreHandle_t xStoreMutex = NULL;
+
+/**
+ * @brief The agent instance publishes are sent with, and the drain task.
+ */
+static MQTTAgentHandle_t xStoreAgent = NULL;
+static TaskHandle_t xDrainTask = NULL;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Passed into xMQTTAgentPublish() as the callback to execute when a
+ * stored publish completes. Runs in the MQTT agent task.
+ *
+ * @param[in] pxCommandContext The slot of the publish.
+ * @param[in] pxReturnInfo The result of the command.
+ */
+static void prvPublishCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                       MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Reserve the slot at the tail of the ring.
+ *
+ * @return The reserved slot, or NULL if the ring is full.
+ */
+static StoreForwardSlot_t * prvReserveSlot( void );
+
+/**
+ * @brief Point the publish info of a slot at its entry and mark it queued.
+ *
+ * @param[in] pxSlot A reserved slot holding an entry.
+ */
+static void prvCommitSlot( StoreForwardSlot_t * pxSlot );
+
+/**
+ * @brief Release the acknowledged slots at the head of the ring, then move
+ * spilled publishes into the free slots.
+ */
+static void prvRefillRing( void );
+
+/**
+ * @brief Send queued publishes until STORE_FORWARD_DRAIN_BURST are in flight.
+ *
+ * @return Number of publishes sent.
+ */
+static uint32_t prvSendQueued( void );
+
+/**
+ * @brief Task sending the stored publishes while the agent is connected.
+ *
+ * @param[in] pvParameters Not used.
+ */
+static void prvStoreForwardTask( void * pvParameters );
+
+/*-----------------------------------------------------------*/
+
+static void prvPublishCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                       MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    StoreForwardSlot_t * pxSlot = ( StoreForwardSlot_t * ) pxCommandContext;
+
+    taskENTER_CRITICAL();
+    {
+        if( pxReturnInfo->returnCode == MQTTSuccess )
+        {
+            pxSlot->ucState = STORE_FORWARD_SLOT_DONE;
+            ulSentCount++;
+        }
+        else
+        {
+            /* Sent again by a later burst. */
+            pxSlot->ucState = STORE_FORWARD_SLOT_QUEUED;
+        }
+
+        ulInFlight--;
+    }
+    taskEXIT_CRITICAL();
+
+    ( void ) xTaskNotifyGive( xDrainTask );
+}
+
+/*-----------------------------------------------------------*/
+
+static StoreForwardSlot_t * prvReserveSlot( void )
+{
+    StoreForwardSlot_t * pxSlot = NULL;
+
+    taskENTER_CRITICAL();
+    {
+        if( ( ulTail - ulHead ) < STORE_FORWARD_RAM_SLOTS )
+        {
+            pxSlot = &( xSlots[ ulTail % STORE_FORWARD_RAM_SLOTS ] );
+            pxSlot->ucState = STORE_FORWARD_SLOT_WRITING;
+            ulTail++;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    return pxSlot;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCommitSlot( StoreForwardSlot_t * pxSlot )
+{
+    memset( &( pxSlot->xPublishInfo ), 0x00, sizeof( MQTTPublishInfo_t ) );
+    pxSlot->xPublishInfo.qos = MQTTQoS1;
+    pxSlot->xPublishInfo.pTopicName = pxSlot->xEntry.cTopic;
+    pxSlot->xPublishInfo.topicNameLength = pxSlot->xEntry.usTopicLength;
+    pxSlot->xPublishInfo.pPayload = pxSlot->xEntry.ucPayload;
+    pxSlot->xPublishInfo.payloadLength = pxSlot->xEntry.usPayloadLength;
+
+    taskENTER_CRITICAL();
+    {
+        pxSlot->ucState = STORE_FORWARD_SLOT_QUEUED;
+    }
+    taskEXIT_CRITICAL();
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRefillRing( void )
+{
+    StoreForwardSlot_t * pxSlot = NULL;
+    bool xRefill = true;
+
+    ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+    taskENTER_CRITICAL();
+    {
+        while( ( ulHead != ulTail ) &&
+               ( xSlots[ ulHead % STORE_FORWARD_RAM_SLOTS ].ucState == STORE_FORWARD_SLOT_DONE ) )
+        {
+            xSlots[ ulHead % STORE_FORWARD_RAM_SLOTS ].ucState = STORE_FORWARD_SLOT_FREE;
+            ulHead++;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    #if ( STORE_FORWARD_USE_PSA_PS == 1 )
+        while( ( xRefill == true ) && ( ulSpillHead != ulSpillTail ) )
+        {
+            psa_storage_uid_t xUid = STORE_FORWARD_PS_UID_BASE + ( ulSpillHead % STORE_FORWARD_PS_MAX_ENTRIES );
+            size_t xLength = 0U;
+            psa_status_t xStatus;
+
+            pxSlot = prvReserveSlot();
+
+            if( pxSlot == NULL )
+            {
+                xRefill = false;
+            }
+            else
+            {
+                xStatus = psa_ps_get( xUid, 0U, sizeof( StoreForwardEntry_t ), &( pxSlot->xEntry ), &xLength );
+
+                if( ( xStatus != PSA_SUCCESS ) ||
+                    ( xLength < offsetof( StoreForwardEntry_t, ucPayload ) ) ||
+                    ( pxSlot->xEntry.usTopicLength > STORE_FORWARD_MAX_TOPIC_LENGTH ) ||
+                    ( pxSlot->xEntry.usPayloadLength > STORE_FORWARD_MAX_PAYLOAD_LENGTH ) )
+                {
+                    LogError( ( "Failed to read spilled publish %u, status %d. Dropping it.",
+                                ( unsigned int ) ulSpillHead,
+                                ( int ) xStatus ) );
+                    ulDroppedCount++;
+
+                    /* Nothing to send from this slot. */
+                    pxSlot->ucState = STORE_FORWARD_SLOT_DONE;
+                }
+                else
+                {
+                    prvCommitSlot( pxSlot );
+                }
+
+                ( void ) psa_ps_remove( xUid );
+                ulSpillHead++;
+            }
+        }
+    #else /* if ( STORE_FORWARD_USE_PSA_PS == 1 ) */
+        ( void ) pxSlot;
+        ( void ) xRefill;
+    #endif /* if ( STORE_FORWARD_USE_PSA_PS == 1 ) */
+
+    ( void ) xSemaphoreGive( xStoreMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvSendQueued( void )
+{
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+    StoreForwardSlot_t * pxSlot = NULL;
+    MQTTStatus_t xStatus = MQTTSuccess;
+    uint32_t ulIndex;
+    uint32_t ulSent = 0U;
+
+    /* The drain task is the only one sending, so the range cannot shrink below
+     * what is read here. */
+    for( ulIndex = ulHead; ( ulIndex != ulTail ) && ( xStatus == MQTTSuccess ); ulIndex++ )
+    {
+        pxSlot = NULL;
+
+        taskENTER_CRITICAL();
+        {
+            if( ( ulInFlight < STORE_FORWARD_DRAIN_BURST ) &&
+                ( xSlots[ ulIndex % STORE_FORWARD_RAM_SLOTS ].ucState == STORE_FORWARD_SLOT_QUEUED ) )
+            {
+                pxSlot = &( xSlots[ ulIndex % STORE_FORWARD_RAM_SLOTS ] );
+                pxSlot->ucState = STORE_FORWARD_SLOT_IN_FLIGHT;
+                ulInFlight++;
+            }
+        }
+        taskEXIT_CRITICAL();
+
+        if( ( pxSlot == NULL ) && ( ulInFlight >= STORE_FORWARD_DRAIN_BURST ) )
+        {
+            /* The window is full. */
+            xStatus = MQTTNoMemory;
+        }
+        else if( pxSlot != NULL )
+        {
+            /* Do not block the drain task if the agent queue or its
+             * in-flight window is full, the publish is retried in the next
+             * burst. */
+            xCommandParams.blockTimeMs = 0U;
+            xCommandParams.cmdCompleteCallback = prvPublishCommandCallback;
+            xCommandParams.pCmdCompleteCallbackContext = ( MQTTAgentCommandContext_t * ) pxSlot;
+
+            xStatus = xMQTTAgentPublish( xStoreAgent,
+                                         &( pxSlot->xPublishInfo ),
+                                         &xCommandParams,
+                                         0U );
+
+            if( xStatus != MQTTSuccess )
+            {
+                taskENTER_CRITICAL();
+                {
+                    pxSlot->ucState = STORE_FORWARD_SLOT_QUEUED;
+                    ulInFlight--;
+                }
+                taskEXIT_CRITICAL();
+            }
+            else
+            {
+                ulSent++;
+            }
+        }
+        else
+        {
+            /* Slot being written, in flight or already acknowledged. */
+        }
+    }
+
+    return ulSent;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvStoreForwardTask( void * pvParameters )
+{
+    uint32_t ulSent;
+
+    ( void ) pvParameters;
+
+    #if ( STORE_FORWARD_USE_PSA_PS == 1 )
+    {
+        uint32_t ulIndex;
+
+        /* Spilled publishes do not survive a reset, release their storage. */
+        for( ulIndex = 0U; ulIndex < STORE_FORWARD_PS_MAX_ENTRIES; ulIndex++ )
+        {
+            ( void ) psa_ps_remove( STORE_FORWARD_PS_UID_BASE + ulIndex );
+        }
+    }
+    #endif
+
+    for( ; ; )
+    {
+        vMQTTAgentWaitUntilConnected( xStoreAgent );
+
+        prvRefillRing();
+        ulSent = prvSendQueued();
+
+        if( ulSent > 0U )
+        {
+            LogDebug( ( "Sent %u stored publishes.", ( unsigned int ) ulSent ) );
+
+            /* Pace the bursts so that a backlog built up during an outage does
+             * not saturate the link once reconnected. */
+            vTaskDelay( pdMS_TO_TICKS( STORE_FORWARD_DRAIN_PERIOD_MS ) );
+        }
+        else
+        {
+            /* Woken up by a new publish or a completion. */
+            ( void ) ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( STORE_FORWARD_DRAIN_PERIOD_MS ) );
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void StoreForward_Start( MQTTAgentHandle_t xAgent )
+{
+    static StaticSemaphore_t xStoreMutexBuffer;
+    BaseType_t xResult;
+
+    configASSERT( xAgent != NULL );
+    configASSERT( xDrainTask == NULL );
+
+    xStoreAgent = xAgent;
+    xStoreMutex = xSemaphoreCreateMutexStatic( &xStoreMutexBuffer );
+    configASSERT( xStoreMutex );
+
+    xResult = xTaskCreate( prvStoreForwardTask,
+                           "Store Forward",
+                           STORE_FORWARD_TASK_STACK_SIZE,
+                           NULL,
+                           STORE_FORWARD_TASK_PRIORITY,
+                           &xDrainTask );
+    configASSERT( xResult == pdPASS );
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t StoreForward_Publish( const MQTTPublishInfo_t * pxPublishInfo )
+{
+    MQTTStatus_t xStatus = MQTTSuccess;
+    StoreForwardSlot_t * pxSlot = NULL;
+
+    configASSERT( xStoreMutex != NULL );
+
+    if( ( pxPublishInfo == NULL ) ||
+        ( pxPublishInfo->qos != MQTTQoS1 ) ||
+        ( pxPublishInfo->topicNameLength > STORE_FORWARD_MAX_TOPIC_LENGTH ) ||
+        ( pxPublishInfo->payloadLength > STORE_FORWARD_MAX_PAYLOAD_LENGTH ) )
+    {
+        LogError( ( "Only QoS1 publishes within the configured topic and payload limits can be stored." ) );
+        xStatus = MQTTBadParameter;
+    }
+    else
+    {
+        ( void ) xSemaphoreTake( xStoreMutex, portMAX_DELAY );
+
+        /* Publishes go to the ring only while nothing is spilled, so that they
+         * are sent in order. */
+        if( ulSpillHead == ulSpillTail )
+        {
+            pxSlot = prvReserveSlot();
+        }
+
+        if( pxSlot != NULL )
+        {
+            pxSlot->xEntry.usTopicLength = pxPublishInfo->topicNameLength;
+            pxSlot->xEntry.usPayloadLength = ( uint16_t ) pxPublishInfo->payloadLength;
+            memcpy( pxSlot->xEntry.cTopic, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength );
+
+            if( pxPublishInfo->payloadLength > 0U )
+            {
+                memcpy( pxSlot->xEntry.ucPayload, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
+            }
+
+            prvCommitSlot( pxSlot );
+        }
+
+        #if ( STORE_FORWARD_USE_PSA_PS == 1 )
+            else if( ( ulSpillTail - ulSpillHead ) < STORE_FORWARD_PS_MAX_ENTRIES )
+            {
+                static StoreForwardEntry_t xSpillEntry;
+                psa_status_t xPsaStatus;
+
+                xSpillEntry.usTopicLength = pxPublishInfo->topicNameLength;
+                xSpillEntry.usPayloadLength = ( uint16_t ) pxPublishInfo->payloadLength;
+                memcpy( xSpillEntry.cTopic, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength );
+
+                if( pxPublishInfo->payloadLength > 0U )
+                {
+                    memcpy( xSpillEntry.ucPayload, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
+                }
+
+                xPsaStatus = psa_ps_set( STORE_FORWARD_PS_UID_BASE + ( ulSpillTail % STORE_FORWARD_PS_MAX_ENTRIES ),
+                                         offsetof( StoreForwardEntry_t, ucPayload ) + pxPublishInfo->payloadLength,
+                                         &xSpillEntry,
+                                         PSA_STORAGE_FLAG_NONE );
+
+                if( xPsaStatus == PSA_SUCCESS )
+                {
+                    ulSpillTail++;
+                }
+                else
+                {
+                    LogError( ( "Failed to spill publish to Protected Storage, status %d.", ( int ) xPsaStatus ) );
+                    ulDroppedCount++;
+                    xStatus = MQTTNoMemory;
+                }
+            }
+        #endif /* if ( STORE_FORWARD_USE_PSA_PS == 1 ) */
+        else
+        {
+            LogWarn( ( "Store-and-forward queue is full, dropping publish." ) );
+            ulDroppedCount++;
+            xStatus = MQTTNoMemory;
+        }
+
+        ( void ) xSemaphoreGive( xStoreMutex );
+
+        if( ( xStatus == MQTTSuccess ) && ( xDrainTask != NULL ) )
+        {
+            ( void ) xTaskNotifyGive( xDrainTask );
+        }
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+void StoreForward_GetStats( StoreForwardStats_t * pxStats )
+{
+    configASSERT( pxStats != NULL );
+
+    taskENTER_CRITICAL();
+    {
+        pxStats->ulQueued = ulTail - ulHead;
+        pxStats->ulSpilled = ulSpillTail - ulSpillHead;
+        pxStats->ulSent = ulSentCount;
+        pxStats->ulDropped = ulDroppedCount;
+    }
+    taskEXIT_CRITICAL();
+}
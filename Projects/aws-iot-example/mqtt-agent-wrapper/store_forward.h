@@ -0,0 +1,134 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file store_forward.h
+ * @brief Store-and-forward queue for outgoing QoS1 publishes.
+ *
+ * StoreForward_Publish() copies a publish into a RAM ring and returns
+ * immediately, whether or not the broker is reachable. A drain task sends the
+ * queued publishes once the agent is connected, at most
+ * STORE_FORWARD_DRAIN_BURST at a time and no more often than every
+ * STORE_FORWARD_DRAIN_PERIOD_MS, and only releases a publish once the broker
+ * acknowledged it. When STORE_FORWARD_USE_PSA_PS is set, publishes that do not
+ * fit the ring are spilled to PSA Protected Storage and read back as the ring
+ * drains.
+ */
+#ifndef STORE_FORWARD_H
+#define STORE_FORWARD_H
+
+#include <stdint.h>
+
+/* MQTT library includes. */
+#include "core_mqtt.h"
+
+/* MQTT agent task header include. */
+#include "mqtt_agent_task.h"
+
+/**
+ * @brief Number of publishes held in RAM.
+ */
+#ifndef STORE_FORWARD_RAM_SLOTS
+    #define STORE_FORWARD_RAM_SLOTS    ( 16U )
+#endif
+
+/**
+ * @brief Longest topic name of a stored publish.
+ */
+#ifndef STORE_FORWARD_MAX_TOPIC_LENGTH
+    #define STORE_FORWARD_MAX_TOPIC_LENGTH    ( 64U )
+#endif
+
+/**
+ * @brief Largest payload of a stored publish.
+ */
+#ifndef STORE_FORWARD_MAX_PAYLOAD_LENGTH
+    #define STORE_FORWARD_MAX_PAYLOAD_LENGTH    ( 256U )
+#endif
+
+/**
+ * @brief Maximum number of stored publishes waiting for their PUBACK. This is
+ * also the number of publishes sent per drain period.
+ */
+#ifndef STORE_FORWARD_DRAIN_BURST
+    #define STORE_FORWARD_DRAIN_BURST    ( 4U )
+#endif
+
+/**
+ * @brief Minimum time between two bursts of stored publishes.
+ */
+#ifndef STORE_FORWARD_DRAIN_PERIOD_MS
+    #define STORE_FORWARD_DRAIN_PERIOD_MS    ( 250U )
+#endif
+
+/**
+ * @brief Set to 1 to spill publishes that do not fit the RAM ring to PSA
+ * Protected Storage.
+ *
+ * @note Spilled publishes are not recovered after a reset.
+ */
+#ifndef STORE_FORWARD_USE_PSA_PS
+    #define STORE_FORWARD_USE_PSA_PS    ( 0 )
+#endif
+
+/**
+ * @brief Maximum number of publishes spilled to Protected Storage, and the
+ * first of the consecutive UIDs they are stored under.
+ */
+#ifndef STORE_FORWARD_PS_MAX_ENTRIES
+    #define STORE_FORWARD_PS_MAX_ENTRIES    ( 32U )
+#endif
+#ifndef STORE_FORWARD_PS_UID_BASE
+    #define STORE_FORWARD_PS_UID_BASE    ( 0x53460000U )
+#endif
+
+/**
+ * @brief Stack size and priority of the drain task.
+ */
+#ifndef STORE_FORWARD_TASK_STACK_SIZE
+    #define STORE_FORWARD_TASK_STACK_SIZE    ( 1024 )
+#endif
+#ifndef STORE_FORWARD_TASK_PRIORITY
+    #define STORE_FORWARD_TASK_PRIORITY    ( tskIDLE_PRIORITY + 1 )
+#endif
+
+/**
+ * @brief Counters of the store-and-forward queue.
+ */
+typedef struct StoreForwardStats
+{
+    uint32_t ulQueued;    /**< Publishes waiting in RAM or in flight. */
+    uint32_t ulSpilled;   /**< Publishes waiting in Protected Storage. */
+    uint32_t ulSent;      /**< Publishes acknowledged by the broker. */
+    uint32_t ulDropped;   /**< Publishes rejected because the queue was full. */
+} StoreForwardStats_t;
+
+/**
+ * @brief Create the drain task of the store-and-forward queue.
+ *
+ * @param[in] xAgent The MQTT agent instance to publish with.
+ */
+void StoreForward_Start( MQTTAgentHandle_t xAgent );
+
+/**
+ * @brief Queue a QoS1 publish. Never waits for the connection.
+ *
+ * @param[in] pxPublishInfo The publish to queue. The topic and payload are
+ * copied.
+ *
+ * @return `MQTTSuccess` if the publish was queued, `MQTTBadParameter` if it is
+ * not a QoS1 publish or is larger than the configured limits, `MQTTNoMemory`
+ * if the queue is full.
+ */
+MQTTStatus_t StoreForward_Publish( const MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Read the counters of the queue.
+ *
+ * @param[out] pxStats The counters.
+ */
+void StoreForward_GetStats( StoreForwardStats_t * pxStats );
+
+#endif /* STORE_FORWARD_H */
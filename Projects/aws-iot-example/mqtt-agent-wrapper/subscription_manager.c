@@ -29,44 +29,1007 @@
 /**
  * @file subscription_manager.c
  * @brief Functions for managing MQTT subscriptions.
+ *
+ * The topic filters of a subscription list are indexed by a trie with one
+ * node per topic filter level, wildcards included. An incoming topic is
+ * matched by walking down the trie one topic level at a time, following the
+ * node equal to the level and the "+" and "#" nodes, so dispatch does not
+ * depend on the number of subscriptions.
+ */
+
+/* Standard includes. */
+#include <string.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "SUB MGR"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/* Subscription manager header include. */
+#include "subscription_manager.h"
+
+/**
+ * @brief Node index stored in the trie links when there is no node.
+ */
+#define TRIE_NO_NODE    ( 0U )
+
+/**
+ * @brief Get the trie node of a link.
+ */
+#define TRIE_NODE( usLink )    ( &( xTrieNodes[ ( usLink ) - 1U ] ) )
+
+/**
+ * @brief Size of the header of a topic filter stored in the arena.
+ */
+#define FILTER_HEADER_SIZE     ( sizeof( FilterArenaHeader_t ) )
+
+/**
+ * @brief Test, set and clear the bit of a subscription in a mask.
+ */
+#define MASK_BIT( ulIndex )              ( 1UL << ( ( ulIndex ) % 32U ) )
+#define MASK_TEST( pxMask, ulIndex )     ( ( ( pxMask )->ulWords[ ( ulIndex ) / 32U ] & MASK_BIT( ulIndex ) ) != 0U )
+#define MASK_SET( pxMask, ulIndex )      ( ( pxMask )->ulWords[ ( ulIndex ) / 32U ] |= MASK_BIT( ulIndex ) )
+#define MASK_CLEAR( pxMask, ulIndex )    ( ( pxMask )->ulWords[ ( ulIndex ) / 32U ] &= ~MASK_BIT( ulIndex ) )
+
+/**
+ * @brief Outcomes of prvAddSubscription().
+ */
+#define ADD_SUBSCRIPTION_ADDED        ( 0U )
+#define ADD_SUBSCRIPTION_EXISTS       ( 1U )
+#define ADD_SUBSCRIPTION_LIST_FULL    ( 2U )
+#define ADD_SUBSCRIPTION_NO_FILTER    ( 3U )
+#define ADD_SUBSCRIPTION_NO_NODE      ( 4U )
+#define ADD_SUBSCRIPTION_NO_ELEMENT   ( 5U )
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Header of a topic filter stored in the arena, followed by the topic
+ * filter and a terminating NUL. An entry whose usReferences is 0 is free and
+ * can be reused by a topic filter of up to usCapacity bytes.
+ */
+typedef struct FilterArenaHeader
+{
+    uint16_t usReferences;
+    uint16_t usCapacity;
+    uint16_t usLength;
+} FilterArenaHeader_t;
+
+/**
+ * @brief Callbacks of a subscription matching an incoming publish, copied out
+ * of the list so that they can be called without holding on to the list.
  */
+typedef struct SubscriptionTarget
+{
+    IncomingPubCallback_t pxCallback;
+    IncomingPubChunkCallback_t pxChunkCallback;
+    void * pvContext;
+} SubscriptionTarget_t;
+
+/**
+ * @brief Subscriptions of all the subscription lists. A subscription is free
+ * while its usFilterStringLength is 0.
+ *
+ * @note Only modified between prvWriteBegin() and prvWriteEnd().
+ */
+static SubscriptionElement_t xSubscriptionPool[ SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE ];
+
+/**
+ * @brief Trie nodes of all the subscription lists. A node is free while its
+ * xPassMask is empty.
+ *
+ * @note Only modified between prvWriteBegin() and prvWriteEnd().
+ */
+static SubscriptionTrieNode_t xTrieNodes[ SUBSCRIPTION_MANAGER_MAX_TRIE_NODES ];
+
+/**
+ * @brief Topic filters of all the subscription lists. Entries are packed from
+ * the start of the arena up to usFilterArenaTop. Freed entries are reused but
+ * never moved, so a stored topic filter stays at the same address for as long
+ * as it is subscribed to.
+ *
+ * @note Only modified between prvWriteBegin() and prvWriteEnd().
+ */
+static uint16_t usFilterArena[ SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE / sizeof( uint16_t ) ];
+static uint16_t usFilterArenaTop = 0U;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Start modifying a subscription list, or the shared pools.
+ *
+ * Writers are serialized by suspending the scheduler, which on a single core
+ * also makes every modification atomic with respect to the agent task reading
+ * the list. The sequence number of the list is odd while it is modified, and
+ * changes with every modification, so that a reader can detect that the list
+ * was modified while it walked it. Nothing may block until prvWriteEnd().
+ *
+ * @param[in] pxSubscriptionList The list to modify, or NULL for the pools only.
+ */
+static void prvWriteBegin( SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Done modifying a subscription list.
+ *
+ * @param[in] pxSubscriptionList The list given to prvWriteBegin().
+ */
+static void prvWriteEnd( SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Collect the callbacks of the subscriptions matching an incoming
+ * publish, retrying until no writer modified the list during the walk.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] pxPublishInfo The incoming publish.
+ * @param[out] pxTargets The callbacks of the matching subscriptions, in
+ * subscription order.
+ *
+ * @return Number of matching subscriptions.
+ */
+static uint32_t prvReadMatches( const SubscriptionList_t * pxSubscriptionList,
+                                const MQTTPublishInfo_t * pxPublishInfo,
+                                SubscriptionTarget_t * pxTargets );
+
+/**
+ * @brief Check whether a mask has no subscription.
+ *
+ * @param[in] pxMask The mask.
+ *
+ * @return `true` if no bit is set.
+ */
+static bool prvMaskIsEmpty( const SubscriptionMask_t * pxMask );
+
+/**
+ * @brief Add the subscriptions of a mask to another one.
+ *
+ * @param[in,out] pxTo The mask added to.
+ * @param[in] pxFrom The subscriptions to add.
+ */
+static void prvMaskAdd( SubscriptionMask_t * pxTo,
+                        const SubscriptionMask_t * pxFrom );
+
+/**
+ * @brief Allocate a trie node.
+ *
+ * @param[in] ulIndex Index of the subscription the node is allocated for.
+ *
+ * @return Index + 1 of the node, or 0 if all nodes are in use.
+ */
+static uint16_t prvAllocateTrieNode( uint32_t ulIndex );
+
+/**
+ * @brief Get a stored copy of a topic filter, storing it if no subscription
+ * uses the same topic filter yet.
+ *
+ * @param[in] pcTopicFilterString The topic filter.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ *
+ * @return The stored copy, or NULL if the arena is full.
+ */
+static const char * prvInternFilter( const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength );
+
+/**
+ * @brief Drop a reference to a stored topic filter, freeing it with the last
+ * reference.
+ *
+ * @param[in] pcStoredFilter A topic filter returned by prvInternFilter().
+ */
+static void prvReleaseFilter( const char * pcStoredFilter );
+
+/**
+ * @brief Compare the level of a trie node with a topic or topic filter level.
+ *
+ * @param[in] pxNode The trie node.
+ * @param[in] pcLevel The level.
+ * @param[in] usLevelLength Length of the level.
+ *
+ * @return `true` if the node holds the level.
+ */
+static bool prvTrieLevelEquals( const SubscriptionTrieNode_t * pxNode,
+                                const char * pcLevel,
+                                uint16_t usLevelLength );
+
+/**
+ * @brief Find the end of a topic or topic filter level.
+ *
+ * @param[in] pcString The topic or topic filter.
+ * @param[in] usLength Length of pcString.
+ * @param[in] usLevelStart Offset of the level.
+ *
+ * @return Offset of the '/' ending the level, or usLength for the last level.
+ */
+static uint16_t prvLevelEnd( const char * pcString,
+                             uint16_t usLength,
+                             uint16_t usLevelStart );
+
+/**
+ * @brief Add the topic filter of a subscription to the trie.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] ulIndex Index of the subscription, already filled in.
+ *
+ * @return `false` if the trie ran out of nodes. The trie is left unchanged.
+ */
+static bool prvTrieInsert( SubscriptionList_t * pxSubscriptionList,
+                           uint32_t ulIndex );
+
+/**
+ * @brief Remove the topic filter of a subscription from the trie, freeing the
+ * nodes no other subscription goes through.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] ulIndex Index of the subscription, still filled in.
+ */
+static void prvTrieRemove( SubscriptionList_t * pxSubscriptionList,
+                           uint32_t ulIndex );
+
+/**
+ * @brief Collect the subscriptions matching a topic, starting at one level of
+ * the topic and at the children of the trie node matching the level above.
+ *
+ * @param[in] usChild First child of the node matching the level above.
+ * @param[in] pcTopic The topic name.
+ * @param[in] usTopicLength Length of the topic name.
+ * @param[in] usLevelStart Offset of the level to match.
+ * @param[in,out] pxMatched The matching subscriptions are added to it.
+ * @param[in,out] pulNodesLeft Number of nodes the walk may still visit. A
+ * walk racing with a writer may see the trie in a shape it never had, and
+ * could loop without this bound.
+ */
+static void prvTrieMatch( uint16_t usChild,
+                          const char * pcTopic,
+                          uint16_t usTopicLength,
+                          uint16_t usLevelStart,
+                          SubscriptionMask_t * pxMatched,
+                          uint32_t * pulNodesLeft );
+
+/**
+ * @brief Add a subscription to a list being modified.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] pcTopicFilterString Topic filter of the subscription.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] xQoS QoS of the subscription.
+ * @param[in] pxIncomingPublishCallback Callback of the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context of the callback.
+ *
+ * @return One of the ADD_SUBSCRIPTION_ outcomes.
+ */
+static uint8_t prvAddSubscription( SubscriptionList_t * pxSubscriptionList,
+                                   const char * pcTopicFilterString,
+                                   uint16_t usTopicFilterLength,
+                                   MQTTQoS_t xQoS,
+                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                   void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Log the outcome of prvAddSubscription(), once the list is released.
+ *
+ * @param[in] ucOutcome The outcome.
+ * @param[in] pcTopicFilterString Topic filter of the subscription.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ */
+static void prvLogAddOutcome( uint8_t ucOutcome,
+                              const char * pcTopicFilterString,
+                              uint16_t usTopicFilterLength );
+
+/**
+ * @brief Find the subscriptions whose topic filter is exactly the given one.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] pcTopicFilterString The topic filter.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[out] pxEndMask The subscriptions.
+ */
+static void prvFindFilter( const SubscriptionList_t * pxSubscriptionList,
+                           const char * pcTopicFilterString,
+                           uint16_t usTopicFilterLength,
+                           SubscriptionMask_t * pxEndMask );
+
+/**
+ * @brief Count the subscriptions of a mask and their highest QoS.
+ *
+ * @param[in] pxMask The subscriptions.
+ * @param[out] pxReferences The count and highest QoS.
+ */
+static void prvCountReferences( const SubscriptionMask_t * pxMask,
+                                SubscriptionReferences_t * pxReferences );
+
+/*-----------------------------------------------------------*/
+
+static void prvWriteBegin( SubscriptionList_t * pxSubscriptionList )
+{
+    vTaskSuspendAll();
+
+    if( pxSubscriptionList != NULL )
+    {
+        pxSubscriptionList->ulSequence++;
+        portMEMORY_BARRIER();
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvWriteEnd( SubscriptionList_t * pxSubscriptionList )
+{
+    if( pxSubscriptionList != NULL )
+    {
+        portMEMORY_BARRIER();
+        pxSubscriptionList->ulSequence++;
+    }
+
+    ( void ) xTaskResumeAll();
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvMaskIsEmpty( const SubscriptionMask_t * pxMask )
+{
+    bool xEmpty = true;
+    uint32_t ulWord;
+
+    for( ulWord = 0U; ulWord < SUBSCRIPTION_MASK_WORDS; ulWord++ )
+    {
+        if( pxMask->ulWords[ ulWord ] != 0U )
+        {
+            xEmpty = false;
+            break;
+        }
+    }
+
+    return xEmpty;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvMaskAdd( SubscriptionMask_t * pxTo,
+                        const SubscriptionMask_t * pxFrom )
+{
+    uint32_t ulWord;
+
+    for( ulWord = 0U; ulWord < SUBSCRIPTION_MASK_WORDS; ulWord++ )
+    {
+        pxTo->ulWords[ ulWord ] |= pxFrom->ulWords[ ulWord ];
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvAllocateTrieNode( uint32_t ulIndex )
+{
+    uint16_t usNode = TRIE_NO_NODE;
+    uint32_t ulNode;
+
+    for( ulNode = 0U; ulNode < SUBSCRIPTION_MANAGER_MAX_TRIE_NODES; ulNode++ )
+    {
+        if( prvMaskIsEmpty( &( xTrieNodes[ ulNode ].xPassMask ) ) == true )
+        {
+            MASK_SET( &( xTrieNodes[ ulNode ].xPassMask ), ulIndex );
+            usNode = ( uint16_t ) ( ulNode + 1U );
+            break;
+        }
+    }
+
+    return usNode;
+}
+
+/*-----------------------------------------------------------*/
+
+static const char * prvInternFilter( const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength )
+{
+    uint8_t * pucArena = ( uint8_t * ) usFilterArena;
+    FilterArenaHeader_t * pxHeader;
+    FilterArenaHeader_t * pxFree = NULL;
+    const char * pcStoredFilter = NULL;
+    uint32_t ulOffset;
+    uint32_t ulEntrySize;
+
+    /* Round the entry up so that the next header stays aligned. */
+    ulEntrySize = ( FILTER_HEADER_SIZE + usTopicFilterLength + 1U + 1U ) & ~1UL;
+
+    for( ulOffset = 0U; ulOffset < usFilterArenaTop; ulOffset += FILTER_HEADER_SIZE + pxHeader->usCapacity )
+    {
+        pxHeader = ( FilterArenaHeader_t * ) &( pucArena[ ulOffset ] );
+
+        if( pxHeader->usReferences == 0U )
+        {
+            if( ( pxFree == NULL ) && ( ( FILTER_HEADER_SIZE + pxHeader->usCapacity ) >= ulEntrySize ) )
+            {
+                pxFree = pxHeader;
+            }
+        }
+        else if( ( pxHeader->usLength == usTopicFilterLength ) &&
+                 ( memcmp( &( pucArena[ ulOffset + FILTER_HEADER_SIZE ] ), pcTopicFilterString, usTopicFilterLength ) == 0 ) )
+        {
+            pxHeader->usReferences++;
+            pcStoredFilter = ( const char * ) &( pucArena[ ulOffset + FILTER_HEADER_SIZE ] );
+            break;
+        }
+        else
+        {
+            /* Another topic filter. */
+        }
+    }
+
+    if( pcStoredFilter == NULL )
+    {
+        if( ( pxFree == NULL ) && ( ( usFilterArenaTop + ulEntrySize ) <= sizeof( usFilterArena ) ) )
+        {
+            pxFree = ( FilterArenaHeader_t * ) &( pucArena[ usFilterArenaTop ] );
+            pxFree->usCapacity = ( uint16_t ) ( ulEntrySize - FILTER_HEADER_SIZE );
+            usFilterArenaTop += ( uint16_t ) ulEntrySize;
+        }
+
+        if( pxFree != NULL )
+        {
+            pxFree->usReferences = 1U;
+            pxFree->usLength = usTopicFilterLength;
+            memcpy( &( pxFree[ 1 ] ), pcTopicFilterString, usTopicFilterLength );
+            ( ( char * ) &( pxFree[ 1 ] ) )[ usTopicFilterLength ] = '\0';
+            pcStoredFilter = ( const char * ) &( pxFree[ 1 ] );
+        }
+    }
+
+    return pcStoredFilter;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvReleaseFilter( const char * pcStoredFilter )
+{
+    uint8_t * pucArena = ( uint8_t * ) usFilterArena;
+    FilterArenaHeader_t * pxHeader = ( ( FilterArenaHeader_t * ) pcStoredFilter ) - 1;
+    uint32_t ulOffset;
+    uint32_t ulUsedTop = 0U;
+
+    configASSERT( pxHeader->usReferences > 0U );
+    pxHeader->usReferences--;
+
+    if( pxHeader->usReferences == 0U )
+    {
+        /* Give the free entries at the end of the arena back to it. */
+        for( ulOffset = 0U; ulOffset < usFilterArenaTop; ulOffset += FILTER_HEADER_SIZE + pxHeader->usCapacity )
+        {
+            pxHeader = ( FilterArenaHeader_t * ) &( pucArena[ ulOffset ] );
+
+            if( pxHeader->usReferences != 0U )
+            {
+                ulUsedTop = ulOffset + FILTER_HEADER_SIZE + pxHeader->usCapacity;
+            }
+        }
+
+        usFilterArenaTop = ( uint16_t ) ulUsedTop;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvTrieLevelEquals( const SubscriptionTrieNode_t * pxNode,
+                                const char * pcLevel,
+                                uint16_t usLevelLength )
+{
+    const char * pcFilter = xSubscriptionPool[ pxNode->usOwner ].pcSubscriptionFilterString;
+
+    /* A reader racing with a writer may reach a node whose owner was just
+     * removed, or even given to another list. It retries once it notices the
+     * write. */
+    return( ( pcFilter != NULL ) &&
+            ( pxNode->usLength == usLevelLength ) &&
+            ( strncmp( &( pcFilter[ pxNode->usOffset ] ), pcLevel, usLevelLength ) == 0 ) );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvLevelEnd( const char * pcString,
+                             uint16_t usLength,
+                             uint16_t usLevelStart )
+{
+    uint16_t usLevelEnd = usLevelStart;
+
+    while( ( usLevelEnd < usLength ) && ( pcString[ usLevelEnd ] != '/' ) )
+    {
+        usLevelEnd++;
+    }
+
+    return usLevelEnd;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvTrieInsert( SubscriptionList_t * pxSubscriptionList,
+                           uint32_t ulIndex )
+{
+    const SubscriptionElement_t * pxSubscription = &( xSubscriptionPool[ ulIndex ] );
+    uint16_t * pusLink = &( pxSubscriptionList->usTrieRoot );
+    SubscriptionTrieNode_t * pxNode = NULL;
+    uint16_t usChild;
+    uint16_t usLevelStart = 0U;
+    uint16_t usLevelEnd;
+    bool xInserted = true;
+
+    do
+    {
+        usLevelEnd = prvLevelEnd( pxSubscription->pcSubscriptionFilterString,
+                                  pxSubscription->usFilterStringLength,
+                                  usLevelStart );
+
+        usChild = *pusLink;
+
+        while( ( usChild != TRIE_NO_NODE ) &&
+               ( prvTrieLevelEquals( TRIE_NODE( usChild ),
+                                     &( pxSubscription->pcSubscriptionFilterString[ usLevelStart ] ),
+                                     usLevelEnd - usLevelStart ) == false ) )
+        {
+            usChild = TRIE_NODE( usChild )->usNextSibling;
+        }
+
+        if( usChild == TRIE_NO_NODE )
+        {
+            usChild = prvAllocateTrieNode( ulIndex );
+
+            if( usChild != TRIE_NO_NODE )
+            {
+                pxNode = TRIE_NODE( usChild );
+                memset( &( pxNode->xEndMask ), 0x00, sizeof( SubscriptionMask_t ) );
+                pxNode->usOffset = usLevelStart;
+                pxNode->usLength = usLevelEnd - usLevelStart;
+                pxNode->usFirstChild = TRIE_NO_NODE;
+                pxNode->usNextSibling = *pusLink;
+                pxNode->usOwner = ( uint16_t ) ulIndex;
+                *pusLink = usChild;
+            }
+        }
+
+        if( usChild == TRIE_NO_NODE )
+        {
+            xInserted = false;
+        }
+        else
+        {
+            pxNode = TRIE_NODE( usChild );
+            MASK_SET( &( pxNode->xPassMask ), ulIndex );
+            pusLink = &( pxNode->usFirstChild );
+            usLevelStart = usLevelEnd + 1U;
+        }
+    } while( ( xInserted == true ) && ( usLevelEnd < pxSubscription->usFilterStringLength ) );
+
+    if( xInserted == true )
+    {
+        MASK_SET( &( pxNode->xEndMask ), ulIndex );
+    }
+    else
+    {
+        /* Undo the levels inserted so far. */
+        prvTrieRemove( pxSubscriptionList, ulIndex );
+    }
+
+    return xInserted;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTrieRemove( SubscriptionList_t * pxSubscriptionList,
+                           uint32_t ulIndex )
+{
+    const SubscriptionElement_t * pxSubscription = &( xSubscriptionPool[ ulIndex ] );
+    uint16_t * pusLink = &( pxSubscriptionList->usTrieRoot );
+    SubscriptionTrieNode_t * pxNode;
+    uint16_t usLevelStart = 0U;
+    uint16_t usLevelEnd;
+    uint32_t ulOwner;
+
+    do
+    {
+        usLevelEnd = prvLevelEnd( pxSubscription->pcSubscriptionFilterString,
+                                  pxSubscription->usFilterStringLength,
+                                  usLevelStart );
+
+        /* Find the link to the node of the level, so that the node can be
+         * unlinked. */
+        while( ( *pusLink != TRIE_NO_NODE ) &&
+               ( ( MASK_TEST( &( TRIE_NODE( *pusLink )->xPassMask ), ulIndex ) == false ) ||
+                 ( prvTrieLevelEquals( TRIE_NODE( *pusLink ),
+                                       &( pxSubscription->pcSubscriptionFilterString[ usLevelStart ] ),
+                                       usLevelEnd - usLevelStart ) == false ) ) )
+        {
+            pusLink = &( TRIE_NODE( *pusLink )->usNextSibling );
+        }
+
+        if( *pusLink != TRIE_NO_NODE )
+        {
+            pxNode = TRIE_NODE( *pusLink );
+            MASK_CLEAR( &( pxNode->xPassMask ), ulIndex );
+            MASK_CLEAR( &( pxNode->xEndMask ), ulIndex );
+
+            if( prvMaskIsEmpty( &( pxNode->xPassMask ) ) == true )
+            {
+                /* No other filter goes through the node, nor through the nodes
+                 * below it on this path. Their text is still readable from
+                 * this subscription until they are reached. */
+                *pusLink = pxNode->usNextSibling;
+            }
+            else if( pxNode->usOwner == ( uint16_t ) ulIndex )
+            {
+                for( ulOwner = 0U; MASK_TEST( &( pxNode->xPassMask ), ulOwner ) == false; ulOwner++ )
+                {
+                }
+
+                pxNode->usOwner = ( uint16_t ) ulOwner;
+            }
+            else
+            {
+                /* The node still reads its text from another subscription. */
+            }
+
+            pusLink = &( pxNode->usFirstChild );
+            usLevelStart = usLevelEnd + 1U;
+        }
+    } while( ( *pusLink != TRIE_NO_NODE ) && ( usLevelEnd < pxSubscription->usFilterStringLength ) );
+}
+
+/*-----------------------------------------------------------*/
 
-/* Standard includes. */
-#include <string.h>
+static void prvTrieMatch( uint16_t usChild,
+                          const char * pcTopic,
+                          uint16_t usTopicLength,
+                          uint16_t usLevelStart,
+                          SubscriptionMask_t * pxMatched,
+                          uint32_t * pulNodesLeft )
+{
+    const SubscriptionTrieNode_t * pxNode;
+    const SubscriptionTrieNode_t * pxGrandChild;
+    uint16_t usLevelEnd = prvLevelEnd( pcTopic, usTopicLength, usLevelStart );
+    uint16_t usGrandChild;
+    bool xWildcardAllowed;
+    bool xLevelMatched;
 
-/* Include header that defines log levels. */
-#include "logging_levels.h"
+    /* Topics starting with '$' are not matched by a wildcard in the first
+     * level of a filter. */
+    xWildcardAllowed = ( usLevelStart > 0U ) || ( usTopicLength == 0U ) || ( pcTopic[ 0 ] != '$' );
 
-/* Configure name and log level. */
-#ifndef LIBRARY_LOG_NAME
-    #define LIBRARY_LOG_NAME     "SUB MGR"
-#endif
-#ifndef LIBRARY_LOG_LEVEL
-    #define LIBRARY_LOG_LEVEL    LOG_INFO
-#endif
-#include "logging_stack.h"
+    while( ( usChild != TRIE_NO_NODE ) && ( *pulNodesLeft > 0U ) )
+    {
+        pxNode = TRIE_NODE( usChild );
+        ( *pulNodesLeft )--;
 
-/* Subscription manager header include. */
-#include "subscription_manager.h"
+        if( prvTrieLevelEquals( pxNode, "#", 1U ) == true )
+        {
+            xLevelMatched = false;
 
-/**
- * @brief The global array of subscription elements.
- *
- * @note No thread safety is required to this array, since the updates the array
- * elements are done only from one task at a time. The subscription manager
- * implementation expects that the array of the subscription elements used for
- * storing subscriptions to be initialized to 0. As this is a global array, it
- * will be intialized to 0 by default.
- */
-SubscriptionElement_t xGlobalSubscriptionList[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+            if( xWildcardAllowed == true )
+            {
+                prvMaskAdd( pxMatched, &( pxNode->xEndMask ) );
+            }
+        }
+        else if( prvTrieLevelEquals( pxNode, "+", 1U ) == true )
+        {
+            xLevelMatched = xWildcardAllowed;
+        }
+        else
+        {
+            xLevelMatched = prvTrieLevelEquals( pxNode,
+                                                &( pcTopic[ usLevelStart ] ),
+                                                usLevelEnd - usLevelStart );
+        }
+
+        if( xLevelMatched == false )
+        {
+            /* Not this branch. */
+        }
+        else if( usLevelEnd < usTopicLength )
+        {
+            /* The depth of the recursion is bounded by the number of levels
+             * of the longest topic filter. */
+            prvTrieMatch( pxNode->usFirstChild,
+                          pcTopic,
+                          usTopicLength,
+                          usLevelEnd + 1U,
+                          pxMatched,
+                          pulNodesLeft );
+        }
+        else
+        {
+            prvMaskAdd( pxMatched, &( pxNode->xEndMask ) );
+
+            /* "a/#" also matches "a". */
+            for( usGrandChild = pxNode->usFirstChild; usGrandChild != TRIE_NO_NODE; usGrandChild = pxGrandChild->usNextSibling )
+            {
+                pxGrandChild = TRIE_NODE( usGrandChild );
+
+                if( prvTrieLevelEquals( pxGrandChild, "#", 1U ) == true )
+                {
+                    prvMaskAdd( pxMatched, &( pxGrandChild->xEndMask ) );
+                }
+            }
+        }
+
+        usChild = pxNode->usNextSibling;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvReadMatches( const SubscriptionList_t * pxSubscriptionList,
+                                const MQTTPublishInfo_t * pxPublishInfo,
+                                SubscriptionTarget_t * pxTargets )
+{
+    const SubscriptionElement_t * pxSubscription;
+    SubscriptionMask_t xMatched;
+    uint32_t ulSequence;
+    uint32_t ulNodesLeft;
+    uint32_t ulIndex;
+    uint32_t ulCount;
+
+    do
+    {
+        ulSequence = pxSubscriptionList->ulSequence;
+        portMEMORY_BARRIER();
+
+        ulNodesLeft = SUBSCRIPTION_MANAGER_MAX_TRIE_NODES;
+        memset( &xMatched, 0x00, sizeof( xMatched ) );
+        prvTrieMatch( pxSubscriptionList->usTrieRoot,
+                      pxPublishInfo->pTopicName,
+                      pxPublishInfo->topicNameLength,
+                      0U,
+                      &xMatched,
+                      &ulNodesLeft );
+        ulCount = 0U;
+
+        /* A walk racing with a writer may collect subscriptions of another
+         * list, and more than a list holds. */
+        for( ulIndex = 0U; ( ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE ) && ( ulCount < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ); ulIndex++ )
+        {
+            if( MASK_TEST( &xMatched, ulIndex ) == true )
+            {
+                pxSubscription = &( xSubscriptionPool[ ulIndex ] );
+                pxTargets[ ulCount ].pxCallback = pxSubscription->pxIncomingPublishCallback;
+                pxTargets[ ulCount ].pxChunkCallback = pxSubscription->pxIncomingPublishChunkCallback;
+                pxTargets[ ulCount ].pvContext = pxSubscription->pvIncomingPublishCallbackContext;
+                ulCount++;
+            }
+        }
+
+        portMEMORY_BARRIER();
+    } while( ( ( ulSequence & 1UL ) != 0U ) || ( ulSequence != pxSubscriptionList->ulSequence ) );
+
+    return ulCount;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint8_t prvAddSubscription( SubscriptionList_t * pxSubscriptionList,
+                                   const char * pcTopicFilterString,
+                                   uint16_t usTopicFilterLength,
+                                   MQTTQoS_t xQoS,
+                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                   void * pvIncomingPublishCallbackContext )
+{
+    SubscriptionElement_t * pxSubscriptions = xSubscriptionPool;
+    const char * pcStoredFilter = NULL;
+    uint32_t ulIndex;
+    uint32_t ulMembers = 0U;
+    size_t xAvailableIndex = SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE;
+    uint8_t ucOutcome = ADD_SUBSCRIPTION_NO_ELEMENT;
+
+    /* Find the first free subscription of the pool, and look for duplicates
+     * in the list. */
+    for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE; ulIndex++ )
+    {
+        if( MASK_TEST( &( pxSubscriptionList->xMembers ), ulIndex ) == false )
+        {
+            if( ( xAvailableIndex == SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE ) &&
+                ( pxSubscriptions[ ulIndex ].usFilterStringLength == 0U ) )
+            {
+                xAvailableIndex = ulIndex;
+            }
+        }
+        else if( ( pxSubscriptions[ ulIndex ].usFilterStringLength == usTopicFilterLength ) &&
+                 ( strncmp( pcTopicFilterString, pxSubscriptions[ ulIndex ].pcSubscriptionFilterString, ( size_t ) usTopicFilterLength ) == 0 ) &&
+                 ( pxSubscriptions[ ulIndex ].pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+                 ( pxSubscriptions[ ulIndex ].pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
+        {
+            /* If a subscription already exists, don't do anything. */
+            ucOutcome = ADD_SUBSCRIPTION_EXISTS;
+            break;
+        }
+        else
+        {
+            ulMembers++;
+        }
+    }
+
+    if( ucOutcome == ADD_SUBSCRIPTION_EXISTS )
+    {
+        /* Nothing to add. */
+    }
+    else if( ulMembers >= SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+    {
+        ucOutcome = ADD_SUBSCRIPTION_LIST_FULL;
+    }
+    else if( xAvailableIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE )
+    {
+        pcStoredFilter = prvInternFilter( pcTopicFilterString, usTopicFilterLength );
+        ucOutcome = ADD_SUBSCRIPTION_NO_FILTER;
+    }
+    else
+    {
+        /* The pool is used up by the other lists. */
+    }
+
+    if( pcStoredFilter != NULL )
+    {
+        pxSubscriptions[ xAvailableIndex ].pcSubscriptionFilterString = pcStoredFilter;
+        pxSubscriptions[ xAvailableIndex ].usFilterStringLength = usTopicFilterLength;
+        pxSubscriptions[ xAvailableIndex ].xQoS = xQoS;
+        pxSubscriptions[ xAvailableIndex ].pxIncomingPublishCallback = pxIncomingPublishCallback;
+        pxSubscriptions[ xAvailableIndex ].pxIncomingPublishChunkCallback = NULL;
+        pxSubscriptions[ xAvailableIndex ].pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+
+        if( prvTrieInsert( pxSubscriptionList, ( uint32_t ) xAvailableIndex ) == true )
+        {
+            MASK_SET( &( pxSubscriptionList->xMembers ), xAvailableIndex );
+            ucOutcome = ADD_SUBSCRIPTION_ADDED;
+        }
+        else
+        {
+            memset( &( pxSubscriptions[ xAvailableIndex ] ), 0x00, sizeof( SubscriptionElement_t ) );
+            prvReleaseFilter( pcStoredFilter );
+            ucOutcome = ADD_SUBSCRIPTION_NO_NODE;
+        }
+    }
+
+    return ucOutcome;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvLogAddOutcome( uint8_t ucOutcome,
+                              const char * pcTopicFilterString,
+                              uint16_t usTopicFilterLength )
+{
+    if( ucOutcome == ADD_SUBSCRIPTION_EXISTS )
+    {
+        LogWarn( ( "Subscription already exists.\n" ) );
+    }
+    else if( ucOutcome == ADD_SUBSCRIPTION_NO_NODE )
+    {
+        LogError( ( "No trie node left for topic filter %.*s.",
+                    ( int ) usTopicFilterLength,
+                    pcTopicFilterString ) );
+    }
+    else if( ucOutcome == ADD_SUBSCRIPTION_NO_FILTER )
+    {
+        LogError( ( "No room in the filter arena for topic filter %.*s.",
+                    ( int ) usTopicFilterLength,
+                    pcTopicFilterString ) );
+    }
+    else if( ucOutcome == ADD_SUBSCRIPTION_NO_ELEMENT )
+    {
+        LogError( ( "No subscription left in the pool for topic filter %.*s.",
+                    ( int ) usTopicFilterLength,
+                    pcTopicFilterString ) );
+    }
+    else
+    {
+        /* Added, or the list is full. */
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvFindFilter( const SubscriptionList_t * pxSubscriptionList,
+                           const char * pcTopicFilterString,
+                           uint16_t usTopicFilterLength,
+                           SubscriptionMask_t * pxEndMask )
+{
+    uint16_t usChild = pxSubscriptionList->usTrieRoot;
+    const SubscriptionTrieNode_t * pxNode = NULL;
+    uint16_t usLevelStart = 0U;
+    uint16_t usLevelEnd;
+
+    memset( pxEndMask, 0x00, sizeof( SubscriptionMask_t ) );
+
+    /* Walk down the levels of the filter. Every subscription ending at
+     * the last node has this exact filter. */
+    do
+    {
+        usLevelEnd = prvLevelEnd( pcTopicFilterString, usTopicFilterLength, usLevelStart );
+
+        while( ( usChild != TRIE_NO_NODE ) &&
+               ( prvTrieLevelEquals( TRIE_NODE( usChild ),
+                                     &( pcTopicFilterString[ usLevelStart ] ),
+                                     usLevelEnd - usLevelStart ) == false ) )
+        {
+            usChild = TRIE_NODE( usChild )->usNextSibling;
+        }
+
+        if( usChild != TRIE_NO_NODE )
+        {
+            pxNode = TRIE_NODE( usChild );
+            usChild = pxNode->usFirstChild;
+            usLevelStart = usLevelEnd + 1U;
+
+            if( usLevelEnd >= usTopicFilterLength )
+            {
+                *pxEndMask = pxNode->xEndMask;
+            }
+        }
+    } while( ( usChild != TRIE_NO_NODE ) && ( usLevelEnd < usTopicFilterLength ) );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCountReferences( const SubscriptionMask_t * pxMask,
+                                SubscriptionReferences_t * pxReferences )
+{
+    uint32_t ulIndex;
+
+    pxReferences->usCount = 0U;
+    pxReferences->xMaxQoS = MQTTQoS0;
+
+    for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE; ulIndex++ )
+    {
+        if( MASK_TEST( pxMask, ulIndex ) == true )
+        {
+            pxReferences->usCount++;
+
+            if( xSubscriptionPool[ ulIndex ].xQoS > pxReferences->xMaxQoS )
+            {
+                pxReferences->xMaxQoS = xSubscriptionPool[ ulIndex ].xQoS;
+            }
+        }
+    }
+}
 
+/*-----------------------------------------------------------*/
 
-bool addSubscription( const char * pcTopicFilterString,
+bool addSubscription( SubscriptionList_t * pxSubscriptionList,
+                      const char * pcTopicFilterString,
                       uint16_t usTopicFilterLength,
+                      MQTTQoS_t xQoS,
                       IncomingPubCallback_t pxIncomingPublishCallback,
                       void * pvIncomingPublishCallbackContext )
+{
+    SubscriptionReferences_t xReferences;
+
+    return addSubscriptionReference( pxSubscriptionList,
+                                     pcTopicFilterString,
+                                     usTopicFilterLength,
+                                     xQoS,
+                                     pxIncomingPublishCallback,
+                                     pvIncomingPublishCallbackContext,
+                                     &xReferences );
+}
+
+/*-----------------------------------------------------------*/
+
+bool addSubscriptionReference( SubscriptionList_t * pxSubscriptionList,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               MQTTQoS_t xQoS,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext,
+                               SubscriptionReferences_t * pxReferencesBefore )
 {
     bool xReturnStatus = false;
+    SubscriptionMask_t xEndMask;
+    uint8_t ucOutcome;
+
+    pxReferencesBefore->usCount = 0U;
+    pxReferencesBefore->xMaxQoS = MQTTQoS0;
 
     if( ( pcTopicFilterString == NULL ) ||
         ( usTopicFilterLength == 0U ) ||
@@ -80,48 +1043,67 @@ bool addSubscription( const char * pcTopicFilterString,
     }
     else
     {
-        int32_t lIndex;
-        size_t xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+        prvWriteBegin( pxSubscriptionList );
 
-        /* Start at end of array, so that we will insert at the first available index.
-         * Scans backwards to find duplicates. */
-        for( lIndex = ( int32_t ) SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS - 1; lIndex >= 0; lIndex-- )
-        {
-            if( xGlobalSubscriptionList[ lIndex ].usFilterStringLength == 0 )
-            {
-                xAvailableIndex = lIndex;
-            }
-            else if( ( xGlobalSubscriptionList[ lIndex ].usFilterStringLength == usTopicFilterLength ) &&
-                     ( strncmp( pcTopicFilterString, xGlobalSubscriptionList[ lIndex ].pcSubscriptionFilterString, ( size_t ) usTopicFilterLength ) == 0 ) )
-            {
-                /* If a subscription already exists, don't do anything. */
-                if( ( xGlobalSubscriptionList[ lIndex ].pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
-                    ( xGlobalSubscriptionList[ lIndex ].pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
-                {
-                    LogWarn( ( "Subscription already exists.\n" ) );
-                    xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
-                    xReturnStatus = true;
-                    break;
-                }
-            }
-        }
+        prvFindFilter( pxSubscriptionList, pcTopicFilterString, usTopicFilterLength, &xEndMask );
+        prvCountReferences( &xEndMask, pxReferencesBefore );
+
+        ucOutcome = prvAddSubscription( pxSubscriptionList,
+                                        pcTopicFilterString,
+                                        usTopicFilterLength,
+                                        xQoS,
+                                        pxIncomingPublishCallback,
+                                        pvIncomingPublishCallbackContext );
+
+        prvWriteEnd( pxSubscriptionList );
+
+        /* Logging may block, so it waits until the list is released. */
+        prvLogAddOutcome( ucOutcome, pcTopicFilterString, usTopicFilterLength );
 
-        if( xAvailableIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+        xReturnStatus = ( ( ucOutcome == ADD_SUBSCRIPTION_ADDED ) || ( ucOutcome == ADD_SUBSCRIPTION_EXISTS ) );
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+bool setSubscriptionChunkCallback( SubscriptionList_t * pxSubscriptionList,
+                                   const char * pcTopicFilterString,
+                                   uint16_t usTopicFilterLength,
+                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                   void * pvIncomingPublishCallbackContext,
+                                   IncomingPubChunkCallback_t pxIncomingPublishChunkCallback )
+{
+    SubscriptionElement_t * pxSubscriptions = xSubscriptionPool;
+    bool xReturnStatus = false;
+    uint32_t ulIndex;
+
+    prvWriteBegin( pxSubscriptionList );
+
+    for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE; ulIndex++ )
+    {
+        if( ( MASK_TEST( &( pxSubscriptionList->xMembers ), ulIndex ) == true ) &&
+            ( pxSubscriptions[ ulIndex ].usFilterStringLength == usTopicFilterLength ) &&
+            ( pxSubscriptions[ ulIndex ].pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+            ( pxSubscriptions[ ulIndex ].pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) &&
+            ( strncmp( pxSubscriptions[ ulIndex ].pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 ) )
         {
-            xGlobalSubscriptionList[ xAvailableIndex ].pcSubscriptionFilterString = pcTopicFilterString;
-            xGlobalSubscriptionList[ xAvailableIndex ].usFilterStringLength = usTopicFilterLength;
-            xGlobalSubscriptionList[ xAvailableIndex ].pxIncomingPublishCallback = pxIncomingPublishCallback;
-            xGlobalSubscriptionList[ xAvailableIndex ].pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+            pxSubscriptions[ ulIndex ].pxIncomingPublishChunkCallback = pxIncomingPublishChunkCallback;
             xReturnStatus = true;
+            break;
         }
     }
 
+    prvWriteEnd( pxSubscriptionList );
+
     return xReturnStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-void removeSubscription( const char * pcTopicFilterString,
+void removeSubscription( SubscriptionList_t * pxSubscriptionList,
+                         const char * pcTopicFilterString,
                          uint16_t usTopicFilterLength )
 {
     if( ( pcTopicFilterString == NULL ) ||
@@ -134,26 +1116,112 @@ void removeSubscription( const char * pcTopicFilterString,
     }
     else
     {
-        int32_t lIndex;
+        SubscriptionMask_t xEndMask;
+        uint32_t ulIndex;
+        const char * pcStoredFilter;
+
+        prvWriteBegin( pxSubscriptionList );
 
-        for( lIndex = 0; lIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; lIndex++ )
+        prvFindFilter( pxSubscriptionList, pcTopicFilterString, usTopicFilterLength, &xEndMask );
+
+        for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE; ulIndex++ )
         {
-            if( xGlobalSubscriptionList[ lIndex ].usFilterStringLength == usTopicFilterLength )
+            if( MASK_TEST( &xEndMask, ulIndex ) == true )
             {
-                if( strncmp( xGlobalSubscriptionList[ lIndex ].pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 )
-                {
-                    memset( &( xGlobalSubscriptionList[ lIndex ] ), 0x00, sizeof( SubscriptionElement_t ) );
-                }
+                pcStoredFilter = xSubscriptionPool[ ulIndex ].pcSubscriptionFilterString;
+                prvTrieRemove( pxSubscriptionList, ulIndex );
+                MASK_CLEAR( &( pxSubscriptionList->xMembers ), ulIndex );
+                memset( &( xSubscriptionPool[ ulIndex ] ), 0x00, sizeof( SubscriptionElement_t ) );
+                prvReleaseFilter( pcStoredFilter );
+            }
+        }
+
+        prvWriteEnd( pxSubscriptionList );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+bool removeSubscriptionReference( SubscriptionList_t * pxSubscriptionList,
+                                  const char * pcTopicFilterString,
+                                  uint16_t usTopicFilterLength,
+                                  IncomingPubCallback_t pxIncomingPublishCallback,
+                                  void * pvIncomingPublishCallbackContext,
+                                  SubscriptionReferences_t * pxReferencesAfter )
+{
+    SubscriptionElement_t * pxSubscriptions = xSubscriptionPool;
+    bool xReturnStatus = false;
+    SubscriptionMask_t xEndMask = { 0 };
+    uint32_t ulIndex;
+    const char * pcStoredFilter;
+
+    if( ( pcTopicFilterString != NULL ) && ( usTopicFilterLength != 0U ) )
+    {
+        prvWriteBegin( pxSubscriptionList );
+
+        prvFindFilter( pxSubscriptionList, pcTopicFilterString, usTopicFilterLength, &xEndMask );
+
+        for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE; ulIndex++ )
+        {
+            if( ( MASK_TEST( &xEndMask, ulIndex ) == true ) &&
+                ( pxSubscriptions[ ulIndex ].pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+                ( pxSubscriptions[ ulIndex ].pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
+            {
+                pcStoredFilter = pxSubscriptions[ ulIndex ].pcSubscriptionFilterString;
+                prvTrieRemove( pxSubscriptionList, ulIndex );
+                MASK_CLEAR( &( pxSubscriptionList->xMembers ), ulIndex );
+                memset( &( pxSubscriptions[ ulIndex ] ), 0x00, sizeof( SubscriptionElement_t ) );
+                prvReleaseFilter( pcStoredFilter );
+
+                MASK_CLEAR( &xEndMask, ulIndex );
+                xReturnStatus = true;
+                break;
             }
         }
+
+        prvCountReferences( &xEndMask, pxReferencesAfter );
+
+        prvWriteEnd( pxSubscriptionList );
     }
+    else
+    {
+        prvCountReferences( &xEndMask, pxReferencesAfter );
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+bool readSubscription( const SubscriptionList_t * pxSubscriptionList,
+                       uint32_t ulIndex,
+                       SubscriptionElement_t * pxSubscription )
+{
+    uint32_t ulSequence;
+    bool xMember;
+
+    configASSERT( ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE );
+
+    do
+    {
+        ulSequence = pxSubscriptionList->ulSequence;
+        portMEMORY_BARRIER();
+
+        xMember = MASK_TEST( &( pxSubscriptionList->xMembers ), ulIndex );
+        *pxSubscription = xSubscriptionPool[ ulIndex ];
+
+        portMEMORY_BARRIER();
+    } while( ( ( ulSequence & 1UL ) != 0U ) || ( ulSequence != pxSubscriptionList->ulSequence ) );
+
+    return xMember;
 }
 
 /*-----------------------------------------------------------*/
 
-bool handleIncomingPublishes( MQTTPublishInfo_t * pxPublishInfo )
+bool handleIncomingPublishes( SubscriptionList_t * pxSubscriptionList,
+                              MQTTPublishInfo_t * pxPublishInfo )
 {
-    bool isMatched = false, publishHandled = false;
+    bool publishHandled = false;
 
     if( pxPublishInfo == NULL )
     {
@@ -162,27 +1230,101 @@ bool handleIncomingPublishes( MQTTPublishInfo_t * pxPublishInfo )
     }
     else
     {
-        int32_t lIndex;
+        SubscriptionTarget_t xTargets[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+        uint32_t ulCount = prvReadMatches( pxSubscriptionList, pxPublishInfo, xTargets );
+        uint32_t ulIndex;
 
-        for( lIndex = 0; lIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; lIndex++ )
+        /* The callbacks run without any lock, so they may add or remove
+         * subscriptions. */
+        for( ulIndex = 0U; ulIndex < ulCount; ulIndex++ )
         {
-            if( xGlobalSubscriptionList[ lIndex ].usFilterStringLength > 0 )
-            {
-                MQTT_MatchTopic( pxPublishInfo->pTopicName,
-                                 pxPublishInfo->topicNameLength,
-                                 xGlobalSubscriptionList[ lIndex ].pcSubscriptionFilterString,
-                                 xGlobalSubscriptionList[ lIndex ].usFilterStringLength,
-                                 &isMatched );
-
-                if( isMatched == true )
-                {
-                    xGlobalSubscriptionList[ lIndex ].pxIncomingPublishCallback( xGlobalSubscriptionList[ lIndex ].pvIncomingPublishCallbackContext,
-                                                                                 pxPublishInfo );
-                    publishHandled = true;
-                }
-            }
+            xTargets[ ulIndex ].pxCallback( xTargets[ ulIndex ].pvContext, pxPublishInfo );
+            publishHandled = true;
         }
     }
 
     return publishHandled;
 }
+
+/*-----------------------------------------------------------*/
+
+bool handleIncomingPublishChunk( SubscriptionList_t * pxSubscriptionList,
+                                 MQTTPublishInfo_t * pxPublishInfo,
+                                 size_t xOffset,
+                                 size_t xTotalLength )
+{
+    SubscriptionTarget_t xTargets[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+    uint32_t ulCount = prvReadMatches( pxSubscriptionList, pxPublishInfo, xTargets );
+    bool chunkHandled = false;
+    uint32_t ulIndex;
+
+    for( ulIndex = 0U; ulIndex < ulCount; ulIndex++ )
+    {
+        if( xTargets[ ulIndex ].pxChunkCallback != NULL )
+        {
+            xTargets[ ulIndex ].pxChunkCallback( xTargets[ ulIndex ].pvContext,
+                                                 pxPublishInfo,
+                                                 xOffset,
+                                                 xTotalLength );
+            chunkHandled = true;
+        }
+    }
+
+    return chunkHandled;
+}
+
+/*-----------------------------------------------------------*/
+
+void getSubscriptionStats( const SubscriptionList_t * pxSubscriptionList,
+                           SubscriptionStats_t * pxStats )
+{
+    const uint8_t * pucArena = ( const uint8_t * ) usFilterArena;
+    const FilterArenaHeader_t * pxHeader;
+    uint32_t ulIndex;
+    uint32_t ulOffset;
+
+    memset( pxStats, 0x00, sizeof( SubscriptionStats_t ) );
+    pxStats->usSubscriptionCapacity = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+    pxStats->usSubscriptionPoolSize = SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE;
+    pxStats->usTrieNodeCapacity = SUBSCRIPTION_MANAGER_MAX_TRIE_NODES;
+    pxStats->usFilterArenaCapacity = ( uint16_t ) sizeof( usFilterArena );
+
+    /* Keep writers out for a consistent picture of the pools. */
+    prvWriteBegin( NULL );
+
+    for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE; ulIndex++ )
+    {
+        if( MASK_TEST( &( pxSubscriptionList->xMembers ), ulIndex ) == true )
+        {
+            pxStats->usSubscriptions++;
+        }
+
+        if( xSubscriptionPool[ ulIndex ].usFilterStringLength != 0U )
+        {
+            pxStats->usPooledSubscriptions++;
+        }
+    }
+
+    for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_TRIE_NODES; ulIndex++ )
+    {
+        if( prvMaskIsEmpty( &( xTrieNodes[ ulIndex ].xPassMask ) ) == false )
+        {
+            pxStats->usTrieNodes++;
+        }
+    }
+
+    for( ulOffset = 0U; ulOffset < usFilterArenaTop; ulOffset += FILTER_HEADER_SIZE + pxHeader->usCapacity )
+    {
+        pxHeader = ( const FilterArenaHeader_t * ) &( pucArena[ ulOffset ] );
+
+        if( pxHeader->usReferences != 0U )
+        {
+            pxStats->usFilters++;
+            pxStats->usFilterBytes += ( uint16_t ) ( FILTER_HEADER_SIZE + pxHeader->usCapacity );
+        }
+    }
+
+    pxStats->usFilterArenaUsed = usFilterArenaTop;
+
+    prvWriteEnd( NULL );
+}
@@ -41,6 +41,44 @@
     #define SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS    10U
 #endif
 
+/**
+ * @brief Number of subscriptions shared by all the subscription lists. A list
+ * takes its subscriptions from this pool, up to
+ * SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS of them.
+ */
+#ifndef SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE
+    #define SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE    ( 2U * SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+#endif
+
+/**
+ * @brief Number of 32-bit words of a mask with one bit per subscription of
+ * the pool.
+ */
+#define SUBSCRIPTION_MASK_WORDS    ( ( SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE + 31U ) / 32U )
+
+/**
+ * @brief Number of topic filter trie nodes shared by all the subscription
+ * lists. Each distinct topic filter level of a list, e.g. "things" in
+ * "$aws/things/+/jobs/#", takes one node. Levels shared by several topic
+ * filters of a list share a node.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MAX_TRIE_NODES
+    #define SUBSCRIPTION_MANAGER_MAX_TRIE_NODES    ( 64U )
+#endif
+
+/**
+ * @brief Size in bytes of the arena the topic filters of all the
+ * subscription lists are copied to. A topic filter subscribed to several
+ * times is stored once, and takes its length plus 7 or 8 bytes.
+ */
+#ifndef SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE
+    #define SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE    ( 1024U )
+#endif
+
+#if ( SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 65534U )
+    #error "SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE must be below 64 KiB."
+#endif
+
 /**
  * @brief Callback function called when receiving a publish.
  *
@@ -51,25 +89,119 @@ typedef void (* IncomingPubCallback_t )( void * pvIncomingPublishCallbackContext
                                          MQTTPublishInfo_t * pxPublishInfo );
 
 /**
- * @brief An element in the list of subscriptions.
+ * @brief Callback function called with each chunk of an incoming publish too
+ * large for the MQTT agent network buffer.
  *
- * This subscription manager implementation expects that the array of the
- * subscription elements used for storing subscriptions to be initialized to 0.
+ * @param[in] pvIncomingPublishCallbackContext The incoming publish callback context.
+ * @param[in] pxPublishInfo Deserialized publish information. The payload
+ * fields describe the current chunk only.
+ * @param[in] xOffset Offset of the chunk in the full payload.
+ * @param[in] xTotalLength Length of the full payload.
+ */
+typedef void (* IncomingPubChunkCallback_t )( void * pvIncomingPublishCallbackContext,
+                                              MQTTPublishInfo_t * pxPublishInfo,
+                                              size_t xOffset,
+                                              size_t xTotalLength );
+
+/**
+ * @brief A subscription, taken from the pool shared by all the subscription
+ * lists. It is free while usFilterStringLength is 0.
  *
  * @note This implementation allows multiple tasks to subscribe to the same topic.
  * In this case, another element is added to the subscription list, differing
- * in the intended publish callback. Also note that the topic filters are not
- * copied in the subscription manager and hence the topic filter strings need to
- * stay in scope until unsubscribed.
+ * in the intended publish callback. The topic filter is copied to the filter
+ * arena, pcSubscriptionFilterString points to the copy.
  */
 typedef struct subscriptionElement
 {
     IncomingPubCallback_t pxIncomingPublishCallback;
+    IncomingPubChunkCallback_t pxIncomingPublishChunkCallback;
     void * pvIncomingPublishCallbackContext;
     uint16_t usFilterStringLength;
     const char * pcSubscriptionFilterString;
+    MQTTQoS_t xQoS;
 } SubscriptionElement_t;
 
+/**
+ * @brief A set of subscriptions of the pool, with bit ( n % 32 ) of word
+ * ( n / 32 ) set for subscription n.
+ */
+typedef struct SubscriptionMask
+{
+    uint32_t ulWords[ SUBSCRIPTION_MASK_WORDS ];
+} SubscriptionMask_t;
+
+/**
+ * @brief A node of the topic filter trie, i.e. one level of one or more topic
+ * filters.
+ *
+ * The text of the level is not copied. It is read at usOffset in the filter
+ * string of subscription usOwner, one of the subscriptions in xPassMask: all
+ * the filters going through the node share the same prefix, so the level is
+ * at the same offset in each of them.
+ */
+typedef struct SubscriptionTrieNode
+{
+    SubscriptionMask_t xPassMask; /**< Subscriptions whose filter goes through this node. Empty if the node is free. */
+    SubscriptionMask_t xEndMask;  /**< Subscriptions whose filter ends at this node. */
+    uint16_t usOffset;
+    uint16_t usLength;
+    uint16_t usFirstChild;  /**< Index + 1 of the first child, 0 if none. */
+    uint16_t usNextSibling; /**< Index + 1 of the next sibling, 0 if none. */
+    uint16_t usOwner;
+} SubscriptionTrieNode_t;
+
+/**
+ * @brief A list of subscriptions, indexed by a trie of their topic filter
+ * levels so that an incoming publish is matched in a single walk down the
+ * levels of its topic instead of against every topic filter. The
+ * subscriptions, the trie nodes and the topic filters are allocated from pools
+ * shared by all the lists.
+ *
+ * The list may be modified from any task while the agent task dispatches
+ * incoming publishes. Writers are serialized, and dispatch does not lock:
+ * it walks the list, then checks ulSequence to find out whether a writer
+ * modified the list in the meantime, in which case it walks it again.
+ * Elements must therefore be read with readSubscription() outside of the
+ * subscription manager.
+ *
+ * @note The list must be initialized to 0.
+ */
+typedef struct SubscriptionList
+{
+    SubscriptionMask_t xMembers;   /**< Subscriptions of the pool that belong to the list. */
+    uint16_t usTrieRoot;           /**< Index + 1 of the first top level node, 0 if none. */
+    volatile uint32_t ulSequence;  /**< Odd while a writer modifies the list. */
+} SubscriptionList_t;
+
+/**
+ * @brief Occupancy of a subscription list and of the shared pools.
+ */
+typedef struct SubscriptionStats
+{
+    uint16_t usSubscriptions;        /**< Subscriptions in the list. */
+    uint16_t usSubscriptionCapacity; /**< SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS. */
+    uint16_t usPooledSubscriptions;  /**< Subscriptions used by all the lists. */
+    uint16_t usSubscriptionPoolSize; /**< SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE. */
+    uint16_t usTrieNodes;            /**< Trie nodes used by all the lists. */
+    uint16_t usTrieNodeCapacity;     /**< SUBSCRIPTION_MANAGER_MAX_TRIE_NODES. */
+    uint16_t usFilters;              /**< Distinct topic filters stored in the arena. */
+    uint16_t usFilterBytes;          /**< Arena bytes taken by the stored topic filters. */
+    uint16_t usFilterArenaUsed;      /**< Arena bytes below the highest stored topic filter. */
+    uint16_t usFilterArenaCapacity;  /**< SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE. */
+} SubscriptionStats_t;
+
+/**
+ * @brief The local subscriptions sharing one topic filter. The broker only
+ * needs to be subscribed to the topic filter while usCount is not 0, with the
+ * QoS xMaxQoS.
+ */
+typedef struct SubscriptionReferences
+{
+    uint16_t usCount;   /**< Subscriptions to the topic filter. */
+    MQTTQoS_t xMaxQoS;  /**< Highest QoS of these subscriptions, MQTTQoS0 if none. */
+} SubscriptionReferences_t;
+
 /**
  * @brief Add a subscription to the subscription list.
  *
@@ -77,42 +209,168 @@ typedef struct subscriptionElement
  * context-callback pairs. However, a single context-callback pair may only be
  * associated to the same topic filter once.
  *
- * @param[in] pxSubscriptionList  The pointer to the subscription list array.
- * @param[in] pcTopicFilterString Topic filter string of subscription.
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter string of subscription. It is
+ * copied, so it does not need to stay in scope.
  * @param[in] usTopicFilterLength Length of topic filter string.
+ * @param[in] xQoS QoS the topic filter was subscribed with. Used when the
+ * subscription has to be re-established with the broker.
  * @param[in] pxIncomingPublishCallback Callback function for the subscription.
  * @param[in] pvIncomingPublishCallbackContext Context for the subscription callback.
  *
- * @return `true` if subscription added or exists, `false` if insufficient memory.
+ * @return `true` if subscription added or exists, `false` if there is no free
+ * subscription, trie node or room in the filter arena.
  */
-bool addSubscription( const char * pcTopicFilterString,
+bool addSubscription( SubscriptionList_t * pxSubscriptionList,
+                      const char * pcTopicFilterString,
                       uint16_t usTopicFilterLength,
+                      MQTTQoS_t xQoS,
                       IncomingPubCallback_t pxIncomingPublishCallback,
                       void * pvIncomingPublishCallbackContext );
 
+/**
+ * @brief Accept oversized publishes for an existing subscription, delivered in
+ * chunks to pxIncomingPublishChunkCallback.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter string of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter string.
+ * @param[in] pxIncomingPublishCallback Callback the subscription was added with.
+ * @param[in] pvIncomingPublishCallbackContext Context the subscription was added with.
+ * @param[in] pxIncomingPublishChunkCallback Callback for the chunks, or NULL to
+ * stop accepting oversized publishes.
+ *
+ * @return `true` if the subscription was found, `false` otherwise.
+ */
+bool setSubscriptionChunkCallback( SubscriptionList_t * pxSubscriptionList,
+                                   const char * pcTopicFilterString,
+                                   uint16_t usTopicFilterLength,
+                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                   void * pvIncomingPublishCallbackContext,
+                                   IncomingPubChunkCallback_t pxIncomingPublishChunkCallback );
+
 /**
  * @brief Remove a subscription from the subscription list.
  *
  * @note If the topic filter exists multiple times in the subscription list,
- * then every instance of the subscription will be removed.
+ * then every instance of the subscription will be removed. Use
+ * removeSubscriptionReference() to remove the subscription of one user.
  *
- * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
  * @param[in] pcTopicFilterString Topic filter of subscription.
  * @param[in] usTopicFilterLength Length of topic filter.
  */
-void removeSubscription( const char * pcTopicFilterString,
+void removeSubscription( SubscriptionList_t * pxSubscriptionList,
+                         const char * pcTopicFilterString,
                          uint16_t usTopicFilterLength );
 
+/**
+ * @brief Add a subscription and report how many subscriptions shared its
+ * topic filter before, so that the caller only subscribes with the broker for
+ * the first one, or when the QoS has to be raised.
+ *
+ * @note A context-callback pair already subscribed to the topic filter is not
+ * added again and counts as one reference.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter string of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter string.
+ * @param[in] xQoS QoS of the subscription.
+ * @param[in] pxIncomingPublishCallback Callback function for the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context for the subscription callback.
+ * @param[out] pxReferencesBefore The other subscriptions to the topic filter,
+ * read in the same update as the addition.
+ *
+ * @return `true` if subscription added or exists, `false` otherwise.
+ */
+bool addSubscriptionReference( SubscriptionList_t * pxSubscriptionList,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               MQTTQoS_t xQoS,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext,
+                               SubscriptionReferences_t * pxReferencesBefore );
+
+/**
+ * @brief Remove the subscription of one context-callback pair and report the
+ * subscriptions left on its topic filter, so that the caller only unsubscribes
+ * from the broker with the last one.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter.
+ * @param[in] pxIncomingPublishCallback Callback the subscription was added with.
+ * @param[in] pvIncomingPublishCallbackContext Context the subscription was added with.
+ * @param[out] pxReferencesAfter The subscriptions left on the topic filter.
+ *
+ * @return `true` if the subscription was found and removed.
+ */
+bool removeSubscriptionReference( SubscriptionList_t * pxSubscriptionList,
+                                  const char * pcTopicFilterString,
+                                  uint16_t usTopicFilterLength,
+                                  IncomingPubCallback_t pxIncomingPublishCallback,
+                                  void * pvIncomingPublishCallbackContext,
+                                  SubscriptionReferences_t * pxReferencesAfter );
+
+/**
+ * @brief Read a consistent copy of a subscription while other tasks may be
+ * modifying the list.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] ulIndex Index of the subscription in the pool, below
+ * SUBSCRIPTION_MANAGER_SUBSCRIPTION_POOL_SIZE.
+ * @param[out] pxSubscription The copy. Its topic filter stays valid while the
+ * subscription exists.
+ *
+ * @return `true` if the element holds a subscription of the list.
+ */
+bool readSubscription( const SubscriptionList_t * pxSubscriptionList,
+                       uint32_t ulIndex,
+                       SubscriptionElement_t * pxSubscription );
+
 /**
  * @brief Handle incoming publishes by invoking the callbacks registered
  * for the incoming publish's topic filter.
  *
- * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @note The callbacks of the subscriptions matching the publish are copied
+ * before any is invoked, so a callback may still be invoked for a
+ * subscription removed by another task during the dispatch.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
  * @param[in] pxPublishInfo Info of incoming publish.
  *
  * @return `true` if an application callback could be invoked;
  *  `false` otherwise.
  */
-bool handleIncomingPublishes( MQTTPublishInfo_t * pxPublishInfo );
+bool handleIncomingPublishes( SubscriptionList_t * pxSubscriptionList,
+                              MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Handle a chunk of an oversized incoming publish by invoking the chunk
+ * callbacks registered for the incoming publish's topic filter.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pxPublishInfo Info of incoming publish, with the payload fields
+ * describing the chunk.
+ * @param[in] xOffset Offset of the chunk in the full payload.
+ * @param[in] xTotalLength Length of the full payload.
+ *
+ * @return `true` if a chunk callback could be invoked;
+ *  `false` otherwise.
+ */
+bool handleIncomingPublishChunk( SubscriptionList_t * pxSubscriptionList,
+                                 MQTTPublishInfo_t * pxPublishInfo,
+                                 size_t xOffset,
+                                 size_t xTotalLength );
+
+/**
+ * @brief Get the occupancy of a subscription list and of the pools shared by
+ * all the lists.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[out] pxStats The occupancy.
+ */
+void getSubscriptionStats( const SubscriptionList_t * pxSubscriptionList,
+                           SubscriptionStats_t * pxStats );
 
 #endif /* SUBSCRIPTION_MANAGER_H */
@@ -30,13 +30,12 @@
  * to the same MQTT agent.  Some tasks use QoS0 and others QoS1.
  *
  * vSimpleSubscribePublishTask() subscribes to a topic then periodically publishes a message to the same
- * topic to which it has subscribed.  The command context sent to
- * MQTTAgent_Publish() contains a unique number that is sent back to the task
- * as a task notification from the callback function that executes when the
- * PUBLISH operation is acknowledged (or just sent in the case of QoS 0).  The
- * task checks the number it receives from the callback equals the number it
- * previously set in the command context before printing out either a success
- * or failure message.
+ * topic to which it has subscribed.  The publishes are submitted without
+ * waiting for them to be acknowledged (or just sent in the case of QoS 0), so a
+ * task can have several publishes in flight, e.g. while the connection is
+ * being re-established.  Each publish carries its sequence number as the user
+ * context, which the task gets back with the result of the publish before
+ * printing out either a success or failure message.
  */
 
 
@@ -59,6 +58,21 @@
 /* Subscription manager header include. */
 #include "subscription_manager.h"
 
+/* Store-and-forward queue used while the broker is unreachable. */
+#include "store_forward.h"
+
+/* Deferred dispatch header include. */
+#include "deferred_dispatch.h"
+
+/* Non-blocking publishes of the tasks. */
+#include "async_publish.h"
+
+/* Round-trip latency of the echoed publishes. */
+#include "latency_probe.h"
+
+/* Encoding of the payloads. */
+#include "telemetry.h"
+
 /* MQTT library includes. */
 #include "mqtt_agent_task.h"
 #include "core_mqtt.h"
@@ -80,12 +94,6 @@
  */
 #define mqttexampleDELAY_BETWEEN_PUBLISH_OPERATIONS_MS    ( 5000U )
 
-/**
- * @brief Number of times a publish has to be retried if agent cannot send a QoS0 packet
- * or an ACK is not received for a QoS1 packet.
- */
-#define mqttexampleNUM_PUBLISH_RETRIES                    ( 3 )
-
 /**
  * @brief The maximum amount of time in milliseconds to wait for the commands
  * to be posted to the MQTT agent should the MQTT agent's command queue be full.
@@ -151,8 +159,65 @@
  */
 #define mqttexampleINPUT_TOPIC_BUFFER_LENGTH     ( sizeof( mqttexampleINPUT_TOPIC_FORMAT ) + mqttexampleTHING_NAME_MAX_LENGTH + 10U )
 
+/**
+ * @brief Number of incoming publishes queued to a demo task, and the policy
+ * when its queue is full. Echoed publishes are only logged, so they are
+ * dropped rather than holding up the agent task.
+ */
+#define mqttexampleDEFERRED_QUEUE_DEPTH          ( 2U )
+#define mqttexampleDEFERRED_POLICY               DeferredDispatchDrop
+
+/**
+ * @brief Period at which a demo task logs the round-trip latency of its
+ * echoed publishes.
+ */
+#define mqttexampleLATENCY_REPORT_PERIOD_MS      ( 60000U )
+
+/**
+ * @brief Encoding of the payloads. Set to TelemetryFormatJson to read them
+ * in the MQTT test client of the AWS IoT console.
+ */
+#ifndef mqttexampleTELEMETRY_FORMAT
+    #define mqttexampleTELEMETRY_FORMAT          TelemetryFormatCbor
+#endif
+
+/**
+ * @brief Fields of a payload: the number of the task, the sequence number of
+ * the publish and the tick count at which it was sent, from which the round
+ * trip is measured once the publish is echoed back.
+ */
+#define mqttexampleTELEMETRY_KEY_TASK            "task"
+#define mqttexampleTELEMETRY_KEY_SEQUENCE        "seq"
+#define mqttexampleTELEMETRY_KEY_SENT_TICK       "t"
+#define mqttexampleTELEMETRY_NUM_FIELDS          ( 3U )
+
 static char cTopicFilter[ appCONFIG_MQTT_NUM_PUBSUB_TASKS ][ mqttexampleINPUT_TOPIC_BUFFER_LENGTH ];
 
+/**
+ * @brief Payload and topic each task publishes from. The topic must stay
+ * valid while a publish is in flight, so every task has its own. The payload
+ * is copied by AsyncPublish_Submit().
+ */
+static uint8_t ucPayloadBufs[ appCONFIG_MQTT_NUM_PUBSUB_TASKS ][ mqttexampleSTRING_BUFFER_LENGTH ];
+static char cOutTopicBufs[ appCONFIG_MQTT_NUM_PUBSUB_TASKS ][ mqttexampleOUTPUT_TOPIC_BUFFER_LENGTH ];
+
+/**
+ * @brief Publishes in flight of each task, with the results the task has not
+ * collected yet.
+ */
+static AsyncPublisher_t xAsyncPublishers[ appCONFIG_MQTT_NUM_PUBSUB_TASKS ];
+
+/**
+ * @brief Queues the publishes echoed on the topic of each task are delivered
+ * to, so that they are logged by the task instead of the agent task.
+ */
+static DeferredSubscriber_t xDeferredSubscribers[ appCONFIG_MQTT_NUM_PUBSUB_TASKS ];
+
+/**
+ * @brief Round-trip latency of the publishes echoed back to each task.
+ */
+static LatencyProbe_t xLatencyProbes[ appCONFIG_MQTT_NUM_PUBSUB_TASKS ];
+
 #if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
     #define mqttexampleDEVICE_ADVISOR_TOPIC_FORMAT           "device_advisor_test"
     #define mqttexampleDEVICE_ADVISOR_TOPIC_BUFFER_LENGTH    ( strlen( mqttexampleDEVICE_ADVISOR_TOPIC_FORMAT ) )
@@ -161,93 +226,88 @@ static char cTopicFilter[ appCONFIG_MQTT_NUM_PUBSUB_TASKS ][ mqttexampleINPUT_TO
 
 /*-----------------------------------------------------------*/
 
-/**
- * @brief Passed into MQTTAgent_Subscribe() as the callback to execute when the
- * broker ACKs the SUBSCRIBE message.  Its implementation sends a notification
- * to the task that called MQTTAgent_Subscribe() to let the task know the
- * SUBSCRIBE operation completed.  It also sets the xReturnStatus of the
- * structure passed in as the command's context to the value of the
- * xReturnStatus parameter - which enables the task to check the status of the
- * operation.
- *
- * See https://freertos.org/mqtt/mqtt-agent-demo.html#example_mqtt_api_call
- *
- * @param[in] pxCommandContext Context of the initial command.
- * @param[in].xReturnStatus The result of the command.
- */
-static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                         MQTTAgentReturnInfo_t * pxReturnInfo );
-
-/**
- * @brief Passed into MQTTAgent_Publish() as the callback to execute when the
- * broker ACKs the PUBLISH message.  Its implementation sends a notification
- * to the task that called MQTTAgent_Publish() to let the task know the
- * PUBLISH operation completed.  It also sets the xReturnStatus of the
- * structure passed in as the command's context to the value of the
- * xReturnStatus parameter - which enables the task to check the status of the
- * operation.
- *
- * See https://freertos.org/mqtt/mqtt-agent-demo.html#example_mqtt_api_call
- *
- * @param[in] pxCommandContext Context of the initial command.
- * @param[in].xReturnStatus The result of the command.
- */
-static void prvPublishCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                       MQTTAgentReturnInfo_t * pxReturnInfo );
+#if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
 
 /**
- * @brief Passed into MQTTAgent_Subscribe() as the callback to execute when
- * there is an incoming publish on the topic being subscribed to.  Its
+ * @brief Passed into xMQTTAgentSubscribe() as the callback to execute when
+ * there is an incoming publish on the Device Advisor topic.  Its
  * implementation just logs information about the incoming publish including
- * the publish messages source topic and payload.
+ * the publish messages source topic and payload. Runs on the agent task.
  *
  * See https://freertos.org/mqtt/mqtt-agent-demo.html#example_mqtt_api_call
  *
  * @param[in] pvIncomingPublishCallbackContext Context of the initial command.
  * @param[in] pxPublishInfo Deserialized publish.
  */
-static void prvIncomingPublishCallback( void * pvIncomingPublishCallbackContext,
-                                        MQTTPublishInfo_t * pxPublishInfo );
+    static void prvIncomingPublishCallback( void * pvIncomingPublishCallbackContext,
+                                            MQTTPublishInfo_t * pxPublishInfo );
+#endif
 
 /**
- * @brief Subscribe to the topic the demo task will also publish to - that
- * results in all outgoing publishes being published back to the task
- * (effectively echoed back).
+ * @brief Log the publishes queued to a demo task, and record their round
+ * trip, until a delay expires.
  *
- * @param[in] xQoS The quality of service (QoS) to use.  Can be zero or one
- * for all MQTT brokers.  Can also be QoS2 if supported by the broker.  AWS IoT
- * does not support QoS2.
- * @param[in] pcTopicFilter Pointer to the topic filter string to subscribe for.
- * @param[in] xTopicFilterLength Length of the topic filter string.
+ * @param[in] pxSubscriber The queue of the task.
+ * @param[in] pxProbe The latency probe of the task.
+ * @param[in] xTicksToDelay Time to spend in the function.
  */
-static MQTTStatus_t prvSubscribeToTopic( MQTTQoS_t xQoS,
-                                         char * pcTopicFilter,
-                                         size_t xTopicFilterLength );
-
+static void prvProcessIncomingPublishes( DeferredSubscriber_t * pxSubscriber,
+                                         LatencyProbe_t * pxProbe,
+                                         TickType_t xTicksToDelay );
 
 /**
- * @brief Publishes the given payload using the given qos to the topic provided.
+ * @brief Submits the given payload using the given qos to the topic provided,
+ * without waiting for the publish to complete.
  *
- * Function queues a publish command with the MQTT agent and waits for response. For
- * Qos0 publishes command is successful when the message is sent out of network. For Qos1
- * publishes, the command succeeds once a puback is received. If publish is unsuccessful, the function
- * retries the publish for a configure number of tries.
+ * For Qos0 publishes the publish completes when the message is sent out of
+ * network. For Qos1 publishes, it completes once a puback is received. The
+ * result is collected later with prvCollectPublishResults().
  *
+ * @param[in] pxPublisher The publisher of the task.
  * @param[in] xQoS The quality of service (QoS) to use.  Can be zero or one
  * for all MQTT brokers.  Can also be QoS2 if supported by the broker.  AWS IoT
  * does not support QoS2.
  * @param[in] pcTopic NULL terminated topic string to which message is published.
+ * It must stay valid until the publish completes.
  * @param[in] xTopicLength Length of the topic string.
- * @param[in] pucPayload The payload blob to be published.
+ * @param[in] pucPayload The payload blob to be published. It is copied.
  * @param[in] xPayloadLength Length of the payload blob to be published.
- * @param[in] lNumTries Number of retries if the QoS1 publish is not acknowledged.
+ * @param[in] ulSequence Sequence number of the publish, returned with its result.
+ */
+static MQTTStatus_t prvSubmitPublish( AsyncPublisher_t * pxPublisher,
+                                      MQTTQoS_t xQoS,
+                                      char * pcTopic,
+                                      size_t xTopicLength,
+                                      uint8_t * pucPayload,
+                                      size_t xPayloadLength,
+                                      uint32_t ulSequence );
+
+/**
+ * @brief Log the results of the completed publishes of a task and count them.
+ *
+ * @param[in] pxPublisher The publisher of the task.
+ * @param[in] pcTopic Topic the task publishes to.
+ * @param[in,out] pulSuccessCount Publishes that succeeded.
+ * @param[in,out] pulFailCount Publishes that failed.
  */
-static MQTTStatus_t prvPublishToTopic( MQTTQoS_t xQoS,
-                                       char * pcTopic,
-                                       size_t xTopicLength,
-                                       uint8_t * pucPayload,
-                                       size_t xPayloadLength,
-                                       int32_t lNumTries );
+static void prvCollectPublishResults( AsyncPublisher_t * pxPublisher,
+                                      const char * pcTopic,
+                                      uint32_t * pulSuccessCount,
+                                      uint32_t * pulFailCount );
+
+/**
+ * @brief Queues a QoS1 publish to the store-and-forward queue, to be sent once
+ * the MQTT agent is connected again.
+ *
+ * @param[in] pcTopic Topic string to which message is published.
+ * @param[in] xTopicLength Length of the topic string.
+ * @param[in] pucPayload The payload blob to be published. It is copied.
+ * @param[in] xPayloadLength Length of the payload blob to be published.
+ */
+static MQTTStatus_t prvStorePublish( char * pcTopic,
+                                     size_t xTopicLength,
+                                     uint8_t * pucPayload,
+                                     size_t xPayloadLength );
 
 /**
  * @brief Retrieves the thing name from key store to use in demo.
@@ -280,281 +340,184 @@ BaseType_t xStartSimplePubSubTasks( uint32_t ulNumPubsubTasks,
 
 /*-----------------------------------------------------------*/
 
-/**
- * @brief The MQTT agent manages the MQTT contexts.  This set the handle to the
- * context used by this demo.
- */
-extern MQTTAgentContext_t xGlobalMqttAgentContext;
+#if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
+    static void prvIncomingPublishCallback( void * pvIncomingPublishCallbackContext,
+                                            MQTTPublishInfo_t * pxPublishInfo )
+    {
+        static char cTerminatedString[ mqttexampleSTRING_BUFFER_LENGTH ];
 
-/*-----------------------------------------------------------*/
+        ( void ) pvIncomingPublishCallbackContext;
 
-static void prvPublishCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                       MQTTAgentReturnInfo_t * pxReturnInfo )
-{
-    if( pxCommandContext->xTaskToNotify != NULL )
-    {
-        ( void ) xTaskNotify( pxCommandContext->xTaskToNotify,
-                              pxReturnInfo->returnCode,
-                              eSetValueWithOverwrite );
+        /* Create a message that contains the incoming MQTT payload to the logger,
+         * terminating the string first. */
+        if( pxPublishInfo->payloadLength < mqttexampleSTRING_BUFFER_LENGTH )
+        {
+            memcpy( ( void * ) cTerminatedString, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
+            cTerminatedString[ pxPublishInfo->payloadLength ] = 0x00;
+        }
+        else
+        {
+            memcpy( ( void * ) cTerminatedString, pxPublishInfo->pPayload, mqttexampleSTRING_BUFFER_LENGTH );
+            cTerminatedString[ mqttexampleSTRING_BUFFER_LENGTH - 1 ] = 0x00;
+        }
+
+        LogInfo( ( "Received incoming publish message %s\n", cTerminatedString ) );
     }
-}
+#endif /* if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 ) */
 
 /*-----------------------------------------------------------*/
 
-static void prvRegisterSubscribeCallback( const char * pTopicFilter,
-                                          uint16_t topicFilterLength )
+static void prvProcessIncomingPublishes( DeferredSubscriber_t * pxSubscriber,
+                                         LatencyProbe_t * pxProbe,
+                                         TickType_t xTicksToDelay )
 {
-    bool isMatch = false;
-    MQTTStatus_t mqttStatus;
-    uint16_t usIndex = 0U;
-    bool subscriptionAdded;
-    size_t xTopicFilterLen;
+    DeferredPublish_t * pxPublish;
+    TimeOut_t xTimeOut;
+    uint64_t ullSequence, ullSentTick;
 
-    for( ; usIndex < appCONFIG_MQTT_NUM_PUBSUB_TASKS; usIndex++ )
-    {
-        xTopicFilterLen = strlen( cTopicFilter[ usIndex ] );
+    vTaskSetTimeOutState( &xTimeOut );
 
-        mqttStatus = MQTT_MatchTopic( pTopicFilter,
-                                      topicFilterLength,
-                                      cTopicFilter[ usIndex ],
-                                      xTopicFilterLen,
-                                      &isMatch );
+    do
+    {
+        pxPublish = DeferredDispatch_Receive( pxSubscriber, xTicksToDelay );
 
-        if( ( mqttStatus == MQTTSuccess ) && isMatch )
+        if( pxPublish != NULL )
         {
-            /* Add subscription so that incoming publishes are routed to the application callback. */
-            subscriptionAdded = addSubscription( pTopicFilter,
-                                                 topicFilterLength,
-                                                 prvIncomingPublishCallback,
-                                                 NULL );
-
-            if( subscriptionAdded == false )
+            if( ( Telemetry_GetUInt( mqttexampleTELEMETRY_FORMAT,
+                                     pxPublish->xPublishInfo.pPayload,
+                                     pxPublish->xPublishInfo.payloadLength,
+                                     mqttexampleTELEMETRY_KEY_SEQUENCE,
+                                     &ullSequence ) == true ) &&
+                ( Telemetry_GetUInt( mqttexampleTELEMETRY_FORMAT,
+                                     pxPublish->xPublishInfo.pPayload,
+                                     pxPublish->xPublishInfo.payloadLength,
+                                     mqttexampleTELEMETRY_KEY_SENT_TICK,
+                                     &ullSentTick ) == true ) )
             {
-                LogError( ( "Failed to register a publish callback for topic %.*s.",
-                            pTopicFilter,
-                            topicFilterLength ) );
-            }
-        }
-
-        #if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 )
-            mqttStatus = MQTT_MatchTopic( pTopicFilter,
-                                          topicFilterLength,
-                                          cDeviceAdvisorTopicFilter,
-                                          mqttexampleDEVICE_ADVISOR_TOPIC_BUFFER_LENGTH,
-                                          &isMatch );
+                LogInfo( ( "Received incoming publish message %u (%u bytes)\n",
+                           ( unsigned int ) ullSequence,
+                           ( unsigned int ) pxPublish->xPublishInfo.payloadLength ) );
 
-            if( ( mqttStatus == MQTTSuccess ) && isMatch )
+                LatencyProbe_Record( pxProbe, ( uint32_t ) ullSequence, ( TickType_t ) ullSentTick );
+            }
+            else
             {
-                /* Add subscription so that incoming publishes are routed to the application callback. */
-                subscriptionAdded = addSubscription( pTopicFilter,
-                                                     topicFilterLength,
-                                                     prvIncomingPublishCallback,
-                                                     NULL );
-
-                if( subscriptionAdded == false )
-                {
-                    LogError( ( "Failed to register a publish callback for topic %.*s.",
-                                pTopicFilter,
-                                topicFilterLength ) );
-                }
+                LogWarn( ( "Received incoming publish without a sequence number (%u bytes)\n",
+                           ( unsigned int ) pxPublish->xPublishInfo.payloadLength ) );
             }
-        #endif /* if ( appCONFIG_DEVICE_ADVISOR_TEST_ACTIVE == 1 ) */
-    }
-}
-
-static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                         MQTTAgentReturnInfo_t * pxReturnInfo )
-{
-    if( pxReturnInfo->returnCode == MQTTSuccess )
-    {
-        MQTTAgentSubscribeArgs_t * pSubscribeArgs = ( MQTTAgentSubscribeArgs_t * ) ( pxCommandContext->pArgs );
-        prvRegisterSubscribeCallback( pSubscribeArgs->pSubscribeInfo->pTopicFilter, pSubscribeArgs->pSubscribeInfo->topicFilterLength );
-    }
 
-    /* Store the result in the application defined context so the task that
-     * initiated the publish can check the operation's status. */
-    pxCommandContext->xReturnStatus = pxReturnInfo->returnCode;
-
-    if( pxCommandContext->xTaskToNotify != NULL )
-    {
-        /* Send the context's ulNotificationValue as the notification value so
-         * the receiving task can check the value it set in the context matches
-         * the value it receives in the notification. */
-        xTaskNotify( pxCommandContext->xTaskToNotify, ( uint32_t ) ( pxReturnInfo->returnCode ), eSetValueWithOverwrite );
-    }
+            DeferredDispatch_Release( pxPublish );
+        }
+    } while( xTaskCheckForTimeOut( &xTimeOut, &xTicksToDelay ) == pdFALSE );
 }
 
 /*-----------------------------------------------------------*/
 
-static void prvIncomingPublishCallback( void * pvIncomingPublishCallbackContext,
-                                        MQTTPublishInfo_t * pxPublishInfo )
+static MQTTStatus_t prvSubmitPublish( AsyncPublisher_t * pxPublisher,
+                                      MQTTQoS_t xQoS,
+                                      char * pcTopic,
+                                      size_t xTopicLength,
+                                      uint8_t * pucPayload,
+                                      size_t xPayloadLength,
+                                      uint32_t ulSequence )
 {
-    static char cTerminatedString[ mqttexampleSTRING_BUFFER_LENGTH ];
+    MQTTPublishInfo_t xPublishInfo = { 0 };
+    MQTTStatus_t xCommandStatus;
 
-    ( void ) pvIncomingPublishCallbackContext;
+    xPublishInfo.qos = xQoS;
+    xPublishInfo.pTopicName = pcTopic;
+    xPublishInfo.topicNameLength = ( uint16_t ) xTopicLength;
+    xPublishInfo.pPayload = pucPayload;
+    xPublishInfo.payloadLength = xPayloadLength;
 
-    /* Create a message that contains the incoming MQTT payload to the logger,
-     * terminating the string first. */
-    if( pxPublishInfo->payloadLength < mqttexampleSTRING_BUFFER_LENGTH )
+    /*
+     * If command was enqueued successfully, then agent will either process the packet successfully, or if
+     * there is a disconnect, then it either retries the publish after reconnecting and resuming session
+     * (only for persistent sessions) or cancel the operation and returns the failed response.
+     */
+    xCommandStatus = AsyncPublish_Submit( pxPublisher,
+                                          &xPublishInfo,
+                                          true,
+                                          ( void * ) ( uintptr_t ) ulSequence,
+                                          mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS );
+
+    if( ( xCommandStatus != MQTTSuccess ) )
     {
-        memcpy( ( void * ) cTerminatedString, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
-        cTerminatedString[ pxPublishInfo->payloadLength ] = 0x00;
+        LogError( ( "Failed to send PUBLISH packet to broker with error = %u.", xCommandStatus ) );
     }
     else
     {
-        memcpy( ( void * ) cTerminatedString, pxPublishInfo->pPayload, mqttexampleSTRING_BUFFER_LENGTH );
-        cTerminatedString[ mqttexampleSTRING_BUFFER_LENGTH - 1 ] = 0x00;
+        LogInfo( ( "Sent PUBLISH packet to broker %.*s to broker (%u in flight).\n",
+                   xTopicLength,
+                   pcTopic,
+                   ( unsigned int ) AsyncPublish_GetInFlightCount( pxPublisher ) ) );
     }
 
-    LogInfo( ( "Received incoming publish message %s\n", cTerminatedString ) );
+    return xCommandStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-static MQTTStatus_t prvSubscribeToTopic( MQTTQoS_t xQoS,
-                                         char * pcTopicFilter,
-                                         size_t xTopicFilterLength )
+static void prvCollectPublishResults( AsyncPublisher_t * pxPublisher,
+                                      const char * pcTopic,
+                                      uint32_t * pulSuccessCount,
+                                      uint32_t * pulFailCount )
 {
-    MQTTStatus_t xCommandStatus;
-    static MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
-    static MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
-    static MQTTAgentCommandContext_t xCommandContext = { 0UL };
-    static MQTTAgentCommandInfo_t xCommandParams = { 0UL };
-    uint32_t ulNotifiedValue = 0U;
-    BaseType_t result;
-
-    /* Complete the subscribe information.  The topic string must persist for
-     * duration of subscription! */
-    xSubscribeInfo.pTopicFilter = pcTopicFilter;
-
-    xSubscribeInfo.topicFilterLength = ( uint16_t ) xTopicFilterLength;
-    xSubscribeInfo.qos = xQoS;
-    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
-    xSubscribeArgs.numSubscriptions = 1;
-
-    /* Complete an application defined context associated with this subscribe message.
-     * This gets updated in the callback function so the variable must persist until
-     * the callback executes. */
-    xCommandContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
-    xCommandContext.pArgs = ( void * ) &xSubscribeArgs;
-
-    xCommandParams.blockTimeMs = mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS;
-    xCommandParams.cmdCompleteCallback = prvSubscribeCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xCommandContext;
-
-    xTaskNotifyStateClear( NULL );
-
-    xCommandStatus = MQTTAgent_Subscribe( &xGlobalMqttAgentContext,
-                                          &xSubscribeArgs,
-                                          &xCommandParams );
-
-    if( xCommandStatus == MQTTSuccess )
+    AsyncPublishCompletion_t xCompletion;
+
+    while( AsyncPublish_GetCompletion( pxPublisher, &xCompletion, 0U ) == true )
     {
-        /*
-         * If command was enqueued successfully, then agent will either process the packet successfully, or if
-         * there is a disconnect, then it either retries the publish after reconnecting and resuming session
-         * (only for persistent sessions) or cancel the operation and invokes the callback for failed response.
-         * Hence the caller task wait indefinitely for a success or failure response from agent.
-         */
-        result = xTaskNotifyWait( 0UL,
-                                  UINT32_MAX,
-                                  &ulNotifiedValue,
-                                  mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS );
-
-        if( result != pdTRUE )
+        if( xCompletion.xStatus == MQTTSuccess )
         {
-            xCommandStatus = MQTTSendFailed;
+            ( *pulSuccessCount )++;
+            LogInfo( ( "Successfully sent publish %u to topic: %s (PassCount:%u, FailCount:%u).\n",
+                       ( unsigned int ) ( uintptr_t ) xCompletion.pvUserContext,
+                       pcTopic,
+                       ( unsigned int ) *pulSuccessCount,
+                       ( unsigned int ) *pulFailCount ) );
         }
         else
         {
-            xCommandStatus = xCommandContext.xReturnStatus;
+            ( *pulFailCount )++;
+            LogError( ( "Failed to send publish %u to topic: %s with error = %u (PassCount:%u, FailCount:%u).\n",
+                        ( unsigned int ) ( uintptr_t ) xCompletion.pvUserContext,
+                        pcTopic,
+                        xCompletion.xStatus,
+                        ( unsigned int ) *pulSuccessCount,
+                        ( unsigned int ) *pulFailCount ) );
         }
     }
-
-    if( ( xCommandStatus != MQTTSuccess ) )
-    {
-        LogError( ( "Failed to SUBSCRIBE to topic with error = %u.", xCommandStatus ) );
-    }
-    else
-    {
-        LogInfo( ( "Subscribed to topic %.*s.\n",
-                   xTopicFilterLength,
-                   pcTopicFilter ) );
-    }
-
-    return xCommandStatus;
 }
 /*-----------------------------------------------------------*/
 
-static MQTTStatus_t prvPublishToTopic( MQTTQoS_t xQoS,
-                                       char * pcTopic,
-                                       size_t xTopicLength,
-                                       uint8_t * pucPayload,
-                                       size_t xPayloadLength,
-                                       int32_t lNumRetries )
+static MQTTStatus_t prvStorePublish( char * pcTopic,
+                                     size_t xTopicLength,
+                                     uint8_t * pucPayload,
+                                     size_t xPayloadLength )
 {
-    static MQTTPublishInfo_t xPublishInfo = { 0UL };
-    static MQTTAgentCommandContext_t xCommandContext = { 0 };
-    MQTTStatus_t xCommandStatus;
-    static MQTTAgentCommandInfo_t xCommandParams = { 0UL };
-    uint32_t ulNotifiedValue = 0U;
-    BaseType_t result;
+    MQTTPublishInfo_t xPublishInfo = { 0 };
+    MQTTStatus_t xStatus;
+    StoreForwardStats_t xStats;
 
-    xTaskNotifyStateClear( NULL );
-
-    /* Configure the publish operation. */
-    xPublishInfo.qos = xQoS;
+    xPublishInfo.qos = MQTTQoS1;
     xPublishInfo.pTopicName = pcTopic;
     xPublishInfo.topicNameLength = ( uint16_t ) xTopicLength;
     xPublishInfo.pPayload = pucPayload;
     xPublishInfo.payloadLength = xPayloadLength;
 
-    xCommandContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
+    xStatus = StoreForward_Publish( &xPublishInfo );
 
-    xCommandParams.blockTimeMs = mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS;
-    xCommandParams.cmdCompleteCallback = prvPublishCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = &xCommandContext;
+    StoreForward_GetStats( &xStats );
+    LogInfo( ( "MQTT agent not connected, stored publish to topic %.*s (queued: %u, spilled: %u, dropped: %u).",
+               ( int ) xTopicLength,
+               pcTopic,
+               ( unsigned int ) xStats.ulQueued,
+               ( unsigned int ) xStats.ulSpilled,
+               ( unsigned int ) xStats.ulDropped ) );
 
-    xCommandStatus = MQTTAgent_Publish( &xGlobalMqttAgentContext,
-                                        &xPublishInfo,
-                                        &xCommandParams );
-
-    if( xCommandStatus == MQTTSuccess )
-    {
-        /*
-         * If command was enqueued successfully, then agent will either process the packet successfully, or if
-         * there is a disconnect, then it either retries the publish after reconnecting and resuming session
-         * (only for persistent sessions) or cancel the operation and invokes the callback for failed response.
-         * Hence the caller task wait indefinitely for a success or failure response from agent.
-         */
-        result = xTaskNotifyWait( 0UL,
-                                  UINT32_MAX,
-                                  &ulNotifiedValue,
-                                  pdMS_TO_TICKS( mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS ) );
-
-        if( result != pdTRUE )
-        {
-            xCommandStatus = MQTTSendFailed;
-        }
-        else
-        {
-            xCommandStatus = xCommandContext.xReturnStatus;
-        }
-    }
-
-    if( ( xCommandStatus != MQTTSuccess ) )
-    {
-        LogError( ( "Failed to send PUBLISH packet to broker with error = %u.", xCommandStatus ) );
-    }
-    else
-    {
-        LogInfo( ( "Sent PUBLISH packet to broker %.*s to broker.\n",
-                   xTopicLength,
-                   pcTopic ) );
-    }
-
-    return xCommandStatus;
+    return xStatus;
 }
+
 /*-----------------------------------------------------------*/
 
 
@@ -562,15 +525,26 @@ void vSimpleSubscribePublishTask( void * pvParameters )
 {
     uint32_t ulTaskNumber = ( uint32_t ) pvParameters;
     MQTTQoS_t xQoS;
-    TickType_t xTicksToDelay;
-    static char cPayloadBuf[ mqttexampleSTRING_BUFFER_LENGTH ];
-    static char cOutTopicBuf[ mqttexampleOUTPUT_TOPIC_BUFFER_LENGTH ];
+    TickType_t xTicksToDelay, xLastReportTick;
+    TelemetryEncoder_t xEncoder;
+    uint8_t * pucPayloadBuf;
+    char * cOutTopicBuf;
     size_t xInTopicLength, xOutTopicLength, xPayloadLength;
     uint32_t ulPublishCount = 0U, ulSuccessCount = 0U, ulFailCount = 0U;
     BaseType_t xStatus = pdPASS;
     MQTTStatus_t xMQTTStatus;
 
+    configASSERT( ulTaskNumber < appCONFIG_MQTT_NUM_PUBSUB_TASKS );
+    pucPayloadBuf = ucPayloadBufs[ ulTaskNumber ];
+    cOutTopicBuf = cOutTopicBufs[ ulTaskNumber ];
+
+    LatencyProbe_Init( &xLatencyProbes[ ulTaskNumber ] );
+
     vWaitUntilMQTTAgentReady();
+
+    /* Completions are queued to the task, which collects them between
+     * publishes. */
+    AsyncPublish_Init( &xAsyncPublishers[ ulTaskNumber ], xMQTTAgentGetDefault(), NULL );
     vWaitUntilMQTTAgentConnected();
 
     /* Have different tasks use different QoS.  0 and 1.  2 can also be used
@@ -589,13 +563,24 @@ void vSimpleSubscribePublishTask( void * pvParameters )
         /*  Assert if the topic buffer is enough to hold the required topic. */
         configASSERT( xInTopicLength <= mqttexampleINPUT_TOPIC_BUFFER_LENGTH );
 
+        /* The queue must exist before the subscription is added. */
+        DeferredDispatch_Init( &xDeferredSubscribers[ ulTaskNumber ],
+                               mqttexampleDEFERRED_QUEUE_DEPTH,
+                               mqttexampleDEFERRED_POLICY,
+                               0U );
+
         /* Subscribe to the same topic to which this task will publish.  That will
          * result in each published message being published from the server back to
          * the target. */
 
         LogDebug( ( "Sending subscribe request to agent for topic filter: %.*s\n", xInTopicLength, cTopicFilter[ ulTaskNumber ] ) );
 
-        xMQTTStatus = prvSubscribeToTopic( xQoS, cTopicFilter[ ulTaskNumber ], xInTopicLength );
+        xMQTTStatus = DeferredDispatch_Subscribe( xMQTTAgentGetDefault(),
+                                                  cTopicFilter[ ulTaskNumber ],
+                                                  ( uint16_t ) xInTopicLength,
+                                                  xQoS,
+                                                  &xDeferredSubscribers[ ulTaskNumber ],
+                                                  mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS );
 
         if( xMQTTStatus != MQTTSuccess )
         {
@@ -621,7 +606,13 @@ void vSimpleSubscribePublishTask( void * pvParameters )
 
             LogDebug( ( "Sending subscribe request to agent for topic filter: %.*s\n", mqttexampleDEVICE_ADVISOR_TOPIC_BUFFER_LENGTH, cDeviceAdvisorTopicFilter ) );
 
-            xMQTTStatus = prvSubscribeToTopic( MQTTQoS1, cDeviceAdvisorTopicFilter, mqttexampleDEVICE_ADVISOR_TOPIC_BUFFER_LENGTH );
+            xMQTTStatus = xMQTTAgentSubscribe( xMQTTAgentGetDefault(),
+                                               cDeviceAdvisorTopicFilter,
+                                               ( uint16_t ) mqttexampleDEVICE_ADVISOR_TOPIC_BUFFER_LENGTH,
+                                               MQTTQoS1,
+                                               prvIncomingPublishCallback,
+                                               NULL,
+                                               mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS );
 
             if( xMQTTStatus != MQTTSuccess )
             {
@@ -651,41 +642,52 @@ void vSimpleSubscribePublishTask( void * pvParameters )
         /*  Assert if the topic buffer is enough to hold the required topic. */
         configASSERT( xOutTopicLength <= mqttexampleOUTPUT_TOPIC_BUFFER_LENGTH );
 
+        xLastReportTick = xTaskGetTickCount();
+
         /* For a finite number of publishes... */
         for( ; ; ulPublishCount++ )
         {
-            vWaitUntilMQTTAgentConnected();
-
             /* Create a payload to send with the publish message.  This contains
-             * the task name and an incrementing number. */
-            xPayloadLength = snprintf( cPayloadBuf,
-                                       mqttexampleSTRING_BUFFER_LENGTH,
-                                       "Task %u publishing message %d",
-                                       ulTaskNumber,
-                                       ( int ) ulPublishCount );
+             * the task number, an incrementing number and the time it is sent. */
+            Telemetry_Begin( &xEncoder,
+                             mqttexampleTELEMETRY_FORMAT,
+                             pucPayloadBuf,
+                             mqttexampleSTRING_BUFFER_LENGTH,
+                             mqttexampleTELEMETRY_NUM_FIELDS );
+            Telemetry_AddUInt( &xEncoder, mqttexampleTELEMETRY_KEY_TASK, ulTaskNumber );
+            Telemetry_AddUInt( &xEncoder, mqttexampleTELEMETRY_KEY_SEQUENCE, ulPublishCount );
+            Telemetry_AddUInt( &xEncoder, mqttexampleTELEMETRY_KEY_SENT_TICK, xTaskGetTickCount() );
+            xPayloadLength = Telemetry_End( &xEncoder );
 
             /* Assert if the buffer length is not enough to hold the message.*/
-            configASSERT( xPayloadLength <= mqttexampleSTRING_BUFFER_LENGTH );
-
-            LogDebug( ( "Sending publish request on topic \"%.*s\"\n", xOutTopicLength, cOutTopicBuf ) );
+            configASSERT( xPayloadLength > 0U );
 
-            xMQTTStatus = prvPublishToTopic( xQoS,
-                                             cOutTopicBuf,
-                                             xOutTopicLength,
-                                             ( uint8_t * ) cPayloadBuf,
-                                             xPayloadLength,
-                                             mqttexampleNUM_PUBLISH_RETRIES );
-
-            if( xMQTTStatus == MQTTSuccess )
+            if( ( xQoS == MQTTQoS1 ) && ( xIsMqttAgentConnected() == false ) )
             {
-                ulSuccessCount++;
-                LogInfo( ( "Successfully sent QoS %u publish to topic: %s (PassCount:%d, FailCount:%d).\n",
-                           xQoS,
-                           cOutTopicBuf,
-                           ulSuccessCount,
-                           ulFailCount ) );
+                /* Do not stall while the broker is unreachable, QoS1 publishes
+                 * are queued and sent once reconnected. */
+                xMQTTStatus = prvStorePublish( cOutTopicBuf,
+                                               xOutTopicLength,
+                                               pucPayloadBuf,
+                                               xPayloadLength );
             }
             else
+            {
+                vWaitUntilMQTTAgentConnected();
+
+                LogDebug( ( "Sending publish request on topic \"%.*s\"\n", xOutTopicLength, cOutTopicBuf ) );
+
+                xMQTTStatus = prvSubmitPublish( &xAsyncPublishers[ ulTaskNumber ],
+                                                xQoS,
+                                                cOutTopicBuf,
+                                                xOutTopicLength,
+                                                pucPayloadBuf,
+                                                xPayloadLength,
+                                                ulPublishCount );
+            }
+
+            /* A publish that was submitted is counted once it completes. */
+            if( xMQTTStatus != MQTTSuccess )
             {
                 ulFailCount++;
                 LogError( ( "Timed out while sending QoS %u publish to topic: %s (PassCount:%d, FailCount: %d)\n",
@@ -696,10 +698,25 @@ void vSimpleSubscribePublishTask( void * pvParameters )
             }
 
             /* Add a little randomness into the delay so the tasks don't remain
-             * in lockstep. */
+             * in lockstep. The echoed publishes are logged meanwhile. */
             xTicksToDelay = pdMS_TO_TICKS( mqttexampleDELAY_BETWEEN_PUBLISH_OPERATIONS_MS ) +
                             ( xTaskGetTickCount() % 0xff );
-            vTaskDelay( xTicksToDelay );
+            prvProcessIncomingPublishes( &xDeferredSubscribers[ ulTaskNumber ],
+                                         &xLatencyProbes[ ulTaskNumber ],
+                                         xTicksToDelay );
+
+            prvCollectPublishResults( &xAsyncPublishers[ ulTaskNumber ],
+                                      cOutTopicBuf,
+                                      &ulSuccessCount,
+                                      &ulFailCount );
+
+            if( ( xTaskGetTickCount() - xLastReportTick ) >= pdMS_TO_TICKS( mqttexampleLATENCY_REPORT_PERIOD_MS ) )
+            {
+                /* Keep the local queue drops out of the loss figure. */
+                LatencyProbe_SetDropped( &xLatencyProbes[ ulTaskNumber ], xDeferredSubscribers[ ulTaskNumber ].ulDropped );
+                LatencyProbe_Report( &xLatencyProbes[ ulTaskNumber ], cOutTopicBuf );
+                xLastReportTick = xTaskGetTickCount();
+            }
         }
 
         /* Delete the task if it is complete. */
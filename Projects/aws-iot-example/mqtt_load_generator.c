@@ -0,0 +1,635 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * This file runs a repeatable MQTT workload through the MQTT agent, to size the
+ * agent command queue, the command and request pools and the network buffers.
+ *
+ * A controller task starts a number of producer tasks once the agent is
+ * connected. Each producer publishes at its share of the total publish rate
+ * for the configured duration, with payload sizes and QoS picked from a
+ * pseudo-random sequence seeded by the task number, so that two runs of the
+ * same workload send the same publishes. Publishes are not waited for: the
+ * producer releases the request straight away and the completion is counted
+ * in the agent task. Meanwhile the controller samples the depth of the agent
+ * command queue. Once every producer has seen its publishes complete, the
+ * controller logs messages/s, bytes/s, failures and queue depth.
+ *
+ * The workload is set in app_config.h and can be overridden by the load
+ * generator parameters of the provisioning data.
+ */
+
+/* Standard includes. */
+#include <string.h>
+#include <stdio.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Application Specific configs. */
+#include "app_config.h"
+
+/* Demo Specific configs. */
+#include "demo_config.h"
+
+/* Load generator parameters of the provisioning data. */
+#include "provisioning_data.h"
+
+/* Request objects of the publishes of the producers. */
+#include "agent_request.h"
+
+/* MQTT library includes. */
+#include "mqtt_agent_task.h"
+#include "freertos_agent_message.h"
+#include "freertos_command_pool.h"
+#include "core_mqtt.h"
+
+/* Configure name and log level. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "MQTT LOADGEN"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+#include "logging_stack.h"
+
+/**
+ * @brief Format of the topic a producer publishes to. Nothing subscribes to
+ * it, so the broker does not send the publishes back.
+ */
+#define loadgenTOPIC_FORMAT                "loadgen/%s/task_%u"
+
+/**
+ * @brief Size of the topic buffer of a producer.
+ */
+#define loadgenTOPIC_BUFFER_LENGTH         ( sizeof( loadgenTOPIC_FORMAT ) + 128U + 10U )
+
+/**
+ * @brief Time a producer waits for a free request, and for the agent to take
+ * a publish, before counting it as failed.
+ */
+#define loadgenSEND_BLOCK_TIME_MS          ( 5000U )
+
+/**
+ * @brief Time a producer waits for its publishes to complete after the run.
+ */
+#define loadgenDRAIN_TIMEOUT_MS            ( 30000U )
+
+/**
+ * @brief Period at which the controller samples the agent queue depth.
+ */
+#define loadgenSAMPLE_PERIOD_MS            ( 100U )
+
+/**
+ * @brief Bit set in the notification value of the controller by each producer
+ * once its publishes have completed or the drain timed out.
+ */
+#define loadgenPRODUCER_DONE_NOTIFICATION  ( 1U )
+
+#if ( appCONFIG_LOADGEN_MAX_TASKS > 32 )
+    #error "appCONFIG_LOADGEN_MAX_TASKS must not exceed the 32 bits of a task notification value."
+#endif
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief State of a producer task.
+ */
+typedef struct LoadGenProducer
+{
+    uint32_t ulTaskNumber;
+    char cTopic[ loadgenTOPIC_BUFFER_LENGTH ];
+    uint16_t usTopicLength;
+    uint32_t ulRandomState;
+
+    /* Written by the producer only. */
+    uint32_t ulSent;          /**< Publishes taken by the agent. */
+    uint32_t ulNoRequest;     /**< Publishes dropped as no request was free in time. */
+    uint32_t ulNotQueued;     /**< Publishes the agent did not take in time. */
+    uint32_t ulQoS1Sent;      /**< Publishes taken by the agent with QoS1. */
+    TickType_t xSendEndTick;  /**< When the producer stopped sending, before draining. */
+
+    /* Written by the agent task only, from prvPublishCompleteCallback(). */
+    uint32_t ulCompleted;      /**< Publishes completed, successfully or not. */
+    uint32_t ulCompleteFailed; /**< Publishes completed with an error. */
+    uint64_t ullBytesSent;     /**< Payload bytes of the successful publishes, only read once drained. */
+} LoadGenProducer_t;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Workload of the run, from app_config.h and the provisioning data.
+ */
+static LoadGeneratorParams_t xLoadGenParams;
+
+static LoadGenProducer_t xProducers[ appCONFIG_LOADGEN_MAX_TASKS ];
+
+/**
+ * @brief Payload of every publish, of which each publish sends a prefix.
+ * Never written while publishes are in flight.
+ */
+static uint8_t ucPayload[ appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE ];
+
+static TaskHandle_t xControllerTask = NULL;
+
+static TickType_t xRunStartTick;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Set the workload from app_config.h, then apply the parameters of the
+ * provisioning data that are set.
+ *
+ * @param[out] pxParams The workload.
+ */
+static void prvLoadParams( LoadGeneratorParams_t * pxParams );
+
+/**
+ * @brief Next number of the pseudo-random sequence of a producer (xorshift32).
+ *
+ * @param[in] pxProducer The producer.
+ *
+ * @return The number.
+ */
+static uint32_t prvNextRandom( LoadGenProducer_t * pxProducer );
+
+/**
+ * @brief Count the completion of a publish. Runs in the agent task.
+ *
+ * @param[in] pxRequest The request of the publish, with the producer as user
+ * context.
+ * @param[in] pxReturnInfo Return information of the publish.
+ */
+static void prvPublishCompleteCallback( AgentRequest_t * pxRequest,
+                                        MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Send one publish without waiting for it to complete.
+ *
+ * @param[in] pxProducer The producer.
+ * @param[in] xQoS QoS of the publish.
+ * @param[in] xPayloadLength Length of the payload.
+ */
+static void prvSendPublish( LoadGenProducer_t * pxProducer,
+                            MQTTQoS_t xQoS,
+                            size_t xPayloadLength );
+
+/**
+ * @brief Wait for the publishes of a producer to complete.
+ *
+ * @param[in] pxProducer The producer.
+ *
+ * @return `true` if they all completed before loadgenDRAIN_TIMEOUT_MS.
+ */
+static bool prvDrainPublishes( LoadGenProducer_t * pxProducer );
+
+/**
+ * @brief Log the results of the run.
+ *
+ * @param[in] ulSendMs Time from the start of the run until the last producer
+ * stopped sending.
+ * @param[in] ulDrainMs Time from then until every producer was done.
+ * @param[in] ulMaxQueueDepth Largest agent queue depth sampled.
+ * @param[in] ullQueueDepthSum Sum of the agent queue depths sampled.
+ * @param[in] ulSamples Number of samples.
+ */
+static void prvReportResults( uint32_t ulSendMs,
+                              uint32_t ulDrainMs,
+                              uint32_t ulMaxQueueDepth,
+                              uint64_t ullQueueDepthSum,
+                              uint32_t ulSamples );
+
+/**
+ * @brief Producer task, publishing its share of the workload.
+ *
+ * @param[in] pvParameters The task number.
+ */
+static void prvLoadGeneratorProducerTask( void * pvParameters );
+
+/**
+ * @brief Controller task, running the producers and reporting the results.
+ *
+ * @param[in] pvParameters The stack size of the producers.
+ */
+static void prvLoadGeneratorTask( void * pvParameters );
+
+/*-----------------------------------------------------------*/
+
+static void prvLoadParams( LoadGeneratorParams_t * pxParams )
+{
+    const ProvisioningParamsBundle_t * pxBundle = ( const ProvisioningParamsBundle_t * ) PROVISIONING_DATA_START;
+    const LoadGeneratorParams_t * pxProvisioned = &( pxBundle->loadGeneratorParams );
+
+    pxParams->numTasks = appCONFIG_LOADGEN_NUM_TASKS;
+    pxParams->publishesPerSecond = appCONFIG_LOADGEN_PUBLISHES_PER_SECOND;
+    pxParams->payloadMinSize = appCONFIG_LOADGEN_PAYLOAD_MIN_SIZE;
+    pxParams->payloadMaxSize = appCONFIG_LOADGEN_PAYLOAD_MAX_SIZE;
+    pxParams->qos1Percent = appCONFIG_LOADGEN_QOS1_PERCENT;
+    pxParams->durationSeconds = appCONFIG_LOADGEN_DURATION_S;
+
+    if( ( pxBundle->provisioningMagic1 == PROVISIONING_MAGIC ) &&
+        ( pxBundle->provisioningMagic2 == PROVISIONING_MAGIC ) &&
+        ( pxProvisioned->loadGeneratorMagic == PROVISIONING_LOAD_GENERATOR_MAGIC ) )
+    {
+        LogInfo( ( "Using the load generator parameters of the provisioning data." ) );
+
+        pxParams->numTasks = ( pxProvisioned->numTasks != PROVISIONING_LOAD_GENERATOR_UNSET ) ? pxProvisioned->numTasks : pxParams->numTasks;
+        pxParams->publishesPerSecond = ( pxProvisioned->publishesPerSecond != PROVISIONING_LOAD_GENERATOR_UNSET ) ? pxProvisioned->publishesPerSecond : pxParams->publishesPerSecond;
+        pxParams->payloadMinSize = ( pxProvisioned->payloadMinSize != PROVISIONING_LOAD_GENERATOR_UNSET ) ? pxProvisioned->payloadMinSize : pxParams->payloadMinSize;
+        pxParams->payloadMaxSize = ( pxProvisioned->payloadMaxSize != PROVISIONING_LOAD_GENERATOR_UNSET ) ? pxProvisioned->payloadMaxSize : pxParams->payloadMaxSize;
+        pxParams->qos1Percent = ( pxProvisioned->qos1Percent != PROVISIONING_LOAD_GENERATOR_UNSET ) ? pxProvisioned->qos1Percent : pxParams->qos1Percent;
+        pxParams->durationSeconds = ( pxProvisioned->durationSeconds != PROVISIONING_LOAD_GENERATOR_UNSET ) ? pxProvisioned->durationSeconds : pxParams->durationSeconds;
+    }
+
+    if( pxParams->numTasks == 0U )
+    {
+        LogWarn( ( "No producer tasks requested, using 1." ) );
+        pxParams->numTasks = 1U;
+    }
+    else if( pxParams->numTasks > appCONFIG_LOADGEN_MAX_TASKS )
+    {
+        LogWarn( ( "Number of producer tasks %u above appCONFIG_LOADGEN_MAX_TASKS, using %u.",
+                   ( unsigned int ) pxParams->numTasks,
+                   ( unsigned int ) appCONFIG_LOADGEN_MAX_TASKS ) );
+        pxParams->numTasks = appCONFIG_LOADGEN_MAX_TASKS;
+    }
+
+    if( pxParams->payloadMaxSize > appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE )
+    {
+        LogWarn( ( "Largest payload %u above appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE, using %u.",
+                   ( unsigned int ) pxParams->payloadMaxSize,
+                   ( unsigned int ) appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE ) );
+        pxParams->payloadMaxSize = appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE;
+    }
+
+    if( pxParams->payloadMinSize > pxParams->payloadMaxSize )
+    {
+        pxParams->payloadMinSize = pxParams->payloadMaxSize;
+    }
+
+    if( pxParams->qos1Percent > 100U )
+    {
+        pxParams->qos1Percent = 100U;
+    }
+
+    if( pxParams->durationSeconds == 0U )
+    {
+        pxParams->durationSeconds = 1U;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvNextRandom( LoadGenProducer_t * pxProducer )
+{
+    uint32_t ulState = pxProducer->ulRandomState;
+
+    ulState ^= ulState << 13;
+    ulState ^= ulState >> 17;
+    ulState ^= ulState << 5;
+    pxProducer->ulRandomState = ulState;
+
+    return ulState;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvPublishCompleteCallback( AgentRequest_t * pxRequest,
+                                        MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    LoadGenProducer_t * pxProducer = ( LoadGenProducer_t * ) pxRequest->pvUserContext;
+
+    if( pxReturnInfo->returnCode == MQTTSuccess )
+    {
+        pxProducer->ullBytesSent += pxRequest->xPublishInfo.payloadLength;
+    }
+    else
+    {
+        pxProducer->ulCompleteFailed++;
+    }
+
+    /* Counted last, the producer reads it to know when it has drained. */
+    ( void ) __atomic_add_fetch( &( pxProducer->ulCompleted ), 1U, __ATOMIC_RELEASE );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvSendPublish( LoadGenProducer_t * pxProducer,
+                            MQTTQoS_t xQoS,
+                            size_t xPayloadLength )
+{
+    AgentRequest_t * pxRequest;
+    MQTTStatus_t xStatus;
+
+    pxRequest = AgentRequest_Obtain( loadgenSEND_BLOCK_TIME_MS );
+
+    if( pxRequest == NULL )
+    {
+        pxProducer->ulNoRequest++;
+    }
+    else
+    {
+        AgentRequest_SetPublish( pxRequest,
+                                 xQoS,
+                                 pxProducer->cTopic,
+                                 pxProducer->usTopicLength,
+                                 ucPayload,
+                                 xPayloadLength );
+        pxRequest->xCallback = prvPublishCompleteCallback;
+        pxRequest->pvUserContext = pxProducer;
+
+        xStatus = AgentRequest_Publish( xMQTTAgentGetDefault(), pxRequest, loadgenSEND_BLOCK_TIME_MS );
+
+        if( xStatus == MQTTSuccess )
+        {
+            pxProducer->ulSent++;
+
+            if( xQoS == MQTTQoS1 )
+            {
+                pxProducer->ulQoS1Sent++;
+            }
+        }
+        else
+        {
+            pxProducer->ulNotQueued++;
+        }
+
+        /* The request goes back to the pool once the publish completes. */
+        AgentRequest_Release( pxRequest );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvDrainPublishes( LoadGenProducer_t * pxProducer )
+{
+    TickType_t xTicksToWait = pdMS_TO_TICKS( loadgenDRAIN_TIMEOUT_MS );
+    TimeOut_t xTimeOut;
+    bool xDrained = ( __atomic_load_n( &( pxProducer->ulCompleted ), __ATOMIC_ACQUIRE ) == pxProducer->ulSent );
+
+    vTaskSetTimeOutState( &xTimeOut );
+
+    /* Each completion notifies the task that sent the publish. */
+    while( ( xDrained == false ) && ( xTicksToWait > 0U ) )
+    {
+        ( void ) ulTaskNotifyTakeIndexed( AGENT_REQUEST_NOTIFICATION_INDEX, pdTRUE, xTicksToWait );
+        xDrained = ( __atomic_load_n( &( pxProducer->ulCompleted ), __ATOMIC_ACQUIRE ) == pxProducer->ulSent );
+
+        if( xTaskCheckForTimeOut( &xTimeOut, &xTicksToWait ) != pdFALSE )
+        {
+            xTicksToWait = 0U;
+        }
+    }
+
+    return xDrained;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvReportResults( uint32_t ulSendMs,
+                              uint32_t ulDrainMs,
+                              uint32_t ulMaxQueueDepth,
+                              uint64_t ullQueueDepthSum,
+                              uint32_t ulSamples )
+{
+    uint32_t ulSent = 0U, ulQoS1Sent = 0U, ulCompleted = 0U, ulSucceeded;
+    uint32_t ulNoRequest = 0U, ulNotQueued = 0U, ulCompleteFailed = 0U;
+    uint64_t ullBytesSent = 0U;
+    CommandPoolStats_t xPoolStats;
+    LoadGenProducer_t * pxProducer;
+    uint32_t i;
+
+    for( i = 0U; i < xLoadGenParams.numTasks; i++ )
+    {
+        pxProducer = &( xProducers[ i ] );
+        ulSent += pxProducer->ulSent;
+        ulQoS1Sent += pxProducer->ulQoS1Sent;
+        ulNoRequest += pxProducer->ulNoRequest;
+        ulNotQueued += pxProducer->ulNotQueued;
+        ulCompleted += __atomic_load_n( &( pxProducer->ulCompleted ), __ATOMIC_ACQUIRE );
+        ulCompleteFailed += pxProducer->ulCompleteFailed;
+        ullBytesSent += pxProducer->ullBytesSent;
+    }
+
+    ulSucceeded = ulCompleted - ulCompleteFailed;
+
+    /* The rates are over the send phase only, the drain adds no load. */
+    if( ulSendMs == 0U )
+    {
+        ulSendMs = 1U;
+    }
+
+    Agent_GetPoolStats( &xPoolStats );
+
+    LogInfo( ( "Load generator results over %u ms of sending, then %u ms to drain:",
+               ( unsigned int ) ulSendMs,
+               ( unsigned int ) ulDrainMs ) );
+    LogInfo( ( "  publishes sent %u (QoS1 %u), succeeded %u, %u msgs/s, %u bytes/s.",
+               ( unsigned int ) ulSent,
+               ( unsigned int ) ulQoS1Sent,
+               ( unsigned int ) ulSucceeded,
+               ( unsigned int ) ( ( ( uint64_t ) ulSucceeded * 1000U ) / ulSendMs ),
+               ( unsigned int ) ( ( ullBytesSent * 1000U ) / ulSendMs ) ) );
+    LogInfo( ( "  failures: no request %u, not queued %u, completed with error %u, not completed %u.",
+               ( unsigned int ) ulNoRequest,
+               ( unsigned int ) ulNotQueued,
+               ( unsigned int ) ulCompleteFailed,
+               ( unsigned int ) ( ulSent - ulCompleted ) ) );
+    LogInfo( ( "  agent queue depth: max %u, mean %u.%02u over %u samples (lanes hold %u).",
+               ( unsigned int ) ulMaxQueueDepth,
+               ( unsigned int ) ( ( ulSamples != 0U ) ? ( ullQueueDepthSum / ulSamples ) : 0U ),
+               ( unsigned int ) ( ( ulSamples != 0U ) ? ( ( ( ullQueueDepthSum * 100U ) / ulSamples ) % 100U ) : 0U ),
+               ( unsigned int ) ulSamples,
+               ( unsigned int ) ( MQTT_AGENT_CONTROL_QUEUE_LENGTH + MQTT_AGENT_COMMAND_QUEUE_LENGTH ) ) );
+    LogInfo( ( "  command pool since boot: high water mark %u of %u, exhausted %u, failed %u.",
+               ( unsigned int ) xPoolStats.highWaterMark,
+               ( unsigned int ) MQTT_COMMAND_CONTEXTS_POOL_SIZE,
+               ( unsigned int ) xPoolStats.exhaustedCount,
+               ( unsigned int ) xPoolStats.failedCount ) );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvLoadGeneratorProducerTask( void * pvParameters )
+{
+    uint32_t ulTaskNumber = ( uint32_t ) pvParameters;
+    LoadGenProducer_t * pxProducer;
+    TickType_t xDurationTicks = pdMS_TO_TICKS( xLoadGenParams.durationSeconds * 1000U );
+    TickType_t xTarget, xNow;
+    uint32_t ulPayloadRange = xLoadGenParams.payloadMaxSize - xLoadGenParams.payloadMinSize + 1U;
+    uint64_t ullPublishNumber;
+    MQTTQoS_t xQoS;
+    size_t xPayloadLength;
+    bool xDrained;
+
+    configASSERT( ulTaskNumber < xLoadGenParams.numTasks );
+    pxProducer = &( xProducers[ ulTaskNumber ] );
+
+    for( ullPublishNumber = 0U; ; ullPublishNumber++ )
+    {
+        xNow = xTaskGetTickCount();
+
+        if( ( xNow - xRunStartTick ) >= xDurationTicks )
+        {
+            break;
+        }
+
+        if( xLoadGenParams.publishesPerSecond != 0U )
+        {
+            /* Publishes of all the producers are interleaved at the total rate.
+             * The schedule is absolute, so a producer that falls behind catches
+             * up instead of drifting. */
+            xTarget = xRunStartTick +
+                      pdMS_TO_TICKS( ( ( ullPublishNumber * xLoadGenParams.numTasks + ulTaskNumber ) * 1000U ) /
+                                     xLoadGenParams.publishesPerSecond );
+
+            if( ( TickType_t ) ( xTarget - xNow ) <= xDurationTicks )
+            {
+                vTaskDelay( xTarget - xNow );
+            }
+        }
+
+        xQoS = ( ( prvNextRandom( pxProducer ) % 100U ) < xLoadGenParams.qos1Percent ) ? MQTTQoS1 : MQTTQoS0;
+        xPayloadLength = xLoadGenParams.payloadMinSize + ( prvNextRandom( pxProducer ) % ulPayloadRange );
+
+        prvSendPublish( pxProducer, xQoS, xPayloadLength );
+    }
+
+    pxProducer->xSendEndTick = xTaskGetTickCount();
+
+    xDrained = prvDrainPublishes( pxProducer );
+
+    ( void ) xTaskNotify( xControllerTask, loadgenPRODUCER_DONE_NOTIFICATION << ulTaskNumber, eSetBits );
+
+    if( xDrained == true )
+    {
+        vTaskDelete( NULL );
+    }
+    else
+    {
+        /* Completions still notify this task, so it must not be deleted. */
+        LogWarn( ( "Producer %u gave up waiting for %u publishes.",
+                   ( unsigned int ) ulTaskNumber,
+                   ( unsigned int ) ( pxProducer->ulSent - __atomic_load_n( &( pxProducer->ulCompleted ), __ATOMIC_ACQUIRE ) ) ) );
+        vTaskSuspend( NULL );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvLoadGeneratorTask( void * pvParameters )
+{
+    configSTACK_DEPTH_TYPE uxStackSize = ( configSTACK_DEPTH_TYPE ) ( uint32_t ) pvParameters;
+    uint32_t ulAllDone, ulDone = 0U;
+    uint32_t ulQueueDepth, ulMaxQueueDepth = 0U, ulSamples = 0U;
+    uint64_t ullQueueDepthSum = 0U;
+    uint32_t ulNotifiedValue;
+    TickType_t xSendTicks = 0U, xDoneTick;
+    LoadGenProducer_t * pxProducer;
+    BaseType_t xRetVal;
+    uint32_t i;
+
+    prvLoadParams( &xLoadGenParams );
+
+    LogInfo( ( "Load generator: %u tasks, %u publishes/s, payload %u to %u bytes, %u%% QoS1, %u s.",
+               ( unsigned int ) xLoadGenParams.numTasks,
+               ( unsigned int ) xLoadGenParams.publishesPerSecond,
+               ( unsigned int ) xLoadGenParams.payloadMinSize,
+               ( unsigned int ) xLoadGenParams.payloadMaxSize,
+               ( unsigned int ) xLoadGenParams.qos1Percent,
+               ( unsigned int ) xLoadGenParams.durationSeconds ) );
+
+    for( i = 0U; i < appCONFIG_LOADGEN_MAX_PAYLOAD_SIZE; i++ )
+    {
+        ucPayload[ i ] = ( uint8_t ) ( 'a' + ( i % 26U ) );
+    }
+
+    for( i = 0U; i < xLoadGenParams.numTasks; i++ )
+    {
+        pxProducer = &( xProducers[ i ] );
+        memset( pxProducer, 0x00, sizeof( LoadGenProducer_t ) );
+        pxProducer->ulTaskNumber = i;
+        pxProducer->ulRandomState = ( i + 1U ) * 0x9E3779B9U;
+        pxProducer->usTopicLength = ( uint16_t ) snprintf( pxProducer->cTopic,
+                                                           loadgenTOPIC_BUFFER_LENGTH,
+                                                           loadgenTOPIC_FORMAT,
+                                                           democonfigCLIENT_IDENTIFIER,
+                                                           ( unsigned int ) i );
+
+        /*  Assert if the topic buffer is enough to hold the required topic. */
+        configASSERT( pxProducer->usTopicLength < loadgenTOPIC_BUFFER_LENGTH );
+    }
+
+    vWaitUntilMQTTAgentReady();
+    vWaitUntilMQTTAgentConnected();
+
+    xRunStartTick = xTaskGetTickCount();
+
+    for( i = 0U; i < xLoadGenParams.numTasks; i++ )
+    {
+        xRetVal = xTaskCreate( prvLoadGeneratorProducerTask,
+                               "LOADGEN PRODUCER",
+                               uxStackSize,
+                               ( void * ) i,
+                               uxTaskPriorityGet( NULL ),
+                               NULL );
+        configASSERT( xRetVal == pdTRUE );
+    }
+
+    ulAllDone = ( ( 1U << ( xLoadGenParams.numTasks - 1U ) ) << 1U ) - 1U;
+
+    /* Sample the queue depth until every producer is done. The samples taken
+     * while the producers drain show how fast the agent empties the queue. */
+    while( ulDone != ulAllDone )
+    {
+        if( xTaskNotifyWait( 0U, ulAllDone, &ulNotifiedValue, pdMS_TO_TICKS( loadgenSAMPLE_PERIOD_MS ) ) == pdTRUE )
+        {
+            ulDone |= ulNotifiedValue & ulAllDone;
+        }
+
+        ulQueueDepth = ( uint32_t ) uxMQTTAgentGetQueueDepth( xMQTTAgentGetDefault() );
+        ulMaxQueueDepth = ( ulQueueDepth > ulMaxQueueDepth ) ? ulQueueDepth : ulMaxQueueDepth;
+        ullQueueDepthSum += ulQueueDepth;
+        ulSamples++;
+    }
+
+    xDoneTick = xTaskGetTickCount();
+
+    /* A producer sets its end tick before notifying, so every one is set. */
+    for( i = 0U; i < xLoadGenParams.numTasks; i++ )
+    {
+        if( ( xProducers[ i ].xSendEndTick - xRunStartTick ) > xSendTicks )
+        {
+            xSendTicks = xProducers[ i ].xSendEndTick - xRunStartTick;
+        }
+    }
+
+    prvReportResults( ( uint32_t ) ( xSendTicks * portTICK_PERIOD_MS ),
+                      ( uint32_t ) ( ( xDoneTick - xRunStartTick - xSendTicks ) * portTICK_PERIOD_MS ),
+                      ulMaxQueueDepth,
+                      ullQueueDepthSum,
+                      ulSamples );
+
+    vTaskDelete( NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t xStartLoadGeneratorTasks( configSTACK_DEPTH_TYPE uxStackSize,
+                                     UBaseType_t uxPriority )
+{
+    BaseType_t xRetVal;
+
+    xRetVal = xTaskCreate( prvLoadGeneratorTask,
+                           "MQTT LOADGEN",
+                           uxStackSize,
+                           ( void * ) ( uint32_t ) uxStackSize,
+                           uxPriority,
+                           &xControllerTask );
+    configASSERT( xRetVal == pdTRUE );
+
+    return xRetVal;
+}
@@ -10,10 +10,11 @@
 #ifndef _PROVISIONING_CONFIG_H_
 #define _PROVISIONING_CONFIG_H_
 
-#define PROVISIONING_MAGIC               0xC0DEFEED
-#define PROVISIONING_DATA_LEN            ( 0x1000 )
-#define PROVISIONING_DATA_HEADER_SIZE    ( 0x4 )
-#define PROVISIONING_PARAM_START         ( PROVISIONING_DATA_START + PROVISIONING_DATA_HEADER_SIZE )
+#define PROVISIONING_MAGIC                   0xC0DEFEED
+#define PROVISIONING_LOAD_GENERATOR_MAGIC    0x10ADF00D
+#define PROVISIONING_DATA_LEN                ( 0x1000 )
+#define PROVISIONING_DATA_HEADER_SIZE        ( 0x4 )
+#define PROVISIONING_PARAM_START             ( PROVISIONING_DATA_START + PROVISIONING_DATA_HEADER_SIZE )
 
 #endif /* _PROVISIONING_CONFIG_H_ */
 
@@ -6,6 +6,30 @@
 #include "provisioning_data.h"
 #include "aws_clientcredential_keys.h"
 
+/* The load generator parameters are only written when set at configuration
+ * time, a parameter that is not set keeps the value the application was built
+ * with. */
+#ifdef LOAD_GENERATOR_PROVISIONED
+    #ifndef LOAD_GENERATOR_NUM_TASKS
+        #define LOAD_GENERATOR_NUM_TASKS               PROVISIONING_LOAD_GENERATOR_UNSET
+    #endif
+    #ifndef LOAD_GENERATOR_PUBLISHES_PER_SECOND
+        #define LOAD_GENERATOR_PUBLISHES_PER_SECOND    PROVISIONING_LOAD_GENERATOR_UNSET
+    #endif
+    #ifndef LOAD_GENERATOR_PAYLOAD_MIN_SIZE
+        #define LOAD_GENERATOR_PAYLOAD_MIN_SIZE        PROVISIONING_LOAD_GENERATOR_UNSET
+    #endif
+    #ifndef LOAD_GENERATOR_PAYLOAD_MAX_SIZE
+        #define LOAD_GENERATOR_PAYLOAD_MAX_SIZE        PROVISIONING_LOAD_GENERATOR_UNSET
+    #endif
+    #ifndef LOAD_GENERATOR_QOS1_PERCENT
+        #define LOAD_GENERATOR_QOS1_PERCENT            PROVISIONING_LOAD_GENERATOR_UNSET
+    #endif
+    #ifndef LOAD_GENERATOR_DURATION_SECONDS
+        #define LOAD_GENERATOR_DURATION_SECONDS        PROVISIONING_LOAD_GENERATOR_UNSET
+    #endif
+#endif /* ifdef LOAD_GENERATOR_PROVISIONED */
+
 const ProvisioningParamsBundle_t provisioningBundle =
 {
     .provisioningMagic1       = PROVISIONING_MAGIC,
@@ -15,5 +39,17 @@ const ProvisioningParamsBundle_t provisioningBundle =
         .pucClientCertificate = keyCLIENT_CERTIFICATE_PEM,
         .pucClientPrivateKey  = keyCLIENT_PRIVATE_KEY_PEM
     },
-    .provisioningMagic2       = PROVISIONING_MAGIC
+    .provisioningMagic2       = PROVISIONING_MAGIC,
+    #ifdef LOAD_GENERATOR_PROVISIONED
+        .loadGeneratorParams  =
+        {
+            .loadGeneratorMagic = PROVISIONING_LOAD_GENERATOR_MAGIC,
+            .numTasks           = LOAD_GENERATOR_NUM_TASKS,
+            .publishesPerSecond = LOAD_GENERATOR_PUBLISHES_PER_SECOND,
+            .payloadMinSize     = LOAD_GENERATOR_PAYLOAD_MIN_SIZE,
+            .payloadMaxSize     = LOAD_GENERATOR_PAYLOAD_MAX_SIZE,
+            .qos1Percent        = LOAD_GENERATOR_QOS1_PERCENT,
+            .durationSeconds    = LOAD_GENERATOR_DURATION_SECONDS
+        }
+    #endif
 };
@@ -32,11 +32,35 @@ typedef struct ProvisioningParams_t
                                          *   If JITP is not being used, this value should be set to 0. */
 } ProvisioningParams_t;
 
+/**
+ * @brief Value of a load generator field that keeps the value the application
+ * was built with.
+ */
+#define PROVISIONING_LOAD_GENERATOR_UNSET    ( 0xFFFFFFFFU )
+
+/**
+ * @brief Workload of the MQTT load generator. Only used when
+ * loadGeneratorMagic is PROVISIONING_LOAD_GENERATOR_MAGIC, and a field set to
+ * PROVISIONING_LOAD_GENERATOR_UNSET keeps the value the application was built
+ * with.
+ */
+typedef struct LoadGeneratorParams_t
+{
+    uint32_t loadGeneratorMagic;
+    uint32_t numTasks;           /**< Number of producer tasks. */
+    uint32_t publishesPerSecond; /**< Total publish rate of the producer tasks. */
+    uint32_t payloadMinSize;     /**< Smallest payload, in bytes. */
+    uint32_t payloadMaxSize;     /**< Largest payload, in bytes. */
+    uint32_t qos1Percent;        /**< Share of QoS1 publishes, the others are QoS0. */
+    uint32_t durationSeconds;    /**< Duration of the run. */
+} LoadGeneratorParams_t;
+
 typedef struct ProvisioningParamsBundle_t
 {
     uint32_t provisioningMagic1;
     ProvisioningParams_t provisioningParams;
     uint32_t provisioningMagic2;
+    LoadGeneratorParams_t loadGeneratorParams;
 } ProvisioningParamsBundle_t;
 
 
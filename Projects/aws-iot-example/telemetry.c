@@ -0,0 +1,492 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file telemetry.c
+ * @brief Implements the CBOR and JSON encoding of telemetry payloads, and the
+ * reading of a field back.
+ */
+
+#include "telemetry.h"
+
+/* Standard includes. */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+/* Kernel includes. */
+#include "FreeRTOS.h"
+
+/* coreJSON includes. */
+#include "core_json.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Longest decimal text of a 64-bit integer, with its sign.
+ */
+#define TELEMETRY_MAX_INTEGER_LENGTH    ( 20U )
+
+/**
+ * @brief Longest text of a float written with "%.7g", e.g. "-1.234567e-38".
+ */
+#define TELEMETRY_MAX_FLOAT_LENGTH      ( 16U )
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Append bytes to a JSON payload.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcData The bytes.
+ * @param[in] xLength Number of bytes.
+ */
+static void prvJsonAppend( TelemetryEncoder_t * pxEncoder,
+                           const char * pcData,
+                           size_t xLength );
+
+/**
+ * @brief Append a quoted JSON string, escaping the characters JSON requires.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcString The string.
+ * @param[in] xLength Length of the string.
+ */
+static void prvJsonAppendString( TelemetryEncoder_t * pxEncoder,
+                                 const char * pcString,
+                                 size_t xLength );
+
+/**
+ * @brief Append the decimal text of an integer.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] ullMagnitude Absolute value of the integer.
+ * @param[in] xNegative Whether the integer is negative.
+ */
+static void prvJsonAppendInteger( TelemetryEncoder_t * pxEncoder,
+                                  uint64_t ullMagnitude,
+                                  bool xNegative );
+
+/**
+ * @brief Start a field of a JSON payload: separator, key and colon.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcKey Name of the field, terminated.
+ */
+static void prvJsonAppendKey( TelemetryEncoder_t * pxEncoder,
+                              const char * pcKey );
+
+/**
+ * @brief Start a field of a payload, and write the key of a CBOR field.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcKey Name of the field, terminated.
+ *
+ * @return `true` if the value of the field can be written.
+ */
+static bool prvAddKey( TelemetryEncoder_t * pxEncoder,
+                       const char * pcKey );
+
+/**
+ * @brief Remember the result of encoding a CBOR item.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] xError The result.
+ */
+static void prvCborCheck( TelemetryEncoder_t * pxEncoder,
+                          CborError xError );
+
+/*-----------------------------------------------------------*/
+
+static void prvJsonAppend( TelemetryEncoder_t * pxEncoder,
+                           const char * pcData,
+                           size_t xLength )
+{
+    if( ( pxEncoder->xFailed == false ) &&
+        ( xLength <= ( pxEncoder->xBufferLength - pxEncoder->xJsonLength ) ) )
+    {
+        memcpy( &( pxEncoder->pucBuffer[ pxEncoder->xJsonLength ] ), pcData, xLength );
+        pxEncoder->xJsonLength += xLength;
+    }
+    else
+    {
+        pxEncoder->xFailed = true;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvJsonAppendString( TelemetryEncoder_t * pxEncoder,
+                                 const char * pcString,
+                                 size_t xLength )
+{
+    static const char cHexDigits[] = "0123456789abcdef";
+    char cEscape[ 6 ] = { '\\', 'u', '0', '0', '0', '0' };
+    size_t xStart = 0U;
+    size_t i;
+
+    prvJsonAppend( pxEncoder, "\"", 1U );
+
+    /* Copy the runs of characters that need no escaping in one go. */
+    for( i = 0U; i < xLength; i++ )
+    {
+        if( ( pcString[ i ] == '"' ) || ( pcString[ i ] == '\\' ) || ( ( uint8_t ) pcString[ i ] < 0x20U ) )
+        {
+            prvJsonAppend( pxEncoder, &pcString[ xStart ], i - xStart );
+
+            if( ( uint8_t ) pcString[ i ] < 0x20U )
+            {
+                cEscape[ 4 ] = cHexDigits[ ( ( uint8_t ) pcString[ i ] ) >> 4 ];
+                cEscape[ 5 ] = cHexDigits[ ( ( uint8_t ) pcString[ i ] ) & 0x0FU ];
+                prvJsonAppend( pxEncoder, cEscape, sizeof( cEscape ) );
+            }
+            else
+            {
+                prvJsonAppend( pxEncoder, "\\", 1U );
+                prvJsonAppend( pxEncoder, &pcString[ i ], 1U );
+            }
+
+            xStart = i + 1U;
+        }
+    }
+
+    prvJsonAppend( pxEncoder, &pcString[ xStart ], xLength - xStart );
+    prvJsonAppend( pxEncoder, "\"", 1U );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvJsonAppendInteger( TelemetryEncoder_t * pxEncoder,
+                                  uint64_t ullMagnitude,
+                                  bool xNegative )
+{
+    char cDigits[ TELEMETRY_MAX_INTEGER_LENGTH ];
+    size_t xStart = sizeof( cDigits );
+
+    /* Written from the last digit backwards. */
+    do
+    {
+        xStart--;
+        cDigits[ xStart ] = ( char ) ( '0' + ( ullMagnitude % 10U ) );
+        ullMagnitude /= 10U;
+    } while( ullMagnitude != 0U );
+
+    if( xNegative == true )
+    {
+        xStart--;
+        cDigits[ xStart ] = '-';
+    }
+
+    prvJsonAppend( pxEncoder, &cDigits[ xStart ], sizeof( cDigits ) - xStart );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvJsonAppendKey( TelemetryEncoder_t * pxEncoder,
+                              const char * pcKey )
+{
+    if( pxEncoder->xNumFields > 0U )
+    {
+        prvJsonAppend( pxEncoder, ",", 1U );
+    }
+
+    prvJsonAppendString( pxEncoder, pcKey, strlen( pcKey ) );
+    prvJsonAppend( pxEncoder, ":", 1U );
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvAddKey( TelemetryEncoder_t * pxEncoder,
+                       const char * pcKey )
+{
+    configASSERT( pxEncoder != NULL );
+    configASSERT( pcKey != NULL );
+
+    if( pxEncoder->xFailed == false )
+    {
+        if( pxEncoder->xFormat == TelemetryFormatCbor )
+        {
+            prvCborCheck( pxEncoder, cbor_encode_text_stringz( &( pxEncoder->xCborMap ), pcKey ) );
+        }
+        else
+        {
+            prvJsonAppendKey( pxEncoder, pcKey );
+        }
+
+        pxEncoder->xNumFields++;
+    }
+
+    return( pxEncoder->xFailed == false );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCborCheck( TelemetryEncoder_t * pxEncoder,
+                          CborError xError )
+{
+    if( xError != CborNoError )
+    {
+        pxEncoder->xFailed = true;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Telemetry_Begin( TelemetryEncoder_t * pxEncoder,
+                      TelemetryFormat_t xFormat,
+                      uint8_t * pucBuffer,
+                      size_t xBufferLength,
+                      size_t xNumFields )
+{
+    configASSERT( pxEncoder != NULL );
+    configASSERT( pucBuffer != NULL );
+
+    memset( pxEncoder, 0x00, sizeof( TelemetryEncoder_t ) );
+    pxEncoder->xFormat = xFormat;
+    pxEncoder->pucBuffer = pucBuffer;
+    pxEncoder->xBufferLength = xBufferLength;
+
+    if( xFormat == TelemetryFormatCbor )
+    {
+        cbor_encoder_init( &( pxEncoder->xCborPayload ), pucBuffer, xBufferLength, 0 );
+        prvCborCheck( pxEncoder, cbor_encoder_create_map( &( pxEncoder->xCborPayload ),
+                                                          &( pxEncoder->xCborMap ),
+                                                          xNumFields ) );
+    }
+    else
+    {
+        prvJsonAppend( pxEncoder, "{", 1U );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Telemetry_AddUInt( TelemetryEncoder_t * pxEncoder,
+                        const char * pcKey,
+                        uint64_t ullValue )
+{
+    if( prvAddKey( pxEncoder, pcKey ) == true )
+    {
+        if( pxEncoder->xFormat == TelemetryFormatCbor )
+        {
+            prvCborCheck( pxEncoder, cbor_encode_uint( &( pxEncoder->xCborMap ), ullValue ) );
+        }
+        else
+        {
+            prvJsonAppendInteger( pxEncoder, ullValue, false );
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Telemetry_AddInt( TelemetryEncoder_t * pxEncoder,
+                       const char * pcKey,
+                       int64_t llValue )
+{
+    if( prvAddKey( pxEncoder, pcKey ) == true )
+    {
+        if( pxEncoder->xFormat == TelemetryFormatCbor )
+        {
+            prvCborCheck( pxEncoder, cbor_encode_int( &( pxEncoder->xCborMap ), llValue ) );
+        }
+        else if( llValue < 0 )
+        {
+            /* Negated as unsigned, which also holds INT64_MIN. */
+            prvJsonAppendInteger( pxEncoder, 0U - ( uint64_t ) llValue, true );
+        }
+        else
+        {
+            prvJsonAppendInteger( pxEncoder, ( uint64_t ) llValue, false );
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Telemetry_AddFloat( TelemetryEncoder_t * pxEncoder,
+                         const char * pcKey,
+                         float fValue )
+{
+    char cText[ TELEMETRY_MAX_FLOAT_LENGTH + 1U ];
+    int lLength;
+
+    if( prvAddKey( pxEncoder, pcKey ) == true )
+    {
+        if( pxEncoder->xFormat == TelemetryFormatCbor )
+        {
+            prvCborCheck( pxEncoder, cbor_encode_float( &( pxEncoder->xCborMap ), fValue ) );
+        }
+        else if( isfinite( fValue ) == 0 )
+        {
+            /* JSON has no representation of NaN and infinities. */
+            prvJsonAppend( pxEncoder, "null", 4U );
+        }
+        else
+        {
+            /* Only the JSON fallback formats text, 7 digits keep a float exact. */
+            lLength = snprintf( cText, sizeof( cText ), "%.7g", ( double ) fValue );
+
+            if( ( lLength > 0 ) && ( ( size_t ) lLength < sizeof( cText ) ) )
+            {
+                prvJsonAppend( pxEncoder, cText, ( size_t ) lLength );
+            }
+            else
+            {
+                pxEncoder->xFailed = true;
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Telemetry_AddBool( TelemetryEncoder_t * pxEncoder,
+                        const char * pcKey,
+                        bool xValue )
+{
+    if( prvAddKey( pxEncoder, pcKey ) == true )
+    {
+        if( pxEncoder->xFormat == TelemetryFormatCbor )
+        {
+            prvCborCheck( pxEncoder, cbor_encode_boolean( &( pxEncoder->xCborMap ), xValue ) );
+        }
+        else if( xValue == true )
+        {
+            prvJsonAppend( pxEncoder, "true", 4U );
+        }
+        else
+        {
+            prvJsonAppend( pxEncoder, "false", 5U );
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Telemetry_AddString( TelemetryEncoder_t * pxEncoder,
+                          const char * pcKey,
+                          const char * pcValue,
+                          size_t xValueLength )
+{
+    configASSERT( ( pcValue != NULL ) || ( xValueLength == 0U ) );
+
+    if( prvAddKey( pxEncoder, pcKey ) == true )
+    {
+        if( pxEncoder->xFormat == TelemetryFormatCbor )
+        {
+            prvCborCheck( pxEncoder, cbor_encode_text_string( &( pxEncoder->xCborMap ), pcValue, xValueLength ) );
+        }
+        else
+        {
+            prvJsonAppendString( pxEncoder, pcValue, xValueLength );
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+size_t Telemetry_End( TelemetryEncoder_t * pxEncoder )
+{
+    size_t xPayloadLength = 0U;
+
+    configASSERT( pxEncoder != NULL );
+
+    if( pxEncoder->xFailed == false )
+    {
+        if( pxEncoder->xFormat == TelemetryFormatCbor )
+        {
+            /* Fails if the map does not have the announced number of fields. */
+            prvCborCheck( pxEncoder, cbor_encoder_close_container_checked( &( pxEncoder->xCborPayload ),
+                                                                           &( pxEncoder->xCborMap ) ) );
+
+            if( pxEncoder->xFailed == false )
+            {
+                xPayloadLength = cbor_encoder_get_buffer_size( &( pxEncoder->xCborPayload ), pxEncoder->pucBuffer );
+            }
+        }
+        else
+        {
+            prvJsonAppend( pxEncoder, "}", 1U );
+
+            if( pxEncoder->xFailed == false )
+            {
+                xPayloadLength = pxEncoder->xJsonLength;
+            }
+        }
+    }
+
+    return xPayloadLength;
+}
+
+/*-----------------------------------------------------------*/
+
+bool Telemetry_GetUInt( TelemetryFormat_t xFormat,
+                        const uint8_t * pucPayload,
+                        size_t xPayloadLength,
+                        const char * pcKey,
+                        uint64_t * pullValue )
+{
+    CborParser xParser;
+    CborValue xMap, xValue;
+    const char * pcValue;
+    size_t xValueLength, i;
+    JSONTypes_t xType;
+    uint64_t ullValue = 0U;
+    bool xFound = false;
+
+    configASSERT( pucPayload != NULL );
+    configASSERT( pcKey != NULL );
+    configASSERT( pullValue != NULL );
+
+    if( xFormat == TelemetryFormatCbor )
+    {
+        if( ( cbor_parser_init( pucPayload, xPayloadLength, 0, &xParser, &xMap ) == CborNoError ) &&
+            ( cbor_value_is_map( &xMap ) == true ) &&
+            ( cbor_value_map_find_value( &xMap, pcKey, &xValue ) == CborNoError ) &&
+            ( cbor_value_is_unsigned_integer( &xValue ) == true ) &&
+            ( cbor_value_get_uint64( &xValue, &ullValue ) == CborNoError ) )
+        {
+            xFound = true;
+        }
+    }
+    else if( ( JSON_SearchConst( ( const char * ) pucPayload,
+                                 xPayloadLength,
+                                 pcKey,
+                                 strlen( pcKey ),
+                                 &pcValue,
+                                 &xValueLength,
+                                 &xType ) == JSONSuccess ) &&
+             ( xType == JSONNumber ) )
+    {
+        /* Only plain digits, which also rejects signs, fractions and numbers
+         * that do not fit. */
+        xFound = true;
+
+        for( i = 0U; ( i < xValueLength ) && ( xFound == true ); i++ )
+        {
+            if( ( pcValue[ i ] < '0' ) || ( pcValue[ i ] > '9' ) ||
+                ( ullValue > ( ( UINT64_MAX - ( uint64_t ) ( pcValue[ i ] - '0' ) ) / 10U ) ) )
+            {
+                xFound = false;
+            }
+            else
+            {
+                ullValue = ( ullValue * 10U ) + ( uint64_t ) ( pcValue[ i ] - '0' );
+            }
+        }
+    }
+    else
+    {
+        /* The payload does not have the field. */
+    }
+
+    if( xFound == true )
+    {
+        *pullValue = ullValue;
+    }
+
+    return xFound;
+}
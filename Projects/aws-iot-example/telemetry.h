@@ -0,0 +1,154 @@
+/* Copyright 2023 Arm Limited and/or its affiliates
+ * <open-source-office@arm.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+ * @file telemetry.h
+ * @brief Encoding of telemetry payloads as a map of typed fields.
+ *
+ * A payload is built field by field directly into a buffer of the caller,
+ * without allocating and without formatting numbers as text. It is encoded as
+ * a CBOR map, or as a JSON object to read the payloads while debugging. A
+ * field is set with one of the Telemetry_Add functions, an error such as a
+ * buffer too small is remembered and reported by Telemetry_End().
+ *
+ * Telemetry_GetUInt() reads back an unsigned field of a received payload.
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* tinycbor includes. */
+#include "cbor.h"
+
+/**
+ * @brief Encoding of a payload.
+ */
+typedef enum TelemetryFormat
+{
+    TelemetryFormatCbor = 0, /**< CBOR map, the compact encoding. */
+    TelemetryFormatJson      /**< JSON object, readable for debugging. */
+} TelemetryFormat_t;
+
+/**
+ * @brief State of a payload being encoded. Only accessed through the
+ * functions below.
+ */
+typedef struct TelemetryEncoder
+{
+    TelemetryFormat_t xFormat;
+    uint8_t * pucBuffer;
+    size_t xBufferLength;
+    CborEncoder xCborPayload;
+    CborEncoder xCborMap;
+    size_t xJsonLength;
+    size_t xNumFields; /**< Fields added so far. */
+    bool xFailed;
+} TelemetryEncoder_t;
+
+/**
+ * @brief Start a payload.
+ *
+ * @param[out] pxEncoder The encoder.
+ * @param[in] xFormat Encoding of the payload.
+ * @param[in] pucBuffer Buffer the payload is written to.
+ * @param[in] xBufferLength Length of the buffer.
+ * @param[in] xNumFields Number of fields the payload will have, which a CBOR
+ * map is prefixed with.
+ */
+void Telemetry_Begin( TelemetryEncoder_t * pxEncoder,
+                      TelemetryFormat_t xFormat,
+                      uint8_t * pucBuffer,
+                      size_t xBufferLength,
+                      size_t xNumFields );
+
+/**
+ * @brief Add an unsigned integer field.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcKey Name of the field, terminated.
+ * @param[in] ullValue Value of the field.
+ */
+void Telemetry_AddUInt( TelemetryEncoder_t * pxEncoder,
+                        const char * pcKey,
+                        uint64_t ullValue );
+
+/**
+ * @brief Add a signed integer field.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcKey Name of the field, terminated.
+ * @param[in] llValue Value of the field.
+ */
+void Telemetry_AddInt( TelemetryEncoder_t * pxEncoder,
+                       const char * pcKey,
+                       int64_t llValue );
+
+/**
+ * @brief Add a floating point field. It is written as text in JSON, and as
+ * `null` if it is not a finite number.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcKey Name of the field, terminated.
+ * @param[in] fValue Value of the field.
+ */
+void Telemetry_AddFloat( TelemetryEncoder_t * pxEncoder,
+                         const char * pcKey,
+                         float fValue );
+
+/**
+ * @brief Add a boolean field.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcKey Name of the field, terminated.
+ * @param[in] xValue Value of the field.
+ */
+void Telemetry_AddBool( TelemetryEncoder_t * pxEncoder,
+                        const char * pcKey,
+                        bool xValue );
+
+/**
+ * @brief Add a text string field.
+ *
+ * @param[in] pxEncoder The encoder.
+ * @param[in] pcKey Name of the field, terminated.
+ * @param[in] pcValue Value of the field, UTF-8 and not necessarily terminated.
+ * @param[in] xValueLength Length of the value.
+ */
+void Telemetry_AddString( TelemetryEncoder_t * pxEncoder,
+                          const char * pcKey,
+                          const char * pcValue,
+                          size_t xValueLength );
+
+/**
+ * @brief Finish a payload.
+ *
+ * @param[in] pxEncoder The encoder.
+ *
+ * @return Length of the payload, or 0 if it did not fit in the buffer or did
+ * not have the number of fields given to Telemetry_Begin().
+ */
+size_t Telemetry_End( TelemetryEncoder_t * pxEncoder );
+
+/**
+ * @brief Read an unsigned integer field of a payload.
+ *
+ * @param[in] xFormat Encoding of the payload.
+ * @param[in] pucPayload The payload.
+ * @param[in] xPayloadLength Length of the payload.
+ * @param[in] pcKey Name of the field, terminated.
+ * @param[out] pullValue Value of the field.
+ *
+ * @return `true` if the payload has the field, with an unsigned integer value.
+ */
+bool Telemetry_GetUInt( TelemetryFormat_t xFormat,
+                        const uint8_t * pucPayload,
+                        size_t xPayloadLength,
+                        const char * pcKey,
+                        uint64_t * pullValue );
+
+#endif /* TELEMETRY_H */